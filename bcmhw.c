@@ -43,6 +43,7 @@ int base_clocks[4] =
 };
 
 int base_clock = 0;
+static int bcmhw_type = -1;
 
 void *base_address = 0;
 void *clks_base;
@@ -104,19 +105,138 @@ void bcmhw_gpio_print(int gpio)
 
 void bcmhw_gpio_set(int gpio, int on)
 {
-    if (gpio < 0 || gpio > 31)
+    if (gpio < 0 || gpio > 53)
 	return;
 
     if (on)
-	writel(GPSET0, 1 << gpio);
+	bcmhw_gpio_set_mask(GPIO_BANK(gpio), GPIO_BIT(gpio));
     else
-	writel(GPCLR0, 1 << gpio);
+	bcmhw_gpio_clear_mask(GPIO_BANK(gpio), GPIO_BIT(gpio));
+}
+
+int bcmhw_gpio_get(int gpio)
+{
+    if (gpio < 0 || gpio > 53)
+	return -1;
+
+    return (bcmhw_gpio_read_mask(GPIO_BANK(gpio)) & GPIO_BIT(gpio)) != 0;
+}
+
+/*
+ * Set, clear or read every pin of a bank in a single register access.
+ * Bank 0 is GPIO 0-31, bank 1 is GPIO 32-53.
+ */
+void bcmhw_gpio_set_mask(int bank, unsigned long mask)
+{
+    if (bank < 0 || bank > 1)
+	return;
+
+    writel(GPSET0 + 4 * bank, mask);
+}
+
+void bcmhw_gpio_clear_mask(int bank, unsigned long mask)
+{
+    if (bank < 0 || bank > 1)
+	return;
+
+    writel(GPCLR0 + 4 * bank, mask);
+}
+
+unsigned long bcmhw_gpio_read_mask(int bank)
+{
+    if (bank < 0 || bank > 1)
+	return 0;
+
+    return readl(GPLEV0 + 4 * bank);
+}
+
+/*
+ * Configure pull up/down with one of the GPIO_PU_* values.  The Pi 4 has
+ * direct pull registers.  Earlier chips need the clocked GPPUD sequence,
+ * which requires 150 cycles of setup and hold.
+ */
+void bcmhw_gpio_pull(int gpio, int pull)
+{
+    if (gpio < 0 || gpio > 53)
+	return;
+
+    if (bcmhw_type == 2)
+    {
+	int value = GPIO_PUPPDN_NONE;
+	if (pull == GPIO_PU_ENABLEUP)
+	    value = GPIO_PUPPDN_UP;
+	else if (pull == GPIO_PU_ENABLEDOWN)
+	    value = GPIO_PUPPDN_DOWN;
+
+	unsigned long addr = GPPUPPDN0 + (gpio / 16) * 4;
+	int shift = (gpio % 16) * 2;
+	writel(addr, (readl(addr) & ~(3UL << shift)) | ((unsigned long) value << shift));
+    }
+    else
+    {
+	unsigned long clk = GPPUDCLK0 + 4 * GPIO_BANK(gpio);
+
+	writel(GPPUD, pull);
+	for (volatile int i = 0; i < 150; i++)
+	    ;
+	writel(clk, GPIO_BIT(gpio));
+	for (volatile int i = 0; i < 150; i++)
+	    ;
+	writel(GPPUD, GPIO_PU_DISABLE);
+	writel(clk, 0);
+    }
+}
+
+/*
+ * Enable or disable synchronous edge detection on a pin, clearing any
+ * event already latched.  Detected edges latch in GPEDS until cleared
+ * with bcmhw_gpio_read_events().
+ *
+ * The event bits also drive the GPIO bank interrupt, which stays asserted
+ * until they are cleared.  Linux's gpio-bcm2835 handler only looks at and
+ * clears the pins it has enabled, so an event on any other pin makes it
+ * run over and over until the next poll, and if that goes on long enough
+ * the kernel disables the interrupt for the whole bank.  Only enable this
+ * on pins that are polled often, and disable it again when polling stops.
+ */
+void bcmhw_gpio_edge_detect(int gpio, int rising, int falling)
+{
+    if (gpio < 0 || gpio > 53)
+	return;
+
+    int bank = GPIO_BANK(gpio);
+    unsigned long bit = GPIO_BIT(gpio);
+    unsigned long ren = GPREN0 + 4 * bank;
+    unsigned long fen = GPFEN0 + 4 * bank;
+
+    writel(ren, rising ? readl(ren) | bit : readl(ren) & ~bit);
+    writel(fen, falling ? readl(fen) | bit : readl(fen) & ~bit);
+    writel(GPEDS0 + 4 * bank, bit);
+}
+
+/*
+ * Read and clear the latched edge events of a bank.
+ */
+unsigned long bcmhw_gpio_read_events(int bank)
+{
+    if (bank < 0 || bank > 1)
+	return 0;
+
+    unsigned long events = readl(GPEDS0 + 4 * bank);
+    if (events)
+	writel(GPEDS0 + 4 * bank, events);
+
+    return events;
 }
 
 #define BCMHW_ADDR(x)	(off_t) ((char *) base_address + x)
 
 int bcmhw_init(void)
 {
+#ifdef BCMHW_EMULATE
+    return bcmhw_init_emulated();
+#endif
+
     int hwtype = bcmhw_get_hw_type();
     if (hwtype < 0)
     {
@@ -124,6 +244,7 @@ int bcmhw_init(void)
 	return -1;
     }
 
+    bcmhw_type = hwtype;
     base_address = (void *) (unsigned long) base_addresses[hwtype];
     base_clock = base_clocks[hwtype];
 
@@ -5,6 +5,8 @@
 #ifndef __bcmhw_h__
 #define __bcmhw_h__
 
+#include <time.h>
+
 // Clock manager
 #define CM_GPCTL(x)		((unsigned long)(clks_base) + (8 * (x)))
 #define CM_GPDIV(x)		((unsigned long)(clks_base) + (8 * (x)) + 4)
@@ -34,9 +36,30 @@
 
 #define GPFSEL0			((unsigned long) gpio_base + 0x00)
 #define GPSET0			((unsigned long) gpio_base + 0x1C)
+#define GPSET1			((unsigned long) gpio_base + 0x20)
 #define GPCLR0			((unsigned long) gpio_base + 0x28)
+#define GPCLR1			((unsigned long) gpio_base + 0x2C)
+#define GPLEV0			((unsigned long) gpio_base + 0x34)
+#define GPLEV1			((unsigned long) gpio_base + 0x38)
+#define GPEDS0			((unsigned long) gpio_base + 0x40)
+#define GPEDS1			((unsigned long) gpio_base + 0x44)
+#define GPREN0			((unsigned long) gpio_base + 0x4C)
+#define GPREN1			((unsigned long) gpio_base + 0x50)
+#define GPFEN0			((unsigned long) gpio_base + 0x58)
+#define GPFEN1			((unsigned long) gpio_base + 0x5C)
 #define GPPUD			((unsigned long) gpio_base + 0x94)
 #define GPPUDCLK0		((unsigned long) gpio_base + 0x98)
+#define GPPUDCLK1		((unsigned long) gpio_base + 0x9C)
+
+// Pi 4 replaces GPPUD/GPPUDCLK with 2 bits per pin, 16 pins per register
+#define GPPUPPDN0		((unsigned long) gpio_base + 0xE4)
+
+#define GPIO_PUPPDN_NONE	0
+#define GPIO_PUPPDN_UP		1
+#define GPIO_PUPPDN_DOWN	2
+
+#define GPIO_BANK(gpio)		((gpio) / 32)
+#define GPIO_BIT(gpio)		(1UL << ((gpio) % 32))
 
 #define GPIO_PU_ENABLEUP	2
 #define GPIO_PU_ENABLEDOWN	1
@@ -129,7 +152,42 @@ extern void *base_address;
 extern void *clks_base;
 extern void *gpio_base;
 extern void *pcm_base;
+extern void *systemtimer_base;
+
+#ifdef BCMHW_EMULATE
+/*
+ * Register accesses go to the emulated peripherals in bcmhw_emu.c so the
+ * library can be exercised on a machine without the hardware.
+ */
+unsigned long bcmhw_emu_readl(unsigned long lp);
+void bcmhw_emu_writel(unsigned long lp, unsigned long l);
+
+int bcmhw_init_emulated(void);
+void bcmhw_emu_gpio_input(int gpio, int level);
+void bcmhw_emu_set_system_timer(unsigned long us);
+unsigned long bcmhw_emu_write_count(unsigned long lp);
 
+typedef void (*bcmhw_emu_pcm_in_t)(unsigned long long frame, int *left, int *right);
+typedef void (*bcmhw_emu_pcm_out_t)(unsigned long long frame, int left, int right);
+
+void bcmhw_emu_pcm_set_rate(double rate);
+void bcmhw_emu_pcm_advance(int nframes);
+void bcmhw_emu_pcm_slip(int rx, int tx);
+int bcmhw_emu_pcm_rx_level(void);
+void bcmhw_emu_pcm_set_io(bcmhw_emu_pcm_in_t in, bcmhw_emu_pcm_out_t out);
+void bcmhw_emu_pcm_set_loopback(int delay);
+unsigned long long bcmhw_emu_pcm_frames(void);
+
+static inline void writel(unsigned long lp, unsigned long l)
+{
+    bcmhw_emu_writel(lp, l);
+}
+
+static inline unsigned long readl(unsigned long lp)
+{
+    return bcmhw_emu_readl(lp);
+}
+#else
 static inline void writel(unsigned long lp, unsigned long l)
 {
     *(volatile unsigned long *)lp = l;
@@ -139,12 +197,69 @@ static inline unsigned long readl(unsigned long lp)
 {
     return *(volatile unsigned long *)lp;
 }
+#endif
+
+/*
+ * Free running counter that reads without touching the peripheral bus.
+ * The ARM generic timer where there is one, otherwise CLOCK_MONOTONIC in
+ * nanoseconds.
+ */
+static inline unsigned long long bcmhw_cycles(void)
+{
+#if defined(__aarch64__)
+    unsigned long long v;
+    asm volatile("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+#elif defined(__arm__) && __ARM_ARCH >= 7
+    unsigned int lo, hi;
+    asm volatile("mrrc p15, 1, %0, %1, c14" : "=r" (lo), "=r" (hi));
+    return ((unsigned long long) hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline unsigned long long bcmhw_cycles_per_sec(void)
+{
+#if defined(__aarch64__)
+    unsigned long long v;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (v));
+    return v;
+#elif defined(__arm__) && __ARM_ARCH >= 7
+    unsigned int v;
+    asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (v));
+    return v;
+#else
+    return 1000000000ULL;
+#endif
+}
+
+/*
+ * Spin loop hint, lets the other hardware thread or the bus have a turn.
+ */
+static inline void bcmhw_relax(void)
+{
+#if defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+    asm volatile("yield");
+#elif defined(__x86_64__) || defined(__i386__)
+    asm volatile("pause");
+#endif
+}
 
 int bcmhw_init(void);
 void bcmhw_gpio_select(int gpio, int function);
 void bcmhw_gpio_print(int gpio);
 int bcmhw_set_i2s_clk(int samplerate);
 void bcmhw_gpio_set(int gpio, int on);
+int bcmhw_gpio_get(int gpio);
+void bcmhw_gpio_set_mask(int bank, unsigned long mask);
+void bcmhw_gpio_clear_mask(int bank, unsigned long mask);
+unsigned long bcmhw_gpio_read_mask(int bank);
+void bcmhw_gpio_pull(int gpio, int pull);
+void bcmhw_gpio_edge_detect(int gpio, int rising, int falling);
+unsigned long bcmhw_gpio_read_events(int bank);
 unsigned long bcmhw_get_system_timer(void);
 
 #endif /* __bcmhw_h__ */
@@ -0,0 +1,512 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Emulated peripheral registers.  Build with -DBCMHW_EMULATE and call
+ * bcmhw_init_emulated() instead of bcmhw_init().  Each block is a page of
+ * 32-bit registers.  Registers with side effects on the real hardware are
+ * modelled here; everything else just holds the last value written.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "bcmhw.h"
+
+#define BCMHW_EMU_REGS		1024
+
+struct bcmhw_emu_block_s
+{
+    unsigned int regs[BCMHW_EMU_REGS];
+    unsigned long writes[BCMHW_EMU_REGS];
+};
+
+static struct bcmhw_emu_block_s bcmhw_emu_clks;
+static struct bcmhw_emu_block_s bcmhw_emu_gpio;
+static struct bcmhw_emu_block_s bcmhw_emu_pcm;
+static struct bcmhw_emu_block_s bcmhw_emu_timer;
+
+#define EMU_GPIO(reg)		bcmhw_emu_gpio.regs[((reg) - (unsigned long) gpio_base) / 4]
+#define EMU_PCM(reg)		bcmhw_emu_pcm.regs[((reg) - (unsigned long) pcm_base) / 4]
+
+/*
+ * PCM model.  Frames move at the emulated sample rate measured against
+ * CLOCK_MONOTONIC, or only when bcmhw_emu_pcm_advance() is called if the
+ * rate is 0.  Each frame takes two words from the TX FIFO and puts two
+ * words in the RX FIFO.
+ */
+#define BCMHW_EMU_FIFO		64
+
+struct bcmhw_emu_fifo_s
+{
+    unsigned int data[BCMHW_EMU_FIFO];
+    int head;
+    int count;
+};
+
+static struct bcmhw_emu_fifo_s bcmhw_emu_rx;
+static struct bcmhw_emu_fifo_s bcmhw_emu_tx;
+static double bcmhw_emu_rate = 48000.0;
+static struct timespec bcmhw_emu_start;
+static unsigned long long bcmhw_emu_frames = 0;
+static unsigned long long bcmhw_emu_frames_at_start = 0;
+static int bcmhw_emu_running = 0;
+static bcmhw_emu_pcm_in_t bcmhw_emu_in_func = NULL;
+static bcmhw_emu_pcm_out_t bcmhw_emu_out_func = NULL;
+static int bcmhw_emu_rx_slips = 0;
+static int bcmhw_emu_tx_slips = 0;
+
+/*
+ * A cable from the output back to the input.  Transmitted frames come
+ * back as received frames bcmhw_emu_loopback frames later, or never if it
+ * is negative.
+ */
+#define BCMHW_EMU_LOOPBACK_MAX	8192
+
+static int bcmhw_emu_loopback = -1;
+static int bcmhw_emu_loopback_line[BCMHW_EMU_LOOPBACK_MAX][2];
+
+/*
+ * The PCM model is shared between the audio thread and a test driving it,
+ * so PCM accesses are serialized.
+ */
+static pthread_mutex_t bcmhw_emu_pcm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct bcmhw_emu_block_s *bcmhw_emu_block(unsigned long lp, int *index)
+{
+    struct bcmhw_emu_block_s *blocks[4] =
+    {
+	&bcmhw_emu_clks, &bcmhw_emu_gpio, &bcmhw_emu_pcm, &bcmhw_emu_timer
+    };
+
+    for (int i = 0; i < 4; i++)
+    {
+	unsigned long base = (unsigned long) blocks[i]->regs;
+	if (lp >= base && lp < base + sizeof(blocks[i]->regs))
+	{
+	    *index = (lp - base) / 4;
+	    return blocks[i];
+	}
+    }
+
+    printf("bcmhw_emu: access outside emulated registers: %lx\n", lp);
+    abort();
+}
+
+static void bcmhw_emu_fifo_put(struct bcmhw_emu_fifo_s *fifo, unsigned int value, unsigned long errbit)
+{
+    if (fifo->count >= BCMHW_EMU_FIFO)
+    {
+	EMU_PCM(PCM_CS_A) |= errbit;
+	return;
+    }
+
+    fifo->data[(fifo->head + fifo->count) % BCMHW_EMU_FIFO] = value;
+    fifo->count++;
+}
+
+static unsigned int bcmhw_emu_fifo_get(struct bcmhw_emu_fifo_s *fifo, unsigned long errbit)
+{
+    if (fifo->count == 0)
+    {
+	EMU_PCM(PCM_CS_A) |= errbit;
+	return 0;
+    }
+
+    unsigned int value = fifo->data[fifo->head];
+    fifo->head = (fifo->head + 1) % BCMHW_EMU_FIFO;
+    fifo->count--;
+
+    return value;
+}
+
+static void bcmhw_emu_pcm_frame(void)
+{
+    unsigned long cs = EMU_PCM(PCM_CS_A);
+    int left = 0, right = 0;
+
+    /*
+     * A slip loses one word, as on an overrun or underrun mid frame.  On
+     * receive the left word of this frame is lost.
+     */
+    int rx_slip = 0;
+    if (bcmhw_emu_rx_slips > 0)
+    {
+	rx_slip = 1;
+	bcmhw_emu_rx_slips--;
+    }
+    if (bcmhw_emu_tx_slips > 0 && bcmhw_emu_tx.count > 0)
+    {
+	bcmhw_emu_fifo_get(&bcmhw_emu_tx, 0);
+	bcmhw_emu_tx_slips--;
+    }
+
+    /*
+     * Underruns and overruns lose whole frames, so only injected slips
+     * misalign the FIFOs.  This keeps tests independent of how well the
+     * emulating process gets scheduled.
+     */
+    if (cs & PCM_CS_TXON)
+    {
+	if (bcmhw_emu_tx.count >= 2)
+	{
+	    left = bcmhw_emu_fifo_get(&bcmhw_emu_tx, PCM_CS_TXERR);
+	    right = bcmhw_emu_fifo_get(&bcmhw_emu_tx, PCM_CS_TXERR);
+	}
+	else
+	{
+	    EMU_PCM(PCM_CS_A) |= PCM_CS_TXERR;
+	}
+
+	if (bcmhw_emu_out_func)
+	    bcmhw_emu_out_func(bcmhw_emu_frames, left, right);
+    }
+
+    int *line = bcmhw_emu_loopback_line[bcmhw_emu_frames % BCMHW_EMU_LOOPBACK_MAX];
+    line[0] = left;
+    line[1] = right;
+
+    if (cs & PCM_CS_RXON)
+    {
+	left = right = 0;
+	if (bcmhw_emu_loopback >= 0)
+	{
+	    line = bcmhw_emu_loopback_line[(bcmhw_emu_frames + BCMHW_EMU_LOOPBACK_MAX -
+					     bcmhw_emu_loopback) % BCMHW_EMU_LOOPBACK_MAX];
+	    left = line[0];
+	    right = line[1];
+	}
+	else if (bcmhw_emu_in_func)
+	    bcmhw_emu_in_func(bcmhw_emu_frames, &left, &right);
+
+	if (bcmhw_emu_rx.count <= BCMHW_EMU_FIFO - 2)
+	{
+	    if (!rx_slip)
+		bcmhw_emu_fifo_put(&bcmhw_emu_rx, left, PCM_CS_RXERR);
+	    bcmhw_emu_fifo_put(&bcmhw_emu_rx, right, PCM_CS_RXERR);
+	}
+	else
+	{
+	    EMU_PCM(PCM_CS_A) |= PCM_CS_RXERR;
+	}
+    }
+
+    bcmhw_emu_frames++;
+}
+
+static void bcmhw_emu_pcm_update(void)
+{
+    unsigned long cs = EMU_PCM(PCM_CS_A);
+    int on = (cs & PCM_CS_EN) && (cs & (PCM_CS_TXON | PCM_CS_RXON));
+
+    if (!on)
+    {
+	bcmhw_emu_running = 0;
+	return;
+    }
+
+    if (!bcmhw_emu_running)
+    {
+	bcmhw_emu_running = 1;
+	clock_gettime(CLOCK_MONOTONIC, &bcmhw_emu_start);
+	bcmhw_emu_frames_at_start = bcmhw_emu_frames;
+	return;
+    }
+
+    if (bcmhw_emu_rate <= 0.0)
+	return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - bcmhw_emu_start.tv_sec) +
+	(now.tv_nsec - bcmhw_emu_start.tv_nsec) / 1e9;
+    unsigned long long due = bcmhw_emu_frames_at_start + (unsigned long long) (elapsed * bcmhw_emu_rate);
+
+    /* Don't spend forever catching up after the process was stopped. */
+    if (due > bcmhw_emu_frames + 1000)
+	bcmhw_emu_frames = due - 1000;
+
+    while (bcmhw_emu_frames < due)
+	bcmhw_emu_pcm_frame();
+}
+
+static unsigned long bcmhw_emu_pcm_status(void)
+{
+    unsigned long cs = EMU_PCM(PCM_CS_A);
+
+    cs &= ~(PCM_CS_RXF | PCM_CS_TXE | PCM_CS_RXD | PCM_CS_TXD | PCM_CS_RXR |
+	    PCM_CS_TXW | PCM_CS_RXSYNC | PCM_CS_TXSYNC);
+
+    if (bcmhw_emu_rx.count == BCMHW_EMU_FIFO)
+	cs |= PCM_CS_RXF;
+    if (bcmhw_emu_rx.count > 0)
+	cs |= PCM_CS_RXD;
+    if (bcmhw_emu_rx.count >= 2)
+	cs |= PCM_CS_RXR;
+    if ((bcmhw_emu_rx.count % 2) == 0)
+	cs |= PCM_CS_RXSYNC;
+    if (bcmhw_emu_tx.count == 0)
+	cs |= PCM_CS_TXE;
+    if (bcmhw_emu_tx.count < BCMHW_EMU_FIFO)
+	cs |= PCM_CS_TXD;
+    if (bcmhw_emu_tx.count <= BCMHW_EMU_FIFO - 2)
+	cs |= PCM_CS_TXW;
+    if ((bcmhw_emu_tx.count % 2) == 0)
+	cs |= PCM_CS_TXSYNC;
+
+    return cs;
+}
+
+static void bcmhw_emu_pcm_write_cs(unsigned long l)
+{
+    unsigned long cs = EMU_PCM(PCM_CS_A);
+
+    /* Error bits are write one to clear. */
+    cs &= ~(l & (PCM_CS_RXERR | PCM_CS_TXERR));
+
+    if (l & PCM_CS_RXCLR)
+	bcmhw_emu_rx.count = 0;
+    if (l & PCM_CS_TXCLR)
+	bcmhw_emu_tx.count = 0;
+
+    /* SYNC reads back as written, here without the two clock delay. */
+    unsigned long writable = PCM_CS_STBY | PCM_CS_SYNC | PCM_CS_RXSEX | PCM_CS_DMAEN |
+	(3 << 7) | (3 << 5) | PCM_CS_TXON | PCM_CS_RXON | PCM_CS_EN;
+    cs = (cs & ~writable) | (l & writable);
+
+    EMU_PCM(PCM_CS_A) = cs;
+    bcmhw_emu_pcm_update();
+}
+
+void bcmhw_emu_pcm_set_rate(double rate)
+{
+    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+    bcmhw_emu_pcm_update();
+    bcmhw_emu_rate = rate;
+    bcmhw_emu_running = 0;
+    bcmhw_emu_pcm_update();
+    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+}
+
+void bcmhw_emu_pcm_advance(int nframes)
+{
+    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+
+    unsigned long cs = EMU_PCM(PCM_CS_A);
+    if (cs & PCM_CS_EN)
+    {
+	for (int i = 0; i < nframes; i++)
+	    bcmhw_emu_pcm_frame();
+    }
+
+    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+}
+
+/*
+ * Words waiting in the receive FIFO.
+ */
+int bcmhw_emu_pcm_rx_level(void)
+{
+    return __atomic_load_n(&bcmhw_emu_rx.count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop one word from the receive and/or transmit FIFO at the next frame.
+ */
+void bcmhw_emu_pcm_slip(int rx, int tx)
+{
+    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+    bcmhw_emu_rx_slips += rx;
+    bcmhw_emu_tx_slips += tx;
+    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+}
+
+void bcmhw_emu_pcm_set_io(bcmhw_emu_pcm_in_t in, bcmhw_emu_pcm_out_t out)
+{
+    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+    bcmhw_emu_in_func = in;
+    bcmhw_emu_out_func = out;
+    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+}
+
+/*
+ * Loop the output back to the input, delayed by up to
+ * BCMHW_EMU_LOOPBACK_MAX - 1 frames, instead of calling the input
+ * function.  A negative delay disconnects the loop.
+ */
+void bcmhw_emu_pcm_set_loopback(int delay)
+{
+    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+    if (delay >= BCMHW_EMU_LOOPBACK_MAX)
+	delay = BCMHW_EMU_LOOPBACK_MAX - 1;
+    if (bcmhw_emu_loopback < 0)
+	memset(bcmhw_emu_loopback_line, 0, sizeof(bcmhw_emu_loopback_line));
+    bcmhw_emu_loopback = delay;
+    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+}
+
+unsigned long long bcmhw_emu_pcm_frames(void)
+{
+    return bcmhw_emu_frames;
+}
+
+int bcmhw_init_emulated(void)
+{
+    memset(&bcmhw_emu_clks, 0, sizeof(bcmhw_emu_clks));
+    memset(&bcmhw_emu_gpio, 0, sizeof(bcmhw_emu_gpio));
+    memset(&bcmhw_emu_pcm, 0, sizeof(bcmhw_emu_pcm));
+    memset(&bcmhw_emu_timer, 0, sizeof(bcmhw_emu_timer));
+
+    clks_base = bcmhw_emu_clks.regs;
+    gpio_base = bcmhw_emu_gpio.regs;
+    pcm_base = bcmhw_emu_pcm.regs;
+    systemtimer_base = bcmhw_emu_timer.regs;
+
+    memset(&bcmhw_emu_rx, 0, sizeof(bcmhw_emu_rx));
+    memset(&bcmhw_emu_tx, 0, sizeof(bcmhw_emu_tx));
+    bcmhw_emu_running = 0;
+
+    return 0;
+}
+
+/*
+ * Change the level of GPIO pins in a bank, latching edge events the way
+ * GPREN/GPFEN would.
+ */
+static void bcmhw_emu_gpio_level(int bank, unsigned long level)
+{
+    unsigned long old = EMU_GPIO(GPLEV0 + 4 * bank);
+    unsigned long rising = level & ~old;
+    unsigned long falling = old & ~level;
+
+    EMU_GPIO(GPEDS0 + 4 * bank) |= (rising & EMU_GPIO(GPREN0 + 4 * bank)) |
+	(falling & EMU_GPIO(GPFEN0 + 4 * bank));
+    EMU_GPIO(GPLEV0 + 4 * bank) = level;
+}
+
+void bcmhw_emu_gpio_input(int gpio, int level)
+{
+    int bank = GPIO_BANK(gpio);
+    unsigned long lev = EMU_GPIO(GPLEV0 + 4 * bank);
+
+    bcmhw_emu_gpio_level(bank, level ? lev | GPIO_BIT(gpio) : lev & ~GPIO_BIT(gpio));
+}
+
+void bcmhw_emu_set_system_timer(unsigned long us)
+{
+    bcmhw_emu_timer.regs[1] = us;
+    bcmhw_emu_timer.writes[1]++;
+}
+
+unsigned long bcmhw_emu_write_count(unsigned long lp)
+{
+    int index;
+    struct bcmhw_emu_block_s *block = bcmhw_emu_block(lp, &index);
+
+    return block->writes[index];
+}
+
+unsigned long bcmhw_emu_readl(unsigned long lp)
+{
+    int index;
+    struct bcmhw_emu_block_s *block = bcmhw_emu_block(lp, &index);
+
+    if (block == &bcmhw_emu_pcm)
+    {
+	unsigned long value = block->regs[index];
+
+	pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+	bcmhw_emu_pcm_update();
+	if (lp == PCM_CS_A)
+	    value = bcmhw_emu_pcm_status();
+	else if (lp == PCM_FIFO_A)
+	    value = bcmhw_emu_fifo_get(&bcmhw_emu_rx, 0);
+	pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+
+	return value;
+    }
+    else if (block == &bcmhw_emu_timer && index == 1)
+    {
+	/* Free running microsecond counter unless a test set it. */
+	if (block->writes[index] == 0)
+	{
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    return (unsigned long) (now.tv_sec * 1000000ULL + now.tv_nsec / 1000) & 0xffffffff;
+	}
+    }
+
+    return block->regs[index];
+}
+
+void bcmhw_emu_writel(unsigned long lp, unsigned long l)
+{
+    int index;
+    struct bcmhw_emu_block_s *block = bcmhw_emu_block(lp, &index);
+
+    block->writes[index]++;
+
+    if (block == &bcmhw_emu_pcm)
+    {
+	if (lp == PCM_CS_A)
+	{
+	    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+	    bcmhw_emu_pcm_write_cs(l);
+	    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+	    return;
+	}
+	else if (lp == PCM_FIFO_A)
+	{
+	    pthread_mutex_lock(&bcmhw_emu_pcm_lock);
+	    bcmhw_emu_pcm_update();
+	    bcmhw_emu_fifo_put(&bcmhw_emu_tx, l, 0);
+	    pthread_mutex_unlock(&bcmhw_emu_pcm_lock);
+	    return;
+	}
+    }
+    else if (block == &bcmhw_emu_gpio)
+    {
+	if (lp == GPSET0 || lp == GPSET1)
+	{
+	    int bank = (lp - GPSET0) / 4;
+	    bcmhw_emu_gpio_level(bank, EMU_GPIO(GPLEV0 + 4 * bank) | l);
+	    return;
+	}
+	else if (lp == GPCLR0 || lp == GPCLR1)
+	{
+	    int bank = (lp - GPCLR0) / 4;
+	    bcmhw_emu_gpio_level(bank, EMU_GPIO(GPLEV0 + 4 * bank) & ~l);
+	    return;
+	}
+	else if (lp == GPEDS0 || lp == GPEDS1)
+	{
+	    block->regs[index] &= ~l;
+	    return;
+	}
+	else if (lp == GPLEV0 || lp == GPLEV1)
+	{
+	    return;
+	}
+    }
+
+    block->regs[index] = l;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Example handler chain plugin, used by the pusa unit test.  Replaces
+ * every frame with the level given as the argument, positive on the left
+ * and negative on the right.
+ */
+
+#include <stdlib.h>
+
+#include "pusachain.h"
+
+static void *level_create(const char *args)
+{
+    int *level = malloc(sizeof(int));
+
+    if (level != NULL)
+	*level = atoi(args != NULL ? args : "0") << 16;
+
+    return level;
+}
+
+static void level_process(void *ctx, int *data, int nchannels)
+{
+    int level = *(int *) ctx;
+
+    data[0] = level;
+    if (nchannels > 1)
+	data[1] = -level;
+}
+
+static void level_destroy(void *ctx)
+{
+    free(ctx);
+}
+
+const struct pusachain_plugin_s pusa_plugin =
+{
+    "level", level_create, level_process, level_destroy
+};
@@ -21,36 +21,255 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
-#include <i2c/smbus.h>
 
 #include "bcmhw.h"
 #include "codecs.h"
 
-int codec_pisound_init(void)
+/* Same as the kernel's I2C_RDWR_IOCTL_MAX_MSGS */
+#define CODEC_I2C_MAX_MSGS	42
+
+/*
+ * Registers are written in runs of consecutive addresses.  With auto
+ * increment a run is one message, otherwise one message per register.
+ */
+#define CODEC_RUN_MAX		32
+
+/*
+ * Generic register cache and I2C access.
+ */
+static int codec_i2c_dev_transfer(void *ctx, struct i2c_msg *msgs, int nmsgs)
+{
+    struct codec_s *codec = ctx;
+    struct i2c_rdwr_ioctl_data data = { msgs, nmsgs };
+
+    return ioctl(codec->fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+}
+
+static int codec_transfer(struct codec_s *codec, struct i2c_msg *msgs, int nmsgs)
+{
+    codec->transactions++;
+    return codec->bus.transfer(codec->bus.ctx, msgs, nmsgs);
+}
+
+int codec_reg_read(struct codec_s *codec, int reg)
+{
+    unsigned char addr = reg;
+    unsigned char value;
+    struct i2c_msg msgs[2] =
+    {
+	{ codec->driver->i2c_addr, 0, 1, &addr },
+	{ codec->driver->i2c_addr, I2C_M_RD, 1, &value },
+    };
+
+    if (codec_transfer(codec, msgs, 2) < 0)
+	return -1;
+
+    return value;
+}
+
+/*
+ * Update the register cache.  Nothing is sent until codec_reg_sync().
+ */
+void codec_reg_write(struct codec_s *codec, int reg, int value)
+{
+    if (reg < 0 || reg >= CODEC_REGS)
+	return;
+
+    if (!codec->cached[reg] || codec->cache[reg] != value)
+	codec->dirty[reg] = 1;
+
+    codec->cache[reg] = value;
+    codec->cached[reg] = 1;
+}
+
+void codec_reg_update(struct codec_s *codec, int reg, int mask, int value)
+{
+    if (reg < 0 || reg >= CODEC_REGS)
+	return;
+
+    codec_reg_write(codec, reg, (codec->cache[reg] & ~mask) | (value & mask));
+}
+
+void codec_reg_write_table(struct codec_s *codec, const struct codec_reg_s *regs, int nregs)
+{
+    for (int i = 0; i < nregs; i++)
+	codec_reg_write(codec, regs[i].reg, regs[i].value);
+}
+
+/*
+ * Write every dirty register, then read them all back and compare with
+ * the cache.  Writes go out as one I2C_RDWR transaction and the readback
+ * as another, unless there are more runs than fit in one.
+ */
+int codec_reg_sync(struct codec_s *codec)
+{
+    struct i2c_msg msgs[CODEC_I2C_MAX_MSGS];
+    unsigned char bufs[CODEC_I2C_MAX_MSGS][CODEC_RUN_MAX + 1];
+    int starts[CODEC_I2C_MAX_MSGS];
+    int lens[CODEC_I2C_MAX_MSGS];
+    unsigned short addr = codec->driver->i2c_addr;
+    int incr = codec->driver->auto_increment;
+    int rv = 0;
+
+    int reg = 0;
+    while (reg < CODEC_REGS)
+    {
+	/* Gather as many runs as fit in one transaction. */
+	int nruns = 0;
+	while (reg < CODEC_REGS && nruns < CODEC_I2C_MAX_MSGS / 2)
+	{
+	    if (!codec->dirty[reg])
+	    {
+		reg++;
+		continue;
+	    }
+
+	    int len = 1;
+	    while (incr && reg + len < CODEC_REGS && codec->dirty[reg + len] && len < CODEC_RUN_MAX)
+		len++;
+
+	    starts[nruns] = reg;
+	    lens[nruns] = len;
+	    nruns++;
+	    reg += len;
+	}
+
+	if (nruns == 0)
+	    break;
+
+	for (int i = 0; i < nruns; i++)
+	{
+	    bufs[i][0] = starts[i] | (lens[i] > 1 ? incr : 0);
+	    memcpy(bufs[i] + 1, codec->cache + starts[i], lens[i]);
+	    msgs[i].addr = addr;
+	    msgs[i].flags = 0;
+	    msgs[i].len = lens[i] + 1;
+	    msgs[i].buf = bufs[i];
+	}
+
+	if (codec_transfer(codec, msgs, nruns) < 0)
+	    return -1;
+
+	/* Readback: set the register address, then read the run. */
+	unsigned char readback[CODEC_I2C_MAX_MSGS / 2][CODEC_RUN_MAX];
+	for (int i = 0; i < nruns; i++)
+	{
+	    msgs[2 * i].addr = addr;
+	    msgs[2 * i].flags = 0;
+	    msgs[2 * i].len = 1;
+	    msgs[2 * i].buf = bufs[i];
+	    msgs[2 * i + 1].addr = addr;
+	    msgs[2 * i + 1].flags = I2C_M_RD;
+	    msgs[2 * i + 1].len = lens[i];
+	    msgs[2 * i + 1].buf = readback[i];
+	}
+
+	if (codec_transfer(codec, msgs, 2 * nruns) < 0)
+	    return -1;
+
+	for (int i = 0; i < nruns; i++)
+	{
+	    for (int j = 0; j < lens[i]; j++)
+	    {
+		int r = starts[i] + j;
+		if (readback[i][j] == codec->cache[r])
+		{
+		    codec->dirty[r] = 0;
+		}
+		else
+		{
+		    printf("%s: register %02x wrote %02x read %02x\n",
+			   codec->driver->name, r, codec->cache[r], readback[i][j]);
+		    codec->verify_errors++;
+		    rv = -1;
+		}
+	    }
+	}
+    }
+
+    return rv;
+}
+
+/*
+ * Pisound.  No control interface, the ADC is configured with pins.
+ */
+#define PISOUND_GPIO_ADC_RESET	12
+#define PISOUND_GPIO_OSR0	13
+#define PISOUND_GPIO_OSR1	26
+#define PISOUND_GPIO_OSR2	16
+
+static int codec_pisound_probe(struct codec_s *codec)
 {
-    bcmhw_gpio_select(12, GPIO_FUNC_OUTPUT);
-    bcmhw_gpio_select(13, GPIO_FUNC_OUTPUT);
-    bcmhw_gpio_select(26, GPIO_FUNC_OUTPUT);
-    bcmhw_gpio_select(16, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_select(PISOUND_GPIO_ADC_RESET, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_select(PISOUND_GPIO_OSR0, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_select(PISOUND_GPIO_OSR1, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_select(PISOUND_GPIO_OSR2, GPIO_FUNC_OUTPUT);
 
-    bcmhw_gpio_set(12, 0);
+    return 0;
+}
+
+static int codec_pisound_init(struct codec_s *codec, int rate, int format)
+{
+    if (rate != 48000 || format != CODEC_FORMAT_I2S)
+	return -1;
+
+    bcmhw_gpio_set(PISOUND_GPIO_ADC_RESET, 0);
     usleep(1000);
 
-    bcmhw_gpio_set(13, 1);
-    bcmhw_gpio_set(26, 0);
-    bcmhw_gpio_set(16, 0);
+    bcmhw_gpio_set(PISOUND_GPIO_OSR0, 1);
+    bcmhw_gpio_set(PISOUND_GPIO_OSR1, 0);
+    bcmhw_gpio_set(PISOUND_GPIO_OSR2, 0);
 
-    bcmhw_gpio_set(12, 1);
+    bcmhw_gpio_set(PISOUND_GPIO_ADC_RESET, 1);
     usleep(1000);
 
     return 0;
 }
 
-int codec_lp1b_init(void)
+static int codec_pisound_shutdown(struct codec_s *codec)
+{
+    bcmhw_gpio_set(PISOUND_GPIO_ADC_RESET, 0);
+    return 0;
+}
+
+/*
+ * Looperlative LP1B, Cirrus CS4270.
+ */
+#define CS4270_GPIO_RESET	17
+
+#define CS4270_CHIPID		0x01
+#define CS4270_PWRCTL		0x02
+#define CS4270_MODE		0x03
+#define CS4270_FORMAT		0x04
+#define CS4270_TRANS		0x05
+#define CS4270_MUTE		0x06
+#define CS4270_VOLA		0x07
+#define CS4270_VOLB		0x08
+
+#define CS4270_PWRCTL_PDN_ADC	0x20
+#define CS4270_PWRCTL_PDN_DAC	0x02
+#define CS4270_PWRCTL_PDN	0x01
+#define CS4270_PWRCTL_ALL	(CS4270_PWRCTL_PDN_ADC | CS4270_PWRCTL_PDN_DAC | CS4270_PWRCTL_PDN)
+#define CS4270_MUTE_DAC_A	0x01
+#define CS4270_MUTE_DAC_B	0x02
+#define CS4270_I2C_INCR		0x80
+
+static const struct codec_reg_s codec_cs4270_regs[] =
+{
+    { CS4270_MODE,	0x00 },
+    { CS4270_FORMAT,	0x09 },
+    { CS4270_TRANS,	0x60 },
+    { CS4270_MUTE,	0x00 },
+    { CS4270_VOLA,	0x00 },
+    { CS4270_VOLB,	0x00 },
+};
+
+static int codec_lp1b_probe(struct codec_s *codec)
 {
     /*
      * Clock not needed for Looperlative CS4270 because it
@@ -59,59 +278,322 @@ int codec_lp1b_init(void)
     //bcmhw_set_i2s_clk(48000);
 
     // Reset codec and LED driver.
-    bcmhw_gpio_select(17, GPIO_FUNC_OUTPUT);
-    bcmhw_gpio_set(17, 0);
+    bcmhw_gpio_select(CS4270_GPIO_RESET, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_set(CS4270_GPIO_RESET, 0);
     usleep(100);
-    bcmhw_gpio_set(17, 1);
+    bcmhw_gpio_set(CS4270_GPIO_RESET, 1);
     usleep(100);
 
-    // Configure codec
-    int i2cfd = open("/dev/i2c-1", O_RDWR);
-    if (i2cfd < 0)
+    int id = codec_reg_read(codec, CS4270_CHIPID);
+    if (id < 0 || (id & 0xf0) != 0xc0)
     {
-	printf("Couldn't open I2C bus device\n");
+	printf("CS4270 not found (id %x)\n", id);
 	return -1;
     }
 
-    if (ioctl(i2cfd, I2C_SLAVE, 0x48) < 0)
-    {
-	printf("Couldn't set I2C slave address\n");
+    return 0;
+}
+
+static int codec_lp1b_init(struct codec_s *codec, int rate, int format)
+{
+    if (rate != 48000 || format != CODEC_FORMAT_I2S)
 	return -1;
+
+    /* Power down while configuring, then power up. */
+    codec_reg_write(codec, CS4270_PWRCTL, CS4270_PWRCTL_ALL);
+    if (codec_reg_sync(codec) < 0)
+	return -1;
+
+    codec_reg_write_table(codec, codec_cs4270_regs,
+			  sizeof(codec_cs4270_regs) / sizeof(codec_cs4270_regs[0]));
+    if (codec_reg_sync(codec) < 0)
+	return -1;
+
+    codec_reg_write(codec, CS4270_PWRCTL, 0);
+    return codec_reg_sync(codec);
+}
+
+static int codec_lp1b_set_volume(struct codec_s *codec, int channel, double db)
+{
+    /* Attenuation in 0.5 dB steps */
+    int value = (int) (-db * 2 + 0.5);
+    if (value < 0)
+	value = 0;
+    if (value > 255)
+	value = 255;
+
+    if (channel == 0 || channel == CODEC_CHANNEL_ALL)
+	codec_reg_write(codec, CS4270_VOLA, value);
+    if (channel == 1 || channel == CODEC_CHANNEL_ALL)
+	codec_reg_write(codec, CS4270_VOLB, value);
+
+    return codec_reg_sync(codec);
+}
+
+static int codec_lp1b_mute(struct codec_s *codec, int on)
+{
+    codec_reg_update(codec, CS4270_MUTE, CS4270_MUTE_DAC_A | CS4270_MUTE_DAC_B,
+		     on ? CS4270_MUTE_DAC_A | CS4270_MUTE_DAC_B : 0);
+    return codec_reg_sync(codec);
+}
+
+static int codec_lp1b_shutdown(struct codec_s *codec)
+{
+    codec_lp1b_mute(codec, 1);
+    codec_reg_write(codec, CS4270_PWRCTL, CS4270_PWRCTL_ALL);
+    return codec_reg_sync(codec);
+}
+
+static const struct codec_driver_s codec_drivers[] =
+{
+    {
+	"lp1b", 0x48, CS4270_I2C_INCR,
+	codec_lp1b_probe, codec_lp1b_init, codec_lp1b_set_volume,
+	codec_lp1b_mute, codec_lp1b_shutdown
+    },
+    {
+	"pisound", 0, 0,
+	codec_pisound_probe, codec_pisound_init, NULL,
+	NULL, codec_pisound_shutdown
+    },
+    { NULL }
+};
+
+/*
+ * Find a codec driver by name and probe it.  If bus is NULL, codecs with
+ * an I2C address use /dev/i2c-1.
+ */
+struct codec_s *codec_open(const char *name, const struct codec_i2c_s *bus)
+{
+    const struct codec_driver_s *driver = codec_drivers;
+    while (driver->name && strcmp(name, driver->name) != 0)
+	driver++;
+
+    if (driver->name == NULL)
+	return NULL;
+
+    struct codec_s *codec = calloc(1, sizeof(*codec));
+    if (codec == NULL)
+	return NULL;
+
+    codec->driver = driver;
+    codec->fd = -1;
+
+    if (bus)
+    {
+	codec->bus = *bus;
     }
+    else if (driver->i2c_addr)
+    {
+	codec->fd = open("/dev/i2c-1", O_RDWR);
+	if (codec->fd < 0)
+	{
+	    printf("Couldn't open I2C bus device\n");
+	    free(codec);
+	    return NULL;
+	}
+
+	codec->bus.transfer = codec_i2c_dev_transfer;
+	codec->bus.ctx = codec;
+    }
+
+    if (driver->probe && driver->probe(codec) < 0)
+    {
+	if (codec->fd >= 0)
+	    close(codec->fd);
+	free(codec);
+	return NULL;
+    }
+
+    return codec;
+}
+
+void codec_close(struct codec_s *codec)
+{
+    if (codec == NULL)
+	return;
+
+    if (codec->driver->shutdown)
+	codec->driver->shutdown(codec);
+
+    if (codec->fd >= 0)
+	close(codec->fd);
+
+    free(codec);
+}
+
+int codec_init(struct codec_s *codec, int rate, int format)
+{
+    if (codec->driver->init == NULL)
+	return 0;
+
+    return codec->driver->init(codec, rate, format);
+}
+
+int codec_set_volume(struct codec_s *codec, int channel, double db)
+{
+    if (codec->driver->set_volume == NULL)
+	return -1;
+
+    return codec->driver->set_volume(codec, channel, db);
+}
 
-    i2c_smbus_write_byte_data(i2cfd, 0x02, 0x23);
-
-    int rv = i2c_smbus_read_byte_data(i2cfd, 0x01);
-    printf("0x48:0x01 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x02);
-    printf("0x48:0x02 = %x\n", rv);
-
-    i2c_smbus_write_byte_data(i2cfd, 0x03, 0x00);
-    i2c_smbus_write_byte_data(i2cfd, 0x04, 0x09);
-    i2c_smbus_write_byte_data(i2cfd, 0x05, 0x60);
-    i2c_smbus_write_byte_data(i2cfd, 0x06, 0x00);
-    i2c_smbus_write_byte_data(i2cfd, 0x07, 0x00);
-    i2c_smbus_write_byte_data(i2cfd, 0x08, 0x00);
-    i2c_smbus_write_byte_data(i2cfd, 0x02, 0x00);
-
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x01);
-    printf("0x48:0x01 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x02);
-    printf("0x48:0x02 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x03);
-    printf("0x48:0x03 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x04);
-    printf("0x48:0x04 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x05);
-    printf("0x48:0x05 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x06);
-    printf("0x48:0x06 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x07);
-    printf("0x48:0x07 = %x\n", rv);
-    rv = i2c_smbus_read_byte_data(i2cfd, 0x08);
-    printf("0x48:0x08 = %x\n", rv);
-
-    close(i2cfd);
+int codec_mute(struct codec_s *codec, int on)
+{
+    if (codec->driver->mute == NULL)
+	return -1;
+
+    return codec->driver->mute(codec, on);
+}
+
+#ifdef CODECS_UNIT_TEST
+#include <time.h>
+#include "pusatest.h"
+
+/*
+ * Fake I2C bus with one CS4270 at 0x48.  Bus time is estimated at
+ * 100 kHz: start, address and stop per message and 9 clocks per byte.
+ */
+struct fake_i2c_s
+{
+    unsigned char regs[CODEC_REGS];
+    int pointer;
+    unsigned long transactions;
+    unsigned long messages;
+    unsigned long bytes;
+    double bus_us;
+};
+
+static int fake_i2c_transfer(void *ctx, struct i2c_msg *msgs, int nmsgs)
+{
+    struct fake_i2c_s *fake = ctx;
+
+    fake->transactions++;
+    for (int i = 0; i < nmsgs; i++)
+    {
+	struct i2c_msg *msg = msgs + i;
+	if (msg->addr != 0x48)
+	    return -1;
+
+	fake->messages++;
+	fake->bytes += msg->len;
+	fake->bus_us += (2 + 9 + 9 * msg->len) * 10.0;
+
+	int incr = 0;
+	for (int j = 0; j < msg->len; j++)
+	{
+	    if (msg->flags & I2C_M_RD)
+	    {
+		msg->buf[j] = fake->regs[fake->pointer & 0x7f];
+		fake->pointer++;
+	    }
+	    else if (j == 0)
+	    {
+		fake->pointer = msg->buf[0] & 0x7f;
+		incr = msg->buf[0] & CS4270_I2C_INCR;
+	    }
+	    else
+	    {
+		/* Chip ID is read only. */
+		if (fake->pointer != CS4270_CHIPID)
+		    fake->regs[fake->pointer & 0x7f] = msg->buf[j];
+		if (incr)
+		    fake->pointer++;
+	    }
+	}
+    }
 
     return 0;
 }
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *what, struct fake_i2c_s *fake, double cpu_us)
+{
+    printf("%-22s %3lu transactions, %3lu messages, %4lu bytes, bus %6.0f us, cpu %6.1f us\n",
+	   what, fake->transactions, fake->messages, fake->bytes, fake->bus_us, cpu_us);
+    fake->transactions = fake->messages = fake->bytes = 0;
+    fake->bus_us = 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct fake_i2c_s fake;
+    memset(&fake, 0, sizeof(fake));
+    fake.regs[CS4270_CHIPID] = 0xc3;
+
+    struct codec_i2c_s bus = { fake_i2c_transfer, &fake };
+
+    bcmhw_init_emulated();
+
+    /*
+     * The previous bring-up for comparison: one SMBus transfer per
+     * register access.
+     */
+    static const unsigned char old_writes[][2] =
+    {
+	{ 0x02, 0x23 }, { 0x03, 0x00 }, { 0x04, 0x09 }, { 0x05, 0x60 },
+	{ 0x06, 0x00 }, { 0x07, 0x00 }, { 0x08, 0x00 }, { 0x02, 0x00 },
+    };
+    for (int i = 0; i < 8; i++)
+    {
+	unsigned char buf[2] = { old_writes[i][0], old_writes[i][1] };
+	struct i2c_msg msg = { 0x48, 0, 2, buf };
+	fake_i2c_transfer(&fake, &msg, 1);
+    }
+    for (int i = 0; i < 11; i++)
+    {
+	unsigned char reg = i < 2 ? i + 1 : i - 1, value;
+	struct i2c_msg msgs[2] = { { 0x48, 0, 1, &reg }, { 0x48, I2C_M_RD, 1, &value } };
+	fake_i2c_transfer(&fake, msgs, 2);
+    }
+    report("smbus bring-up:", &fake, 0);
+    memset(fake.regs, 0, sizeof(fake.regs));
+    fake.regs[CS4270_CHIPID] = 0xc3;
+
+    double t0 = now_us();
+    struct codec_s *codec = codec_open("lp1b", &bus);
+    check(codec != NULL, "probe");
+    if (codec == NULL)
+	return 1;
+    check(codec_init(codec, 48000, CODEC_FORMAT_I2S) == 0, "init");
+    report("batched bring-up:", &fake, now_us() - t0);
+
+    check(fake.regs[CS4270_PWRCTL] == 0x00, "power up");
+    check(fake.regs[CS4270_FORMAT] == 0x09, "format");
+    check(fake.regs[CS4270_TRANS] == 0x60, "transition");
+    check(codec_init(codec, 44100, CODEC_FORMAT_I2S) < 0, "reject unsupported rate");
+
+    /* Preset change: only the two volume registers should go out. */
+    t0 = now_us();
+    check(codec_set_volume(codec, CODEC_CHANNEL_ALL, -6.0) == 0, "volume");
+    report("volume change:", &fake, now_us() - t0);
+    check(fake.regs[CS4270_VOLA] == 12 && fake.regs[CS4270_VOLB] == 12, "volume registers");
+
+    t0 = now_us();
+    check(codec_set_volume(codec, CODEC_CHANNEL_ALL, -6.0) == 0, "same volume");
+    check(fake.transactions == 0, "unchanged volume is not sent");
+    report("unchanged volume:", &fake, now_us() - t0);
+
+    check(codec_mute(codec, 1) == 0, "mute");
+    check(fake.regs[CS4270_MUTE] == (CS4270_MUTE_DAC_A | CS4270_MUTE_DAC_B), "mute register");
+    report("mute:", &fake, 0);
+
+    /* A register that doesn't stick must be reported. */
+    codec_reg_write(codec, CS4270_CHIPID, 0x55);
+    check(codec_reg_sync(codec) < 0 && codec->verify_errors == 1, "readback verification");
+    codec->dirty[CS4270_CHIPID] = 0;
+    report("failed verify:", &fake, 0);
+
+    codec_close(codec);
+    check(fake.regs[CS4270_PWRCTL] == CS4270_PWRCTL_ALL, "shutdown powers down");
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+#endif
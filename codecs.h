@@ -1,7 +1,68 @@
 #ifndef __codecs_h__
 #define __codecs_h__
 
-int codec_lp1b_init(void);
-int codec_pisound_init(void);
+#include <linux/i2c.h>
+
+#define CODEC_FORMAT_I2S	0
+
+#define CODEC_REGS		256
+#define CODEC_CHANNEL_ALL	-1
+
+/*
+ * One register and value in a register map.
+ */
+struct codec_reg_s
+{
+    unsigned char reg;
+    unsigned char value;
+};
+
+/*
+ * I2C access for a codec.  transfer() performs all messages as a single
+ * combined transaction, like I2C_RDWR.
+ */
+struct codec_i2c_s
+{
+    int (*transfer)(void *ctx, struct i2c_msg *msgs, int nmsgs);
+    void *ctx;
+};
+
+struct codec_s;
+
+struct codec_driver_s
+{
+    const char *name;
+    unsigned short i2c_addr;
+    unsigned char auto_increment;
+    int (*probe)(struct codec_s *codec);
+    int (*init)(struct codec_s *codec, int rate, int format);
+    int (*set_volume)(struct codec_s *codec, int channel, double db);
+    int (*mute)(struct codec_s *codec, int on);
+    int (*shutdown)(struct codec_s *codec);
+};
+
+struct codec_s
+{
+    const struct codec_driver_s *driver;
+    struct codec_i2c_s bus;
+    int fd;
+    unsigned char cache[CODEC_REGS];
+    unsigned char cached[CODEC_REGS];
+    unsigned char dirty[CODEC_REGS];
+    unsigned long transactions;
+    unsigned long verify_errors;
+};
+
+struct codec_s *codec_open(const char *name, const struct codec_i2c_s *bus);
+void codec_close(struct codec_s *codec);
+int codec_init(struct codec_s *codec, int rate, int format);
+int codec_set_volume(struct codec_s *codec, int channel, double db);
+int codec_mute(struct codec_s *codec, int on);
+
+int codec_reg_read(struct codec_s *codec, int reg);
+void codec_reg_write(struct codec_s *codec, int reg, int value);
+void codec_reg_update(struct codec_s *codec, int reg, int mask, int value);
+void codec_reg_write_table(struct codec_s *codec, const struct codec_reg_s *regs, int nregs);
+int codec_reg_sync(struct codec_s *codec);
 
 #endif /* __codecs_h__ */
@@ -35,20 +35,24 @@
 #include "bcmhw.h"
 #include "codecs.h"
 #include "pusa.h"
+#include "pusasync.h"
+#include "pusagpio.h"
+#include "pusagov.h"
+#include "pusacpu.h"
+#include "pusamem.h"
+#include "pusacapture.h"
+#include "pusaanalysis.h"
+#include "pusajournal.h"
+#include "pusashm.h"
+#include "pusanet.h"
+#include "pusabridge.h"
+#include "pusalatency.h"
+#include "pusatrace.h"
+#include "pusaclock.h"
+#include "pusaparam.h"
 
 pid_t gettid(void);
 
-struct pusa_codec_s
-{
-    char *name;
-    int (*init)(void);
-} pusa_codecs[] =
-{
-    { "lp1b", 		codec_lp1b_init },
-    { "pisound", 	codec_pisound_init },
-    { NULL, NULL }
-};
-
 int pusa_rx_errors = 0;
 int pusa_tx_errors = 0;
 int pusa_max_loops = 0;
@@ -56,11 +60,56 @@ int pusa_rx_counter = 0;
 int pusa_tx_counter = 0;
 int pusa_tx_counter_at_first_found = 0;
 int pusa_prefill_count = 0;
-int pusa_done = 0;
+volatile int pusa_done = 0;
+static unsigned long long pusa_sample_index = 0;
+static int pusa_sample_rate = PUSA_SAMPLE_RATE;
 static int pusa_rt_tid = 0;
 static __thread int pusa_is_rt_thread = 0;
 
 pusa_audio_handler_t pusa_audio_handler = NULL;
+static struct codec_s *pusa_codec = NULL;
+
+#define PUSA_STATE_STOPPED	0
+#define PUSA_STATE_STARTING	1
+#define PUSA_STATE_RUNNING	2
+#define PUSA_STATE_FAILED	3
+
+#define PUSA_SYNC_TIMEOUT_US		1000
+#define PUSA_FIRST_RX_TIMEOUT_US	100000
+#define PUSA_DRAIN_TIMEOUT_US		5000
+
+/*
+ * A FIFO must stay out of sync this long before we treat it as a slip
+ * rather than a transient, then recovery takes about one FIFO of frames.
+ * The transmit FIFO is refilled with the last output ramping to zero and
+ * new output fades in over PUSA_RESYNC_FADE frames.
+ */
+#define PUSA_SYNC_BITS			(PCM_CS_RXSYNC | PCM_CS_TXSYNC)
+#define PUSA_RESYNC_CONFIRM_US		50
+#define PUSA_RESYNC_PREFILL		32
+#define PUSA_RESYNC_FADE		64
+
+/*
+ * Adaptive polling sleeps on the local counter until this long before the
+ * next frame is expected.  The margin grows whenever a frame was already
+ * waiting when polling resumed, and shrinks back slowly.
+ */
+#define PUSA_POLL_GUARD_US		2
+#define PUSA_POLL_SHRINK_FRAMES		48000
+
+static pthread_t pusa_rt_thread;
+static int pusa_rt_started = 0;
+static volatile int pusa_rt_state = PUSA_STATE_STOPPED;
+static int pusa_pcm_warm = 0;
+static struct pusa_start_times_s pusa_start_times;
+static struct pusa_resync_stats_s pusa_resync_stats;
+static int pusa_rt_cpu = 3;
+static unsigned long pusa_housekeeping_cpus = 0x7;
+static struct pusacpu_audit_s pusa_audit;
+static volatile int pusa_poll_mode = PUSA_POLL_ADAPTIVE;
+static struct pusa_poll_stats_s pusa_poll_stats;
+static int pusa_sync_suspect = 0;
+static unsigned long pusa_sync_suspect_time;
 
 static pusa_rt_func pusa_rt_modifier_func;
 static int pusa_rt_modifier_return;
@@ -75,6 +124,37 @@ static unsigned long time1_times[100];
 static unsigned long time2_times[100];
 volatile unsigned long num_times = 0;
 
+/*
+ * Number of frames passed to the audio handler since start.  Safe to call
+ * from any thread.
+ */
+unsigned long long pusa_get_sample_index(void)
+{
+    return __atomic_load_n(&pusa_sample_index, __ATOMIC_RELAXED);
+}
+
+int pusa_get_sample_rate(void)
+{
+    return pusa_sample_rate;
+}
+
+/*
+ * Frames written to the transmit FIFO ahead of the first one received,
+ * which is how far output runs behind input from then on.
+ */
+int pusa_get_prefill_frames(void)
+{
+    return pusa_prefill_count / 2;
+}
+
+/*
+ * True on the audio thread.
+ */
+int pusa_in_rt_thread(void)
+{
+    return pusa_is_rt_thread;
+}
+
 int pusa_execute_in_rt(pusa_rt_func func, void *parm)
 {
     if (pusa_is_rt_thread)
@@ -84,6 +164,19 @@ int pusa_execute_in_rt(pusa_rt_func func, void *parm)
     }
 
     pthread_mutex_lock(&pusa_rt_modifier_lock);
+
+    /*
+     * Nothing to synchronize with while the audio thread is stopped.
+     * pusa_start() holds the lock until it is running or has failed.
+     */
+    if (pusa_rt_state != PUSA_STATE_RUNNING)
+    {
+	pusajournal_rt_call(pusa_sample_index, func, parm);
+	int rv = (*func)(parm);
+	pthread_mutex_unlock(&pusa_rt_modifier_lock);
+	return rv;
+    }
+
     pusa_rt_modifier_parm = parm;
     pusa_rt_modifier_func = func;
     __sync_synchronize(); // Guarantees that previous 2 lines are done before the next line
@@ -98,54 +191,95 @@ int pusa_execute_in_rt(pusa_rt_func func, void *parm)
     return rv;
 }
 
-void *pusa_audio_thread(void *arg)
+/*
+ * Microseconds since the previous call, for timing start up phases.
+ */
+static unsigned long pusa_phase_time(struct timespec *last)
 {
-    pusa_rt_tid = gettid();
-    pusa_is_rt_thread = 1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    cpu_set_t cpus;
-    CPU_ZERO(&cpus);
-    CPU_SET(3, &cpus);
-    sched_setaffinity(0, sizeof(cpus), &cpus);
+    long us = (now.tv_sec - last->tv_sec) * 1000000L + (now.tv_nsec - last->tv_nsec) / 1000;
+    *last = now;
 
-    struct sched_param sparam;
-    sparam.sched_priority = 99;
-    sched_setscheduler(pusa_rt_tid, SCHED_FIFO, &sparam);
+    return us;
+}
 
-    /*
-     * It is possible that we were running before and never stopped.  There is
-     * no reset bit, but we can stop the interface, wait, and then enable it again.
-     *
-     * This does seem to steal the I2S interface from Linux.  This is tested with
-     * the Pisound card.  Stealing the interface without disabling the driver allows
-     * the Pisound MIDI interface to continue to work in Linux ALSA.  This may not
-     * strictly the cleanest way to do things, but it works and avoids rewriting
-     * the device driver for the Pisound MIDI interface which is currently a single
-     * driver with the audio interface.  Honestly, it doesn't need to be that way
-     * since the Pisound is using a UART with a SPI interface for MIDI.  Like it or
-     * not, I've decided to leave things this way.
-     */
-    writel(PCM_CS_A, 0);
-    usleep(10000);
+/*
+ * Wait for the PCM block to catch up with the last write to CS.  The SYNC
+ * bit reads back what was written only after two PCM clocks, so toggling
+ * it and polling tells us when FIFO clears and enables have taken effect.
+ * Falls back to a sleep if the clock isn't running yet.
+ */
+static int pusa_pcm_sync(unsigned long timeout_us)
+{
+    unsigned long cs = readl(PCM_CS_A) & ~(PCM_CS_TXCLR | PCM_CS_RXCLR | PCM_CS_RXERR | PCM_CS_TXERR);
+    unsigned long want = (cs & PCM_CS_SYNC) ^ PCM_CS_SYNC;
 
-    writel(PCM_CS_A, PCM_CS_EN);
-    usleep(10000);
+    writel(PCM_CS_A, (cs & ~PCM_CS_SYNC) | want);
 
-    /*
-     * Remove RAM standby mode.  Doc isn't clear on whether this is required for the Pi Zero,
-     * but we don't want to take a chance.
-     */
-    writel(PCM_CS_A, PCM_CS_STBY | PCM_CS_EN);
-    usleep(1000);
+    unsigned long start = bcmhw_get_system_timer();
+    while ((readl(PCM_CS_A) & PCM_CS_SYNC) != want)
+    {
+	if (bcmhw_get_system_timer() - start > timeout_us)
+	{
+	    usleep(1000);
+	    return -1;
+	}
+    }
 
-    /*
-     * ALT0 function for each:
-     * GPIO18 - CLK, GPIO19 - FS, GPIO20 - DIN, GPIO21 - DOUT
-     */
-    bcmhw_gpio_select(18, GPIO_FUNC_ALT0);
-    bcmhw_gpio_select(19, GPIO_FUNC_ALT0);
-    bcmhw_gpio_select(20, GPIO_FUNC_ALT0);
-    bcmhw_gpio_select(21, GPIO_FUNC_ALT0);
+    return 0;
+}
+
+/*
+ * Put the PCM block in a known state and configure it for I2S.  A cold
+ * start assumes nothing about the hardware.  A warm start follows our own
+ * pusa_pcm_drain(), so the interface is already enabled, out of standby,
+ * with the pins selected and the FIFOs empty.
+ */
+static void pusa_pcm_setup(int warm)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    if (!warm)
+    {
+	/*
+	 * It is possible that we were running before and never stopped.  There is
+	 * no reset bit, but we can stop the interface, wait, and then enable it again.
+	 *
+	 * This does seem to steal the I2S interface from Linux.  This is tested with
+	 * the Pisound card.  Stealing the interface without disabling the driver allows
+	 * the Pisound MIDI interface to continue to work in Linux ALSA.  This may not
+	 * strictly the cleanest way to do things, but it works and avoids rewriting
+	 * the device driver for the Pisound MIDI interface which is currently a single
+	 * driver with the audio interface.  Honestly, it doesn't need to be that way
+	 * since the Pisound is using a UART with a SPI interface for MIDI.  Like it or
+	 * not, I've decided to leave things this way.
+	 */
+	writel(PCM_CS_A, 0);
+	usleep(10000);
+
+	writel(PCM_CS_A, PCM_CS_EN);
+	usleep(10000);
+
+	/*
+	 * Remove RAM standby mode.  Doc isn't clear on whether this is required for the Pi Zero,
+	 * but we don't want to take a chance.
+	 */
+	writel(PCM_CS_A, PCM_CS_STBY | PCM_CS_EN);
+	usleep(1000);
+
+	/*
+	 * ALT0 function for each:
+	 * GPIO18 - CLK, GPIO19 - FS, GPIO20 - DIN, GPIO21 - DOUT
+	 */
+	bcmhw_gpio_select(18, GPIO_FUNC_ALT0);
+	bcmhw_gpio_select(19, GPIO_FUNC_ALT0);
+	bcmhw_gpio_select(20, GPIO_FUNC_ALT0);
+	bcmhw_gpio_select(21, GPIO_FUNC_ALT0);
+    }
+    pusa_start_times.pcm_reset = pusa_phase_time(&t);
 
     /* 32-bit data, 1-bit shift for I2S */
     writel(PCM_RXC_A, (PCM_RXC_CH1WEX | PCM_RXC_CH1EN | PCM_RXC_CH1POS(1) | PCM_RXC_CH1WID(8) |
@@ -165,10 +299,12 @@ void *pusa_audio_thread(void *arg)
 	   PCM_MODE_FLEN(63) | PCM_MODE_FSLEN(32));
 
     writel(PCM_CS_A, readl(PCM_CS_A) | PCM_CS_TXTHR_LVL1 | PCM_CS_RXTHR_LVL1);
+    pusa_start_times.pcm_config = pusa_phase_time(&t);
 
     /* Clear FIFOs */
     writel(PCM_CS_A, readl(PCM_CS_A) | PCM_CS_TXCLR | PCM_CS_RXCLR);
-    usleep(1000);
+    pusa_pcm_sync(PUSA_SYNC_TIMEOUT_US);
+    pusa_start_times.fifo_clear = pusa_phase_time(&t);
 
     /* Enable rx and tx */
     writel(PCM_CS_A, readl(PCM_CS_A) | PCM_CS_TXON | PCM_CS_RXON | PCM_CS_RXSEX);
@@ -176,11 +312,25 @@ void *pusa_audio_thread(void *arg)
     /* Enable I2S */
     writel(PCM_CS_A, readl(PCM_CS_A) | PCM_CS_EN | PCM_CS_RXSEX);
 
-    for (int i = 1; (readl(PCM_CS_A) & PCM_CS_TXW) != 0 && i <= 64; i++)
+    /* Whole frames only, or the transmit FIFO starts out of sync. */
+    for (int i = 2; (readl(PCM_CS_A) & PCM_CS_TXW) != 0 && i <= 64; i += 2)
     {
+	writel(PCM_FIFO_A, 0);
 	writel(PCM_FIFO_A, 0);
 	pusa_prefill_count = i;
     }
+    pusa_start_times.prefill = pusa_phase_time(&t);
+}
+
+/*
+ * Wait for the first received frame while keeping the transmit FIFO full.
+ */
+static int pusa_pcm_wait_first_rx(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    unsigned long start = bcmhw_get_system_timer();
 
     while (1)
     {
@@ -205,25 +355,182 @@ void *pusa_audio_thread(void *arg)
 	    writel(PCM_FIFO_A, 0);
 	    pusa_tx_counter++;
 	}
+	else if (bcmhw_get_system_timer() - start > PUSA_FIRST_RX_TIMEOUT_US)
+	{
+	    printf("No frames received from codec\n");
+	    return -1;
+	}
     }
 
     pusa_tx_counter_at_first_found = pusa_tx_counter;
     pusa_tx_counter = 0;
+    pusa_start_times.first_rx = pusa_phase_time(&t);
+
+    return 0;
+}
+
+/*
+ * Let the transmit FIFO play out, then stop the interface and leave it
+ * enabled with empty FIFOs, ready for a warm start.
+ */
+static void pusa_pcm_drain(void)
+{
+    unsigned long start = bcmhw_get_system_timer();
+
+    while ((readl(PCM_CS_A) & PCM_CS_TXE) == 0)
+    {
+	if (bcmhw_get_system_timer() - start > PUSA_DRAIN_TIMEOUT_US)
+	{
+	    printf("Timed out draining transmit FIFO\n");
+	    break;
+	}
+    }
+
+    unsigned long cs = readl(PCM_CS_A) & ~(PCM_CS_TXON | PCM_CS_RXON);
+    writel(PCM_CS_A, cs);
+    writel(PCM_CS_A, cs | PCM_CS_TXCLR | PCM_CS_RXCLR);
+    pusa_pcm_sync(PUSA_SYNC_TIMEOUT_US);
+}
+
+/*
+ * Returns true once a FIFO has been out of sync for long enough that left
+ * and right must have slipped.
+ */
+static inline int pusa_pcm_out_of_sync(unsigned long status)
+{
+    if ((status & PUSA_SYNC_BITS) == PUSA_SYNC_BITS)
+    {
+	pusa_sync_suspect = 0;
+	return 0;
+    }
+
+    unsigned long now = bcmhw_get_system_timer();
+    if (!pusa_sync_suspect)
+    {
+	pusa_sync_suspect = 1;
+	pusa_sync_suspect_time = now;
+	return 0;
+    }
+
+    return now - pusa_sync_suspect_time >= PUSA_RESYNC_CONFIRM_US;
+}
+
+/*
+ * Realign both FIFOs to the frame.  Stopping, clearing and restarting
+ * TX/RX makes the hardware start again at channel 1 of the next frame.
+ * The transmit FIFO is refilled with the last output frame ramping down
+ * to silence so the gap doesn't click.
+ */
+static void pusa_pcm_resync(unsigned long status, int last_left, int last_right)
+{
+    if ((status & PCM_CS_RXSYNC) == 0)
+	pusa_resync_stats.rx_slips++;
+    if ((status & PCM_CS_TXSYNC) == 0)
+	pusa_resync_stats.tx_slips++;
+
+    unsigned long cs = readl(PCM_CS_A) & ~(PCM_CS_TXON | PCM_CS_RXON | PCM_CS_RXERR | PCM_CS_TXERR);
+    writel(PCM_CS_A, cs);
+    writel(PCM_CS_A, cs | PCM_CS_TXCLR | PCM_CS_RXCLR);
+    pusa_pcm_sync(PUSA_SYNC_TIMEOUT_US);
+
+    for (int i = 0; i < PUSA_RESYNC_PREFILL && (readl(PCM_CS_A) & PCM_CS_TXW) != 0; i++)
+    {
+	int gain = PUSA_RESYNC_PREFILL - 1 - i;
+	writel(PCM_FIFO_A, (long long) last_left * gain / PUSA_RESYNC_PREFILL);
+	writel(PCM_FIFO_A, (long long) last_right * gain / PUSA_RESYNC_PREFILL);
+    }
+
+    writel(PCM_CS_A, readl(PCM_CS_A) | PCM_CS_TXON | PCM_CS_RXON);
+
+    unsigned long us = bcmhw_get_system_timer() - pusa_sync_suspect_time;
+    pusa_resync_stats.recoveries++;
+    pusa_resync_stats.last_us = us;
+    if (us > pusa_resync_stats.max_us)
+	pusa_resync_stats.max_us = us;
+
+    pusa_sync_suspect = 0;
+}
+
+void *pusa_audio_thread(void *arg)
+{
+    pusa_rt_tid = gettid();
+    pusa_is_rt_thread = 1;
+
+#ifndef BCMHW_EMULATE
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(pusa_rt_cpu, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    struct sched_param sparam;
+    sparam.sched_priority = 99;
+    sched_setscheduler(pusa_rt_tid, SCHED_FIFO, &sparam);
+#endif
+
+    pusa_pcm_setup(pusa_pcm_warm);
+    if (pusa_pcm_wait_first_rx() < 0)
+    {
+	/* State of the interface is unknown, so next start is cold. */
+	pusa_pcm_warm = 0;
+	pusa_rt_state = PUSA_STATE_FAILED;
+	return NULL;
+    }
+
+    pusamem_prefault_stack();
+    pusaclock_rt_reset(pusa_sample_rate);
+    PUSATRACE_THREAD("audio");
+    pusamem_rt_active(1);
+
+    __sync_synchronize();
+    pusa_rt_state = PUSA_STATE_RUNNING;
 
     int data[16];
     int ndata = 0;
+    int last_left = 0, last_right = 0;
+    int fade = 0;
+
+    pusa_sync_suspect = 0;
+
+    unsigned long long cycles_per_sec = bcmhw_cycles_per_sec();
+    unsigned long long us_scale = (1000000ULL << 32) / cycles_per_sec;
+    unsigned long long ns_scale = (1000000000ULL << 32) / cycles_per_sec;
+    unsigned long long period = cycles_per_sec / pusa_sample_rate;
+    unsigned long long min_guard = cycles_per_sec * PUSA_POLL_GUARD_US / 1000000;
+    unsigned long long guard = min_guard;
+    unsigned long long next_poll = 0;
+    unsigned long mmio = 0;
+    int on_time = 0;
+    int wait_polls = 0;
 
     while (!pusa_done)
     {
 	pusa_rt_func last_func;
 	if (pusa_rt_modifier_go)
 	{
+	    pusajournal_rt_call(pusa_sample_index, pusa_rt_modifier_func, pusa_rt_modifier_parm);
+	    PUSATRACE_BEGIN(PUSATRACE_MODIFIER);
 	    pusa_rt_modifier_return = (*pusa_rt_modifier_func)(pusa_rt_modifier_parm);
+	    PUSATRACE_END(PUSATRACE_MODIFIER);
 	    last_func = pusa_rt_modifier_func;
 	    __sync_synchronize(); // Guarantees that previous line is done before the next line
 	    pusa_rt_modifier_go = 0;
 	}
 
+	/*
+	 * Stay off the peripheral bus until just before the next frame is due.
+	 * Status polls are uncached reads that slow down memory access from
+	 * the other cores.
+	 */
+	int waited = 0;
+	if (pusa_poll_mode == PUSA_POLL_ADAPTIVE && next_poll != 0)
+	{
+	    while ((long long) (bcmhw_cycles() - next_poll) < 0)
+		bcmhw_relax();
+	    next_poll = 0;
+	    waited = 1;
+	    wait_polls = 0;
+	}
+
 	/*
 	 * Read FIFO if data available and the send to TX FIFO. Keep count of RX and TX errors.
 	 */
@@ -233,34 +540,124 @@ void *pusa_audio_thread(void *arg)
 	do
 	{
 	    status = readl(PCM_CS_A);
-	    writel(PCM_CS_A, status);
+	    mmio++;
+	    pusa_poll_stats.polls++;
+
+	    /* Error bits are write one to clear, nothing else needs writing. */
+	    if (pusa_poll_mode == PUSA_POLL_BUSY || (status & (PCM_CS_RXERR | PCM_CS_TXERR)))
+	    {
+		writel(PCM_CS_A, status);
+		mmio++;
+	    }
 
 	    if (status & PCM_CS_RXERR)
+	    {
 		pusa_rx_errors++;
+		PUSATRACE_INSTANT(PUSATRACE_RX_ERROR, pusa_sample_index);
+	    }
 	    if (status & PCM_CS_TXERR)
+	    {
 		pusa_tx_errors++;
+		PUSATRACE_INSTANT(PUSATRACE_TX_ERROR, pusa_sample_index);
+	    }
+	    if ((status & PUSA_SYNC_BITS) != PUSA_SYNC_BITS && pusa_pcm_out_of_sync(status))
+	    {
+		PUSATRACE_INSTANT(PUSATRACE_RESYNC, status);
+		pusa_pcm_resync(status, last_left, last_right);
+		fade = PUSA_RESYNC_FADE;
+		next_poll = 0;
+		break;
+	    }
 	    if (status & PCM_CS_RXR)
 	    {
+		/*
+		 * Predict the next frame from this one.  If it was already
+		 * waiting on the first poll, we woke up too late.
+		 */
+		if (nloops == 0)
+		{
+		    PUSATRACE_INSTANT(PUSATRACE_FIFO_WAKE, wait_polls);
+		    if (waited && wait_polls == 0)
+		    {
+			pusa_poll_stats.late++;
+			guard += guard / 4 + 1;
+			if (guard > period / 2)
+			    guard = period / 2;
+			on_time = 0;
+		    }
+		    else if (++on_time >= PUSA_POLL_SHRINK_FRAMES)
+		    {
+			guard -= guard / 8;
+			if (guard < min_guard)
+			    guard = min_guard;
+			on_time = 0;
+		    }
+		    next_poll = bcmhw_cycles() + period - guard;
+		    pusa_poll_stats.guard_us = (guard * us_scale) >> 32;
+		}
+
 		data[ndata++] = readl(PCM_FIFO_A);
 		data[ndata++] = readl(PCM_FIFO_A);
+		mmio += 2;
 		pusa_rx_counter++;
 		nloops++;
 	    }
+	    wait_polls++;
 
 	    for (int i = 0; i < ndata; i += 2)
 	    {
+		unsigned long long frame_start = bcmhw_cycles();
 		if (num_times < 100)
 		    time1_times[num_times] = bcmhw_get_system_timer();
 
+		pusaclock_rt_frame(pusa_sample_index);
+		pusasync_rt_frame(pusa_sample_index);
+		pusagpio_rt_frame(pusa_sample_index);
+
+		pusamem_rt_period();
+		pusaparam_rt_frame();
+		pusaanalysis_rt_input(data + i);
+		pusajournal_rt_input(data + i);
+		pusashm_rt_input(data + i);
+		pusalatency_rt_input(data + i);
+		PUSATRACE_BEGIN(PUSATRACE_HANDLER);
 		if (pusa_audio_handler != NULL)
 		    pusa_audio_handler(data + i, 2);
+		PUSATRACE_END(PUSATRACE_HANDLER);
+		pusajournal_rt_output(pusa_sample_index, data + i);
+		pusashm_rt_output(data + i);
+		pusanet_rt_frame(data + i);
+		pusabridge_rt_frame(data + i);
+
+		pusagov_rt_frame(pusa_sample_index, ((bcmhw_cycles() - frame_start) * ns_scale) >> 32, nloops);
+
+		__atomic_store_n(&pusa_sample_index, pusa_sample_index + 1, __ATOMIC_RELAXED);
 
 		if (num_times < 100)
 		    time2_times[num_times++] = bcmhw_get_system_timer();
 
+		if (fade > 0)
+		{
+		    int gain = PUSA_RESYNC_FADE - --fade;
+		    data[i] = (long long) data[i] * gain / PUSA_RESYNC_FADE;
+		    data[i + 1] = (long long) data[i + 1] * gain / PUSA_RESYNC_FADE;
+		}
+		last_left = data[i];
+		last_right = data[i + 1];
+		pusacapture_rt_frame(pusa_sample_index - 1, data + i);
+		pusaanalysis_rt_output(data + i);
+		pusalatency_rt_output(data + i);
+
 		writel(PCM_FIFO_A, data[i]);
 		writel(PCM_FIFO_A, data[i + 1]);
+		mmio += 2;
 		pusa_tx_counter++;
+
+		pusa_poll_stats.frames++;
+		pusa_poll_stats.mmio += mmio;
+		if (mmio > pusa_poll_stats.max_mmio)
+		    pusa_poll_stats.max_mmio = mmio;
+		mmio = 0;
 	    }
 	    ndata = 0;
 	}
@@ -276,26 +673,160 @@ void *pusa_audio_thread(void *arg)
 	    pusa_max_loops = nloops;
 	}
     }
+
+    pusa_pcm_drain();
+    pusamem_rt_active(0);
+    pusa_pcm_warm = 1;
+    pusa_rt_state = PUSA_STATE_STOPPED;
+
+    return NULL;
 }
 
-struct pusa_codec_s *pusa_find_codec(const char *name)
+/*
+ * Start the audio thread and wait until it is passing audio.  The first
+ * start after pusa_init() is cold; later ones reuse the state left by
+ * pusa_stop().
+ */
+int pusa_start(void)
 {
-    struct pusa_codec_s *codec = pusa_codecs;
-    while (codec->name)
+    if (pusa_rt_started)
+	return 0;
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    /*
+     * pusa_execute_in_rt() runs functions inline unless the thread is
+     * running, so keep them out until it is running or has failed.
+     * Otherwise one could still be running when the handler is first
+     * called.
+     */
+    pthread_mutex_lock(&pusa_rt_modifier_lock);
+
+    pusa_start_times.warm = pusa_pcm_warm;
+    pusa_done = 0;
+    pusa_rt_state = PUSA_STATE_STARTING;
+    __sync_synchronize();
+
+    if (pthread_create(&pusa_rt_thread, NULL, pusa_audio_thread, NULL) != 0)
     {
-	if (strcmp(name, codec->name) == 0)
-	    return codec;
+	pusa_rt_state = PUSA_STATE_STOPPED;
+	pthread_mutex_unlock(&pusa_rt_modifier_lock);
+	perror("Failed to create audio thread");
+	return -1;
+    }
+    pusa_rt_started = 1;
+
+    while (pusa_rt_state == PUSA_STATE_STARTING)
+	usleep(100);
 
-	codec++;
+    if (pusa_rt_state != PUSA_STATE_RUNNING)
+    {
+	pthread_join(pusa_rt_thread, NULL);
+	pusa_rt_started = 0;
+	pthread_mutex_unlock(&pusa_rt_modifier_lock);
+	return -1;
     }
 
-    return NULL;
+    pthread_mutex_unlock(&pusa_rt_modifier_lock);
+
+    pusa_start_times.start = pusa_phase_time(&t);
+
+    return 0;
+}
+
+/*
+ * Stop the audio thread after it drains the transmit FIFO.  Returns once
+ * the thread has exited.  Handlers and pusa_execute_in_rt() functions are
+ * not called after this returns.
+ */
+void pusa_stop(void)
+{
+    if (!pusa_rt_started)
+	return;
+
+    /* No pusa_execute_in_rt() may be waiting on the thread while it exits. */
+    pthread_mutex_lock(&pusa_rt_modifier_lock);
+    pusa_done = 1;
+    pthread_join(pusa_rt_thread, NULL);
+    pusa_rt_started = 0;
+    pthread_mutex_unlock(&pusa_rt_modifier_lock);
+}
+
+static int pusa_codec_setup(const char *codec_name, int rate)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    pusa_codec = codec_open(codec_name, NULL);
+    if (pusa_codec == NULL)
+	return -1;
+
+    if (codec_init(pusa_codec, rate, CODEC_FORMAT_I2S) < 0)
+    {
+	codec_close(pusa_codec);
+	pusa_codec = NULL;
+	return -1;
+    }
+
+    pusa_sample_rate = rate;
+    pusa_start_times.codec = pusa_phase_time(&t);
+
+    return 0;
+}
+
+/*
+ * Switch codec or sample rate without restarting the process.
+ */
+int pusa_reconfigure(const char *codec_name, int rate)
+{
+    pusa_stop();
+
+    if (pusa_codec != NULL)
+    {
+	codec_close(pusa_codec);
+	pusa_codec = NULL;
+    }
+
+    if (pusa_codec_setup(codec_name, rate) < 0)
+	return -1;
+
+    return pusa_start();
+}
+
+/*
+ * Choose the core for the audio thread and the cores everything else may
+ * use.  Must be called before pusa_init().  The defaults, core 3 and cores
+ * 0-2, suit the four core Pis.
+ */
+int pusa_set_cpus(int rt_cpu, unsigned long housekeeping)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (rt_cpu < 0 || rt_cpu >= ncpus || rt_cpu >= (int) sizeof(housekeeping) * 8 ||
+	housekeeping == 0 || (housekeeping & (1UL << rt_cpu)) ||
+	(ncpus < (long) sizeof(housekeeping) * 8 && (housekeeping >> ncpus) != 0))
+    {
+	printf("Bad CPU placement: rt %d, housekeeping %lx\n", rt_cpu, housekeeping);
+	return -1;
+    }
+
+    pusa_rt_cpu = rt_cpu;
+    pusa_housekeeping_cpus = housekeeping;
+
+    return 0;
+}
+
+const struct pusacpu_audit_s *pusa_get_audit(void)
+{
+    return &pusa_audit;
 }
 
 int pusa_init(const char *codec_name, pusa_audio_handler_t func)
 {
     pusa_audio_handler = func;
 
+#ifndef BCMHW_EMULATE
     /*
      * Disable run time limit on real-time thread.  By default, Linux
      * doesn't allow a real-time thread to comsume 100% of a CPU, but
@@ -327,38 +858,106 @@ int pusa_init(const char *codec_name, pusa_audio_handler_t func)
      */
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(0, &cpuset);
-    CPU_SET(1, &cpuset);
-    CPU_SET(2, &cpuset);
+    for (int cpu = 0; cpu < (int) sizeof(pusa_housekeeping_cpus) * 8; cpu++)
+	if (pusa_housekeeping_cpus & (1UL << cpu))
+	    CPU_SET(cpu, &cpuset);
 
     if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
         perror("Failed to set main thread affinity");
         return EXIT_FAILURE;
     }
 
+    /*
+     * Move interrupts off the real-time core and report anything else
+     * that can still interrupt it.
+     */
+    pusacpu_audit("", pusa_rt_cpu, pusa_housekeeping_cpus, 1, &pusa_audit);
+    pusacpu_print_audit(&pusa_audit);
+#endif
+
+    /*
+     * Memory for audio handlers, unless the application already set it
+     * up with its own sizes.
+     */
+    if (pusamem_init(0, 0, 0) < 0)
+	return -1;
+
     /*
      * Prepare the hardware library code for use.  Mostly needs
      * to mmap device registers.
      */
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
     if (bcmhw_init() < 0)
 	return -1;
 
+    pusa_start_times.bcmhw = pusa_phase_time(&t);
+
     /*
      * CODEC specific initialization.
      */
-    struct pusa_codec_s *codec = pusa_find_codec(codec_name);
-    if (codec == NULL || (*codec->init)() < 0)
+    if (pusa_codec_setup(codec_name, PUSA_SAMPLE_RATE) < 0)
 	return -1;
 
     /*
      * Start audio thread.
      */
-    pthread_t rt_tid;
-    pthread_create(&rt_tid, NULL, pusa_audio_thread, NULL);
+    pusa_pcm_warm = 0;
+    return pusa_start();
+}
+
+/*
+ * Set up for pusa_render() without touching the hardware.  Not while the
+ * audio thread is running.
+ */
+int pusa_render_init(int rate, pusa_audio_handler_t func)
+{
+    if (pusa_rt_state == PUSA_STATE_RUNNING)
+	return -1;
+
+    pusa_audio_handler = func;
+    pusa_sample_rate = rate;
+    pusa_sample_index = 0;
 
     return 0;
 }
 
+/*
+ * Make the next frame rendered the one at sample_index.
+ */
+void pusa_render_seek(unsigned long long sample_index)
+{
+    __atomic_store_n(&pusa_sample_index, sample_index, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pass nframes interleaved stereo frames through the handler in place,
+ * the same way the audio thread does, minus the PCM, sync, GPIO and
+ * governor.
+ */
+void pusa_render(int *data, int nframes)
+{
+    for (int i = 0; i < nframes * 2; i += 2)
+    {
+	pusamem_rt_period();
+	pusaparam_rt_frame();
+	pusaanalysis_rt_input(data + i);
+	if (pusa_audio_handler != NULL)
+	    pusa_audio_handler(data + i, 2);
+
+	__atomic_store_n(&pusa_sample_index, pusa_sample_index + 1, __ATOMIC_RELAXED);
+
+	pusacapture_rt_frame(pusa_sample_index - 1, data + i);
+	pusaanalysis_rt_output(data + i);
+    }
+}
+
+struct codec_s *pusa_get_codec(void)
+{
+    return pusa_codec;
+}
+
 void pusa_print_stats(void)
 {
     printf("tx %d (%d), rx %d, tx errors %d, rx errors %d, prefill %d, max loops %d\n",
@@ -366,6 +965,28 @@ void pusa_print_stats(void)
 	   pusa_tx_errors, pusa_rx_errors, pusa_prefill_count, pusa_max_loops);
     pusa_max_loops = 0;
 
+    struct pusa_resync_stats_s *rs = &pusa_resync_stats;
+    if (rs->recoveries)
+	printf("resync %lu (rx slips %lu, tx slips %lu), last %lu us, max %lu us\n",
+	       rs->recoveries, rs->rx_slips, rs->tx_slips, rs->last_us, rs->max_us);
+
+    struct pusa_poll_stats_s *ps = &pusa_poll_stats;
+    if (ps->frames)
+	printf("poll: %.1f mmio/frame (max %lu), %.1f polls/frame, late %lu, guard %lu us\n",
+	       (double) ps->mmio / ps->frames, ps->max_mmio, (double) ps->polls / ps->frames,
+	       ps->late, ps->guard_us);
+    ps->max_mmio = 0;
+
+    struct pusaclock_stats_s cs;
+    pusaclock_get_stats(&cs);
+    if (cs.periods)
+	pusaclock_print_stats();
+
+    struct pusaparam_stats_s pms;
+    pusaparam_get_stats(&pms);
+    if (pms.params)
+	pusaparam_print_stats();
+
     printf("Long functions:\n");
     for (int i = 0; i < long_count; i++)
 	printf("   %p\n", long_funcs[i]);
@@ -378,3 +999,663 @@ void pusa_print_stats(void)
 
     num_times = 0;
 }
+
+void pusa_get_resync_stats(struct pusa_resync_stats_s *stats)
+{
+    *stats = pusa_resync_stats;
+}
+
+void pusa_set_polling(int mode)
+{
+    pusa_poll_mode = mode;
+}
+
+void pusa_get_poll_stats(struct pusa_poll_stats_s *stats)
+{
+    *stats = pusa_poll_stats;
+}
+
+void pusa_get_start_times(struct pusa_start_times_s *times)
+{
+    *times = pusa_start_times;
+}
+
+void pusa_print_start_times(void)
+{
+    struct pusa_start_times_s *st = &pusa_start_times;
+
+    printf("%s start: bcmhw %lu us, codec %lu us, pcm reset %lu us, config %lu us, "
+	   "fifo clear %lu us, prefill %lu us, first rx %lu us, thread start %lu us\n",
+	   st->warm ? "warm" : "cold", st->bcmhw, st->codec, st->pcm_reset, st->pcm_config,
+	   st->fifo_clear, st->prefill, st->first_rx, st->start);
+}
+
+#ifdef PUSA_UNIT_TEST
+#include <math.h>
+#include "pusachain.h"
+#include "pusamidi.h"
+#include "pusatest.h"
+
+/*
+ * Start, stop, warm restart and reconfigure against the emulated PCM block
+ * (build with -DBCMHW_EMULATE).
+ */
+static volatile int test_last_out = 0;
+static int test_counter = 0;
+static volatile int test_passthrough = 0;
+static volatile int test_rx_swapped = 0;
+static volatile int test_tx_swapped = 0;
+static volatile int test_out_left = 0;
+static volatile int test_journal_mode = 0;
+static volatile int test_latency_mode = 0;
+static volatile int test_in_func = 0;
+static volatile int test_func_overlaps = 0;
+static volatile int test_modifying = 0;
+static int test_state = 0;
+static int test_gain = 1;
+static int test_gain_value = 3;
+
+#define TEST_LOG_SIZE	256
+static int test_log[TEST_LOG_SIZE];
+static volatile int test_nlog = -1;
+
+#define TEST_CLOCK_PPM		500.0
+#define TEST_LOOPBACK		100
+#define TEST_PIPELINE		5
+
+static int test_delay_line[TEST_PIPELINE][2];
+static int test_delay_pos = 0;
+
+static void test_handler(int *data, int nchannels)
+{
+    if (test_in_func)
+	test_func_overlaps++;
+
+    /* A handler that adds a known delay. */
+    if (test_latency_mode)
+    {
+	int *d = test_delay_line[test_delay_pos];
+	int left = d[0], right = d[1];
+	d[0] = data[0];
+	d[1] = data[1];
+	data[0] = left;
+	data[1] = right;
+	test_delay_pos = (test_delay_pos + 1) % TEST_PIPELINE;
+	return;
+    }
+
+    /* Depends on everything the journal records. */
+    if (test_journal_mode)
+    {
+	unsigned char msg[8];
+	while (pusamidi_get_midi_message(NULL, msg, sizeof(msg)) > 0)
+	    if ((msg[0] & 0xf0) == 0x90)
+		test_state += msg[1] << 12;
+
+	test_state = test_state / 4 * 3 + (data[0] >> 8) * test_gain;
+	data[0] = test_state + (int) pusa_get_sample_index();
+	data[1] = -data[0];
+	return;
+    }
+
+    if (test_passthrough)
+    {
+	if (data[0] < 0 || data[1] > 0)
+	    test_rx_swapped++;
+	pusachain_process(data, nchannels);
+	return;
+    }
+
+    data[0] = ++test_counter;
+}
+
+/* Left is always positive and right negative, so a slip shows as a sign swap. */
+static void test_in(unsigned long long frame, int *left, int *right)
+{
+    *left = ((frame % 1000) + 1) << 16;
+    *right = -*left;
+}
+
+static void test_out(unsigned long long frame, int left, int right)
+{
+    if (test_passthrough)
+    {
+	if (left < 0 || right > 0)
+	    test_tx_swapped++;
+	test_out_left = left;
+	if (test_nlog >= 0 && test_nlog < TEST_LOG_SIZE)
+	    test_log[test_nlog++] = left;
+    }
+    else if (left != 0)
+	test_last_out = left;
+}
+
+static int test_rt_func(void *parm)
+{
+    return *(int *) parm + 1;
+}
+
+static int test_journal_begin(void *parm)
+{
+    test_state = 0;
+    test_gain = 1;
+    test_journal_mode = 1;
+    return 0;
+}
+
+static int test_set_gain(void *parm)
+{
+    test_gain = *(int *) parm;
+    return 0;
+}
+
+/* Takes a while when run inline, so a handler running alongside shows. */
+static int test_slow_func(void *parm)
+{
+    test_in_func = 1;
+    if (!pusa_in_rt_thread())
+	usleep(2000);
+    test_in_func = 0;
+    return 0;
+}
+
+static void *test_modifier(void *arg)
+{
+    while (test_modifying)
+	pusa_execute_in_rt(test_slow_func, NULL);
+
+    return NULL;
+}
+
+/*
+ * Restart the engine while another thread keeps calling
+ * pusa_execute_in_rt().  The handler must never run during a function.
+ */
+static void test_start_exclusion(void)
+{
+    pthread_t tid;
+
+    test_modifying = 1;
+    pthread_create(&tid, NULL, test_modifier, NULL);
+    for (int i = 0; i < 5; i++)
+    {
+	pusa_stop();
+	usleep(5000);
+	check(pusa_start() == 0, "restart with functions pending");
+	usleep(5000);
+    }
+    test_modifying = 0;
+    pthread_join(tid, NULL);
+    check(test_func_overlaps == 0, "no handler calls during a function");
+}
+
+static void test_run(const char *what)
+{
+    unsigned long long before = pusa_get_sample_index();
+    usleep(50000);
+    check(pusa_get_sample_index() - before > pusa_get_sample_rate() / 40, what);
+}
+
+/*
+ * Average peripheral accesses per frame over a test_run().
+ */
+static double test_mmio_per_frame(int mode, const char *what)
+{
+    struct pusa_poll_stats_s before, after;
+
+    pusa_set_polling(mode);
+    pusa_get_poll_stats(&before);
+    test_run(what);
+    pusa_get_poll_stats(&after);
+
+    double mmio = (double) (after.mmio - before.mmio) / (after.frames - before.frames);
+    printf("%s: %.1f mmio/frame, late %lu\n", what, mmio, after.late - before.late);
+    return mmio;
+}
+
+/*
+ * Clock frames through the emulated PCM one at a time, waiting for the
+ * audio thread to process each, so results don't depend on scheduling.
+ * Frames received while the interface is being resynchronized are lost,
+ * so give up on those after a while.
+ */
+static void test_step(int nframes)
+{
+    for (int i = 0; i < nframes; i++)
+    {
+	unsigned long long before = pusa_get_sample_index();
+
+	bcmhw_emu_pcm_advance(1);
+	for (int n = 0; pusa_get_sample_index() == before && n < 1000; n++)
+	    usleep(10);
+    }
+}
+
+/*
+ * Inject a slip and check that it is recovered and that channels stay
+ * aligned afterwards.
+ */
+static void test_slip(int rx, int tx, const char *what)
+{
+    struct pusa_resync_stats_s before, after;
+    char msg[100];
+
+    pusa_get_resync_stats(&before);
+    test_rx_swapped = test_tx_swapped = 0;
+
+    bcmhw_emu_pcm_slip(rx, tx);
+    test_step(4 * PUSA_RESYNC_PREFILL);
+
+    int rx_swapped = test_rx_swapped, tx_swapped = test_tx_swapped;
+    test_step(4 * PUSA_RESYNC_PREFILL);
+
+    pusa_get_resync_stats(&after);
+    printf("%s: %d rx / %d tx frames swapped, recovery %lu us\n",
+	   what, rx_swapped, tx_swapped, after.last_us);
+
+    sprintf(msg, "%s recovered once", what);
+    check(after.recoveries == before.recoveries + 1, msg);
+
+    /* At most a transmit FIFO of frames goes out before the slip is seen. */
+    sprintf(msg, "%s swapped frames bounded", what);
+    check(rx_swapped == 0 && tx_swapped <= PUSA_RESYNC_PREFILL, msg);
+    sprintf(msg, "%s aligned after recovery", what);
+    check(test_rx_swapped == rx_swapped && test_tx_swapped == tx_swapped, msg);
+}
+
+static void *test_fade_thread(void *arg)
+{
+    return (void *) (long) pusachain_replace(0, "./chainplugin.so", "4", 64);
+}
+
+/*
+ * Swap handlers in the chain while frames are clocked through, and check
+ * when the new one is heard and that no frames are lost.
+ */
+static void test_chain(void)
+{
+    struct pusachain_stats_s cs;
+    struct pusa_resync_stats_s rs;
+    int tx_errors = pusa_tx_errors, rx_errors = pusa_rx_errors;
+
+    pusa_get_resync_stats(&rs);
+    unsigned long recoveries = rs.recoveries;
+
+    check(pusachain_insert(-1, "./chainplugin.so", "1") == 0, "load plugin");
+    test_step(2 * PUSA_RESYNC_PREFILL);
+    check(test_out_left == 1 << 16, "plugin audible");
+
+    check(pusachain_replace(0, "./chainplugin.so", "2", 0) == 0, "swap plugin");
+    int n = 0;
+    while (test_out_left != 2 << 16 && n < 4 * PUSA_RESYNC_PREFILL)
+    {
+	test_step(1);
+	n++;
+    }
+    pusachain_get_stats(&cs);
+    printf("swap: processed after %lu frames, audible after %d frames\n", cs.last_latency, n);
+    check(cs.last_latency <= 1, "new handler runs on next frame");
+    check(n <= 2 * PUSA_RESYNC_PREFILL, "swap audible within transmit FIFO delay");
+
+    /* Crossfade from 2 to 4 while this thread keeps clocking frames. */
+    pthread_t tid;
+    void *ret;
+    unsigned long swaps = cs.swaps;
+    pthread_create(&tid, NULL, test_fade_thread, NULL);
+    for (int i = 0; i < 1000 && cs.swaps == swaps; i++)
+    {
+	usleep(1000);
+	pusachain_get_stats(&cs);
+    }
+    test_nlog = 0;
+    test_step(64 + 2 * PUSA_RESYNC_PREFILL);
+    pthread_join(tid, &ret);
+    check(ret == NULL, "crossfade swap");
+
+    int between = 0, monotonic = 1;
+    for (int i = 0; i < test_nlog; i++)
+    {
+	if (test_log[i] > 2 << 16 && test_log[i] < 4 << 16)
+	    between++;
+	if (i > 0 && test_log[i] < test_log[i - 1])
+	    monotonic = 0;
+    }
+    printf("crossfade: %d intermediate frames\n", between);
+    check(between > 32 && monotonic && test_out_left == 4 << 16, "crossfade ramps to new handler");
+    test_nlog = -1;
+
+    check(pusachain_remove(0) == 0 && pusachain_length() == 0, "remove plugin");
+    test_step(4);
+    usleep(20000);
+    test_step(4);
+    pusachain_get_stats(&cs);
+    check(cs.fade_timeouts == 0, "crossfade completed");
+    check(cs.destroyed == 3, "replaced handlers reclaimed");
+
+    pusa_get_resync_stats(&rs);
+    check(pusa_tx_errors == tx_errors && pusa_rx_errors == rx_errors &&
+	  rs.recoveries == recoveries, "no xruns while swapping");
+    pusachain_print_stats();
+}
+
+/*
+ * Journal a stretch of audio with MIDI and pusa_execute_in_rt() calls,
+ * then replay it with the audio thread stopped.  Stops the audio thread.
+ */
+static void test_journal(void)
+{
+    const char *path = "/tmp/pusat.journal";
+    const unsigned char note[3] = { 0x90, 0x3c, 0x64 };
+    struct pusajournal_stats_s js;
+    struct pusajournal_replay_s replay;
+    int *heap = malloc(sizeof(int));
+
+    *heap = 1;
+    check(pusajournal_start(path) == 0, "start journal");
+    pusa_execute_in_rt(test_journal_begin, NULL);
+    test_step(500);
+    pusamidi_port_input(0, note, 3);
+    test_step(500);
+    pusa_execute_in_rt(test_set_gain, &test_gain_value);
+    pusa_execute_in_rt(test_rt_func, heap);
+    test_step(500);
+    check(pusajournal_stop() == 0, "stop journal");
+    pusa_stop();
+    test_journal_mode = 0;
+    pusajournal_print_stats();
+
+    pusajournal_get_stats(&js);
+    check(js.frames >= 1500 && js.calls == 3 && js.midi == 1 && js.rt_overflows == 0,
+	  "journal holds every input");
+
+    replay.speed = 0;
+    check(pusajournal_replay(path, test_handler, &replay) == 0, "replay journal");
+    printf("replay: %llu frames in %.3f s, %lu runs, %lu mismatched, %lu calls, %lu skipped\n",
+	   replay.frames, replay.seconds, replay.runs, replay.mismatched_runs,
+	   replay.calls, replay.skipped_calls);
+    check(replay.frames == js.frames && replay.midi == 1 && replay.gaps == 0, "replay all frames");
+    check(replay.calls == 2 && replay.skipped_calls == 1, "heap parameter skipped");
+    check(replay.mismatched_runs == 0, "replay is bit exact");
+
+    /* A different gain from the call onwards must be noticed. */
+    test_gain_value = 5;
+    pusajournal_replay(path, test_handler, &replay);
+    check(replay.mismatched_runs > 0, "replay detects divergence");
+    test_journal_mode = 0;
+
+    free(heap);
+    unlink(path);
+}
+
+/*
+ * Clock the emulated codec from CLOCK_MONOTONIC at test_pace_rate.  Frames
+ * are held back rather than lost while the audio thread can't take them,
+ * which on a busy machine is often longer than the FIFO lasts.
+ */
+static volatile int test_pacing = 0;
+static double test_pace_rate;
+
+static void *test_pacer(void *arg)
+{
+    struct timespec start, now;
+    unsigned long long advanced = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (test_pacing)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double due = ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9) * test_pace_rate;
+
+	while (advanced < due && bcmhw_emu_pcm_rx_level() <= 60)
+	{
+	    bcmhw_emu_pcm_advance(1);
+	    advanced++;
+	}
+	usleep(100);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the emulated codec fast against CLOCK_MONOTONIC and check that the
+ * clock model sees it.
+ */
+static void test_clock(void)
+{
+    struct pusaclock_stats_s cs;
+    pthread_t tid;
+    double sample;
+    char msg[100];
+
+    test_pace_rate = 48000 * (1 + TEST_CLOCK_PPM / 1e6);
+    test_pacing = 1;
+    pthread_create(&tid, NULL, test_pacer, NULL);
+
+    pusa_stop();
+    check(pusa_start() == 0, "start with skewed clock");
+    usleep((PUSACLOCK_FAST_SECONDS + 4) * 1000000);
+
+    pusaclock_print_stats();
+    pusaclock_get_stats(&cs);
+    sprintf(msg, "clock drift %.1f ppm", cs.drift_ppm);
+    check(cs.locked && fabs(cs.drift_ppm - TEST_CLOCK_PPM) < 100, msg);
+
+    /* The audio thread is never more than a FIFO or so behind the codec. */
+    unsigned long long index = pusa_get_sample_index();
+    check(pusaclock_time_to_sample(pusaclock_now(), &sample) == 0, "time to sample");
+    sprintf(msg, "time to sample %.1f frames from audio thread", sample - index);
+    check(fabs(sample - index) < 48, msg);
+
+    test_pacing = 0;
+    pthread_join(tid, NULL);
+}
+
+static int test_latency_run(struct pusalatency_result_s *result)
+{
+    int rc = pusalatency_start();
+
+    for (int n = 0; n < 4 * PUSALATENCY_MLS_LENGTH && rc == 0; n += 100)
+    {
+	test_step(100);
+	rc = pusalatency_poll(result);
+    }
+
+    return rc;
+}
+
+/*
+ * Measure round trip latency through the emulated loopback and check it
+ * against the delays put there.
+ */
+static void test_latency(void)
+{
+    struct pusalatency_result_s lr;
+
+    test_latency_mode = 1;
+    bcmhw_emu_pcm_set_loopback(TEST_LOOPBACK);
+    check(test_latency_run(&lr) == 1, "latency measurement completes");
+    pusalatency_print(&lr);
+    check(lr.fifo_frames == pusa_get_prefill_frames(), "latency prefill");
+    check(fabs(lr.pipeline_frames - TEST_PIPELINE) < 0.01, "latency pipeline");
+    check(fabs(lr.converter_frames - TEST_LOOPBACK) < 0.01, "latency converters");
+    check(fabs(lr.round_trip_us - (lr.fifo_frames + TEST_PIPELINE + TEST_LOOPBACK) * 1e6 / 48000) < 1,
+	  "latency round trip");
+    check(lr.confidence > 0.99 && lr.psr_db > 60, "latency confident");
+
+    /* Nothing connected: the input is unrelated to the output. */
+    bcmhw_emu_pcm_set_loopback(-1);
+    check(test_latency_run(&lr) == 1, "latency measurement without loop completes");
+    printf("latency without loop: confidence %.2f, peak to sidelobe %.1f dB\n", lr.confidence, lr.psr_db);
+    check(lr.confidence < PUSALATENCY_MIN_CONFIDENCE, "no latency without loop");
+    test_latency_mode = 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusa_start_times_s st;
+    int parm = 41;
+
+    if (pusa_init("pisound", test_handler) < 0)
+    {
+	printf("Failed to init\n");
+	return 1;
+    }
+    bcmhw_emu_pcm_set_io(NULL, test_out);
+    check(pusacapture_init(pusa_get_sample_rate(), 1024 * 1024) == 0, "start capture");
+
+    pusa_print_start_times();
+    pusa_get_start_times(&st);
+    check(!st.warm, "first start is cold");
+
+    test_run("audio running after cold start");
+    check(pusa_execute_in_rt(test_rt_func, &parm) == 42, "execute in rt while running");
+
+    pusa_stop();
+    unsigned long long stopped_at = pusa_get_sample_index();
+    check(test_last_out == test_counter, "transmit FIFO drained on stop");
+    usleep(10000);
+    check(pusa_get_sample_index() == stopped_at, "no frames after stop");
+    check(pusa_execute_in_rt(test_rt_func, &parm) == 42, "execute in rt while stopped");
+
+    check(pusa_start() == 0, "warm start");
+    pusa_print_start_times();
+    pusa_get_start_times(&st);
+    check(st.warm, "second start is warm");
+    check(st.pcm_reset < 1000, "warm start skips reset");
+    test_run("audio running after warm start");
+
+    /* Pisound only runs at 48 kHz, so this leaves the engine stopped. */
+    check(pusa_reconfigure("pisound", 44100) < 0, "unsupported rate rejected");
+    check(pusa_get_codec() == NULL, "no codec after failed reconfigure");
+
+    check(pusa_reconfigure("pisound", 48000) == 0, "reconfigure");
+    pusa_print_start_times();
+    check(pusa_get_sample_rate() == 48000, "sample rate");
+    test_run("audio running after reconfigure");
+
+    struct pusa_resync_stats_s rs;
+    pusa_get_resync_stats(&rs);
+    check(rs.recoveries == 0, "no resync without slips");
+
+    test_start_exclusion();
+    test_run("audio running after restarts");
+
+    double busy = test_mmio_per_frame(PUSA_POLL_BUSY, "busy polling");
+    double adaptive = test_mmio_per_frame(PUSA_POLL_ADAPTIVE, "adaptive polling");
+    check(adaptive < busy, "adaptive polling reduces bus traffic");
+
+    bcmhw_emu_pcm_set_rate(0);
+    test_clock();
+    bcmhw_emu_pcm_set_io(test_in, test_out);
+    test_passthrough = 1;
+    test_step(4 * PUSA_RESYNC_PREFILL);
+    check(test_rx_swapped == 0 && test_tx_swapped == 0, "channels aligned");
+
+    test_slip(1, 0, "rx slip");
+    test_slip(0, 1, "tx slip");
+    test_slip(1, 1, "rx and tx slip");
+
+    pusa_get_resync_stats(&rs);
+    check(rs.rx_slips == 2 && rs.tx_slips == 2, "slip accounting");
+
+    test_chain();
+    test_latency();
+
+    struct pusacapture_stats_s cap;
+    pusacapture_get_stats(&cap);
+    check(cap.frames > 0 && cap.rt_overflows == 0, "output captured");
+    pusacapture_print_stats();
+
+    test_journal();
+
+    pusa_stop();
+    pusa_print_stats();
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSA_POLL_BENCH
+#define BENCH_BUFFER_SIZE	(16 * 1024 * 1024)
+
+/*
+ * Copy bandwidth on a housekeeping core while the audio thread polls.  The
+ * buffers are much larger than L2, so every copy goes out to memory and
+ * competes with the audio thread's uncached register accesses.
+ */
+static double bench_bandwidth(char *src, char *dst, int seconds)
+{
+    struct timespec start, now;
+    unsigned long long bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+	memcpy(dst, src, BENCH_BUFFER_SIZE);
+	bytes += BENCH_BUFFER_SIZE;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < seconds);
+
+    double s = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    return bytes / s / 1e6;
+}
+
+static void bench_mode(int mode, const char *name, char *src, char *dst)
+{
+    struct pusa_poll_stats_s before, after;
+
+    pusa_set_polling(mode);
+    usleep(100000);
+    pusa_get_poll_stats(&before);
+    double mbs = bench_bandwidth(src, dst, 5);
+    pusa_get_poll_stats(&after);
+
+    unsigned long long frames = after.frames - before.frames;
+    if (frames == 0)
+    {
+	printf("%-9s %8.1f MB/s  no frames processed\n", name, mbs);
+	return;
+    }
+    printf("%-9s %8.1f MB/s  %6.1f mmio/frame  %6.1f polls/frame  late %lu\n", name, mbs,
+	   (double) (after.mmio - before.mmio) / frames,
+	   (double) (after.polls - before.polls) / frames, after.late - before.late);
+}
+
+int main(int argc, char **argv)
+{
+    const char *codec = argc > 1 ? argv[1] : "pisound";
+    char *src = malloc(BENCH_BUFFER_SIZE);
+    char *dst = malloc(BENCH_BUFFER_SIZE);
+
+    if (src == NULL || dst == NULL)
+    {
+	printf("Failed to allocate buffers\n");
+	return 1;
+    }
+    memset(src, 0x55, BENCH_BUFFER_SIZE);
+    memset(dst, 0, BENCH_BUFFER_SIZE);
+
+    if (pusa_init(codec, NULL) < 0)
+    {
+	printf("Failed to init\n");
+	return 1;
+    }
+
+    pusa_stop();
+    printf("%-9s %8.1f MB/s\n", "stopped", bench_bandwidth(src, dst, 5));
+    if (pusa_start() < 0)
+    {
+	printf("Failed to restart\n");
+	return 1;
+    }
+
+    bench_mode(PUSA_POLL_BUSY, "busy", src, dst);
+    bench_mode(PUSA_POLL_ADAPTIVE, "adaptive", src, dst);
+
+    pusa_stop();
+    pusa_print_stats();
+    return 0;
+}
+#endif
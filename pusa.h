@@ -5,11 +5,87 @@
 #ifndef __pusa_h__
 #define __pusa_h__
 
+#define PUSA_SAMPLE_RATE	48000
+
 typedef void (*pusa_audio_handler_t)(int *data, int nchannels);
 typedef int (*pusa_rt_func)(void *parm);
 
+/*
+ * Time spent in each start up phase, in microseconds.  bcmhw and codec are
+ * from the last pusa_init() or pusa_reconfigure(); the rest are from the
+ * last pusa_start().  start covers the whole of pusa_start().
+ */
+struct pusa_start_times_s
+{
+    int warm;
+    unsigned long bcmhw;
+    unsigned long codec;
+    unsigned long pcm_reset;
+    unsigned long pcm_config;
+    unsigned long fifo_clear;
+    unsigned long prefill;
+    unsigned long first_rx;
+    unsigned long start;
+};
+
+/*
+ * FIFO slips detected and recovered by the audio thread.  Durations run
+ * from first seeing a FIFO out of sync to restarting the interface.
+ */
+struct pusa_resync_stats_s
+{
+    unsigned long recoveries;
+    unsigned long rx_slips;
+    unsigned long tx_slips;
+    unsigned long last_us;
+    unsigned long max_us;
+};
+
+/*
+ * PUSA_POLL_BUSY polls the PCM status register continuously.
+ * PUSA_POLL_ADAPTIVE waits on the local counter until just before the next
+ * frame is due and only writes the status register to clear errors.
+ */
+#define PUSA_POLL_BUSY		0
+#define PUSA_POLL_ADAPTIVE	1
+
+/*
+ * Peripheral bus traffic from the audio thread.  mmio counts every PCM
+ * register read and write, polls counts status reads.  late counts frames
+ * that were already waiting when polling resumed.
+ */
+struct pusa_poll_stats_s
+{
+    unsigned long long frames;
+    unsigned long long mmio;
+    unsigned long long polls;
+    unsigned long late;
+    unsigned long max_mmio;
+    unsigned long guard_us;
+};
+
+struct pusacpu_audit_s;
+
+int pusa_set_cpus(int rt_cpu, unsigned long housekeeping);
+const struct pusacpu_audit_s *pusa_get_audit(void);
 int pusa_init(const char *codec_name, pusa_audio_handler_t func);
+int pusa_start(void);
+void pusa_stop(void);
+int pusa_reconfigure(const char *codec_name, int rate);
+void pusa_get_start_times(struct pusa_start_times_s *times);
+void pusa_print_start_times(void);
+void pusa_get_resync_stats(struct pusa_resync_stats_s *stats);
+void pusa_set_polling(int mode);
+void pusa_get_poll_stats(struct pusa_poll_stats_s *stats);
 void pusa_print_stats(void);
+int pusa_render_init(int rate, pusa_audio_handler_t func);
+void pusa_render(int *data, int nframes);
+void pusa_render_seek(unsigned long long sample_index);
 int pusa_execute_in_rt(pusa_rt_func func, void *parm);
+int pusa_in_rt_thread(void);
+unsigned long long pusa_get_sample_index(void);
+int pusa_get_sample_rate(void);
+int pusa_get_prefill_frames(void);
+struct codec_s *pusa_get_codec(void);
 
 #endif /* __pusa_h__ */
@@ -0,0 +1,662 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metering, spectrum and tuner for user interfaces, computed away from the
+ * audio thread.  The audio thread only copies each frame into a ring.  A
+ * worker thread on a housekeeping core analyses the frames every
+ * PUSAANALYSIS_HOP frames:
+ *
+ *   - peak and RMS level per channel
+ *   - momentary and short term loudness, K-weighted as in ITU-R BS.1770
+ *   - Hann windowed FFT magnitude spectrum of the mono sum
+ *   - YIN pitch detection of the mono sum
+ *
+ * Results are published as one snapshot guarded by a sequence count, so
+ * a reader never waits for the worker and never sees half an update.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "pusaanalysis.h"
+#include "pusatrace.h"
+
+/* Long enough for short term loudness. */
+#define PUSAANALYSIS_LOUDNESS_HOPS	160
+
+/*
+ * Audio thread to worker.  Single producer, single consumer.
+ */
+static int pusaanalysis_rt_ring[PUSAANALYSIS_RT_RING][2];
+static volatile unsigned int pusaanalysis_rt_in = 0;
+static volatile unsigned int pusaanalysis_rt_out = 0;
+static volatile int pusaanalysis_running = 0;
+static int pusaanalysis_source = PUSAANALYSIS_OUTPUT;
+static unsigned long pusaanalysis_rt_overflows = 0;
+
+static int pusaanalysis_rate = 48000;
+
+/* Worker state. */
+static float pusaanalysis_history[PUSAANALYSIS_FFT_SIZE];
+static int pusaanalysis_nhistory = 0;
+static float pusaanalysis_window[PUSAANALYSIS_FFT_SIZE];
+static float pusaanalysis_window_gain;
+static float pusaanalysis_cos[PUSAANALYSIS_FFT_SIZE / 2];
+static float pusaanalysis_sin[PUSAANALYSIS_FFT_SIZE / 2];
+static int pusaanalysis_reverse[PUSAANALYSIS_FFT_SIZE];
+
+static float pusaanalysis_peak[2];
+static double pusaanalysis_sumsq[2];
+static double pusaanalysis_ksumsq[2];
+static int pusaanalysis_count = 0;
+
+struct pusaanalysis_biquad_s
+{
+    double b0, b1, b2, a1, a2;
+    double z1[2], z2[2];
+};
+
+static struct pusaanalysis_biquad_s pusaanalysis_shelf;
+static struct pusaanalysis_biquad_s pusaanalysis_highpass;
+
+/* K-weighted mean square of each hop, summed over channels. */
+static double pusaanalysis_loudness[PUSAANALYSIS_LOUDNESS_HOPS];
+static int pusaanalysis_nloudness = 0;
+static int pusaanalysis_momentary_hops;
+static int pusaanalysis_short_hops;
+
+static struct pusaanalysis_snapshot_s pusaanalysis_work;
+static struct pusaanalysis_snapshot_s pusaanalysis_snapshot;
+static volatile unsigned int pusaanalysis_seq = 0;
+static struct pusaanalysis_stats_s pusaanalysis_stats;
+
+/*
+ * Sum of squared differences, the inner loop of YIN.
+ */
+static float pusaanalysis_diff_sq(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    int i = 0;
+
+#ifdef __ARM_NEON
+    float32x4_t acc = vdupq_n_f32(0);
+
+    for (; i + 4 <= n; i += 4)
+    {
+	float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+	acc = vmlaq_f32(acc, d, d);
+    }
+
+    float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(pair, pair), 0);
+#endif
+
+    for (; i < n; i++)
+    {
+	float d = a[i] - b[i];
+	sum += d * d;
+    }
+
+    return sum;
+}
+
+static void pusaanalysis_apply_window(const float *in, float *out, int n)
+{
+    int i = 0;
+
+#ifdef __ARM_NEON
+    for (; i + 4 <= n; i += 4)
+	vst1q_f32(out + i, vmulq_f32(vld1q_f32(in + i), vld1q_f32(pusaanalysis_window + i)));
+#endif
+
+    for (; i < n; i++)
+	out[i] = in[i] * pusaanalysis_window[i];
+}
+
+static void pusaanalysis_fft(float *re, float *im)
+{
+    const int n = PUSAANALYSIS_FFT_SIZE;
+
+    for (int i = 0; i < n; i++)
+    {
+	int j = pusaanalysis_reverse[i];
+	if (j > i)
+	{
+	    float t = re[i];
+	    re[i] = re[j];
+	    re[j] = t;
+	    t = im[i];
+	    im[i] = im[j];
+	    im[j] = t;
+	}
+    }
+
+    for (int size = 2; size <= n; size *= 2)
+    {
+	int half = size / 2;
+	int step = n / size;
+
+	for (int start = 0; start < n; start += size)
+	{
+	    for (int k = 0; k < half; k++)
+	    {
+		float wr = pusaanalysis_cos[k * step];
+		float wi = -pusaanalysis_sin[k * step];
+		int a = start + k, b = a + half;
+		float tr = re[b] * wr - im[b] * wi;
+		float ti = re[b] * wi + im[b] * wr;
+
+		re[b] = re[a] - tr;
+		im[b] = im[a] - ti;
+		re[a] += tr;
+		im[a] += ti;
+	    }
+	}
+    }
+}
+
+static void pusaanalysis_spectrum(struct pusaanalysis_snapshot_s *snap)
+{
+    static float re[PUSAANALYSIS_FFT_SIZE], im[PUSAANALYSIS_FFT_SIZE];
+
+    pusaanalysis_apply_window(pusaanalysis_history, re, PUSAANALYSIS_FFT_SIZE);
+    memset(im, 0, sizeof(im));
+    pusaanalysis_fft(re, im);
+
+    /* Scaled so a full scale sine reads 0 dB in its bin. */
+    float scale = 2 / pusaanalysis_window_gain;
+    for (int i = 0; i < PUSAANALYSIS_BINS; i++)
+    {
+	float mag = sqrtf(re[i] * re[i] + im[i] * im[i]) * scale;
+	snap->spectrum_db[i] = mag > 1e-10f ? 20 * log10f(mag) : -200;
+    }
+}
+
+/*
+ * YIN over the first half of the history, lags up to half its length.
+ */
+static void pusaanalysis_pitch(struct pusaanalysis_snapshot_s *snap)
+{
+    static float cmnd[PUSAANALYSIS_FFT_SIZE / 2];
+    const int w = PUSAANALYSIS_FFT_SIZE / 2;
+    const float *x = pusaanalysis_history;
+    double running = 0;
+
+    cmnd[0] = 1;
+    for (int tau = 1; tau < w; tau++)
+    {
+	float d = pusaanalysis_diff_sq(x, x + tau, w);
+	running += d;
+	cmnd[tau] = running > 0 ? d * tau / running : 1;
+    }
+
+    int tau = 2;
+    while (tau < w && cmnd[tau] >= PUSAANALYSIS_YIN_THRESHOLD)
+	tau++;
+
+    snap->pitch_hz = 0;
+    snap->pitch_confidence = 0;
+    snap->note = 0;
+    snap->cents = 0;
+    if (tau >= w)
+	return;
+
+    while (tau + 1 < w && cmnd[tau + 1] < cmnd[tau])
+	tau++;
+
+    float best = tau;
+    if (tau + 1 < w)
+    {
+	float prev = cmnd[tau - 1], next = cmnd[tau + 1];
+	float denom = prev - 2 * cmnd[tau] + next;
+	if (denom != 0)
+	    best += (prev - next) / (2 * denom);
+    }
+
+    float semitones = 12 * log2f(pusaanalysis_rate / best / 440);
+    snap->pitch_hz = pusaanalysis_rate / best;
+    snap->pitch_confidence = 1 - cmnd[tau];
+    snap->note = 69 + (int) lrintf(semitones);
+    snap->cents = 100 * (semitones - (snap->note - 69));
+}
+
+static double pusaanalysis_filter(struct pusaanalysis_biquad_s *f, int channel, double x)
+{
+    double y = f->b0 * x + f->z1[channel];
+
+    f->z1[channel] = f->b1 * x - f->a1 * y + f->z2[channel];
+    f->z2[channel] = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+static float pusaanalysis_lufs(int hops)
+{
+    double sum = 0;
+    int n = hops < pusaanalysis_nloudness ? hops : pusaanalysis_nloudness;
+
+    for (int i = 0; i < n; i++)
+	sum += pusaanalysis_loudness[(pusaanalysis_nloudness - 1 - i) % PUSAANALYSIS_LOUDNESS_HOPS];
+
+    return sum > 0 ? -0.691 + 10 * log10(sum / n) : -200;
+}
+
+static void pusaanalysis_publish(void)
+{
+    pusaanalysis_seq++;
+    __sync_synchronize();
+    pusaanalysis_snapshot = pusaanalysis_work;
+    __sync_synchronize();
+    pusaanalysis_seq++;
+}
+
+static void pusaanalysis_hop(void)
+{
+    struct pusaanalysis_snapshot_s *snap = &pusaanalysis_work;
+
+    for (int c = 0; c < 2; c++)
+    {
+	snap->peak_db[c] = pusaanalysis_peak[c] > 0 ? 20 * log10f(pusaanalysis_peak[c]) : -200;
+	snap->rms_db[c] = pusaanalysis_sumsq[c] > 0 ?
+	    10 * log10(pusaanalysis_sumsq[c] / pusaanalysis_count) : -200;
+    }
+
+    pusaanalysis_loudness[pusaanalysis_nloudness++ % PUSAANALYSIS_LOUDNESS_HOPS] =
+	(pusaanalysis_ksumsq[0] + pusaanalysis_ksumsq[1]) / pusaanalysis_count;
+    snap->lufs_momentary = pusaanalysis_lufs(pusaanalysis_momentary_hops);
+    snap->lufs_short = pusaanalysis_lufs(pusaanalysis_short_hops);
+
+    pusaanalysis_spectrum(snap);
+    pusaanalysis_pitch(snap);
+
+    pusaanalysis_stats.hops++;
+    snap->frames = pusaanalysis_stats.frames;
+    pusaanalysis_publish();
+
+    memset(pusaanalysis_peak, 0, sizeof(pusaanalysis_peak));
+    memset(pusaanalysis_sumsq, 0, sizeof(pusaanalysis_sumsq));
+    memset(pusaanalysis_ksumsq, 0, sizeof(pusaanalysis_ksumsq));
+    pusaanalysis_count = 0;
+}
+
+static void pusaanalysis_process(int (*frames)[2], int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+	float x[2];
+
+	for (int c = 0; c < 2; c++)
+	{
+	    x[c] = frames[i][c] * (1.0f / 2147483648.0f);
+
+	    float a = fabsf(x[c]);
+	    if (a > pusaanalysis_peak[c])
+		pusaanalysis_peak[c] = a;
+	    pusaanalysis_sumsq[c] += x[c] * x[c];
+
+	    double k = pusaanalysis_filter(&pusaanalysis_shelf, c, x[c]);
+	    k = pusaanalysis_filter(&pusaanalysis_highpass, c, k);
+	    pusaanalysis_ksumsq[c] += k * k;
+	}
+
+	pusaanalysis_count++;
+	pusaanalysis_stats.frames++;
+	pusaanalysis_history[pusaanalysis_nhistory++] = (x[0] + x[1]) * 0.5f;
+
+	if (pusaanalysis_nhistory == PUSAANALYSIS_FFT_SIZE)
+	{
+	    pusaanalysis_hop();
+	    memmove(pusaanalysis_history, pusaanalysis_history + PUSAANALYSIS_HOP,
+		    (PUSAANALYSIS_FFT_SIZE - PUSAANALYSIS_HOP) * sizeof(float));
+	    pusaanalysis_nhistory -= PUSAANALYSIS_HOP;
+	}
+    }
+}
+
+static void *pusaanalysis_worker(void *arg)
+{
+    PUSATRACE_THREAD("analysis");
+
+    while (1)
+    {
+	unsigned int in = pusaanalysis_rt_in;
+	unsigned int out = pusaanalysis_rt_out;
+
+	if (in == out)
+	{
+	    usleep(2000);
+	    continue;
+	}
+
+	__sync_synchronize();
+	int n = in > out ? in - out : PUSAANALYSIS_RT_RING - out;
+	PUSATRACE_BEGIN(PUSATRACE_ANALYSIS);
+	pusaanalysis_process(pusaanalysis_rt_ring + out, n);
+	PUSATRACE_END(PUSATRACE_ANALYSIS);
+
+	__sync_synchronize();
+	pusaanalysis_rt_out = (out + n) % PUSAANALYSIS_RT_RING;
+
+	struct timespec cpu;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	pusaanalysis_stats.worker_cpu = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    }
+
+    return NULL;
+}
+
+static void pusaanalysis_rt_frame(const int *data)
+{
+    unsigned int next = (pusaanalysis_rt_in + 1) % PUSAANALYSIS_RT_RING;
+    if (next == pusaanalysis_rt_out)
+    {
+	pusaanalysis_rt_overflows++;
+	return;
+    }
+
+    pusaanalysis_rt_ring[pusaanalysis_rt_in][0] = data[0];
+    pusaanalysis_rt_ring[pusaanalysis_rt_in][1] = data[1];
+
+    __sync_synchronize();
+    pusaanalysis_rt_in = next;
+}
+
+/*
+ * Called by the audio thread with each received frame and each frame
+ * about to be sent.  Only the one selected in pusaanalysis_init() is kept.
+ */
+void pusaanalysis_rt_input(const int *data)
+{
+    if (pusaanalysis_running && pusaanalysis_source == PUSAANALYSIS_INPUT)
+	pusaanalysis_rt_frame(data);
+}
+
+void pusaanalysis_rt_output(const int *data)
+{
+    if (pusaanalysis_running && pusaanalysis_source == PUSAANALYSIS_OUTPUT)
+	pusaanalysis_rt_frame(data);
+}
+
+/*
+ * Copy out the latest results.  Returns -1 if there are none yet.  Never
+ * blocks the worker; retries if it was publishing at the same time.
+ */
+int pusaanalysis_read(struct pusaanalysis_snapshot_s *snap)
+{
+    unsigned int seq;
+
+    do
+    {
+	seq = pusaanalysis_seq;
+	__sync_synchronize();
+	if (seq & 1)
+	    continue;
+	*snap = pusaanalysis_snapshot;
+	__sync_synchronize();
+    } while ((seq & 1) || seq != pusaanalysis_seq);
+
+    return seq == 0 ? -1 : 0;
+}
+
+/*
+ * K-weighting filter coefficients for any sample rate, as in libebur128.
+ */
+static void pusaanalysis_k_weighting(int rate)
+{
+    double k = tan(M_PI * 1681.974450955533 / rate);
+    double q = 0.7071752369554196;
+    double vh = pow(10, 3.999843853973347 / 20);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1 + k / q + k * k;
+
+    pusaanalysis_shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    pusaanalysis_shelf.b1 = 2 * (k * k - vh) / a0;
+    pusaanalysis_shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    pusaanalysis_shelf.a1 = 2 * (k * k - 1) / a0;
+    pusaanalysis_shelf.a2 = (1 - k / q + k * k) / a0;
+
+    k = tan(M_PI * 38.13547087602444 / rate);
+    q = 0.5003270373238773;
+    a0 = 1 + k / q + k * k;
+
+    pusaanalysis_highpass.b0 = 1;
+    pusaanalysis_highpass.b1 = -2;
+    pusaanalysis_highpass.b2 = 1;
+    pusaanalysis_highpass.a1 = 2 * (k * k - 1) / a0;
+    pusaanalysis_highpass.a2 = (1 - k / q + k * k) / a0;
+}
+
+/*
+ * Start the worker.  source is PUSAANALYSIS_INPUT or PUSAANALYSIS_OUTPUT.
+ */
+int pusaanalysis_init(int sample_rate, int source)
+{
+    if (pusaanalysis_running)
+	return 0;
+
+    pusaanalysis_rate = sample_rate;
+    pusaanalysis_source = source;
+    pusaanalysis_k_weighting(sample_rate);
+
+    pusaanalysis_momentary_hops = lrint(0.4 * sample_rate / PUSAANALYSIS_HOP);
+    pusaanalysis_short_hops = lrint(3.0 * sample_rate / PUSAANALYSIS_HOP);
+    if (pusaanalysis_short_hops > PUSAANALYSIS_LOUDNESS_HOPS)
+	pusaanalysis_short_hops = PUSAANALYSIS_LOUDNESS_HOPS;
+
+    int bits = 0;
+    while ((1 << bits) < PUSAANALYSIS_FFT_SIZE)
+	bits++;
+
+    pusaanalysis_window_gain = 0;
+    for (int i = 0; i < PUSAANALYSIS_FFT_SIZE; i++)
+    {
+	pusaanalysis_window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / PUSAANALYSIS_FFT_SIZE);
+	pusaanalysis_window_gain += pusaanalysis_window[i];
+
+	int r = 0;
+	for (int b = 0; b < bits; b++)
+	    if (i & (1 << b))
+		r |= 1 << (bits - 1 - b);
+	pusaanalysis_reverse[i] = r;
+    }
+
+    for (int i = 0; i < PUSAANALYSIS_FFT_SIZE / 2; i++)
+    {
+	pusaanalysis_cos[i] = cos(2 * M_PI * i / PUSAANALYSIS_FFT_SIZE);
+	pusaanalysis_sin[i] = sin(2 * M_PI * i / PUSAANALYSIS_FFT_SIZE);
+    }
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusaanalysis_worker, NULL) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    __sync_synchronize();
+    pusaanalysis_running = 1;
+
+    return 0;
+}
+
+void pusaanalysis_get_stats(struct pusaanalysis_stats_s *stats)
+{
+    *stats = pusaanalysis_stats;
+    stats->rt_overflows = pusaanalysis_rt_overflows;
+
+    if (stats->frames > 0)
+	stats->worker_cpu /= (double) stats->frames / pusaanalysis_rate;
+}
+
+void pusaanalysis_print_stats(void)
+{
+    struct pusaanalysis_stats_s st;
+
+    pusaanalysis_get_stats(&st);
+    printf("analysis: %llu frames, %lu hops, %lu dropped, worker %.1f%% cpu\n",
+	   st.frames, st.hops, st.rt_overflows, st.worker_cpu * 100);
+}
+
+#if defined(PUSAANALYSIS_UNIT_TEST) || defined(PUSAANALYSIS_BENCH)
+static void test_sine(int *data, unsigned long long i, double freq, double amplitude)
+{
+    data[0] = data[1] = lrint(amplitude * 2147483647.0 * sin(2 * M_PI * freq * i / 48000));
+}
+#endif
+
+#ifdef PUSAANALYSIS_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Feed a stereo sine through the audio thread entry point and return the
+ * snapshot once the worker has caught up.
+ */
+static void test_feed(double freq, double amplitude, int nframes,
+		      struct pusaanalysis_snapshot_s *snap)
+{
+    static unsigned long long frame = 0;
+    unsigned long long end = pusaanalysis_stats.frames + nframes;
+
+    for (int i = 0; i < nframes; i++)
+    {
+	int data[2];
+
+	test_sine(data, frame++, freq, amplitude);
+	while ((pusaanalysis_rt_in + 1) % PUSAANALYSIS_RT_RING == pusaanalysis_rt_out)
+	    usleep(1000);
+	pusaanalysis_rt_output(data);
+	pusaanalysis_rt_input(data);
+    }
+
+    while (pusaanalysis_stats.frames < end)
+	usleep(1000);
+    usleep(5000);
+    pusaanalysis_read(snap);
+}
+
+int main(int argc, char **argv)
+{
+    struct pusaanalysis_snapshot_s snap;
+    struct pusaanalysis_stats_s st;
+
+    check(pusaanalysis_read(&snap) < 0, "nothing before first hop");
+    check(pusaanalysis_init(48000, PUSAANALYSIS_OUTPUT) == 0, "init");
+
+    /* A 997 Hz sine at -6 dBFS in both channels reads about -6 LUFS. */
+    test_feed(997, 0.5, 48000, &snap);
+    printf("997 Hz: peak %.2f dB, rms %.2f dB, momentary %.2f LUFS, short %.2f LUFS, "
+	   "pitch %.2f Hz\n", snap.peak_db[0], snap.rms_db[0], snap.lufs_momentary,
+	   snap.lufs_short, snap.pitch_hz);
+    check(fabs(snap.peak_db[0] + 6.02) < 0.1 && fabs(snap.peak_db[1] + 6.02) < 0.1, "peak");
+    check(fabs(snap.rms_db[0] + 9.03) < 0.1, "rms");
+    check(fabs(snap.lufs_momentary + 6.0) < 0.3, "momentary loudness");
+    check(fabs(snap.lufs_short + 6.0) < 0.3, "short term loudness");
+
+    int bin = 0;
+    for (int i = 1; i < PUSAANALYSIS_BINS; i++)
+	if (snap.spectrum_db[i] > snap.spectrum_db[bin])
+	    bin = i;
+    printf("spectrum peak bin %d, %.2f dB\n", bin, snap.spectrum_db[bin]);
+    check(bin == lrint(997.0 * PUSAANALYSIS_FFT_SIZE / 48000), "spectrum peak bin");
+    check(snap.spectrum_db[bin] > -8 && snap.spectrum_db[bin] < -6, "spectrum level");
+
+    /* A2, a little sharp. */
+    test_feed(110 * pow(2, 10 / 1200.0), 0.3, 8192, &snap);
+    printf("tuner: %.2f Hz, note %d, %+.1f cents, confidence %.2f\n",
+	   snap.pitch_hz, snap.note, snap.cents, snap.pitch_confidence);
+    check(snap.note == 45 && fabsf(snap.cents - 10) < 2, "tuner");
+
+    test_feed(0, 0, 8192, &snap);
+    check(snap.pitch_hz == 0 && snap.peak_db[0] < -199, "silence");
+
+    pusaanalysis_get_stats(&st);
+    check(st.rt_overflows == 0 && st.frames == 48000 + 2 * 8192, "every frame analysed once");
+    pusaanalysis_print_stats();
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSAANALYSIS_BENCH
+#include "bcmhw.h"
+
+/*
+ * Cost of the audio thread side per frame, and how much faster than real
+ * time the worker gets through audio.
+ */
+int main(int argc, char **argv)
+{
+    const int nframes = 10 * 48000;
+    static int frames[PUSAANALYSIS_HOP][2];
+    unsigned long long cycles = 0;
+    int data[2];
+
+    if (pusaanalysis_init(48000, PUSAANALYSIS_OUTPUT) < 0)
+	return 1;
+
+    for (int done = 0; done < nframes; done += PUSAANALYSIS_RT_RING / 2)
+    {
+	unsigned long long start = bcmhw_cycles();
+	for (int i = 0; i < PUSAANALYSIS_RT_RING / 2; i++)
+	{
+	    data[0] = data[1] = i;
+	    pusaanalysis_rt_output(data);
+	}
+	cycles += bcmhw_cycles() - start;
+
+	while (pusaanalysis_rt_out != pusaanalysis_rt_in)
+	    usleep(1000);
+    }
+
+    double ns = cycles * 1e9 / bcmhw_cycles_per_sec() / nframes;
+    printf("audio thread: %.1f ns/frame, %lu dropped\n", ns, pusaanalysis_rt_overflows);
+
+    /* Stop the worker taking frames, then time the analysis directly. */
+    pusaanalysis_running = 0;
+    for (int i = 0; i < PUSAANALYSIS_HOP; i++)
+	test_sine(frames[i], i, 440, 0.5);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    for (int done = 0; done < nframes; done += PUSAANALYSIS_HOP)
+	pusaanalysis_process(frames, PUSAANALYSIS_HOP);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+    double s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("worker: %.1f s of audio in %.3f s cpu, %.0fx real time, %.2f%% of a core\n",
+	   nframes / 48000.0, s, nframes / 48000.0 / s, s / (nframes / 48000.0) * 100);
+
+    return 0;
+}
+#endif
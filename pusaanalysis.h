@@ -0,0 +1,55 @@
+/*
+ * Header file for the analysis service.
+ */
+
+#ifndef __pusaanalysis_h__
+#define __pusaanalysis_h__
+
+#define PUSAANALYSIS_FFT_SIZE	2048
+#define PUSAANALYSIS_BINS	(PUSAANALYSIS_FFT_SIZE / 2)
+#define PUSAANALYSIS_HOP	1024
+#define PUSAANALYSIS_RT_RING	16384
+
+/* Which frames the audio thread hands over. */
+#define PUSAANALYSIS_INPUT	0
+#define PUSAANALYSIS_OUTPUT	1
+
+/* YIN gives up on pitch above this normalized difference. */
+#define PUSAANALYSIS_YIN_THRESHOLD	0.15
+
+/*
+ * Levels are in dBFS, loudness in LUFS, over the last hop unless noted.
+ * Momentary loudness covers 400 ms and short term 3 s.  pitch_hz is 0
+ * when no pitch was found; note is the MIDI note nearest to it and cents
+ * the offset from that note.
+ */
+struct pusaanalysis_snapshot_s
+{
+    unsigned long long frames;
+    float peak_db[2];
+    float rms_db[2];
+    float lufs_momentary;
+    float lufs_short;
+    float pitch_hz;
+    float pitch_confidence;
+    int note;
+    float cents;
+    float spectrum_db[PUSAANALYSIS_BINS];
+};
+
+struct pusaanalysis_stats_s
+{
+    unsigned long long frames;
+    unsigned long hops;
+    unsigned long rt_overflows;
+    double worker_cpu;
+};
+
+int pusaanalysis_init(int sample_rate, int source);
+void pusaanalysis_rt_input(const int *data);
+void pusaanalysis_rt_output(const int *data);
+int pusaanalysis_read(struct pusaanalysis_snapshot_s *snap);
+void pusaanalysis_get_stats(struct pusaanalysis_stats_s *stats);
+void pusaanalysis_print_stats(void);
+
+#endif /* __pusaanalysis_h__ */
@@ -0,0 +1,903 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A bridge between the audio thread and an ALSA PCM device, which runs on
+ * its own clock.  Each direction has a bridge thread, which runs on the
+ * housekeeping cores like any thread started after pusa_init(), and a
+ * ring to the audio thread.  The audio thread only touches the rings.
+ *
+ * The bridge thread moves a device period at a time through a polyphase
+ * resampler: a Kaiser windowed sinc with PUSABRIDGE_TAPS taps, tabulated
+ * at PUSABRIDGE_PHASES positions between samples and interpolated between
+ * them.  Its step is the nominal ratio of the two rates corrected by a
+ * proportional and integral control of how full the ring is each time a
+ * period has been moved, so the integral settles at the drift between the
+ * device's clock and the engine's.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#ifndef PUSABRIDGE_UNIT_TEST
+#include <alsa/asoundlib.h>
+#endif
+
+#include "pusabridge.h"
+#include "pusarate.h"
+
+#define PUSABRIDGE_HIST		(4 * PUSABRIDGE_TAPS)
+#define PUSABRIDGE_KAISER_BETA	8.0
+
+/* Passband edge as a fraction of the lower Nyquist frequency. */
+#define PUSABRIDGE_CUTOFF	0.92
+
+/* Frames kept in the ring beyond what a period takes, and added when it runs dry. */
+#define PUSABRIDGE_MARGIN	64
+#define PUSABRIDGE_MARGIN_STEP	16
+
+struct pusabridge_resampler_s
+{
+    float coef[PUSABRIDGE_PHASES + 1][PUSABRIDGE_TAPS];
+    float hist[PUSABRIDGE_HIST][2];
+    long long count;
+    double pos;
+};
+
+struct pusabridge_dir_s
+{
+    volatile int active;
+    volatile int running;
+    volatile int exited;
+    volatile int primed;
+    int capture;
+    int period;
+    int buffer;
+#ifdef PUSABRIDGE_UNIT_TEST
+    double emu_start;
+    long long emu_done;
+    int emu_started;
+#else
+    snd_pcm_t *pcm;
+#endif
+
+    /* Audio thread to bridge thread for playback, the other way for capture. */
+    int ring[PUSABRIDGE_RING * 2];
+    volatile unsigned int in;
+    volatile unsigned int out;
+
+    /* Bridge thread only. */
+    struct pusabridge_resampler_s rs;
+    double nominal;
+    double step;
+    double burst;
+    struct pusarate_s rate_control;
+    double level;
+    double target;
+    long delay;
+    unsigned long underruns_seen;
+    struct timespec start;
+
+    struct pusabridge_dir_stats_s stats;
+};
+
+static struct pusabridge_dir_s pusabridge_play;
+static struct pusabridge_dir_s pusabridge_capture;
+static int pusabridge_running = 0;
+static int pusabridge_rate;
+static int pusabridge_device_rate;
+
+#ifdef PUSABRIDGE_UNIT_TEST
+static double pusabridge_test_now = 0;
+static double pusabridge_test_skew = 0;
+static void (*pusabridge_test_play)(const int *frames, int n) = NULL;
+static void (*pusabridge_test_record)(int *frames, int n, long long index) = NULL;
+#endif
+
+static inline int pusabridge_clamp(double v)
+{
+    return v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : lrint(v);
+}
+
+static unsigned int pusabridge_ring_level(struct pusabridge_dir_s *d)
+{
+    return (d->in - d->out + PUSABRIDGE_RING) % PUSABRIDGE_RING;
+}
+
+static double pusabridge_bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+
+    for (int k = 1; k < 50 && term > sum * 1e-12; k++)
+    {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+    }
+
+    return sum;
+}
+
+/*
+ * Tabulate the filter.  cutoff is relative to the input's Nyquist
+ * frequency.  Each phase is normalized to unity gain at DC.
+ */
+static void pusabridge_resampler_init(struct pusabridge_resampler_s *rs, double cutoff)
+{
+    const int half = PUSABRIDGE_TAPS / 2;
+    double i0beta = pusabridge_bessel_i0(PUSABRIDGE_KAISER_BETA);
+
+    memset(rs, 0, sizeof(*rs));
+    for (int p = 0; p <= PUSABRIDGE_PHASES; p++)
+    {
+	double frac = (double) p / PUSABRIDGE_PHASES, sum = 0;
+	double h[PUSABRIDGE_TAPS];
+
+	for (int k = 0; k < PUSABRIDGE_TAPS; k++)
+	{
+	    double x = k - (half - 1) - frac;
+	    double w = x / half;
+	    double arg = M_PI * cutoff * x;
+
+	    h[k] = cutoff * (x == 0 ? 1 : sin(arg) / arg);
+	    h[k] *= w * w < 1 ? pusabridge_bessel_i0(PUSABRIDGE_KAISER_BETA * sqrt(1 - w * w)) / i0beta : 0;
+	    sum += h[k];
+	}
+	for (int k = 0; k < PUSABRIDGE_TAPS; k++)
+	    rs->coef[p][k] = h[k] / sum;
+    }
+}
+
+static inline void pusabridge_resampler_push(struct pusabridge_resampler_s *rs, const int *frame)
+{
+    float *h = rs->hist[rs->count % PUSABRIDGE_HIST];
+
+    h[0] = frame[0];
+    h[1] = frame[1];
+    rs->count++;
+}
+
+/* Whether all the input for the next output frame is there. */
+static inline int pusabridge_resampler_ready(struct pusabridge_resampler_s *rs)
+{
+    return (long long) rs->pos + PUSABRIDGE_TAPS / 2 < rs->count;
+}
+
+static void pusabridge_resampler_out(struct pusabridge_resampler_s *rs, int *frame, double step)
+{
+    long long i = rs->pos;
+    double pf = (rs->pos - i) * PUSABRIDGE_PHASES;
+    int p = pf;
+    float w = pf - p;
+    const float *c0 = rs->coef[p], *c1 = rs->coef[p + 1];
+    long long base = i - (PUSABRIDGE_TAPS / 2 - 1);
+    float l = 0, r = 0;
+
+    for (int k = 0; k < PUSABRIDGE_TAPS; k++)
+    {
+	float c = c0[k] + (c1[k] - c0[k]) * w;
+	const float *h = rs->hist[(base + k) % PUSABRIDGE_HIST];
+	l += c * h[0];
+	r += c * h[1];
+    }
+
+    frame[0] = pusabridge_clamp(l);
+    frame[1] = pusabridge_clamp(r);
+    rs->pos += step;
+
+    /* Keep the position small enough for its fraction to stay exact. */
+    if (rs->count >= 1LL << 30)
+    {
+	long long shift = (rs->count / PUSABRIDGE_HIST - 1) * PUSABRIDGE_HIST;
+	rs->count -= shift;
+	rs->pos -= shift;
+    }
+}
+
+#ifdef PUSABRIDGE_UNIT_TEST
+/*
+ * An emulated device on a virtual clock, pusabridge_test_now, that the
+ * test advances.  The device runs pusabridge_test_skew faster than its
+ * rate, hands what it plays to pusabridge_test_play() and records from
+ * pusabridge_test_record().  The test calls pusabridge_period() when
+ * pusabridge_emu_due() says the device would let the bridge thread run.
+ */
+static double pusabridge_emu_rate(void)
+{
+    return pusabridge_device_rate * (1 + pusabridge_test_skew);
+}
+
+static long long pusabridge_emu_position(struct pusabridge_dir_s *d)
+{
+    return floor((pusabridge_test_now - d->emu_start) * pusabridge_emu_rate());
+}
+
+static double pusabridge_emu_due(struct pusabridge_dir_s *d)
+{
+    long long frames = d->capture ? d->emu_done + d->period : d->emu_done + d->period - d->buffer;
+
+    return d->emu_started ? d->emu_start + frames / pusabridge_emu_rate() : pusabridge_test_now;
+}
+
+static int pusabridge_pcm_open(struct pusabridge_dir_s *d, const char *device, int periods)
+{
+    d->buffer = d->period * periods;
+    d->emu_done = 0;
+    d->emu_started = d->capture;
+    d->emu_start = pusabridge_test_now;
+    return 0;
+}
+
+static int pusabridge_pcm_io(struct pusabridge_dir_s *d, int *frames, int n)
+{
+    long long pos = pusabridge_emu_position(d);
+
+    if (!d->emu_started)
+    {
+	d->emu_started = 1;
+	d->emu_start = pusabridge_test_now;
+    }
+    else if (d->capture ? pos - d->emu_done > d->buffer : pos > d->emu_done)
+    {
+	/* Restart where the bridge is, as snd_pcm_recover() would. */
+	d->stats.xruns++;
+	if (d->capture)
+	    d->emu_done = pos - n;
+	else
+	    d->emu_start = pusabridge_test_now - d->emu_done / pusabridge_emu_rate();
+    }
+
+    if (d->capture)
+    {
+	if (pusabridge_test_record != NULL)
+	    pusabridge_test_record(frames, n, d->emu_done);
+    }
+    else if (pusabridge_test_play != NULL)
+	pusabridge_test_play(frames, n);
+    d->emu_done += n;
+
+    return 0;
+}
+
+static long pusabridge_pcm_delay(struct pusabridge_dir_s *d)
+{
+    long long pos = pusabridge_emu_position(d);
+
+    return d->capture ? pos - d->emu_done : d->emu_done - pos;
+}
+
+static void pusabridge_pcm_close(struct pusabridge_dir_s *d)
+{
+}
+#else
+static int pusabridge_pcm_open(struct pusabridge_dir_s *d, const char *device, int periods)
+{
+    snd_pcm_uframes_t buffer_size, period_size;
+    int err;
+
+    err = snd_pcm_open(&d->pcm, device, d->capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0)
+    {
+	printf("pusabridge: %s: %s\n", device, snd_strerror(err));
+	return -1;
+    }
+
+    err = snd_pcm_set_params(d->pcm, SND_PCM_FORMAT_S32, SND_PCM_ACCESS_RW_INTERLEAVED, 2,
+			     pusabridge_device_rate, 0,
+			     (unsigned int) ((double) d->period * periods * 1000000 / pusabridge_device_rate));
+    if (err < 0)
+    {
+	printf("pusabridge: %s: %s\n", device, snd_strerror(err));
+	snd_pcm_close(d->pcm);
+	return -1;
+    }
+
+    d->buffer = d->period * periods;
+    if (snd_pcm_get_params(d->pcm, &buffer_size, &period_size) == 0 &&
+	period_size > 0 && period_size <= PUSABRIDGE_MAX_PERIOD)
+    {
+	d->period = period_size;
+	d->buffer = buffer_size;
+    }
+
+    return 0;
+}
+
+static int pusabridge_pcm_io(struct pusabridge_dir_s *d, int *frames, int n)
+{
+    while (n > 0)
+    {
+	snd_pcm_sframes_t r = d->capture ? snd_pcm_readi(d->pcm, frames, n) : snd_pcm_writei(d->pcm, frames, n);
+
+	if (r == -EAGAIN)
+	    continue;
+	if (r < 0)
+	{
+	    d->stats.xruns++;
+	    r = snd_pcm_recover(d->pcm, r, 1);
+	    if (r < 0)
+	    {
+		printf("pusabridge: %s\n", snd_strerror(r));
+		return -1;
+	    }
+	    continue;
+	}
+
+	frames += 2 * r;
+	n -= r;
+    }
+
+    return 0;
+}
+
+static long pusabridge_pcm_delay(struct pusabridge_dir_s *d)
+{
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(d->pcm, &delay) < 0)
+	return 0;
+    return delay;
+}
+
+static void pusabridge_pcm_close(struct pusabridge_dir_s *d)
+{
+    if (!d->capture)
+	snd_pcm_drain(d->pcm);
+    snd_pcm_close(d->pcm);
+}
+#endif
+
+/*
+ * Steer the step from how much is buffered when a period has just been
+ * moved: the ring and the device's buffer together, which doesn't depend
+ * on how late the bridge thread woke.  More than the target means
+ * playback should read faster and capture should make fewer frames, so
+ * both lengthen the step.
+ */
+static void pusabridge_control(struct pusabridge_dir_s *d)
+{
+    /*
+     * Keep more in the ring if it ever ran dry.  The frames that weren't
+     * there are still to come, so the ring is already that much fuller.
+     */
+    if (d->stats.rt_underruns != d->underruns_seen)
+    {
+	d->underruns_seen = d->stats.rt_underruns;
+	if (d->target < PUSABRIDGE_RING / 2)
+	    d->target += PUSABRIDGE_MARGIN_STEP;
+    }
+
+    d->delay = pusabridge_pcm_delay(d);
+
+    double dt = (double) d->period / pusabridge_device_rate;
+    double alpha = dt / 0.1;
+    double level = pusabridge_ring_level(d) + (double) d->delay * pusabridge_rate / pusabridge_device_rate;
+    d->level += (level - d->level) * (alpha < 1 ? alpha : 1);
+
+    double err = (d->level - d->target) / pusabridge_rate;
+    d->step = d->nominal * (1 + pusarate_update(&d->rate_control, err, dt, 0));
+}
+
+/*
+ * Ring to device: resample a period from the ring, padding with silence
+ * if the ring runs dry, and write it.
+ */
+static void pusabridge_play_period(struct pusabridge_dir_s *d, int *buffer)
+{
+    int dry = 0;
+
+    for (int n = 0; n < d->period; n++)
+    {
+	while (!pusabridge_resampler_ready(&d->rs))
+	{
+	    int frame[2] = { 0, 0 };
+
+	    if (d->out != d->in)
+	    {
+		__sync_synchronize();
+		frame[0] = d->ring[2 * d->out];
+		frame[1] = d->ring[2 * d->out + 1];
+		__sync_synchronize();
+		d->out = (d->out + 1) % PUSABRIDGE_RING;
+	    }
+	    else
+		dry = 1;
+	    pusabridge_resampler_push(&d->rs, frame);
+	}
+	pusabridge_resampler_out(&d->rs, buffer + 2 * n, d->step);
+    }
+
+    if (dry && d->primed)
+	d->stats.rt_underruns++;
+    d->primed = 1;
+}
+
+/*
+ * Device to ring: read a period and resample it into the ring.
+ */
+static void pusabridge_capture_period(struct pusabridge_dir_s *d, int *buffer)
+{
+    for (int n = 0; n < d->period; n++)
+    {
+	pusabridge_resampler_push(&d->rs, buffer + 2 * n);
+	while (pusabridge_resampler_ready(&d->rs))
+	{
+	    unsigned int next = (d->in + 1) % PUSABRIDGE_RING;
+	    int frame[2];
+
+	    pusabridge_resampler_out(&d->rs, frame, d->step);
+	    if (next == d->out)
+	    {
+		d->stats.rt_overflows++;
+		continue;
+	    }
+	    d->ring[2 * d->in] = frame[0];
+	    d->ring[2 * d->in + 1] = frame[1];
+	    __sync_synchronize();
+	    d->in = next;
+	}
+    }
+    d->primed = 1;
+}
+
+/*
+ * Move a period between the ring and the device, waiting for the device.
+ */
+static int pusabridge_period(struct pusabridge_dir_s *d)
+{
+    static __thread int buffer[PUSABRIDGE_MAX_PERIOD * 2];
+
+    if (d->capture)
+    {
+	if (pusabridge_pcm_io(d, buffer, d->period) < 0)
+	    return -1;
+	pusabridge_capture_period(d, buffer);
+    }
+    else
+    {
+	pusabridge_play_period(d, buffer);
+	if (pusabridge_pcm_io(d, buffer, d->period) < 0)
+	    return -1;
+    }
+
+    d->stats.device_frames += d->period;
+    pusabridge_control(d);
+
+    return 0;
+}
+
+#ifndef PUSABRIDGE_UNIT_TEST
+static void pusabridge_update_cpu(struct pusabridge_dir_s *d)
+{
+    struct timespec ts, now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - d->start.tv_sec) + (now.tv_nsec - d->start.tv_nsec) / 1e9;
+    if (elapsed > 0)
+	d->stats.cpu = (ts.tv_sec + ts.tv_nsec / 1e9) / elapsed;
+}
+
+static void *pusabridge_thread(void *arg)
+{
+    struct pusabridge_dir_s *d = arg;
+    unsigned long periods = 0;
+
+    while (d->running && pusabridge_period(d) == 0)
+	if (++periods % 64 == 0)
+	    pusabridge_update_cpu(d);
+
+    pusabridge_update_cpu(d);
+    __sync_synchronize();
+    d->exited = 1;
+
+    return NULL;
+}
+#endif
+
+static int pusabridge_start_dir(struct pusabridge_dir_s *d, const struct pusabridge_config_s *config,
+				int capture)
+{
+    int periods = config->periods ? config->periods : PUSABRIDGE_DEFAULT_PERIODS;
+
+    memset(d, 0, sizeof(*d));
+    d->capture = capture;
+    d->period = config->period ? config->period : PUSABRIDGE_DEFAULT_PERIOD;
+    if (d->period <= 0 || d->period > PUSABRIDGE_MAX_PERIOD || periods < 2)
+    {
+	printf("pusabridge: bad period %d x %d\n", d->period, periods);
+	return -1;
+    }
+
+    if (pusabridge_pcm_open(d, config->device, periods) < 0)
+	return -1;
+
+    /* Step in input frames per output frame; filter below the lower Nyquist frequency. */
+    double in_rate = capture ? pusabridge_device_rate : pusabridge_rate;
+    double out_rate = capture ? pusabridge_rate : pusabridge_device_rate;
+    d->nominal = in_rate / out_rate;
+    d->step = d->nominal;
+    pusarate_init(&d->rate_control);
+    pusabridge_resampler_init(&d->rs, PUSABRIDGE_CUTOFF * (out_rate < in_rate ? out_rate / in_rate : 1));
+
+    /*
+     * Measured just after playback takes a period, leaving the device
+     * buffer full, or capture adds one, leaving it empty.
+     */
+    d->burst = (double) d->period * pusabridge_rate / pusabridge_device_rate;
+    d->target = capture ? d->burst + PUSABRIDGE_MARGIN :
+	(double) d->buffer * pusabridge_rate / pusabridge_device_rate + PUSABRIDGE_MARGIN;
+    d->level = d->target;
+    d->running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &d->start);
+
+#ifdef PUSABRIDGE_UNIT_TEST
+    /* The test runs the periods itself. */
+    d->exited = 1;
+#else
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusabridge_thread, d) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	pusabridge_pcm_close(d);
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+#endif
+
+    __sync_synchronize();
+    d->active = 1;
+
+    return 0;
+}
+
+static void pusabridge_stop_dir(struct pusabridge_dir_s *d)
+{
+    if (!d->running)
+	return;
+
+    d->active = 0;
+    d->running = 0;
+    while (!d->exited)
+	usleep(1000);
+    pusabridge_pcm_close(d);
+}
+
+/*
+ * Open the device and start a bridge thread for each direction.
+ */
+int pusabridge_start(const struct pusabridge_config_s *config)
+{
+    if (pusabridge_running)
+    {
+	printf("pusabridge: already running\n");
+	return -1;
+    }
+    if (config->device == NULL || (!config->playback && !config->capture) || config->rate <= 0)
+    {
+	printf("pusabridge: bad bridge configuration\n");
+	return -1;
+    }
+
+    pusabridge_rate = config->rate;
+    pusabridge_device_rate = config->device_rate ? config->device_rate : config->rate;
+
+    if (config->playback && pusabridge_start_dir(&pusabridge_play, config, 0) < 0)
+	return -1;
+    if (config->capture && pusabridge_start_dir(&pusabridge_capture, config, 1) < 0)
+    {
+	pusabridge_stop_dir(&pusabridge_play);
+	return -1;
+    }
+
+    pusabridge_running = 1;
+    return 0;
+}
+
+void pusabridge_stop(void)
+{
+    if (!pusabridge_running)
+	return;
+
+    pusabridge_stop_dir(&pusabridge_play);
+    pusabridge_stop_dir(&pusabridge_capture);
+    pusabridge_running = 0;
+}
+
+/*
+ * Audio thread only: queue a frame for playback.
+ */
+void pusabridge_rt_play(const int *data)
+{
+    struct pusabridge_dir_s *d = &pusabridge_play;
+
+    if (!d->active)
+	return;
+
+    unsigned int next = (d->in + 1) % PUSABRIDGE_RING;
+    if (next == d->out)
+    {
+	d->stats.rt_overflows++;
+	return;
+    }
+
+    d->ring[2 * d->in] = data[0];
+    d->ring[2 * d->in + 1] = data[1];
+    __sync_synchronize();
+    d->in = next;
+}
+
+/*
+ * Audio thread only: add the next captured frame to data.  Returns 0 if
+ * there was none.
+ */
+int pusabridge_rt_capture(int *data)
+{
+    struct pusabridge_dir_s *d = &pusabridge_capture;
+
+    if (!d->active)
+	return 0;
+
+    unsigned int out = d->out;
+    if (out == d->in)
+    {
+	if (d->primed)
+	    d->stats.rt_underruns++;
+	return 0;
+    }
+
+    __sync_synchronize();
+    data[0] = pusabridge_clamp((double) data[0] + d->ring[2 * out]);
+    data[1] = pusabridge_clamp((double) data[1] + d->ring[2 * out + 1]);
+    __sync_synchronize();
+    d->out = (out + 1) % PUSABRIDGE_RING;
+
+    return 1;
+}
+
+/*
+ * Audio thread only: queue the frame for playback, then mix in the next
+ * captured frame.
+ */
+void pusabridge_rt_frame(int *data)
+{
+    pusabridge_rt_play(data);
+    pusabridge_rt_capture(data);
+}
+
+static void pusabridge_get_dir_stats(struct pusabridge_dir_s *d, struct pusabridge_dir_stats_s *stats)
+{
+    *stats = d->stats;
+    stats->active = d->running;
+    if (!d->running)
+	return;
+
+    /*
+     * What is buffered is a sawtooth a period high, measured at its high
+     * point for capture and its low point for playback.
+     */
+    double ms = 1000.0 / pusabridge_rate, device_ms = 1000.0 / pusabridge_device_rate;
+    double half = d->capture ? -d->burst / 2 : d->burst / 2;
+    double taps = PUSABRIDGE_TAPS / 2 * (d->capture ? device_ms : ms);
+    stats->device_ms = d->delay * device_ms;
+    stats->fill_ms = (d->level + half) * ms - stats->device_ms;
+    stats->target_ms = (d->target + half) * ms - stats->device_ms;
+    stats->latency_ms = (d->level + half) * ms + taps;
+
+    double drift = d->capture ? d->rate_control.integral : -d->rate_control.integral;
+    stats->ratio = (double) pusabridge_device_rate / pusabridge_rate * (1 + drift);
+    stats->drift_ppm = drift * 1e6;
+}
+
+void pusabridge_get_stats(struct pusabridge_stats_s *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->period = pusabridge_play.running ? pusabridge_play.period : pusabridge_capture.period;
+    pusabridge_get_dir_stats(&pusabridge_play, &stats->playback);
+    pusabridge_get_dir_stats(&pusabridge_capture, &stats->capture);
+}
+
+void pusabridge_print_stats(void)
+{
+    struct pusabridge_stats_s st;
+
+    pusabridge_get_stats(&st);
+    for (int i = 0; i < 2; i++)
+    {
+	struct pusabridge_dir_stats_s *ds = i ? &st.capture : &st.playback;
+
+	if (!ds->active)
+	    continue;
+	printf("bridge %s: %llu device frames, %lu xruns, ring %lu overflows %lu underruns, %.2f%% cpu\n"
+	       "  fill %.2f ms (target %.2f), device %.2f ms, latency %.2f ms, ratio %.7f, drift %.1f ppm\n",
+	       i ? "capture" : "playback", ds->device_frames, ds->xruns, ds->rt_overflows,
+	       ds->rt_underruns, ds->cpu * 100, ds->fill_ms, ds->target_ms, ds->device_ms,
+	       ds->latency_ms, ds->ratio, ds->drift_ppm);
+    }
+}
+
+#ifdef PUSABRIDGE_UNIT_TEST
+#include "pusatest.h"
+
+#define TEST_SECONDS	20
+#define TEST_RATE	48000
+#define TEST_DEVICE_RATE 44100
+#define TEST_SKEW	100e-6
+#define TEST_FREQ	440.0
+#define TEST_AMP	(1 << 30)
+#define TEST_WAKE_MS	1
+
+/* Windows of 5 ms are short enough for the steering not to show as noise. */
+#define TEST_WINDOW_MS	5
+
+static int test_played[TEST_SECONDS * TEST_DEVICE_RATE * 2 * 11 / 10];
+static long long test_nplayed = 0;
+static int test_captured[TEST_SECONDS * TEST_RATE * 2 * 11 / 10];
+
+static void test_play(const int *frames, int n)
+{
+    for (int i = 0; i < n && test_nplayed < TEST_SECONDS * TEST_DEVICE_RATE * 11 / 10; i++)
+	test_played[test_nplayed++] = frames[2 * i];
+}
+
+static void test_record(int *frames, int n, long long index)
+{
+    for (int i = 0; i < n; i++)
+    {
+	frames[2 * i] = TEST_AMP * sin(2 * M_PI * TEST_FREQ * (index + i) / TEST_DEVICE_RATE);
+	frames[2 * i + 1] = 0;
+    }
+}
+
+/*
+ * Worst signal to residual ratio, in dB, of a least squares fit of a sine
+ * of w radians per sample over each window from first to last.
+ */
+static double test_snr(const int *x, long long first, long long last, int window, double w)
+{
+    double worst = 1000;
+
+    for (long long s = first; s + window <= last; s += window)
+    {
+	double cc = 0, cs = 0, ss = 0, xc = 0, xs = 0;
+
+	for (int n = 0; n < window; n++)
+	{
+	    double c = cos(w * (s + n)), si = sin(w * (s + n));
+	    cc += c * c;
+	    cs += c * si;
+	    ss += si * si;
+	    xc += x[s + n] * c;
+	    xs += x[s + n] * si;
+	}
+
+	double det = cc * ss - cs * cs;
+	double a = (xc * ss - xs * cs) / det, b = (xs * cc - xc * cs) / det;
+	double sig = 0, res = 0;
+	for (int n = 0; n < window; n++)
+	{
+	    double fit = a * cos(w * (s + n)) + b * sin(w * (s + n));
+	    sig += fit * fit;
+	    res += (x[s + n] - fit) * (x[s + n] - fit);
+	}
+
+	double snr = 10 * log10(sig / (res + 1e-9));
+	if (snr < worst)
+	    worst = snr;
+    }
+
+    return worst;
+}
+
+/*
+ * Bridge a 48 kHz engine to a 44.1 kHz emulated device whose clock runs
+ * 100 ppm fast, playing one sine and capturing another.  This plays the
+ * audio thread, frame by frame on the virtual clock, and runs each
+ * direction's period when the device is ready for it and a random wake
+ * up latency of up to TEST_WAKE_MS has passed.
+ */
+int main(int argc, char **argv)
+{
+    struct pusabridge_config_s config = { "emulated", 1, 1, TEST_RATE, TEST_DEVICE_RATE, 0, 0 };
+    struct pusabridge_dir_s *dirs[2] = { &pusabridge_play, &pusabridge_capture };
+    struct pusabridge_stats_s st;
+    double wake[2] = { 0, 0 };
+    double play_drift = 0, capture_drift = 0;
+    long long frames, captured = 0;
+    unsigned long missed = 0, missed_late = 0;
+    int nstats = 0;
+
+    srand(1);
+    pusabridge_test_skew = TEST_SKEW;
+    pusabridge_test_play = test_play;
+    pusabridge_test_record = test_record;
+    check(pusabridge_start(&config) == 0, "start bridge");
+
+    for (frames = 0; frames < TEST_SECONDS * TEST_RATE; frames++)
+    {
+	pusabridge_test_now = (double) frames / TEST_RATE;
+
+	for (int i = 0; i < 2; i++)
+	    while (pusabridge_emu_due(dirs[i]) + wake[i] <= pusabridge_test_now)
+	    {
+		pusabridge_period(dirs[i]);
+		wake[i] = TEST_WAKE_MS / 1000.0 * rand() / RAND_MAX;
+	    }
+
+	int frame[2] = { TEST_AMP * sin(2 * M_PI * TEST_FREQ * frames / TEST_RATE), 0 };
+	pusabridge_rt_play(frame);
+
+	frame[0] = 0;
+	if (pusabridge_rt_capture(frame))
+	    test_captured[captured++] = frame[0];
+	else if (captured > 0)
+	{
+	    test_captured[captured++] = 0;
+	    missed++;
+	    if (frames > TEST_SECONDS / 2 * TEST_RATE)
+		missed_late++;
+	}
+
+	if (frames > (TEST_SECONDS - 2) * TEST_RATE && frames % 1000 == 0)
+	{
+	    pusabridge_get_stats(&st);
+	    play_drift += st.playback.drift_ppm;
+	    capture_drift += st.capture.drift_ppm;
+	    nstats++;
+	}
+    }
+
+    pusabridge_print_stats();
+    pusabridge_get_stats(&st);
+    pusabridge_stop();
+
+    play_drift /= nstats;
+    capture_drift /= nstats;
+    double play_snr = test_snr(test_played, test_nplayed - 3 * TEST_DEVICE_RATE, test_nplayed,
+			       TEST_DEVICE_RATE * TEST_WINDOW_MS / 1000,
+			       2 * M_PI * TEST_FREQ / (TEST_DEVICE_RATE * (1 + TEST_SKEW)));
+    double capture_snr = test_snr(test_captured, captured - 3 * TEST_RATE, captured,
+				  TEST_RATE * TEST_WINDOW_MS / 1000,
+				  2 * M_PI * TEST_FREQ * (1 + TEST_SKEW) / TEST_RATE);
+    printf("drift %.1f / %.1f ppm, worst snr %.1f / %.1f dB, %lu captured frames missed\n",
+	   play_drift, capture_drift, play_snr, capture_snr, missed);
+
+    check(fabs(play_drift - TEST_SKEW * 1e6) < 5, "playback drift tracked");
+    check(fabs(capture_drift - TEST_SKEW * 1e6) < 5, "capture drift tracked");
+    check(play_snr > 80, "playback continuous and clean");
+    check(capture_snr > 80, "capture continuous and clean");
+    check(missed_late == 0, "capture ring margin adapted");
+    check(st.playback.xruns == 0 && st.capture.xruns == 0, "no device xruns");
+    check(st.playback.latency_ms > 0 && st.playback.latency_ms < 30 &&
+	  st.capture.latency_ms > 0 && st.capture.latency_ms < 30, "latency reported");
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+#endif
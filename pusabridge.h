@@ -0,0 +1,71 @@
+/*
+ * Header file for the ALSA bridge.
+ */
+
+#ifndef __pusabridge_h__
+#define __pusabridge_h__
+
+#define PUSABRIDGE_RING		8192
+#define PUSABRIDGE_TAPS		32
+#define PUSABRIDGE_PHASES	256
+#define PUSABRIDGE_MAX_PERIOD	2048
+#define PUSABRIDGE_DEFAULT_PERIOD 256
+#define PUSABRIDGE_DEFAULT_PERIODS 3
+
+/*
+ * device is an ALSA PCM name such as "hw:1,0", "null" or "loop".  Either
+ * or both of playback and capture may be set.  rate is the engine's and
+ * device_rate the device's, 0 for the same.  period and periods set the
+ * device buffer, in device frames; 0 for the defaults.
+ */
+struct pusabridge_config_s
+{
+    const char *device;
+    int playback;
+    int capture;
+    int rate;
+    int device_rate;
+    int period;
+    int periods;
+};
+
+/*
+ * One direction.  fill_ms is the ring between the audio thread and the
+ * bridge thread, averaged over the ring's sawtooth, and target_ms what it
+ * is steered to.  ratio is the device clock over the engine clock as
+ * measured, nominally device_rate / rate, and drift_ppm how much faster
+ * the device runs than it should.  latency_ms is everything the bridge
+ * adds: the ring, the resampler and the device buffer.
+ */
+struct pusabridge_dir_stats_s
+{
+    int active;
+    unsigned long long device_frames;
+    unsigned long xruns;
+    unsigned long rt_overflows;
+    unsigned long rt_underruns;
+    double fill_ms;
+    double target_ms;
+    double device_ms;
+    double latency_ms;
+    double ratio;
+    double drift_ppm;
+    double cpu;
+};
+
+struct pusabridge_stats_s
+{
+    int period;
+    struct pusabridge_dir_stats_s playback;
+    struct pusabridge_dir_stats_s capture;
+};
+
+int pusabridge_start(const struct pusabridge_config_s *config);
+void pusabridge_stop(void);
+void pusabridge_rt_play(const int *data);
+int pusabridge_rt_capture(int *data);
+void pusabridge_rt_frame(int *data);
+void pusabridge_get_stats(struct pusabridge_stats_s *stats);
+void pusabridge_print_stats(void);
+
+#endif /* __pusabridge_h__ */
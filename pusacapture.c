@@ -0,0 +1,938 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Retrospective capture.  The audio thread copies each output frame into
+ * a ring.  A worker thread compresses the frames in blocks and keeps them
+ * in a fixed amount of memory, dropping the oldest blocks as new ones
+ * arrive.  pusacapture_save() writes out whatever is held, which covers
+ * the last few minutes, while capture carries on.
+ *
+ * Compression follows FLAC: per channel, drop trailing zero bits common
+ * to the block, pick the best fixed polynomial predictor of order 0 to 4,
+ * and Rice code the residual with a parameter per partition.  Stereo
+ * blocks are coded as left and side when that is smaller.  The file format
+ * is not FLAC; pusacapture_decode() turns it into a WAV file.
+ *
+ * File layout: struct pusacapture_file_s, then blocks, each a struct
+ * pusacapture_block_s followed by the bit stream for each channel.
+ * Everything is in host byte order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pusacapture.h"
+#include "pusatrace.h"
+
+#define PUSACAPTURE_MAGIC	"PUSACAP1"
+#define PUSACAPTURE_SAVE_CHUNK	(1024 * 1024)
+
+#define PUSACAPTURE_INDEPENDENT	0
+#define PUSACAPTURE_LEFT_SIDE	1
+
+#define PUSACAPTURE_CONSTANT	0
+#define PUSACAPTURE_VERBATIM	1
+#define PUSACAPTURE_FIXED	2
+
+struct pusacapture_file_s
+{
+    char magic[8];
+    unsigned int sample_rate;
+    unsigned int channels;
+};
+
+struct pusacapture_block_s
+{
+    unsigned int length;
+    unsigned int nframes;
+    unsigned long long sample_index;
+    unsigned int mode;
+    unsigned int hash;
+};
+
+/* Largest possible block: verbatim 33 bit samples plus channel headers. */
+#define PUSACAPTURE_MAX_BLOCK	(sizeof(struct pusacapture_block_s) + \
+				 PUSACAPTURE_CHANNELS * (PUSACAPTURE_BLOCK * 33 / 8 + 16))
+
+struct pusacapture_frame_s
+{
+    unsigned long long sample_index;
+    int data[PUSACAPTURE_CHANNELS];
+};
+
+/*
+ * Audio thread to worker.  Single producer, single consumer.
+ */
+static struct pusacapture_frame_s pusacapture_rt_ring[PUSACAPTURE_RT_RING];
+static volatile unsigned int pusacapture_rt_in = 0;
+static volatile unsigned int pusacapture_rt_out = 0;
+static volatile int pusacapture_running = 0;
+
+/*
+ * Compressed blocks.  head and tail are byte counts since start; the
+ * worker adds at head and drops from tail.
+ */
+static pthread_mutex_t pusacapture_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *pusacapture_ring = NULL;
+static size_t pusacapture_ring_size = 0;
+static unsigned long long pusacapture_head = 0;
+static unsigned long long pusacapture_tail = 0;
+
+static int pusacapture_rate = 48000;
+static struct pusacapture_stats_s pusacapture_stats;
+
+struct pusacapture_bits_s
+{
+    unsigned char *buf;
+    size_t pos;
+    size_t size;
+    unsigned long long acc;
+    int nacc;
+};
+
+static void pusacapture_put(struct pusacapture_bits_s *b, unsigned long long v, int n)
+{
+    b->acc = (b->acc << n) | (v & ((1ULL << n) - 1));
+    b->nacc += n;
+    while (b->nacc >= 8)
+    {
+	b->nacc -= 8;
+	b->buf[b->pos++] = b->acc >> b->nacc;
+    }
+}
+
+static void pusacapture_put_rice(struct pusacapture_bits_s *b, long long r, int k)
+{
+    unsigned long long u = ((unsigned long long) r << 1) ^ (unsigned long long) (r >> 63);
+    unsigned long long q = u >> k;
+
+    while (q >= 32)
+    {
+	pusacapture_put(b, 0, 32);
+	q -= 32;
+    }
+    pusacapture_put(b, 1, q + 1);
+    if (k > 0)
+	pusacapture_put(b, u, k);
+}
+
+static void pusacapture_flush(struct pusacapture_bits_s *b)
+{
+    if (b->nacc > 0)
+	pusacapture_put(b, 0, 8 - b->nacc);
+}
+
+static unsigned long long pusacapture_get(struct pusacapture_bits_s *b, int n)
+{
+    while (b->nacc < n)
+    {
+	unsigned char c = b->pos < b->size ? b->buf[b->pos] : 0;
+	b->pos++;
+	b->acc = (b->acc << 8) | c;
+	b->nacc += 8;
+    }
+
+    b->nacc -= n;
+    return (b->acc >> b->nacc) & ((1ULL << n) - 1);
+}
+
+static long long pusacapture_get_signed(struct pusacapture_bits_s *b, int n)
+{
+    unsigned long long v = pusacapture_get(b, n);
+
+    return (long long) (v << (64 - n)) >> (64 - n);
+}
+
+static long long pusacapture_get_rice(struct pusacapture_bits_s *b, int k)
+{
+    unsigned long long q = 0;
+
+    while (pusacapture_get(b, 1) == 0)
+    {
+	q++;
+	if (b->pos > b->size + 8)
+	    return 0;
+    }
+
+    unsigned long long u = (q << k) | (k > 0 ? pusacapture_get(b, k) : 0);
+    return (long long) (u >> 1) ^ -(long long) (u & 1);
+}
+
+static long long pusacapture_residual(const long long *y, int i, int order)
+{
+    switch (order)
+    {
+    case 0:
+	return y[i];
+    case 1:
+	return y[i] - y[i - 1];
+    case 2:
+	return y[i] - 2 * y[i - 1] + y[i - 2];
+    case 3:
+	return y[i] - 3 * y[i - 1] + 3 * y[i - 2] - y[i - 3];
+    default:
+	return y[i] - 4 * y[i - 1] + 6 * y[i - 2] - 4 * y[i - 3] + y[i - 4];
+    }
+}
+
+static long long pusacapture_predict(const long long *y, int i, int order)
+{
+    return y[i] - pusacapture_residual(y, i, order);
+}
+
+/*
+ * Encode one channel of n samples, each at most width bits.
+ */
+static void pusacapture_encode_channel(struct pusacapture_bits_s *b, const long long *x, int n,
+				       int width)
+{
+    long long y[PUSACAPTURE_BLOCK];
+    unsigned long long all = 0;
+    int constant = 1;
+
+    for (int i = 0; i < n; i++)
+    {
+	all |= x[i];
+	if (x[i] != x[0])
+	    constant = 0;
+    }
+
+    if (constant)
+    {
+	pusacapture_put(b, PUSACAPTURE_CONSTANT, 2);
+	pusacapture_put(b, x[0], width);
+	return;
+    }
+
+    int wasted = 0;
+    while (wasted < 31 && !(all & (1ULL << wasted)))
+	wasted++;
+    for (int i = 0; i < n; i++)
+	y[i] = x[i] >> wasted;
+
+    /* Compare predictors over the same samples. */
+    int order = 0;
+    unsigned long long best = ~0ULL;
+    for (int o = 0; o <= PUSACAPTURE_MAX_ORDER && o < n; o++)
+    {
+	unsigned long long sum = 0;
+	for (int i = PUSACAPTURE_MAX_ORDER; i < n; i++)
+	{
+	    long long r = pusacapture_residual(y, i, o);
+	    sum += r < 0 ? -r : r;
+	}
+	if (sum < best)
+	{
+	    best = sum;
+	    order = o;
+	}
+    }
+
+    int log2_parts = 0;
+    while ((1 << log2_parts) < PUSACAPTURE_PARTITIONS && n % (2 << log2_parts) == 0 &&
+	   n >> (log2_parts + 1) > order)
+	log2_parts++;
+
+    int nparts = 1 << log2_parts;
+    int psize = n >> log2_parts;
+    int k[PUSACAPTURE_PARTITIONS];
+    unsigned long long bits = 2 + 5 + 3 + 4 + order * (width - wasted) + nparts * 5;
+
+    for (int p = 0; p < nparts; p++)
+    {
+	int start = p == 0 ? order : p * psize;
+	int count = (p + 1) * psize - start;
+	unsigned long long sum = 0;
+
+	for (int i = start; i < (p + 1) * psize; i++)
+	{
+	    long long r = pusacapture_residual(y, i, order);
+	    sum += ((unsigned long long) r << 1) ^ (unsigned long long) (r >> 63);
+	}
+
+	k[p] = 0;
+	while (k[p] < 30 && ((unsigned long long) count << (k[p] + 1)) <= sum)
+	    k[p]++;
+	bits += (unsigned long long) count * (k[p] + 1) + (sum >> k[p]);
+    }
+
+    if (bits >= 2 + (unsigned long long) n * width)
+    {
+	pusacapture_put(b, PUSACAPTURE_VERBATIM, 2);
+	for (int i = 0; i < n; i++)
+	    pusacapture_put(b, x[i], width);
+	return;
+    }
+
+    pusacapture_put(b, PUSACAPTURE_FIXED, 2);
+    pusacapture_put(b, wasted, 5);
+    pusacapture_put(b, order, 3);
+    pusacapture_put(b, log2_parts, 4);
+    for (int i = 0; i < order; i++)
+	pusacapture_put(b, y[i], width - wasted);
+
+    for (int p = 0; p < nparts; p++)
+    {
+	pusacapture_put(b, k[p], 5);
+	for (int i = p == 0 ? order : p * psize; i < (p + 1) * psize; i++)
+	    pusacapture_put_rice(b, pusacapture_residual(y, i, order), k[p]);
+    }
+}
+
+static int pusacapture_decode_channel(struct pusacapture_bits_s *b, long long *x, int n,
+				      int width)
+{
+    int type = pusacapture_get(b, 2);
+
+    if (type == PUSACAPTURE_CONSTANT)
+    {
+	long long v = pusacapture_get_signed(b, width);
+	for (int i = 0; i < n; i++)
+	    x[i] = v;
+	return 0;
+    }
+
+    if (type == PUSACAPTURE_VERBATIM)
+    {
+	for (int i = 0; i < n; i++)
+	    x[i] = pusacapture_get_signed(b, width);
+	return 0;
+    }
+
+    if (type != PUSACAPTURE_FIXED)
+	return -1;
+
+    int wasted = pusacapture_get(b, 5);
+    int order = pusacapture_get(b, 3);
+    int log2_parts = pusacapture_get(b, 4);
+    if (order > PUSACAPTURE_MAX_ORDER || order > n || (1 << log2_parts) > PUSACAPTURE_PARTITIONS)
+	return -1;
+
+    for (int i = 0; i < order; i++)
+	x[i] = pusacapture_get_signed(b, width - wasted);
+
+    int nparts = 1 << log2_parts;
+    int psize = n >> log2_parts;
+    for (int p = 0; p < nparts; p++)
+    {
+	int k = pusacapture_get(b, 5);
+	for (int i = p == 0 ? order : p * psize; i < (p + 1) * psize; i++)
+	    x[i] = pusacapture_predict(x, i, order) + pusacapture_get_rice(b, k);
+    }
+
+    for (int i = 0; i < n; i++)
+	x[i] = (long long) ((unsigned long long) x[i] << wasted);
+
+    return b->pos > b->size ? -1 : 0;
+}
+
+static unsigned int pusacapture_hash(const int *data, int nwords)
+{
+    unsigned int h = 2166136261u;
+
+    for (int i = 0; i < nwords; i++)
+    {
+	h ^= (unsigned int) data[i];
+	h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Compress n interleaved stereo frames into out.  Returns the block length.
+ */
+static size_t pusacapture_encode_block(unsigned char *out, const int *frames, int n,
+				       unsigned long long sample_index)
+{
+    long long left[PUSACAPTURE_BLOCK], right[PUSACAPTURE_BLOCK], side[PUSACAPTURE_BLOCK];
+    unsigned long long cost_right = 0, cost_side = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+	left[i] = frames[2 * i];
+	right[i] = frames[2 * i + 1];
+	side[i] = left[i] - right[i];
+	if (i >= 2)
+	{
+	    long long r = right[i] - 2 * right[i - 1] + right[i - 2];
+	    long long s = side[i] - 2 * side[i - 1] + side[i - 2];
+	    cost_right += r < 0 ? -r : r;
+	    cost_side += s < 0 ? -s : s;
+	}
+    }
+
+    struct pusacapture_block_s *hdr = (struct pusacapture_block_s *) out;
+    struct pusacapture_bits_s b = { out + sizeof(*hdr), 0, PUSACAPTURE_MAX_BLOCK - sizeof(*hdr), 0, 0 };
+
+    hdr->nframes = n;
+    hdr->sample_index = sample_index;
+    hdr->mode = cost_side < cost_right ? PUSACAPTURE_LEFT_SIDE : PUSACAPTURE_INDEPENDENT;
+    hdr->hash = pusacapture_hash(frames, n * 2);
+
+    pusacapture_encode_channel(&b, left, n, 32);
+    if (hdr->mode == PUSACAPTURE_LEFT_SIDE)
+	pusacapture_encode_channel(&b, side, n, 33);
+    else
+	pusacapture_encode_channel(&b, right, n, 32);
+    pusacapture_flush(&b);
+
+    hdr->length = sizeof(*hdr) + b.pos;
+    return hdr->length;
+}
+
+static int pusacapture_decode_block(const unsigned char *in, int *frames)
+{
+    const struct pusacapture_block_s *hdr = (const struct pusacapture_block_s *) in;
+    long long left[PUSACAPTURE_BLOCK], other[PUSACAPTURE_BLOCK];
+    struct pusacapture_bits_s b = { (unsigned char *) in + sizeof(*hdr), 0,
+				    hdr->length - sizeof(*hdr), 0, 0 };
+    int n = hdr->nframes;
+
+    if (n <= 0 || n > PUSACAPTURE_BLOCK)
+	return -1;
+
+    int side = hdr->mode == PUSACAPTURE_LEFT_SIDE;
+    if (pusacapture_decode_channel(&b, left, n, 32) < 0 ||
+	pusacapture_decode_channel(&b, other, n, side ? 33 : 32) < 0)
+	return -1;
+
+    for (int i = 0; i < n; i++)
+    {
+	frames[2 * i] = left[i];
+	frames[2 * i + 1] = side ? left[i] - other[i] : other[i];
+    }
+
+    return pusacapture_hash(frames, n * 2) == hdr->hash ? n : -1;
+}
+
+static void pusacapture_ring_read(void *dst, unsigned long long pos, size_t n)
+{
+    size_t offset = pos % pusacapture_ring_size;
+    size_t first = n < pusacapture_ring_size - offset ? n : pusacapture_ring_size - offset;
+
+    memcpy(dst, pusacapture_ring + offset, first);
+    memcpy((char *) dst + first, pusacapture_ring, n - first);
+}
+
+static void pusacapture_ring_write(const void *src, unsigned long long pos, size_t n)
+{
+    size_t offset = pos % pusacapture_ring_size;
+    size_t first = n < pusacapture_ring_size - offset ? n : pusacapture_ring_size - offset;
+
+    memcpy(pusacapture_ring + offset, src, first);
+    memcpy(pusacapture_ring, (const char *) src + first, n - first);
+}
+
+/* Length of the block at pos.  Called with pusacapture_lock held. */
+static unsigned int pusacapture_ring_length(unsigned long long pos)
+{
+    unsigned int length;
+
+    pusacapture_ring_read(&length, pos, sizeof(length));
+    return length;
+}
+
+static void pusacapture_store(const unsigned char *block, size_t length, int nframes)
+{
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+    pthread_mutex_lock(&pusacapture_lock);
+
+    while (pusacapture_head + length - pusacapture_tail > pusacapture_ring_size)
+    {
+	pusacapture_tail += pusacapture_ring_length(pusacapture_tail);
+	pusacapture_stats.dropped_blocks++;
+    }
+
+    pusacapture_ring_write(block, pusacapture_head, length);
+    pusacapture_head += length;
+
+    pusacapture_stats.blocks++;
+    pusacapture_stats.frames += nframes;
+    pusacapture_stats.compressed_bytes += length;
+    pusacapture_stats.worker_cpu = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    pusacapture_stats.ring_used = pusacapture_head - pusacapture_tail;
+
+    pthread_mutex_unlock(&pusacapture_lock);
+}
+
+static void *pusacapture_worker(void *arg)
+{
+    static int frames[PUSACAPTURE_BLOCK * PUSACAPTURE_CHANNELS];
+    static unsigned char block[PUSACAPTURE_MAX_BLOCK];
+    unsigned long long first = 0, next = 0;
+    int n = 0;
+
+    PUSATRACE_THREAD("capture");
+
+    while (1)
+    {
+	if (pusacapture_rt_out == pusacapture_rt_in)
+	{
+	    usleep(5000);
+	    continue;
+	}
+
+	PUSATRACE_BEGIN(PUSATRACE_CAPTURE);
+	while (pusacapture_rt_out != pusacapture_rt_in)
+	{
+	    struct pusacapture_frame_s *f = pusacapture_rt_ring + pusacapture_rt_out;
+
+	    /* Frames lost to an overflow end the block early. */
+	    if (n > 0 && f->sample_index != next)
+	    {
+		pusacapture_store(block, pusacapture_encode_block(block, frames, n, first), n);
+		n = 0;
+	    }
+
+	    if (n == 0)
+		first = f->sample_index;
+	    next = f->sample_index + 1;
+	    frames[2 * n] = f->data[0];
+	    frames[2 * n + 1] = f->data[1];
+	    n++;
+
+	    __sync_synchronize();
+	    pusacapture_rt_out = (pusacapture_rt_out + 1) % PUSACAPTURE_RT_RING;
+
+	    if (n == PUSACAPTURE_BLOCK)
+	    {
+		pusacapture_store(block, pusacapture_encode_block(block, frames, n, first), n);
+		n = 0;
+	    }
+	}
+	PUSATRACE_END(PUSATRACE_CAPTURE);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand one output frame to the capture.  Audio thread only.  Frames are
+ * dropped if the worker falls behind.
+ */
+void pusacapture_rt_frame(unsigned long long sample_index, const int *data)
+{
+    if (!pusacapture_running)
+	return;
+
+    unsigned int next = (pusacapture_rt_in + 1) % PUSACAPTURE_RT_RING;
+    if (next == pusacapture_rt_out)
+    {
+	pusacapture_stats.rt_overflows++;
+	return;
+    }
+
+    struct pusacapture_frame_s *f = pusacapture_rt_ring + pusacapture_rt_in;
+    f->sample_index = sample_index;
+    f->data[0] = data[0];
+    f->data[1] = data[1];
+
+    __sync_synchronize();
+    pusacapture_rt_in = next;
+}
+
+/*
+ * Start capturing, keeping up to ring_bytes of compressed audio, or
+ * PUSACAPTURE_DEFAULT_RING if 0.
+ */
+int pusacapture_init(int sample_rate, size_t ring_bytes)
+{
+    if (pusacapture_running)
+	return 0;
+
+    if (ring_bytes == 0)
+	ring_bytes = PUSACAPTURE_DEFAULT_RING;
+    if (ring_bytes < 2 * PUSACAPTURE_MAX_BLOCK)
+    {
+	printf("pusacapture: ring of %lu bytes is too small\n", (unsigned long) ring_bytes);
+	return -1;
+    }
+
+    pusacapture_ring = malloc(ring_bytes);
+    if (pusacapture_ring == NULL)
+    {
+	printf("pusacapture: failed to allocate %lu bytes\n", (unsigned long) ring_bytes);
+	return -1;
+    }
+    memset(pusacapture_ring, 0, ring_bytes);
+
+    pusacapture_ring_size = ring_bytes;
+    pusacapture_rate = sample_rate;
+    pusacapture_stats.ring_bytes = ring_bytes;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusacapture_worker, NULL) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	free(pusacapture_ring);
+	pusacapture_ring = NULL;
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    __sync_synchronize();
+    pusacapture_running = 1;
+
+    return 0;
+}
+
+/*
+ * Write the blocks held to path.  Capture keeps going; blocks dropped
+ * while saving are skipped.  Frames not yet making up a whole block are
+ * not included.
+ */
+int pusacapture_save(const char *path)
+{
+    if (pusacapture_ring == NULL)
+	return -1;
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+
+    unsigned char *buf = malloc(PUSACAPTURE_SAVE_CHUNK + PUSACAPTURE_MAX_BLOCK);
+    if (buf == NULL)
+    {
+	fclose(fp);
+	return -1;
+    }
+
+    struct pusacapture_file_s file;
+    memcpy(file.magic, PUSACAPTURE_MAGIC, sizeof(file.magic));
+    file.sample_rate = pusacapture_rate;
+    file.channels = PUSACAPTURE_CHANNELS;
+    int result = fwrite(&file, sizeof(file), 1, fp) == 1 ? 0 : -1;
+
+    pthread_mutex_lock(&pusacapture_lock);
+    unsigned long long pos = pusacapture_tail;
+    unsigned long long end = pusacapture_head;
+    pthread_mutex_unlock(&pusacapture_lock);
+
+    while (result == 0 && pos < end)
+    {
+	size_t n = 0;
+
+	pthread_mutex_lock(&pusacapture_lock);
+	if (pos < pusacapture_tail)
+	{
+	    pos = pusacapture_tail;
+	    pusacapture_stats.save_gaps++;
+	}
+	while (pos + n < end && n < PUSACAPTURE_SAVE_CHUNK)
+	{
+	    unsigned int length = pusacapture_ring_length(pos + n);
+	    pusacapture_ring_read(buf + n, pos + n, length);
+	    n += length;
+	}
+	pthread_mutex_unlock(&pusacapture_lock);
+
+	if (n > 0 && fwrite(buf, n, 1, fp) != 1)
+	    result = -1;
+	pos += n;
+    }
+
+    free(buf);
+    if (fclose(fp) != 0)
+	result = -1;
+    if (result < 0)
+	printf("pusacapture: failed to write %s\n", path);
+
+    return result;
+}
+
+static void pusacapture_put32(FILE *fp, unsigned int v)
+{
+    fwrite(&v, 4, 1, fp);
+}
+
+static void pusacapture_put16(FILE *fp, unsigned short v)
+{
+    fwrite(&v, 2, 1, fp);
+}
+
+static void pusacapture_wav_header(FILE *fp, int rate, unsigned int data_bytes)
+{
+    fwrite("RIFF", 4, 1, fp);
+    pusacapture_put32(fp, 36 + data_bytes);
+    fwrite("WAVEfmt ", 8, 1, fp);
+    pusacapture_put32(fp, 16);
+    pusacapture_put16(fp, 1);
+    pusacapture_put16(fp, PUSACAPTURE_CHANNELS);
+    pusacapture_put32(fp, rate);
+    pusacapture_put32(fp, rate * PUSACAPTURE_CHANNELS * 4);
+    pusacapture_put16(fp, PUSACAPTURE_CHANNELS * 4);
+    pusacapture_put16(fp, 32);
+    fwrite("data", 4, 1, fp);
+    pusacapture_put32(fp, data_bytes);
+}
+
+/*
+ * Convert a saved capture to a 32 bit WAV file.  Returns the number of
+ * frames, or -1 if the file is damaged.
+ */
+long long pusacapture_decode(const char *path, const char *wav_path)
+{
+    static unsigned char block[PUSACAPTURE_MAX_BLOCK];
+    static int frames[PUSACAPTURE_BLOCK * PUSACAPTURE_CHANNELS];
+    struct pusacapture_file_s file;
+    struct pusacapture_block_s *hdr = (struct pusacapture_block_s *) block;
+    long long total = 0;
+    int gaps = 0;
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+
+    FILE *out = fopen(wav_path, "wb");
+    if (out == NULL)
+    {
+	perror(wav_path);
+	fclose(in);
+	return -1;
+    }
+
+    if (fread(&file, sizeof(file), 1, in) != 1 ||
+	memcmp(file.magic, PUSACAPTURE_MAGIC, sizeof(file.magic)) != 0 ||
+	file.channels != PUSACAPTURE_CHANNELS)
+    {
+	printf("pusacapture: %s is not a capture file\n", path);
+	total = -1;
+    }
+    else
+	pusacapture_wav_header(out, file.sample_rate, 0);
+
+    unsigned long long next = 0;
+    while (total >= 0 && fread(hdr, sizeof(*hdr), 1, in) == 1)
+    {
+	if (hdr->length < sizeof(*hdr) || hdr->length > PUSACAPTURE_MAX_BLOCK ||
+	    fread(block + sizeof(*hdr), hdr->length - sizeof(*hdr), 1, in) != 1)
+	{
+	    total = -1;
+	    break;
+	}
+
+	int n = pusacapture_decode_block(block, frames);
+	if (n < 0)
+	{
+	    printf("pusacapture: bad block at frame %llu\n", hdr->sample_index);
+	    total = -1;
+	    break;
+	}
+
+	if (total > 0 && hdr->sample_index != next)
+	    gaps++;
+	next = hdr->sample_index + n;
+
+	fwrite(frames, n * PUSACAPTURE_CHANNELS * 4, 1, out);
+	total += n;
+    }
+
+    if (total >= 0)
+    {
+	rewind(out);
+	pusacapture_wav_header(out, file.sample_rate, total * PUSACAPTURE_CHANNELS * 4);
+	if (gaps)
+	    printf("pusacapture: %d gaps in %s\n", gaps, path);
+    }
+
+    fclose(in);
+    fclose(out);
+
+    return total;
+}
+
+void pusacapture_get_stats(struct pusacapture_stats_s *stats)
+{
+    pthread_mutex_lock(&pusacapture_lock);
+    *stats = pusacapture_stats;
+    pthread_mutex_unlock(&pusacapture_lock);
+
+    stats->raw_bytes = stats->frames * PUSACAPTURE_CHANNELS * 4;
+    if (stats->frames == 0)
+	return;
+
+    double minutes = (double) stats->frames / pusacapture_rate / 60;
+    stats->ratio = (double) stats->raw_bytes / stats->compressed_bytes;
+    stats->bytes_per_minute = stats->compressed_bytes / minutes;
+    stats->minutes_held = stats->ring_bytes / stats->bytes_per_minute;
+    stats->worker_cpu /= minutes * 60;
+}
+
+void pusacapture_print_stats(void)
+{
+    struct pusacapture_stats_s st;
+
+    pusacapture_get_stats(&st);
+    printf("capture: %llu frames, ratio %.2f, %.2f MB/minute, %.1f minutes in %.1f MB, "
+	   "worker %.1f%% cpu\n", st.frames, st.ratio, st.bytes_per_minute / 1e6,
+	   st.minutes_held, st.ring_bytes / 1e6, st.worker_cpu * 100);
+    if (st.dropped_blocks || st.rt_overflows || st.save_gaps)
+	printf("  %lu blocks aged out, %lu frames dropped, %lu gaps while saving\n",
+	       st.dropped_blocks, st.rt_overflows, st.save_gaps);
+}
+
+#ifdef PUSACAPTURE_UNIT_TEST
+#include <math.h>
+#include "pusatest.h"
+
+/* 24 bit audio in the top of a 32 bit word, as the PCM block delivers. */
+static void test_signal(unsigned long long i, int *data)
+{
+    unsigned int hash = (unsigned int) i * 2654435761u;
+    int noise = (int) (hash >> 26) - 32;
+
+    data[0] = ((int) (3000000 * sin(i * 0.0131)) + noise) << 8;
+    data[1] = ((int) (2800000 * sin(i * 0.0131 + 0.2)) - noise) << 8;
+    if (i >= 20000 && i < 30000)
+	data[0] = data[1] = 0;
+    if (i >= 30000 && i < 34096)
+    {
+	data[0] = hash;
+	data[1] = hash * 40503u;
+    }
+}
+
+static void test_feed(unsigned long long from, unsigned long long to, int *saved)
+{
+    for (unsigned long long i = from; i < to; i++)
+    {
+	int data[2];
+
+	test_signal(i, data);
+	if (saved != NULL)
+	{
+	    saved[2 * i] = data[0];
+	    saved[2 * i + 1] = data[1];
+	}
+
+	/* Stand in for the audio thread, but never overrun the worker. */
+	while ((pusacapture_rt_in + 1) % PUSACAPTURE_RT_RING == pusacapture_rt_out)
+	    usleep(1000);
+	pusacapture_rt_frame(i, data);
+    }
+
+    while (pusacapture_rt_out != pusacapture_rt_in)
+	usleep(1000);
+    usleep(20000);
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned long long nframes = 40 * PUSACAPTURE_BLOCK;
+    int *saved = malloc(nframes * 2 * sizeof(int));
+    int *decoded = malloc(nframes * 2 * sizeof(int));
+    struct pusacapture_stats_s st;
+
+    /* Round trips of single blocks. */
+    static unsigned char block[PUSACAPTURE_MAX_BLOCK];
+    int frames[PUSACAPTURE_BLOCK * 2], out[PUSACAPTURE_BLOCK * 2];
+    int ok = 1;
+    for (int len = 1; len <= PUSACAPTURE_BLOCK; len = len * 3 + 1)
+    {
+	for (int i = 0; i < len; i++)
+	    test_signal(i * 7 + len, frames + 2 * i);
+	frames[0] = 0x7fffffff;
+	frames[1] = 0x80000000;
+	pusacapture_encode_block(block, frames, len, 0);
+	if (pusacapture_decode_block(block, out) != len || memcmp(frames, out, len * 8) != 0)
+	    ok = 0;
+    }
+    check(ok, "blocks round trip, including extremes");
+
+    check(pusacapture_init(48000, 1024 * 1024) == 0, "init");
+    test_feed(0, nframes, saved);
+
+    pusacapture_get_stats(&st);
+    pusacapture_print_stats();
+    check(st.frames == nframes && st.dropped_blocks == 0, "all blocks kept");
+    check(st.ratio > 1.5, "24 bit audio compresses");
+
+    check(pusacapture_save("/tmp/pusacapture_test.cap") == 0, "save");
+    long long n = pusacapture_decode("/tmp/pusacapture_test.cap", "/tmp/pusacapture_test.wav");
+    check(n == (long long) nframes, "decode all frames");
+
+    FILE *fp = fopen("/tmp/pusacapture_test.wav", "rb");
+    fseek(fp, 44, SEEK_SET);
+    check(fread(decoded, 8, nframes, fp) == nframes && memcmp(saved, decoded, nframes * 8) == 0,
+	  "lossless");
+    fclose(fp);
+
+    /* Keep going until the oldest blocks are dropped. */
+    test_feed(nframes, 8 * nframes, NULL);
+    pusacapture_get_stats(&st);
+    check(st.dropped_blocks > 0 && st.ring_used <= st.ring_bytes, "oldest blocks dropped");
+
+    check(pusacapture_save("/tmp/pusacapture_test.cap") == 0, "save after wrap");
+    n = pusacapture_decode("/tmp/pusacapture_test.cap", "/tmp/pusacapture_test.wav");
+    check(n > 0 && n == (long long) (st.blocks - st.dropped_blocks) * PUSACAPTURE_BLOCK,
+	  "decode after wrap");
+
+    int last[2];
+    fp = fopen("/tmp/pusacapture_test.wav", "rb");
+    fseek(fp, -8, SEEK_END);
+    check(fread(last, 8, 1, fp) == 1, "read last frame");
+    fclose(fp);
+    test_signal(8 * nframes - 1, frames);
+    check(last[0] == frames[0] && last[1] == frames[1], "newest audio saved");
+
+    pusacapture_print_stats();
+    unlink("/tmp/pusacapture_test.cap");
+    unlink("/tmp/pusacapture_test.wav");
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSACAPTURE_DECODE
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+	printf("Usage: %s capture-file wav-file\n", argv[0]);
+	return 1;
+    }
+
+    long long n = pusacapture_decode(argv[1], argv[2]);
+    if (n < 0)
+	return 1;
+
+    printf("%lld frames\n", n);
+    return 0;
+}
+#endif
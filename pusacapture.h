@@ -0,0 +1,45 @@
+/*
+ * Header file for the retrospective capture buffer.
+ */
+
+#ifndef __pusacapture_h__
+#define __pusacapture_h__
+
+#include <stddef.h>
+
+#define PUSACAPTURE_CHANNELS		2
+#define PUSACAPTURE_BLOCK		4096
+#define PUSACAPTURE_PARTITIONS		16
+#define PUSACAPTURE_MAX_ORDER		4
+#define PUSACAPTURE_RT_RING		16384
+#define PUSACAPTURE_DEFAULT_RING	(32 * 1024 * 1024)
+
+/*
+ * raw_bytes is what the captured frames take as 32 bit words.  Minutes
+ * held is an estimate from the compression achieved so far.
+ */
+struct pusacapture_stats_s
+{
+    unsigned long long frames;
+    unsigned long long raw_bytes;
+    unsigned long long compressed_bytes;
+    unsigned long blocks;
+    unsigned long dropped_blocks;
+    unsigned long rt_overflows;
+    unsigned long save_gaps;
+    unsigned long ring_bytes;
+    unsigned long ring_used;
+    double ratio;
+    double bytes_per_minute;
+    double minutes_held;
+    double worker_cpu;
+};
+
+int pusacapture_init(int sample_rate, size_t ring_bytes);
+void pusacapture_rt_frame(unsigned long long sample_index, const int *data);
+int pusacapture_save(const char *path);
+long long pusacapture_decode(const char *path, const char *wav_path);
+void pusacapture_get_stats(struct pusacapture_stats_s *stats);
+void pusacapture_print_stats(void);
+
+#endif /* __pusacapture_h__ */
@@ -0,0 +1,699 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ordered chain of audio handlers that can be changed while audio is
+ * running.  Pass pusachain_process() to pusa_init(), or call it from the
+ * audio handler.
+ *
+ * The audio thread only ever sees a complete chain.  Every change builds a
+ * new copy and publishes it with a single pointer store, so it takes
+ * effect between two frames.  The old copy and any handler taken out are
+ * given to pusamem_retire(), which frees them once the audio thread has
+ * started another callback and can no longer be using them.
+ *
+ * A replaced handler can keep running next to its replacement for a few
+ * frames while the output crossfades from one to the other.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include "pusa.h"
+#include "pusamem.h"
+#include "pusachain.h"
+
+/* Give up on a crossfade if the audio thread stops moving for this long. */
+#define PUSACHAIN_FADE_STALL_MS	20
+
+struct pusachain_node_s
+{
+    const struct pusachain_plugin_s *plugin;
+    void *ctx;
+    void *dl;
+
+    /* Handler being faded out, while fade_left is non-zero. */
+    struct pusachain_node_s *fade_from;
+    int fade_left;
+    int fade_len;
+
+    unsigned long long published;
+    int started;
+};
+
+struct pusachain_s
+{
+    int n;
+    struct pusachain_node_s *nodes[PUSACHAIN_MAX];
+};
+
+static struct pusachain_s *pusachain_current = NULL;
+static pthread_mutex_t pusachain_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pusachain_stats_s pusachain_stats;
+
+static struct pusachain_node_s *pusachain_node_new(const struct pusachain_plugin_s *plugin,
+						   const char *args, void *dl)
+{
+    if (plugin == NULL || plugin->process == NULL)
+    {
+	printf("pusachain: plugin has no process function\n");
+	return NULL;
+    }
+
+    struct pusachain_node_s *node = calloc(1, sizeof(*node));
+    if (node == NULL)
+	return NULL;
+
+    node->plugin = plugin;
+    node->dl = dl;
+    if (plugin->create != NULL)
+    {
+	node->ctx = plugin->create(args);
+	if (node->ctx == NULL)
+	{
+	    printf("pusachain: failed to create %s\n", plugin->name);
+	    free(node);
+	    return NULL;
+	}
+    }
+
+    return node;
+}
+
+static struct pusachain_node_s *pusachain_open(const char *path, const char *args)
+{
+    void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (dl == NULL)
+    {
+	printf("pusachain: %s\n", dlerror());
+	return NULL;
+    }
+
+    const struct pusachain_plugin_s *plugin = dlsym(dl, PUSACHAIN_SYMBOL);
+    if (plugin == NULL)
+    {
+	printf("pusachain: %s has no %s\n", path, PUSACHAIN_SYMBOL);
+	dlclose(dl);
+	return NULL;
+    }
+
+    struct pusachain_node_s *node = pusachain_node_new(plugin, args, dl);
+    if (node == NULL)
+	dlclose(dl);
+
+    return node;
+}
+
+/* Called by the reclaim thread once the audio thread is done with node. */
+static void pusachain_node_free(void *ptr)
+{
+    struct pusachain_node_s *node = ptr;
+
+    if (node->plugin->destroy != NULL)
+	node->plugin->destroy(node->ctx);
+    if (node->dl != NULL)
+	dlclose(node->dl);
+    free(node);
+
+    __atomic_add_fetch(&pusachain_stats.destroyed, 1, __ATOMIC_RELAXED);
+}
+
+static struct pusachain_s *pusachain_copy(void)
+{
+    struct pusachain_s *chain = malloc(sizeof(*chain));
+    if (chain == NULL)
+	return NULL;
+
+    if (pusachain_current != NULL)
+	*chain = *pusachain_current;
+    else
+	chain->n = 0;
+
+    return chain;
+}
+
+/*
+ * Make chain the one the audio thread uses and retire the previous one.
+ * Called with pusachain_lock held.
+ */
+static void pusachain_publish(struct pusachain_s *chain)
+{
+    struct pusachain_s *old = pusachain_current;
+    unsigned long long now = pusa_get_sample_index();
+
+    for (int i = 0; i < chain->n; i++)
+	if (!chain->nodes[i]->started)
+	    chain->nodes[i]->published = now;
+
+    __atomic_store_n(&pusachain_current, chain, __ATOMIC_RELEASE);
+
+    /* The store must be visible before pusamem_retire() reads the epoch. */
+    __sync_synchronize();
+    if (old != NULL)
+	pusamem_retire(old, free);
+
+    pusachain_stats.swaps++;
+}
+
+/*
+ * Wait for the audio thread to finish fading out the handler node
+ * replaced.  If it stops processing frames, cut the fade short.
+ */
+static void pusachain_wait_fade(struct pusachain_node_s *node)
+{
+    unsigned long long last = pusa_get_sample_index();
+    int stalled = 0;
+
+    while (__atomic_load_n(&node->fade_left, __ATOMIC_ACQUIRE) > 0)
+    {
+	usleep(1000);
+
+	unsigned long long now = pusa_get_sample_index();
+	if (now != last)
+	{
+	    last = now;
+	    stalled = 0;
+	}
+	else if (++stalled >= PUSACHAIN_FADE_STALL_MS)
+	{
+	    if (__atomic_exchange_n(&node->fade_left, 0, __ATOMIC_ACQ_REL) > 0)
+		pusachain_stats.fade_timeouts++;
+	    break;
+	}
+    }
+}
+
+static int pusachain_insert_node(int position, struct pusachain_node_s *node)
+{
+    if (node == NULL)
+	return -1;
+
+    pthread_mutex_lock(&pusachain_lock);
+
+    struct pusachain_s *chain = pusachain_copy();
+    if (chain == NULL || chain->n >= PUSACHAIN_MAX)
+    {
+	printf("pusachain: chain is full\n");
+	pthread_mutex_unlock(&pusachain_lock);
+	free(chain);
+	pusachain_node_free(node);
+	return -1;
+    }
+
+    if (position < 0 || position > chain->n)
+	position = chain->n;
+
+    memmove(chain->nodes + position + 1, chain->nodes + position,
+	    (chain->n - position) * sizeof(chain->nodes[0]));
+    chain->nodes[position] = node;
+    chain->n++;
+
+    pusachain_publish(chain);
+    pthread_mutex_unlock(&pusachain_lock);
+
+    return position;
+}
+
+static int pusachain_replace_node(int slot, struct pusachain_node_s *node, int fade)
+{
+    if (node == NULL)
+	return -1;
+
+    pthread_mutex_lock(&pusachain_lock);
+
+    struct pusachain_s *chain = pusachain_copy();
+    if (chain == NULL || slot < 0 || slot >= chain->n)
+    {
+	printf("pusachain: no handler %d\n", slot);
+	pthread_mutex_unlock(&pusachain_lock);
+	free(chain);
+	pusachain_node_free(node);
+	return -1;
+    }
+
+    struct pusachain_node_s *old = chain->nodes[slot];
+    if (fade > 0)
+    {
+	node->fade_from = old;
+	node->fade_len = fade;
+	node->fade_left = fade;
+	pusachain_stats.fades++;
+    }
+    chain->nodes[slot] = node;
+
+    pusachain_publish(chain);
+    if (fade > 0)
+	pusachain_wait_fade(node);
+
+    pusamem_retire(old, pusachain_node_free);
+    pthread_mutex_unlock(&pusachain_lock);
+
+    return 0;
+}
+
+/*
+ * Load a handler from a shared object and insert it before position, or
+ * at the end if position is -1.  args is passed to the plugin's create().
+ * Returns the position it ended up at.
+ */
+int pusachain_insert(int position, const char *path, const char *args)
+{
+    return pusachain_insert_node(position, pusachain_open(path, args));
+}
+
+int pusachain_insert_plugin(int position, const struct pusachain_plugin_s *plugin, const char *args)
+{
+    return pusachain_insert_node(position, pusachain_node_new(plugin, args, NULL));
+}
+
+/*
+ * Replace the handler at slot with one loaded from a shared object.  With
+ * fade non-zero, both run for that many frames while the output crossfades
+ * to the new one, and this waits until the fade is done.
+ */
+int pusachain_replace(int slot, const char *path, const char *args, int fade)
+{
+    return pusachain_replace_node(slot, pusachain_open(path, args), fade);
+}
+
+int pusachain_replace_plugin(int slot, const struct pusachain_plugin_s *plugin, const char *args,
+			     int fade)
+{
+    return pusachain_replace_node(slot, pusachain_node_new(plugin, args, NULL), fade);
+}
+
+int pusachain_remove(int slot)
+{
+    pthread_mutex_lock(&pusachain_lock);
+
+    struct pusachain_s *chain = pusachain_copy();
+    if (chain == NULL || slot < 0 || slot >= chain->n)
+    {
+	pthread_mutex_unlock(&pusachain_lock);
+	free(chain);
+	return -1;
+    }
+
+    struct pusachain_node_s *old = chain->nodes[slot];
+    chain->n--;
+    memmove(chain->nodes + slot, chain->nodes + slot + 1,
+	    (chain->n - slot) * sizeof(chain->nodes[0]));
+
+    pusachain_publish(chain);
+    pusamem_retire(old, pusachain_node_free);
+    pthread_mutex_unlock(&pusachain_lock);
+
+    return 0;
+}
+
+int pusachain_length(void)
+{
+    pthread_mutex_lock(&pusachain_lock);
+    int n = pusachain_current != NULL ? pusachain_current->n : 0;
+    pthread_mutex_unlock(&pusachain_lock);
+
+    return n;
+}
+
+/*
+ * Run each handler in turn on one frame.  Audio thread only.
+ */
+void pusachain_process(int *data, int nchannels)
+{
+    struct pusachain_s *chain = __atomic_load_n(&pusachain_current, __ATOMIC_ACQUIRE);
+
+    if (chain == NULL)
+	return;
+
+    for (int i = 0; i < chain->n; i++)
+    {
+	struct pusachain_node_s *node = chain->nodes[i];
+
+	if (!node->started)
+	{
+	    unsigned long latency = pusa_get_sample_index() - node->published;
+
+	    pusachain_stats.last_latency = latency;
+	    if (latency > pusachain_stats.max_latency)
+		pusachain_stats.max_latency = latency;
+	    node->started = 1;
+	}
+
+	int left = __atomic_load_n(&node->fade_left, __ATOMIC_ACQUIRE);
+	if (left == 0 || nchannels > PUSACHAIN_MAX_CHANNELS)
+	{
+	    node->plugin->process(node->ctx, data, nchannels);
+	    continue;
+	}
+
+	int old[PUSACHAIN_MAX_CHANNELS];
+	struct pusachain_node_s *from = node->fade_from;
+
+	memcpy(old, data, nchannels * sizeof(int));
+	from->plugin->process(from->ctx, old, nchannels);
+	node->plugin->process(node->ctx, data, nchannels);
+
+	for (int c = 0; c < nchannels; c++)
+	    data[c] = ((long long) old[c] * left +
+		       (long long) data[c] * (node->fade_len - left)) / node->fade_len;
+
+	/* Fails if the fade was cut short, which must stay that way. */
+	__atomic_compare_exchange_n(&node->fade_left, &left, left - 1, 0,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+void pusachain_get_stats(struct pusachain_stats_s *stats)
+{
+    *stats = pusachain_stats;
+}
+
+void pusachain_print_stats(void)
+{
+    struct pusachain_stats_s *st = &pusachain_stats;
+
+    printf("chain: %d handlers, %lu swaps, %lu fades (%lu cut short), %lu destroyed, "
+	   "latency %lu frames (max %lu)\n",
+	   pusachain_length(), st->swaps, st->fades, st->fade_timeouts, st->destroyed,
+	   st->last_latency, st->max_latency);
+}
+
+#ifdef PUSACHAIN_BENCH
+#include <time.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+
+#define BENCH_BLOCK		64
+#define BENCH_BLOCKS		20000
+#define BENCH_WARMUP		100
+#define BENCH_EVICT_MB		64
+#define BENCH_SIGNAL		48000
+#define BENCH_COUNTERS		3
+
+/*
+ * Run the chain built from the plugins on the command line over blocks of
+ * a synthetic signal, timing every block.  Warm runs block after block;
+ * cold runs first walk a buffer bigger than the caches so the handlers'
+ * code, state and the block all come from memory.  Hardware counters come
+ * from perf_event_open() and count user space only, while a block is
+ * processed.  Results are printed as JSON.
+ */
+static const char *bench_counter_names[BENCH_COUNTERS] =
+{
+    "instructions", "cycles", "cache_misses"
+};
+static const unsigned long long bench_counter_configs[BENCH_COUNTERS] =
+{
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+};
+static int bench_perf_fd[BENCH_COUNTERS] = { -1, -1, -1 };
+
+static int bench_channels = 2;
+static int bench_block = BENCH_BLOCK;
+static int bench_blocks = BENCH_BLOCKS;
+static size_t bench_evict_size = (size_t) BENCH_EVICT_MB << 20;
+static int *bench_signal;
+static int *bench_data;
+static volatile unsigned char *bench_evict;
+
+struct bench_result_s
+{
+    double ns_per_frame;
+    double p50_ns;
+    double p99_ns;
+    double max_ns;
+    int have_counters;
+    unsigned long long counters[BENCH_COUNTERS];
+};
+
+/*
+ * One group, so all counters cover exactly the same instructions.  Fails
+ * quietly where the kernel or the CPU doesn't allow it.
+ */
+static int bench_perf_open(void)
+{
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+    {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = bench_counter_configs[i];
+	attr.disabled = (i == 0);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	bench_perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : bench_perf_fd[0], 0);
+	if (bench_perf_fd[i] < 0)
+	{
+	    for (int j = 0; j < i; j++)
+		close(bench_perf_fd[j]);
+	    bench_perf_fd[0] = -1;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static void bench_perf_read(unsigned long long *values)
+{
+    unsigned long long buf[1 + BENCH_COUNTERS];
+
+    if (read(bench_perf_fd[0], buf, sizeof(buf)) != sizeof(buf))
+	memset(buf, 0, sizeof(buf));
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+	values[i] = buf[1 + i];
+}
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* A sweep with a little noise, so handlers don't see constant input. */
+static void bench_make_signal(void)
+{
+    unsigned int seed = 1;
+    double phase = 0;
+
+    for (int i = 0; i < BENCH_SIGNAL; i++)
+    {
+	double freq = 20.0 * pow(1000.0, (double) i / BENCH_SIGNAL);
+	phase += 2 * M_PI * freq / 48000;
+	seed = seed * 1103515245 + 12345;
+	int noise = (int) (seed >> 16) - 32768;
+	int value = (int) (sin(phase) * (1 << 22)) + noise;
+	for (int c = 0; c < bench_channels; c++)
+	    bench_signal[i * bench_channels + c] = c & 1 ? -value : value;
+    }
+}
+
+static void bench_evict_caches(void)
+{
+    for (size_t i = 0; i < bench_evict_size; i += 64)
+	bench_evict[i]++;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(int cold, struct bench_result_s *r)
+{
+    double *times = malloc(bench_blocks * sizeof(double));
+    unsigned long long before[BENCH_COUNTERS], after[BENCH_COUNTERS];
+    double total = 0;
+    int pos = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->have_counters = bench_perf_fd[0] >= 0;
+
+    for (int b = -BENCH_WARMUP; b < bench_blocks; b++)
+    {
+	if (pos + bench_block > BENCH_SIGNAL)
+	    pos = 0;
+	memcpy(bench_data, bench_signal + pos * bench_channels,
+	       bench_block * bench_channels * sizeof(int));
+	pos += bench_block;
+
+	if (cold)
+	    bench_evict_caches();
+
+	if (r->have_counters && b >= 0)
+	{
+	    bench_perf_read(before);
+	    ioctl(bench_perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	double start = bench_now_ns();
+	for (int f = 0; f < bench_block; f++)
+	    pusachain_process(bench_data + f * bench_channels, bench_channels);
+	double ns = bench_now_ns() - start;
+
+	if (r->have_counters && b >= 0)
+	{
+	    ioctl(bench_perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	    bench_perf_read(after);
+	    for (int i = 0; i < BENCH_COUNTERS; i++)
+		r->counters[i] += after[i] - before[i];
+	}
+
+	if (b >= 0)
+	{
+	    times[b] = ns;
+	    total += ns;
+	}
+    }
+
+    qsort(times, bench_blocks, sizeof(double), bench_compare);
+    r->ns_per_frame = total / ((double) bench_blocks * bench_block);
+    r->p50_ns = times[bench_blocks / 2];
+    r->p99_ns = times[(int) (bench_blocks * 0.99)];
+    r->max_ns = times[bench_blocks - 1];
+
+    free(times);
+}
+
+static void bench_print_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+	if (*s == '"' || *s == '\\')
+	    putchar('\\');
+	putchar(*s);
+    }
+    putchar('"');
+}
+
+static void bench_print_result(const char *mode, const struct bench_result_s *r, int last)
+{
+    double frames = (double) bench_blocks * bench_block;
+
+    printf("    { \"mode\": \"%s\", \"ns_per_frame\": %.2f, \"block_ns_p50\": %.0f, "
+	   "\"block_ns_p99\": %.0f, \"block_ns_max\": %.0f",
+	   mode, r->ns_per_frame, r->p50_ns, r->p99_ns, r->max_ns);
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+    {
+	if (r->have_counters)
+	    printf(", \"%s_per_frame\": %.2f", bench_counter_names[i], r->counters[i] / frames);
+	else
+	    printf(", \"%s_per_frame\": null", bench_counter_names[i]);
+    }
+    if (r->have_counters && r->counters[1] > 0)
+	printf(", \"ipc\": %.3f", (double) r->counters[0] / r->counters[1]);
+    else
+	printf(", \"ipc\": null");
+    printf(" }%s\n", last ? "" : ",");
+}
+
+static void bench_usage(const char *name)
+{
+    printf("Usage: %s [-c channels] [-b block] [-n blocks] [-e evict_mb] [plugin.so[:args]]...\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_result_s warm, cold;
+    struct utsname un;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:b:n:e:")) != -1)
+    {
+	if (opt == 'c')
+	    bench_channels = atoi(optarg);
+	else if (opt == 'b')
+	    bench_block = atoi(optarg);
+	else if (opt == 'n')
+	    bench_blocks = atoi(optarg);
+	else if (opt == 'e')
+	    bench_evict_size = (size_t) atoi(optarg) << 20;
+	else
+	    bench_usage(argv[0]);
+    }
+
+    if (bench_channels < 1 || bench_channels > PUSACHAIN_MAX_CHANNELS ||
+	bench_block < 1 || bench_block > BENCH_SIGNAL || bench_blocks < 1 || bench_evict_size == 0)
+	bench_usage(argv[0]);
+
+    /* Handlers are loaded in command line order, so any chain can be timed. */
+    for (int i = optind; i < argc; i++)
+    {
+	char *args = strchr(argv[i], ':');
+	if (args != NULL)
+	    *args++ = '\0';
+	if (pusachain_insert(-1, argv[i], args) < 0)
+	    return 1;
+	if (args != NULL)
+	    args[-1] = ':';
+    }
+
+    bench_signal = malloc(BENCH_SIGNAL * bench_channels * sizeof(int));
+    bench_data = malloc(bench_block * bench_channels * sizeof(int));
+    bench_evict = malloc(bench_evict_size);
+    if (bench_signal == NULL || bench_data == NULL || bench_evict == NULL)
+    {
+	printf("Out of memory\n");
+	return 1;
+    }
+    memset((void *) bench_evict, 0, bench_evict_size);
+    bench_make_signal();
+    bench_perf_open();
+
+    bench_run(0, &warm);
+    bench_run(1, &cold);
+
+    uname(&un);
+    printf("{\n  \"machine\": ");
+    bench_print_string(un.machine);
+    printf(",\n  \"handlers\": [");
+    for (int i = optind; i < argc; i++)
+    {
+	bench_print_string(argv[i]);
+	if (i < argc - 1)
+	    printf(", ");
+    }
+    printf("],\n  \"channels\": %d,\n  \"block\": %d,\n  \"blocks\": %d,\n  \"evict_mb\": %zu,\n",
+	   bench_channels, bench_block, bench_blocks, bench_evict_size >> 20);
+    printf("  \"counters\": %s,\n  \"runs\": [\n", bench_perf_fd[0] >= 0 ? "true" : "false");
+    bench_print_result("warm", &warm, 0);
+    bench_print_result("cold", &cold, 1);
+    printf("  ]\n}\n");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Header file for the hot-swappable handler chain.
+ */
+
+#ifndef __pusachain_h__
+#define __pusachain_h__
+
+#define PUSACHAIN_MAX		16
+#define PUSACHAIN_MAX_CHANNELS	16
+
+/* Name of the struct pusachain_plugin_s a plugin shared object exports. */
+#define PUSACHAIN_SYMBOL	"pusa_plugin"
+
+/*
+ * create() and destroy() run outside the audio thread and may be NULL.
+ * process() runs in the audio thread once per frame.
+ */
+struct pusachain_plugin_s
+{
+    const char *name;
+    void *(*create)(const char *args);
+    void (*process)(void *ctx, int *data, int nchannels);
+    void (*destroy)(void *ctx);
+};
+
+/*
+ * Latencies are in frames, from publishing a new chain to the first frame
+ * a new handler processed.
+ */
+struct pusachain_stats_s
+{
+    unsigned long swaps;
+    unsigned long fades;
+    unsigned long fade_timeouts;
+    unsigned long destroyed;
+    unsigned long last_latency;
+    unsigned long max_latency;
+};
+
+int pusachain_insert(int position, const char *path, const char *args);
+int pusachain_insert_plugin(int position, const struct pusachain_plugin_s *plugin, const char *args);
+int pusachain_replace(int slot, const char *path, const char *args, int fade);
+int pusachain_replace_plugin(int slot, const struct pusachain_plugin_s *plugin, const char *args,
+			     int fade);
+int pusachain_remove(int slot);
+int pusachain_length(void);
+void pusachain_process(int *data, int nchannels);
+void pusachain_get_stats(struct pusachain_stats_s *stats);
+void pusachain_print_stats(void);
+
+#endif /* __pusachain_h__ */
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Model of the codec's sample clock against CLOCK_MONOTONIC, so MIDI,
+ * GPIO and network events can be placed on the audio timeline and the
+ * codec crystal's error can be seen.
+ *
+ * The audio thread timestamps every PUSACLOCK_PERIOD'th frame and feeds
+ * a second order delay locked loop, as described by Fons Adriaensen in
+ * "Using a DLL to filter time".  The loop runs wide while locking and is
+ * then narrowed so wake up jitter hardly moves it.  Drift is the slope
+ * of a straight line fitted to every timestamp since the loop locked,
+ * which a late wake up moves much less.
+ *
+ * Each update is published to one of PUSACLOCK_SNAPS slots.  Readers copy
+ * the newest and check it wasn't rewritten meanwhile, which only happens
+ * if a reader is held up for PUSACLOCK_SNAPS periods, so they never wait
+ * for the audio thread.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "pusaclock.h"
+
+#define PUSACLOCK_SNAPS		8
+#define PUSACLOCK_READ_TRIES	4
+
+/* Weight of each period in the jitter average. */
+#define PUSACLOCK_JITTER_WEIGHT	(1.0 / 64)
+
+struct pusaclock_snap_s
+{
+    volatile unsigned long seq;
+    unsigned long long n0;
+    double t0;
+    double ns_per_frame;
+};
+
+static struct pusaclock_snap_s pusaclock_snaps[PUSACLOCK_SNAPS];
+static volatile unsigned long pusaclock_seq = 0;
+
+/*
+ * Loop state, audio thread only.  t0 is the filtered time of frame n0,
+ * t1 the predicted time of frame n1 and e2 the period in ns.
+ */
+static int pusaclock_rate = 0;
+static int pusaclock_running = 0;
+static unsigned long long pusaclock_n0, pusaclock_n1;
+static double pusaclock_t0, pusaclock_t1, pusaclock_e2;
+static double pusaclock_b, pusaclock_c;
+static unsigned long pusaclock_count;
+static unsigned long long pusaclock_base_n;
+static double pusaclock_base_t;
+static double pusaclock_sx, pusaclock_sy, pusaclock_sxx, pusaclock_sxy;
+static unsigned long pusaclock_nfit;
+static double pusaclock_err2;
+static unsigned long pusaclock_publishes = 0;
+static struct pusaclock_stats_s pusaclock_stats;
+
+#ifdef PUSACLOCK_UNIT_TEST
+static double pusaclock_test_now = 0;
+#endif
+
+unsigned long long pusaclock_now(void)
+{
+#ifdef PUSACLOCK_UNIT_TEST
+    return pusaclock_test_now;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void pusaclock_bandwidth(double hz)
+{
+    double w = 2 * M_PI * hz * PUSACLOCK_PERIOD / pusaclock_rate;
+
+    pusaclock_b = sqrt(2) * w;
+    pusaclock_c = w * w;
+}
+
+static void pusaclock_publish(void)
+{
+    unsigned long seq = pusaclock_publishes + 1;
+    struct pusaclock_snap_s *s = pusaclock_snaps + seq % PUSACLOCK_SNAPS;
+
+    s->seq = 0;
+    __sync_synchronize();
+    s->n0 = pusaclock_n0;
+    s->t0 = pusaclock_t0;
+    s->ns_per_frame = pusaclock_e2 / PUSACLOCK_PERIOD;
+    __sync_synchronize();
+    s->seq = seq;
+    pusaclock_seq = seq;
+    pusaclock_publishes = seq;
+}
+
+static int pusaclock_read(struct pusaclock_snap_s *snap)
+{
+    for (int i = 0; i < PUSACLOCK_READ_TRIES; i++)
+    {
+	unsigned long seq = pusaclock_seq;
+	if (seq == 0)
+	    return -1;
+
+	struct pusaclock_snap_s *s = pusaclock_snaps + seq % PUSACLOCK_SNAPS;
+	__sync_synchronize();
+	if (s->seq != seq)
+	    continue;
+	snap->n0 = s->n0;
+	snap->t0 = s->t0;
+	snap->ns_per_frame = s->ns_per_frame;
+	__sync_synchronize();
+	if (s->seq == seq)
+	    return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Start over from frame n seen at time now, keeping the period measured
+ * so far if there is one.
+ */
+static void pusaclock_start(unsigned long long n, double now)
+{
+    if (pusaclock_running)
+	pusaclock_stats.resets++;
+
+    if (!pusaclock_stats.locked)
+	pusaclock_e2 = 1e9 * PUSACLOCK_PERIOD / pusaclock_rate;
+    pusaclock_n0 = n;
+    pusaclock_t0 = now;
+    pusaclock_n1 = n + PUSACLOCK_PERIOD;
+    pusaclock_t1 = now + pusaclock_e2;
+    pusaclock_count = 0;
+    pusaclock_err2 = 0;
+    pusaclock_bandwidth(PUSACLOCK_FAST_HZ);
+    pusaclock_running = 1;
+    pusaclock_stats.locked = 0;
+}
+
+/*
+ * Called by the audio thread when it starts, and so after any gap in the
+ * frames.
+ */
+void pusaclock_rt_reset(int sample_rate)
+{
+    pusaclock_seq = 0;
+    pusaclock_running = 0;
+    pusaclock_rate = sample_rate;
+    pusaclock_stats.nominal_rate = sample_rate;
+    pusaclock_stats.locked = 0;
+}
+
+/*
+ * Called by the audio thread as it starts on each frame.
+ */
+void pusaclock_rt_frame(unsigned long long sample_index)
+{
+    if (pusaclock_rate == 0 || (pusaclock_running && sample_index < pusaclock_n1))
+	return;
+
+    double now = pusaclock_now();
+
+    /* Frames were lost, or the audio thread was held up for a period. */
+    double e = now - pusaclock_t1;
+    if (!pusaclock_running || sample_index != pusaclock_n1 || fabs(e) > pusaclock_e2)
+    {
+	pusaclock_start(sample_index, now);
+	return;
+    }
+
+    pusaclock_n0 = pusaclock_n1;
+    pusaclock_t0 = pusaclock_t1;
+    pusaclock_n1 += PUSACLOCK_PERIOD;
+    pusaclock_t1 += pusaclock_b * e + pusaclock_e2;
+    pusaclock_e2 += pusaclock_c * e;
+    pusaclock_err2 += (e * e - pusaclock_err2) * PUSACLOCK_JITTER_WEIGHT;
+    pusaclock_publish();
+
+    /* Narrow the loop and measure drift from here. */
+    if (++pusaclock_count == (unsigned long) PUSACLOCK_FAST_SECONDS * pusaclock_rate / PUSACLOCK_PERIOD)
+    {
+	pusaclock_bandwidth(PUSACLOCK_SLOW_HZ);
+	pusaclock_base_n = sample_index;
+	pusaclock_base_t = now;
+	pusaclock_sx = pusaclock_sy = pusaclock_sxx = pusaclock_sxy = 0;
+	pusaclock_nfit = 0;
+	pusaclock_stats.locked = 1;
+    }
+
+    struct pusaclock_stats_s *st = &pusaclock_stats;
+    double seconds = 0;
+    if (st->locked)
+    {
+	double x = sample_index - pusaclock_base_n;
+	double y = now - pusaclock_base_t;
+
+	pusaclock_sx += x;
+	pusaclock_sy += y;
+	pusaclock_sxx += x * x;
+	pusaclock_sxy += x * y;
+	pusaclock_nfit++;
+	seconds = y / 1e9;
+    }
+
+    double d = pusaclock_nfit * pusaclock_sxx - pusaclock_sx * pusaclock_sx;
+    if (st->locked && pusaclock_nfit > 2 && d > 0)
+	st->rate_hz = 1e9 * d / (pusaclock_nfit * pusaclock_sxy - pusaclock_sx * pusaclock_sy);
+    else
+	st->rate_hz = 1e9 * PUSACLOCK_PERIOD / pusaclock_e2;
+    st->drift_ppm = (st->rate_hz / pusaclock_rate - 1) * 1e6;
+    st->jitter_us = sqrt(pusaclock_err2) / 1000;
+    st->seconds = st->locked ? seconds : 0;
+    st->periods++;
+}
+
+/*
+ * Where the codec was or will be at time ns, in frames.  Fails until the
+ * audio thread has been running for a period or two.
+ */
+int pusaclock_time_to_sample(unsigned long long ns, double *sample)
+{
+    struct pusaclock_snap_s s;
+
+    if (pusaclock_read(&s) < 0)
+	return -1;
+
+    *sample = s.n0 + ((double) ns - s.t0) / s.ns_per_frame;
+
+    return 0;
+}
+
+int pusaclock_sample_to_time(double sample, unsigned long long *ns)
+{
+    struct pusaclock_snap_s s;
+
+    if (pusaclock_read(&s) < 0)
+	return -1;
+
+    *ns = s.t0 + (sample - s.n0) * s.ns_per_frame;
+
+    return 0;
+}
+
+void pusaclock_get_stats(struct pusaclock_stats_s *stats)
+{
+    *stats = pusaclock_stats;
+}
+
+void pusaclock_print_stats(void)
+{
+    struct pusaclock_stats_s *st = &pusaclock_stats;
+
+    printf("clock: %s, %.3f Hz (%+.1f ppm over %.1f s), jitter %.1f us, %lu periods, %lu resets\n",
+	   st->locked ? "locked" : "locking", st->rate_hz, st->drift_ppm, st->seconds,
+	   st->jitter_us, st->periods, st->resets);
+}
+
+#ifdef PUSACLOCK_UNIT_TEST
+#include <pthread.h>
+#include "pusatest.h"
+
+#define TEST_RATE	48000
+#define TEST_PPM	100.0
+#define TEST_SECONDS	60
+
+static volatile int test_reading = 0;
+static volatile unsigned long test_read_failures = 0;
+static volatile unsigned long test_reads = 0;
+static double test_read_at;
+
+/*
+ * A frame arrives every 1 / rate seconds, rate being off by TEST_PPM,
+ * and the audio thread gets to it up to 300 us later, now and then 2 ms
+ * later, and in order.  Returns the mean delay.
+ */
+static double test_run(unsigned long long first, unsigned long long nframes, double start)
+{
+    double rate = TEST_RATE * (1 + TEST_PPM / 1e6);
+    double last = 0, delay_sum = 0;
+
+    for (unsigned long long i = 0; i < nframes; i++)
+    {
+	double arrival = start + i * 1e9 / rate;
+	double delay = (rand() % 300000) + (rand() % 1000 == 0 ? 2000000 : 0);
+	double t = arrival + delay;
+
+	if (t < last)
+	    t = last;
+	last = t;
+	delay_sum += t - arrival;
+
+	pusaclock_test_now = t;
+	pusaclock_rt_frame(first + i);
+    }
+
+    return delay_sum / nframes;
+}
+
+/* Reads an old position over and over while the loop updates. */
+static void *test_reader(void *arg)
+{
+    while (test_reading)
+    {
+	double sample;
+
+	if (pusaclock_time_to_sample(test_read_at, &sample) < 0 ||
+	    fabs(sample - TEST_RATE * (1 + TEST_PPM / 1e6)) > 100)
+	    test_read_failures++;
+	test_reads++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusaclock_stats_s st;
+    double sample;
+    unsigned long long ns;
+    char msg[100];
+
+    srand(1);
+    pusaclock_rt_reset(TEST_RATE);
+    check(pusaclock_time_to_sample(0, &sample) < 0, "no conversion before running");
+
+    double delay = test_run(0, 3 * TEST_RATE, 1e9);
+    test_read_at = 2e9;
+    test_reading = 1;
+    pthread_t tid;
+    pthread_create(&tid, NULL, test_reader, NULL);
+
+    unsigned long long frames = (unsigned long long) TEST_SECONDS * TEST_RATE;
+    delay = test_run(3 * TEST_RATE, frames, 1e9 + 3 * TEST_RATE * 1e9 / (TEST_RATE * (1 + TEST_PPM / 1e6)));
+    test_reading = 0;
+    pthread_join(tid, NULL);
+
+    pusaclock_print_stats();
+    pusaclock_get_stats(&st);
+    printf("%lu reads from another thread, %lu failed\n", test_reads, test_read_failures);
+    sprintf(msg, "drift %.2f ppm", st.drift_ppm);
+    check(st.locked && fabs(st.drift_ppm - TEST_PPM) < 1, msg);
+    check(st.resets == 0, "no resets");
+    check(test_read_failures == 0, "reads while updating");
+
+    /*
+     * Timestamps are taken when the audio thread gets to a frame, so the
+     * model runs behind arrival by the mean delay.
+     */
+    unsigned long long last = 3 * TEST_RATE + frames - 1;
+    double arrival = 1e9 + last * 1e9 / (TEST_RATE * (1 + TEST_PPM / 1e6));
+    check(pusaclock_time_to_sample(arrival + delay, &sample) == 0, "time to sample");
+    sprintf(msg, "time to sample off by %.2f frames", sample - last);
+    check(fabs(sample - last) < 1, msg);
+    check(pusaclock_sample_to_time(sample, &ns) == 0, "sample to time");
+    check(fabs((double) ns - (arrival + delay)) < 1000, "sample to time inverts time to sample");
+
+    /* Lost frames start the loop over, keeping the rate. */
+    double e2 = pusaclock_e2;
+    test_run(last + 1000, PUSACLOCK_PERIOD, arrival + 1001 * 1e9 / TEST_RATE);
+    pusaclock_get_stats(&st);
+    check(st.resets == 1 && !st.locked, "reset after lost frames");
+    check(pusaclock_e2 == e2, "rate kept over reset");
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Header file for the sample clock model.
+ */
+
+#ifndef __pusaclock_h__
+#define __pusaclock_h__
+
+/* Frames between timestamps taken by the audio thread. */
+#define PUSACLOCK_PERIOD	256
+
+/* Loop bandwidth while locking and once locked. */
+#define PUSACLOCK_FAST_HZ	2.0
+#define PUSACLOCK_SLOW_HZ	0.1
+#define PUSACLOCK_FAST_SECONDS	2
+
+/*
+ * Times are CLOCK_MONOTONIC in ns, so any thread can use clock_gettime()
+ * or pusaclock_now().  rate_hz is the sample rate measured against that
+ * clock and drift_ppm how much faster the codec runs than it should,
+ * fitted to every timestamp since the loop locked.  jitter_us is the RMS
+ * of the timestamps about the loop's prediction.  Resets count the times
+ * the loop started over, after a stop or lost frames.
+ */
+struct pusaclock_stats_s
+{
+    int locked;
+    int nominal_rate;
+    double rate_hz;
+    double drift_ppm;
+    double jitter_us;
+    double seconds;
+    unsigned long periods;
+    unsigned long resets;
+};
+
+void pusaclock_rt_reset(int sample_rate);
+void pusaclock_rt_frame(unsigned long long sample_index);
+unsigned long long pusaclock_now(void);
+int pusaclock_time_to_sample(unsigned long long ns, double *sample);
+int pusaclock_sample_to_time(double sample, unsigned long long *ns);
+void pusaclock_get_stats(struct pusaclock_stats_s *stats);
+void pusaclock_print_stats(void);
+
+#endif /* __pusaclock_h__ */
@@ -0,0 +1,668 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks how well the real-time core is isolated from the rest of the
+ * system, and moves interrupts off it.  Everything is read relative to a
+ * root directory so the checks can run against a fake /proc and /sys.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "pusacpu.h"
+
+#define PUSACPU_PATH_MAX	512
+
+static int pusacpu_read(const char *root, const char *path, char *buf, int size)
+{
+    char fullpath[PUSACPU_PATH_MAX];
+    snprintf(fullpath, sizeof(fullpath), "%s%s", root, path);
+
+    FILE *fp = fopen(fullpath, "r");
+    if (fp == NULL)
+	return -1;
+
+    int n = fread(buf, 1, size - 1, fp);
+    fclose(fp);
+
+    buf[n] = '\0';
+    while (n > 0 && isspace((unsigned char) buf[n - 1]))
+	buf[--n] = '\0';
+
+    return n;
+}
+
+static int pusacpu_write(const char *root, const char *path, const char *value)
+{
+    char fullpath[PUSACPU_PATH_MAX];
+    snprintf(fullpath, sizeof(fullpath), "%s%s", root, path);
+
+    FILE *fp = fopen(fullpath, "w");
+    if (fp == NULL)
+	return -1;
+
+    int rv = fprintf(fp, "%s\n", value);
+    if (fclose(fp) != 0 || rv < 0)
+	return -1;
+
+    return 0;
+}
+
+/* How affinities are set.  The unit test replaces it to act as the kernel. */
+static int (*pusacpu_write_affinity)(const char *root, const char *path, const char *value) =
+    pusacpu_write;
+
+/*
+ * Parse a kernel CPU list such as "0-2,5".  Flag words, as in
+ * "isolcpus=domain,managed_irq,3", are skipped.
+ */
+int pusacpu_parse_list(const char *list, unsigned long *mask)
+{
+    *mask = 0;
+
+    while (*list != '\0' && !isspace((unsigned char) *list))
+    {
+	if (isdigit((unsigned char) *list))
+	{
+	    char *end;
+	    long first = strtol(list, &end, 10);
+	    long last = first;
+
+	    if (*end == '-')
+		last = strtol(end + 1, &end, 10);
+	    if (first < 0 || last < first || last >= (long) sizeof(*mask) * 8)
+		return -1;
+
+	    for (long cpu = first; cpu <= last; cpu++)
+		*mask |= 1UL << cpu;
+
+	    list = end;
+	}
+	else
+	{
+	    while (*list != '\0' && *list != ',' && !isspace((unsigned char) *list))
+		list++;
+	}
+
+	if (*list == ',')
+	    list++;
+    }
+
+    return 0;
+}
+
+int pusacpu_format_list(unsigned long mask, char *buf, int size)
+{
+    int n = 0;
+    buf[0] = '\0';
+
+    for (int cpu = 0; cpu < (int) sizeof(mask) * 8 && n < size; cpu++)
+    {
+	if (!(mask & (1UL << cpu)))
+	    continue;
+
+	int last = cpu;
+	while (last + 1 < (int) sizeof(mask) * 8 && (mask & (1UL << (last + 1))))
+	    last++;
+
+	if (last == cpu)
+	    n += snprintf(buf + n, size - n, "%s%d", n ? "," : "", cpu);
+	else
+	    n += snprintf(buf + n, size - n, "%s%d-%d", n ? "," : "", cpu, last);
+
+	cpu = last;
+    }
+
+    return n < size ? 0 : -1;
+}
+
+/*
+ * Add a name to a comma separated list, dropping it if it doesn't fit.
+ */
+static void pusacpu_append(char *list, int size, const char *name)
+{
+    int n = strlen(list);
+    if (n + (int) strlen(name) + 2 < size)
+	snprintf(list + n, size - n, "%s%s", n ? "," : "", name);
+}
+
+static struct pusacpu_check_s *pusacpu_check(struct pusacpu_audit_s *audit, const char *name,
+					     int result, unsigned long jitter_us)
+{
+    struct pusacpu_check_s *check = audit->checks + audit->nchecks++;
+
+    check->name = name;
+    check->result = result;
+    check->jitter_us = result == PUSACPU_PASS ? 0 : jitter_us;
+    check->detail[0] = '\0';
+
+    if (result == PUSACPU_FAIL)
+	audit->failures++;
+    else if (result == PUSACPU_WARN)
+	audit->warnings++;
+    audit->jitter_us += check->jitter_us;
+
+    return check;
+}
+
+/*
+ * Is the real-time CPU in the list given for a kernel parameter?
+ */
+static void pusacpu_check_cmdline(struct pusacpu_audit_s *audit, const char *cmdline,
+				  const char *param, unsigned long jitter_us)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "%s=", param);
+
+    unsigned long mask = 0;
+    const char *p = cmdline;
+    while ((p = strstr(p, key)) != NULL)
+    {
+	if (p == cmdline || isspace((unsigned char) p[-1]))
+	{
+	    pusacpu_parse_list(p + strlen(key), &mask);
+	    break;
+	}
+	p++;
+    }
+
+    int ok = (mask & (1UL << audit->rt_cpu)) != 0;
+    struct pusacpu_check_s *check = pusacpu_check(audit, param, ok ? PUSACPU_PASS : PUSACPU_WARN,
+						  jitter_us);
+    if (!ok)
+	snprintf(check->detail, sizeof(check->detail), "add %s%d to kernel command line",
+		 key, audit->rt_cpu);
+}
+
+static void pusacpu_mark_percpu(struct pusacpu_audit_s *audit, int irq)
+{
+    if (irq >= 0 && irq < PUSACPU_IRQ_MAX)
+	audit->irq_percpu[irq / 8] |= 1 << (irq % 8);
+}
+
+static int pusacpu_is_percpu(const struct pusacpu_audit_s *audit, int irq)
+{
+    return irq >= 0 && irq < PUSACPU_IRQ_MAX && (audit->irq_percpu[irq / 8] & (1 << (irq % 8)));
+}
+
+/*
+ * Mark the numbered interrupts /proc/interrupts shows to be per-CPU.
+ * After the counts come the chip and its interrupt number.  GIC numbers
+ * below 32 are SGIs and PPIs, banked per CPU, and on the Pi 3 the local
+ * timers and PMU come from the per-core bcm2836 controller.
+ */
+static void pusacpu_find_percpu(struct pusacpu_audit_s *audit, const char *root)
+{
+    char fullpath[PUSACPU_PATH_MAX];
+    char line[1024];
+
+    snprintf(fullpath, sizeof(fullpath), "%s/proc/interrupts", root);
+    FILE *fp = fopen(fullpath, "r");
+    if (fp == NULL)
+	return;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+	char *p = line;
+	while (isspace((unsigned char) *p))
+	    p++;
+	if (!isdigit((unsigned char) *p) || strchr(p, ':') == NULL)
+	    continue;
+
+	int irq = atoi(p);
+	char *tok = strtok(strchr(p, ':') + 1, " \t\n");
+	while (tok != NULL && isdigit((unsigned char) tok[0]))
+	    tok = strtok(NULL, " \t\n");
+	if (tok == NULL)
+	    continue;
+
+	char *hwirq = strtok(NULL, " \t\n");
+	if ((strncmp(tok, "GIC", 3) == 0 && hwirq != NULL && isdigit((unsigned char) hwirq[0]) &&
+	     atoi(hwirq) < 32) ||
+	    strcmp(tok, "bcm2836-timer") == 0 || strcmp(tok, "bcm2836-pmu") == 0)
+	    pusacpu_mark_percpu(audit, irq);
+    }
+
+    fclose(fp);
+}
+
+/*
+ * Move every interrupt that may run on the real-time CPU to the
+ * housekeeping CPUs.  Per-CPU interrupts such as arch_timer still have an
+ * smp_affinity_list; those found by pusacpu_find_percpu() are left to
+ * pusacpu_check_percpu(), as are any others the kernel refuses to move
+ * with EIO.  When not moving nothing is written, so an interrupt that
+ * can't be recognised as per-CPU counts as stuck.
+ */
+static void pusacpu_check_irqs(struct pusacpu_audit_s *audit, const char *root,
+			       unsigned long housekeeping, int move_irqs)
+{
+    char path[PUSACPU_PATH_MAX];
+    char buf[256];
+    char hk[128];
+    char stuck[64] = "";
+    unsigned long rt_mask = 1UL << audit->rt_cpu;
+
+    pusacpu_format_list(housekeeping, hk, sizeof(hk));
+    pusacpu_find_percpu(audit, root);
+
+    snprintf(path, sizeof(path), "%s/proc/irq", root);
+    DIR *dir = opendir(path);
+    if (dir != NULL)
+    {
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL)
+	{
+	    if (!isdigit((unsigned char) de->d_name[0]))
+		continue;
+
+	    unsigned long mask;
+	    snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", de->d_name);
+	    if (pusacpu_read(root, path, buf, sizeof(buf)) < 0 ||
+		pusacpu_parse_list(buf, &mask) < 0 || !(mask & rt_mask))
+		continue;
+
+	    int irq = atoi(de->d_name);
+	    if (pusacpu_is_percpu(audit, irq))
+	    {
+		audit->irqs_percpu++;
+		continue;
+	    }
+
+	    if (move_irqs)
+	    {
+		errno = 0;
+		if (pusacpu_write_affinity(root, path, hk) < 0)
+		{
+		    if (errno == EIO && irq < PUSACPU_IRQ_MAX)
+		    {
+			pusacpu_mark_percpu(audit, irq);
+			audit->irqs_percpu++;
+			continue;
+		    }
+		}
+		else if (pusacpu_read(root, path, buf, sizeof(buf)) >= 0 &&
+			 pusacpu_parse_list(buf, &mask) == 0 && !(mask & rt_mask))
+		{
+		    audit->irqs_moved++;
+		    continue;
+		}
+	    }
+
+	    audit->irqs_stuck++;
+	    pusacpu_append(stuck, sizeof(stuck), de->d_name);
+	}
+	closedir(dir);
+    }
+
+    struct pusacpu_check_s *check =
+	pusacpu_check(audit, "irq affinity", audit->irqs_stuck ? PUSACPU_FAIL : PUSACPU_PASS,
+		      audit->irqs_stuck * PUSACPU_JITTER_IRQ);
+    if (audit->irqs_stuck)
+	snprintf(check->detail, sizeof(check->detail), "%d moved, still on cpu %d: %s",
+		 audit->irqs_moved, audit->rt_cpu, stuck);
+    else if (audit->irqs_percpu)
+	snprintf(check->detail, sizeof(check->detail), "%d moved to %.48s, %d per-cpu",
+		 audit->irqs_moved, hk, audit->irqs_percpu);
+    else
+	snprintf(check->detail, sizeof(check->detail), "%d moved to %.64s", audit->irqs_moved, hk);
+}
+
+/*
+ * Interrupts that have fired on the real-time CPU and can't be moved,
+ * such as IPIs and the local timer.
+ */
+static void pusacpu_check_percpu(struct pusacpu_audit_s *audit, const char *root)
+{
+    char fullpath[PUSACPU_PATH_MAX];
+    char line[1024];
+    char names[64] = "";
+    int count = 0;
+
+    snprintf(fullpath, sizeof(fullpath), "%s/proc/interrupts", root);
+    FILE *fp = fopen(fullpath, "r");
+
+    /* The header names the CPU columns, which skip offline CPUs. */
+    int column = -1;
+    if (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+    {
+	char want[16];
+	snprintf(want, sizeof(want), "CPU%d", audit->rt_cpu);
+
+	int i = 0;
+	for (char *tok = strtok(line, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n"), i++)
+	    if (strcmp(tok, want) == 0)
+		column = i;
+    }
+
+    while (fp != NULL && column >= 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+	char *colon = strchr(line, ':');
+	if (colon == NULL)
+	    continue;
+	*colon = '\0';
+
+	char *label = line;
+	while (isspace((unsigned char) *label))
+	    label++;
+
+	/* Movable interrupts were handled above. */
+	if (isdigit((unsigned char) label[0]) && !pusacpu_is_percpu(audit, atoi(label)))
+	{
+	    char path[PUSACPU_PATH_MAX], buf[64];
+	    snprintf(path, sizeof(path), "/proc/irq/%.32s/smp_affinity_list", label);
+	    if (pusacpu_read(root, path, buf, sizeof(buf)) >= 0)
+		continue;
+	}
+
+	char *p = colon + 1;
+	unsigned long n = 0;
+	for (int i = 0; i <= column; i++)
+	{
+	    char *end;
+	    n = strtoul(p, &end, 10);
+	    if (end == p)
+	    {
+		n = 0;
+		break;
+	    }
+	    p = end;
+	}
+
+	if (n > 0)
+	{
+	    count++;
+	    pusacpu_append(names, sizeof(names), label);
+	}
+    }
+
+    if (fp != NULL)
+	fclose(fp);
+
+    struct pusacpu_check_s *check =
+	pusacpu_check(audit, "per-cpu irqs", count ? PUSACPU_WARN : PUSACPU_PASS,
+		      count * PUSACPU_JITTER_PERCPU);
+    if (count)
+	snprintf(check->detail, sizeof(check->detail), "%s", names);
+}
+
+static void pusacpu_check_cpufreq(struct pusacpu_audit_s *audit, const char *root)
+{
+    char path[PUSACPU_PATH_MAX];
+    char buf[64];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor",
+	     audit->rt_cpu);
+    int n = pusacpu_read(root, path, buf, sizeof(buf));
+
+    int ok = n < 0 || strcmp(buf, "performance") == 0;
+    struct pusacpu_check_s *check =
+	pusacpu_check(audit, "cpufreq", ok ? PUSACPU_PASS : PUSACPU_WARN, PUSACPU_JITTER_CPUFREQ);
+    snprintf(check->detail, sizeof(check->detail), "%s", n < 0 ? "no cpufreq" : buf);
+}
+
+/*
+ * The audio thread never idles while running, but it does sleep while
+ * starting and stopping, and deep states stretch those waits.
+ */
+static void pusacpu_check_idle(struct pusacpu_audit_s *audit, const char *root)
+{
+    char path[PUSACPU_PATH_MAX];
+    char buf[64];
+    char names[64] = "";
+    unsigned long max_latency = 0;
+
+    for (int state = 1; ; state++)
+    {
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency",
+		 audit->rt_cpu, state);
+	if (pusacpu_read(root, path, buf, sizeof(buf)) < 0)
+	    break;
+	unsigned long latency = strtoul(buf, NULL, 10);
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable",
+		 audit->rt_cpu, state);
+	if (pusacpu_read(root, path, buf, sizeof(buf)) >= 0 && atoi(buf) != 0)
+	    continue;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name",
+		 audit->rt_cpu, state);
+	if (pusacpu_read(root, path, buf, sizeof(buf)) < 0)
+	    snprintf(buf, sizeof(buf), "state%d", state);
+
+	pusacpu_append(names, sizeof(names), buf);
+	if (latency > max_latency)
+	    max_latency = latency;
+    }
+
+    struct pusacpu_check_s *check =
+	pusacpu_check(audit, "idle states", names[0] ? PUSACPU_WARN : PUSACPU_PASS, max_latency);
+    if (names[0])
+	snprintf(check->detail, sizeof(check->detail), "%s enabled, exit up to %lu us",
+		 names, max_latency);
+}
+
+/*
+ * Run all checks for rt_cpu.  root is "" for the running system.  If
+ * move_irqs is set, interrupts that may run on rt_cpu are moved to the
+ * housekeeping CPUs.  Returns the number of failed checks.
+ */
+int pusacpu_audit(const char *root, int rt_cpu, unsigned long housekeeping, int move_irqs,
+		  struct pusacpu_audit_s *audit)
+{
+    char buf[1024];
+
+    memset(audit, 0, sizeof(*audit));
+    audit->rt_cpu = rt_cpu;
+    audit->jitter_us = PUSACPU_JITTER_BASE;
+
+    int ok = pusacpu_read(root, "/proc/sys/kernel/sched_rt_runtime_us", buf, sizeof(buf)) >= 0 &&
+	strcmp(buf, "-1") == 0;
+    struct pusacpu_check_s *check =
+	pusacpu_check(audit, "rt runtime", ok ? PUSACPU_PASS : PUSACPU_FAIL, PUSACPU_JITTER_RT_LIMIT);
+    if (!ok)
+	snprintf(check->detail, sizeof(check->detail), "sched_rt_runtime_us is not -1");
+
+    if (pusacpu_read(root, "/proc/cmdline", buf, sizeof(buf)) < 0)
+	buf[0] = '\0';
+    pusacpu_check_cmdline(audit, buf, "isolcpus", PUSACPU_JITTER_ISOLCPUS);
+    pusacpu_check_cmdline(audit, buf, "nohz_full", PUSACPU_JITTER_NOHZ);
+    pusacpu_check_cmdline(audit, buf, "rcu_nocbs", PUSACPU_JITTER_RCU);
+
+    pusacpu_check_irqs(audit, root, housekeeping, move_irqs);
+    pusacpu_check_percpu(audit, root);
+    pusacpu_check_cpufreq(audit, root);
+    pusacpu_check_idle(audit, root);
+
+    return audit->failures;
+}
+
+void pusacpu_print_audit(const struct pusacpu_audit_s *audit)
+{
+    static const char *results[] = { "PASS", "WARN", "FAIL" };
+
+    printf("isolation audit for cpu %d:\n", audit->rt_cpu);
+    for (int i = 0; i < audit->nchecks; i++)
+    {
+	const struct pusacpu_check_s *check = audit->checks + i;
+	printf("   %-14s %s %6lu us  %s\n", check->name, results[check->result],
+	       check->jitter_us, check->detail);
+    }
+    printf("expected worst case jitter %lu us, %d failed, %d warnings\n",
+	   audit->jitter_us, audit->failures, audit->warnings);
+}
+
+#ifdef PUSACPU_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Runs against fake /proc and /sys trees in a temporary directory.
+ */
+static char test_root[PUSACPU_PATH_MAX];
+
+static void test_file(const char *path, const char *contents)
+{
+    char cmd[PUSACPU_PATH_MAX * 2];
+    snprintf(cmd, sizeof(cmd), "mkdir -p \"$(dirname '%s%s')\"", test_root, path);
+    if (system(cmd) != 0 || pusacpu_write(test_root, path, contents) < 0)
+    {
+	printf("Can't create %s%s\n", test_root, path);
+	exit(1);
+    }
+}
+
+/* Acts as the kernel does for a per-CPU interrupt it doesn't recognise. */
+static int test_writes = 0;
+
+static int test_write_affinity(const char *root, const char *path, const char *value)
+{
+    test_writes++;
+    if (strcmp(path, "/proc/irq/13/smp_affinity_list") == 0)
+    {
+	errno = EIO;
+	return -1;
+    }
+
+    return pusacpu_write(root, path, value);
+}
+
+static const char *test_read(const char *path)
+{
+    static char buf[256];
+    if (pusacpu_read(test_root, path, buf, sizeof(buf)) < 0)
+	return "";
+    return buf;
+}
+
+static const struct pusacpu_check_s *test_find(const struct pusacpu_audit_s *audit, const char *name)
+{
+    for (int i = 0; i < audit->nchecks; i++)
+	if (strcmp(audit->checks[i].name, name) == 0)
+	    return audit->checks + i;
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusacpu_audit_s audit;
+    unsigned long mask;
+    char buf[64];
+
+    check(pusacpu_parse_list("0-2,5", &mask) == 0 && mask == 0x27, "parse list");
+    check(pusacpu_parse_list("domain,managed_irq,3", &mask) == 0 && mask == 0x8, "parse flags");
+    check(pusacpu_parse_list("3 nohz_full=3", &mask) == 0 && mask == 0x8, "parse stops at space");
+    check(pusacpu_format_list(0x27, buf, sizeof(buf)) == 0 && strcmp(buf, "0-2,5") == 0, "format list");
+
+    strcpy(test_root, "/tmp/pusacpuXXXXXX");
+    if (mkdtemp(test_root) == NULL)
+    {
+	perror("mkdtemp");
+	return 1;
+    }
+
+    /* A stock Raspberry Pi OS install. */
+    test_file("/proc/sys/kernel/sched_rt_runtime_us", "950000");
+    test_file("/proc/cmdline", "console=tty1 root=PARTUUID=1234-02 rootwait");
+    test_file("/proc/irq/10/smp_affinity_list", "0-3");
+    test_file("/proc/irq/11/smp_affinity_list", "3");
+    test_file("/proc/irq/12/smp_affinity_list", "0-1");
+    test_file("/proc/irq/13/smp_affinity_list", "0-3");
+    test_file("/proc/interrupts",
+	      "           CPU0       CPU1       CPU2       CPU3\n"
+	      " 10:        100        100        100        100  GICv1  27 Level  arch_timer\n"
+	      " 11:         20          0          0          5  GICv2  65 Level  fe00b880.mailbox\n"
+	      " 13:          0          0          0          0  armv7-pmu   3 Level  arm-pmu\n"
+	      " 26:       1000       1000       1000       1000  GICv2  30 Level  arch_timer\n"
+	      "IPI0:        50         40         30         20  Rescheduling interrupts\n"
+	      "IPI1:        10         10         10          0  Function call interrupts\n"
+	      "Err:          0\n");
+    test_file("/sys/devices/system/cpu/cpu3/cpufreq/scaling_governor", "ondemand");
+    test_file("/sys/devices/system/cpu/cpu3/cpuidle/state0/latency", "0");
+    test_file("/sys/devices/system/cpu/cpu3/cpuidle/state1/latency", "1000");
+    test_file("/sys/devices/system/cpu/cpu3/cpuidle/state1/name", "cpu-sleep");
+    test_file("/sys/devices/system/cpu/cpu3/cpuidle/state1/disable", "0");
+
+    /* The PMU is per-CPU too, but only the refused write shows it. */
+    pusacpu_write_affinity = test_write_affinity;
+
+    pusacpu_audit(test_root, 3, 0x7, 1, &audit);
+    pusacpu_print_audit(&audit);
+
+    check(audit.failures == 1 && test_find(&audit, "rt runtime")->result == PUSACPU_FAIL, "rt runtime fails");
+    check(test_find(&audit, "isolcpus")->result == PUSACPU_WARN, "isolcpus missing");
+    check(test_find(&audit, "nohz_full")->result == PUSACPU_WARN, "nohz_full missing");
+    check(test_find(&audit, "rcu_nocbs")->result == PUSACPU_WARN, "rcu_nocbs missing");
+    check(audit.irqs_moved == 1 && audit.irqs_stuck == 0 && audit.irqs_percpu == 2, "irqs moved");
+    check(test_find(&audit, "irq affinity")->result == PUSACPU_PASS, "per-cpu irq doesn't fail");
+    check(strcmp(test_read("/proc/irq/10/smp_affinity_list"), "0-3") == 0 &&
+	  strcmp(test_read("/proc/irq/13/smp_affinity_list"), "0-3") == 0 &&
+	  strcmp(test_read("/proc/irq/11/smp_affinity_list"), "0-2") == 0 &&
+	  strcmp(test_read("/proc/irq/12/smp_affinity_list"), "0-1") == 0, "affinity rewritten");
+    check(strcmp(test_find(&audit, "per-cpu irqs")->detail, "10,26,IPI0") == 0, "per-cpu irqs");
+    check(test_find(&audit, "cpufreq")->result == PUSACPU_WARN, "cpufreq governor");
+    check(test_find(&audit, "idle states")->jitter_us == 1000, "idle exit latency");
+    check(audit.jitter_us == PUSACPU_JITTER_BASE + PUSACPU_JITTER_RT_LIMIT + PUSACPU_JITTER_ISOLCPUS +
+	  PUSACPU_JITTER_NOHZ + PUSACPU_JITTER_RCU + 3 * PUSACPU_JITTER_PERCPU +
+	  PUSACPU_JITTER_CPUFREQ + 1000, "jitter estimate");
+
+    /*
+     * Without moving, interrupts on the real-time CPU fail the audit and
+     * nothing is written.  Only the timer can be told apart as per-CPU.
+     */
+    test_file("/proc/irq/11/smp_affinity_list", "2-3");
+    test_writes = 0;
+    pusacpu_audit(test_root, 3, 0x7, 0, &audit);
+    check(audit.irqs_stuck == 2 && test_find(&audit, "irq affinity")->result == PUSACPU_FAIL, "irq stuck");
+    check(audit.irqs_percpu == 1 && test_writes == 0 &&
+	  strcmp(test_read("/proc/irq/11/smp_affinity_list"), "2-3") == 0,
+	  "per-cpu irq found without moving anything");
+
+    /* Tuned for audio. */
+    test_file("/proc/sys/kernel/sched_rt_runtime_us", "-1");
+    test_file("/proc/cmdline", "console=tty1 isolcpus=domain,managed_irq,3 nohz_full=3 rcu_nocbs=3 rootwait");
+    test_file("/sys/devices/system/cpu/cpu3/cpufreq/scaling_governor", "performance");
+    test_file("/sys/devices/system/cpu/cpu3/cpuidle/state1/disable", "1");
+
+    pusacpu_audit(test_root, 3, 0x7, 1, &audit);
+    pusacpu_print_audit(&audit);
+    check(audit.failures == 0 && audit.warnings == 1, "tuned system passes");
+
+    /* A different real-time CPU isn't covered by the same settings. */
+    pusacpu_audit(test_root, 2, 0xb, 1, &audit);
+    check(test_find(&audit, "isolcpus")->result == PUSACPU_WARN, "isolcpus checks the rt cpu");
+    check(strcmp(test_read("/proc/irq/11/smp_affinity_list"), "0-1,3") == 0, "moved off cpu 2");
+
+    char cmd[PUSACPU_PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", test_root);
+    if (system(cmd) != 0)
+	printf("Can't remove %s\n", test_root);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Header file for CPU placement and system isolation checks.
+ */
+
+#ifndef __pusacpu_h__
+#define __pusacpu_h__
+
+#define PUSACPU_CHECK_MAX	16
+
+#define PUSACPU_PASS		0
+#define PUSACPU_WARN		1
+#define PUSACPU_FAIL		2
+
+/*
+ * Rough worst-case allowances, in microseconds, for each thing that can
+ * interrupt the real-time core.  They only rank problems; measure with
+ * pusa_print_stats() on the target.
+ */
+#define PUSACPU_JITTER_BASE	10
+#define PUSACPU_JITTER_ISOLCPUS	100
+#define PUSACPU_JITTER_NOHZ	10
+#define PUSACPU_JITTER_RCU	100
+#define PUSACPU_JITTER_IRQ	20
+#define PUSACPU_JITTER_PERCPU	10
+#define PUSACPU_JITTER_CPUFREQ	100
+#define PUSACPU_JITTER_RT_LIMIT	50000
+
+struct pusacpu_check_s
+{
+    const char *name;
+    int result;
+    unsigned long jitter_us;
+    char detail[96];
+};
+
+#define PUSACPU_IRQ_MAX		1024
+
+/*
+ * irqs_percpu counts numbered interrupts on the real-time CPU that the
+ * kernel won't move, such as the local timer.  Like the IPIs they are only
+ * a warning.  irq_percpu marks every numbered interrupt known to be
+ * per-CPU.
+ */
+struct pusacpu_audit_s
+{
+    int rt_cpu;
+    int nchecks;
+    struct pusacpu_check_s checks[PUSACPU_CHECK_MAX];
+    int irqs_moved;
+    int irqs_stuck;
+    int irqs_percpu;
+    unsigned char irq_percpu[PUSACPU_IRQ_MAX / 8];
+    int failures;
+    int warnings;
+    unsigned long jitter_us;
+};
+
+int pusacpu_parse_list(const char *list, unsigned long *mask);
+int pusacpu_format_list(unsigned long mask, char *buf, int size);
+int pusacpu_audit(const char *root, int rt_cpu, unsigned long housekeeping, int move_irqs,
+		  struct pusacpu_audit_s *audit);
+void pusacpu_print_audit(const struct pusacpu_audit_s *audit);
+
+#endif /* __pusacpu_h__ */
@@ -0,0 +1,389 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Overload governor.  The audio thread reports how long each frame took
+ * and how far behind it is.  When the load gets close to the frame budget,
+ * registered processing stages are switched to a cheaper fallback or
+ * bypassed, least important first, before the transmit FIFO runs dry.
+ * They are switched back in reverse order once the load has stayed low
+ * for a while.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pusa.h"
+#include "pusagov.h"
+
+struct pusagov_stage_s
+{
+    const char *name;
+    int priority;
+    pusagov_process_t process[2];
+    int lowest;
+    int level;
+    void *ctx;
+};
+
+static struct pusagov_stage_s pusagov_stages[PUSAGOV_STAGE_MAX];
+static int pusagov_nstages = 0;
+
+/* Stages degraded so far, most recent last. */
+static int pusagov_degraded[PUSAGOV_STAGE_MAX * 2];
+static int pusagov_ndegraded = 0;
+
+static int pusagov_window_frames = 0;
+static unsigned long long pusagov_window_ns = 0;
+static int pusagov_window_backlog = 0;
+static int pusagov_quiet_windows = 0;
+
+static struct pusagov_stats_s pusagov_stats;
+
+/*
+ * Audio thread to consumer.  Single producer, single consumer.
+ */
+#define PUSAGOV_RING_SIZE	64
+
+static struct pusagov_event_s pusagov_ring[PUSAGOV_RING_SIZE];
+static volatile unsigned int pusagov_ring_in = 0;
+static volatile unsigned int pusagov_ring_out = 0;
+
+/*
+ * Add a processing stage.  fallback may be NULL if the stage has no cheaper
+ * version.  Stages with lower priority are degraded first.  Must be called
+ * before the audio thread starts or through pusa_execute_in_rt().  Returns
+ * the stage number.
+ */
+int pusagov_stage_add(const char *name, int priority, pusagov_process_t full,
+		      pusagov_process_t fallback, int can_bypass, void *ctx)
+{
+    if (full == NULL || pusagov_nstages >= PUSAGOV_STAGE_MAX)
+	return -1;
+
+    struct pusagov_stage_s *st = pusagov_stages + pusagov_nstages;
+    st->name = name;
+    st->priority = priority;
+    st->process[PUSAGOV_FULL] = full;
+    st->process[PUSAGOV_FALLBACK] = fallback;
+    st->level = PUSAGOV_FULL;
+    st->ctx = ctx;
+
+    if (can_bypass)
+	st->lowest = PUSAGOV_BYPASS;
+    else if (fallback != NULL)
+	st->lowest = PUSAGOV_FALLBACK;
+    else
+	st->lowest = PUSAGOV_FULL;
+
+    return pusagov_nstages++;
+}
+
+const char *pusagov_stage_name(int stage)
+{
+    if (stage < 0 || stage >= pusagov_nstages)
+	return "?";
+
+    return pusagov_stages[stage].name;
+}
+
+/*
+ * Run all stages at their current level.  Call from the audio handler.
+ */
+void pusagov_process(int *data, int nchannels)
+{
+    for (int i = 0; i < pusagov_nstages; i++)
+    {
+	struct pusagov_stage_s *st = pusagov_stages + i;
+
+	if (st->level == PUSAGOV_BYPASS)
+	    continue;
+
+	pusagov_process_t func = st->process[st->level];
+	if (func == NULL)
+	    func = st->process[PUSAGOV_FULL];
+
+	func(st->ctx, data, nchannels);
+    }
+}
+
+static void pusagov_push(int stage, int from, int to, int load, unsigned long long sample_index)
+{
+    unsigned int next = (pusagov_ring_in + 1) % PUSAGOV_RING_SIZE;
+    if (next == pusagov_ring_out)
+    {
+	pusagov_stats.overflows++;
+	return;
+    }
+
+    struct pusagov_event_s *ev = pusagov_ring + pusagov_ring_in;
+    ev->stage = stage;
+    ev->from = from;
+    ev->to = to;
+    ev->load = load;
+    ev->sample_index = sample_index;
+    __sync_synchronize();
+    pusagov_ring_in = next;
+}
+
+static void pusagov_set_level(int stage, int level, int load, unsigned long long sample_index)
+{
+    struct pusagov_stage_s *st = pusagov_stages + stage;
+
+    pusagov_push(stage, st->level, level, load, sample_index);
+    st->level = level;
+    pusagov_stats.levels[stage] = level;
+}
+
+static void pusagov_degrade(int load, unsigned long long sample_index)
+{
+    int best = -1;
+
+    /* Lowest priority first, and the last added among equals. */
+    for (int i = 0; i < pusagov_nstages; i++)
+    {
+	struct pusagov_stage_s *st = pusagov_stages + i;
+	if (st->level < st->lowest &&
+	    (best < 0 || st->priority <= pusagov_stages[best].priority))
+	    best = i;
+    }
+
+    if (best < 0)
+	return;
+
+    struct pusagov_stage_s *st = pusagov_stages + best;
+    int level = st->level + 1;
+    if (level == PUSAGOV_FALLBACK && st->process[PUSAGOV_FALLBACK] == NULL)
+	level = PUSAGOV_BYPASS;
+
+    pusagov_degraded[pusagov_ndegraded++] = best;
+    pusagov_set_level(best, level, load, sample_index);
+    pusagov_stats.degrades++;
+}
+
+static void pusagov_restore(int load, unsigned long long sample_index)
+{
+    if (pusagov_ndegraded == 0)
+	return;
+
+    int stage = pusagov_degraded[--pusagov_ndegraded];
+    struct pusagov_stage_s *st = pusagov_stages + stage;
+    int level = st->level - 1;
+    if (level == PUSAGOV_FALLBACK && st->process[PUSAGOV_FALLBACK] == NULL)
+	level = PUSAGOV_FULL;
+
+    pusagov_set_level(stage, level, load, sample_index);
+    pusagov_stats.restores++;
+}
+
+/*
+ * Called by the audio thread once per frame with the time spent on the
+ * frame in nanoseconds and the number of frames it had to catch up on.
+ * A frame is only about 20 us, so whole microseconds would understate
+ * the load by up to 5%.
+ */
+void pusagov_rt_frame(unsigned long long sample_index, unsigned long frame_ns, int backlog)
+{
+    pusagov_window_ns += frame_ns;
+    if (backlog > pusagov_window_backlog)
+	pusagov_window_backlog = backlog;
+
+    if (++pusagov_window_frames < PUSAGOV_WINDOW)
+	return;
+
+    int load = pusagov_window_ns * pusa_get_sample_rate() * 100 / (PUSAGOV_WINDOW * 1000000000ULL);
+
+    pusagov_stats.windows++;
+    pusagov_stats.load = load;
+    if (load > pusagov_stats.max_load)
+	pusagov_stats.max_load = load;
+    if (pusagov_window_backlog > pusagov_stats.max_backlog)
+	pusagov_stats.max_backlog = pusagov_window_backlog;
+
+    if (load > PUSAGOV_HIGH || pusagov_window_backlog >= PUSAGOV_BACKLOG)
+    {
+	pusagov_stats.overloads++;
+	pusagov_quiet_windows = 0;
+	pusagov_degrade(load, sample_index);
+    }
+    else if (load < PUSAGOV_LOW && pusagov_window_backlog <= 1)
+    {
+	if (++pusagov_quiet_windows >= PUSAGOV_HOLD)
+	{
+	    pusagov_quiet_windows = 0;
+	    pusagov_restore(load, sample_index);
+	}
+    }
+    else
+    {
+	pusagov_quiet_windows = 0;
+    }
+
+    pusagov_window_frames = 0;
+    pusagov_window_ns = 0;
+    pusagov_window_backlog = 0;
+}
+
+/*
+ * Get the next level change.  Returns 1 if an event was returned.  Only
+ * one thread may consume events.
+ */
+int pusagov_get_event(struct pusagov_event_s *ev)
+{
+    if (pusagov_ring_out == pusagov_ring_in)
+	return 0;
+
+    __sync_synchronize();
+    *ev = pusagov_ring[pusagov_ring_out];
+    __sync_synchronize();
+    pusagov_ring_out = (pusagov_ring_out + 1) % PUSAGOV_RING_SIZE;
+
+    return 1;
+}
+
+void pusagov_get_stats(struct pusagov_stats_s *stats)
+{
+    *stats = pusagov_stats;
+}
+
+void pusagov_print_stats(void)
+{
+    static const char *level_names[] = { "full", "fallback", "bypass" };
+    struct pusagov_stats_s stats;
+    pusagov_get_stats(&stats);
+
+    printf("governor: load %d%% (max %d%%), overloads %lu, max backlog %lu, "
+	   "degrades %lu, restores %lu, overflows %lu\n",
+	   stats.load, stats.max_load, stats.overloads, stats.max_backlog,
+	   stats.degrades, stats.restores, stats.overflows);
+
+    for (int i = 0; i < pusagov_nstages; i++)
+	printf("   %s: %s\n", pusagov_stages[i].name, level_names[stats.levels[i]]);
+}
+
+#ifdef PUSAGOV_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Feeds synthetic frame times through the governor.
+ */
+int pusa_get_sample_rate(void)
+{
+    return 48000;
+}
+
+static unsigned long long test_sample = 0;
+static int test_ran[3][3];
+
+static void test_full(void *ctx, int *data, int nchannels)
+{
+    test_ran[(long) ctx][PUSAGOV_FULL]++;
+}
+
+static void test_fallback(void *ctx, int *data, int nchannels)
+{
+    test_ran[(long) ctx][PUSAGOV_FALLBACK]++;
+}
+
+/* Run frames with a fixed cost per frame, given as percent of budget. */
+static void test_frames(int nframes, int load, int backlog)
+{
+    for (int i = 0; i < nframes; i++, test_sample++)
+    {
+	/* 20833 ns per frame at 48 kHz, spread so the average is right. */
+	unsigned long ns = (test_sample + 1) * load * 1000000000ULL / 48000 / 100 -
+	    test_sample * load * 1000000000ULL / 48000 / 100;
+	int data[2] = { 0, 0 };
+
+	pusagov_process(data, 2);
+	pusagov_rt_frame(test_sample, ns, backlog);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct pusagov_stats_s stats;
+    struct pusagov_event_s ev;
+
+    int eq = pusagov_stage_add("eq", 10, test_full, NULL, 0, (void *) 0);
+    int reverb = pusagov_stage_add("reverb", 1, test_full, test_fallback, 1, (void *) 1);
+    int chorus = pusagov_stage_add("chorus", 2, test_full, NULL, 1, (void *) 2);
+
+    test_frames(48000, 40, 1);
+    pusagov_get_stats(&stats);
+    check(stats.degrades == 0 && stats.load == 40, "no change under budget");
+
+    /* Reverb degrades first, to its fallback, then is bypassed. */
+    test_frames(PUSAGOV_WINDOW, 90, 1);
+    check(pusagov_get_event(&ev) && ev.stage == reverb && ev.to == PUSAGOV_FALLBACK, "reverb fallback");
+    test_frames(PUSAGOV_WINDOW, 60, PUSAGOV_BACKLOG);
+    check(pusagov_get_event(&ev) && ev.stage == reverb && ev.to == PUSAGOV_BYPASS, "reverb bypass on backlog");
+    test_frames(PUSAGOV_WINDOW, 90, 1);
+    check(pusagov_get_event(&ev) && ev.stage == chorus && ev.to == PUSAGOV_BYPASS, "chorus bypass");
+
+    /* Nothing left to degrade: the eq can't be bypassed. */
+    test_frames(10 * PUSAGOV_WINDOW, 95, 1);
+    check(!pusagov_get_event(&ev), "eq never degraded");
+
+    memset(test_ran, 0, sizeof(test_ran));
+    test_frames(2 * PUSAGOV_WINDOW, 45, 1);
+    check(test_ran[0][PUSAGOV_FULL] == 2 * PUSAGOV_WINDOW && test_ran[1][PUSAGOV_FULL] == 0 &&
+	  test_ran[1][PUSAGOV_FALLBACK] == 0 && test_ran[2][PUSAGOV_FULL] == 0, "levels applied");
+
+    /* Between the thresholds nothing changes, however long it lasts. */
+    test_frames(2 * PUSAGOV_HOLD * PUSAGOV_WINDOW, 65, 1);
+    check(!pusagov_get_event(&ev), "hysteresis");
+
+    /* Quiet for the hold time restores one step, most recent first. */
+    test_frames(PUSAGOV_HOLD * PUSAGOV_WINDOW, 30, 1);
+    check(pusagov_get_event(&ev) && ev.stage == chorus && ev.to == PUSAGOV_FULL, "chorus restored");
+    test_frames(PUSAGOV_HOLD * PUSAGOV_WINDOW - 1, 30, 1);
+    check(!pusagov_get_event(&ev), "hold time");
+    test_frames(1, 30, 1);
+    check(pusagov_get_event(&ev) && ev.stage == reverb && ev.to == PUSAGOV_FALLBACK, "reverb fallback restored");
+
+    /* A spike during the hold restarts it. */
+    test_frames(PUSAGOV_HOLD * PUSAGOV_WINDOW / 2, 30, 1);
+    test_frames(PUSAGOV_WINDOW, 70, 1);
+    test_frames(PUSAGOV_HOLD * PUSAGOV_WINDOW / 2, 30, 1);
+    check(!pusagov_get_event(&ev), "hold restarted");
+    test_frames(PUSAGOV_HOLD * PUSAGOV_WINDOW / 2, 30, 1);
+    check(pusagov_get_event(&ev) && ev.stage == reverb && ev.to == PUSAGOV_FULL, "reverb restored");
+
+    pusagov_get_stats(&stats);
+    check(stats.degrades == 3 && stats.restores == 3, "degrade accounting");
+    check(stats.max_backlog == PUSAGOV_BACKLOG, "backlog accounting");
+    check(stats.levels[eq] == PUSAGOV_FULL, "eq stays at full");
+
+    /* Every frame taking 16.9 us is 81% of the budget, just over the top. */
+    for (int i = 0; i < PUSAGOV_WINDOW; i++, test_sample++)
+	pusagov_rt_frame(test_sample, 16900, 1);
+    pusagov_get_stats(&stats);
+    check(stats.load == 81, "load measured below a microsecond");
+    check(pusagov_get_event(&ev) && ev.stage == reverb && ev.to == PUSAGOV_FALLBACK,
+	  "degrade just over the top");
+
+    pusagov_print_stats();
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Header file for the overload governor.
+ */
+
+#ifndef __pusagov_h__
+#define __pusagov_h__
+
+#define PUSAGOV_STAGE_MAX	16
+
+/* Processing levels, cheapest last. */
+#define PUSAGOV_FULL		0
+#define PUSAGOV_FALLBACK	1
+#define PUSAGOV_BYPASS		2
+
+/*
+ * Load is measured over windows of PUSAGOV_WINDOW frames.  Above
+ * PUSAGOV_HIGH percent of the frame budget, or with PUSAGOV_BACKLOG frames
+ * queued in the receive FIFO, one stage steps down per window.  A stage
+ * steps back up only after PUSAGOV_HOLD windows in a row below
+ * PUSAGOV_LOW percent.
+ */
+#define PUSAGOV_WINDOW		64
+#define PUSAGOV_HIGH		80
+#define PUSAGOV_LOW		50
+#define PUSAGOV_BACKLOG		4
+#define PUSAGOV_HOLD		400
+
+typedef void (*pusagov_process_t)(void *ctx, int *data, int nchannels);
+
+struct pusagov_event_s
+{
+    int stage;
+    int from;
+    int to;
+    int load;
+    unsigned long long sample_index;
+};
+
+struct pusagov_stats_s
+{
+    unsigned long windows;
+    unsigned long degrades;
+    unsigned long restores;
+    unsigned long overloads;
+    unsigned long max_backlog;
+    int load;
+    int max_load;
+    int levels[PUSAGOV_STAGE_MAX];
+    unsigned long overflows;
+};
+
+int pusagov_stage_add(const char *name, int priority, pusagov_process_t full,
+		      pusagov_process_t fallback, int can_bypass, void *ctx);
+const char *pusagov_stage_name(int stage);
+void pusagov_process(int *data, int nchannels);
+void pusagov_rt_frame(unsigned long long sample_index, unsigned long frame_ns, int backlog);
+int pusagov_get_event(struct pusagov_event_s *ev);
+void pusagov_get_stats(struct pusagov_stats_s *stats);
+void pusagov_print_stats(void);
+
+#endif /* __pusagov_h__ */
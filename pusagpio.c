@@ -0,0 +1,658 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bcmhw.h"
+#include "pusa.h"
+#include "pusagpio.h"
+
+struct pusagpio_input_s
+{
+    int gpio;
+    int active_low;
+    int debounce_polls;
+    int debounce_ms;
+    int state;
+    int candidate;
+    int count;
+    unsigned long long first_sample;
+    unsigned long first_systime;
+    struct timespec first_time;
+};
+
+static struct pusagpio_input_s pusagpio_inputs[PUSAGPIO_INPUT_MAX];
+static int pusagpio_ninputs = 0;
+static unsigned long pusagpio_latch_mask[2];
+
+/*
+ * Poll thread to consumer.  Single producer, single consumer, so the
+ * audio handler may read events without blocking.
+ */
+#define PUSAGPIO_RING_SIZE	256
+
+static struct pusagpio_event_s pusagpio_ring[PUSAGPIO_RING_SIZE];
+static volatile unsigned int pusagpio_ring_in = 0;
+static volatile unsigned int pusagpio_ring_out = 0;
+
+static pthread_t pusagpio_tid;
+static volatile int pusagpio_running = 0;
+static int pusagpio_exit_registered = 0;
+static long pusagpio_period_ns;
+
+static struct pusagpio_stats_s pusagpio_stats;
+static double pusagpio_poll_total_ns = 0.0;
+static double pusagpio_latency_total_us = 0.0;
+
+static double pusagpio_elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/*
+ * Add an input.  pull is one of GPIO_PU_*.  Must be called before
+ * pusagpio_input_start().  See pusagpio.h before using
+ * PUSAGPIO_EDGE_LATCH.
+ */
+int pusagpio_input_add(int gpio, int pull, int active_low, int debounce_ms, int flags)
+{
+    if (gpio < 0 || gpio > 53 || pusagpio_ninputs >= PUSAGPIO_INPUT_MAX || pusagpio_running)
+	return -1;
+
+    bcmhw_gpio_select(gpio, GPIO_FUNC_INPUT);
+    bcmhw_gpio_pull(gpio, pull);
+
+    struct pusagpio_input_s *in = pusagpio_inputs + pusagpio_ninputs++;
+    in->gpio = gpio;
+    in->active_low = active_low;
+    in->debounce_ms = debounce_ms;
+    in->state = bcmhw_gpio_get(gpio) ^ active_low;
+    in->candidate = in->state;
+    in->count = 0;
+
+    /* Edge detection is only armed while the inputs are being polled. */
+    if (flags & PUSAGPIO_EDGE_LATCH)
+	pusagpio_latch_mask[GPIO_BANK(gpio)] |= GPIO_BIT(gpio);
+
+    return 0;
+}
+
+static void pusagpio_push(struct pusagpio_input_s *in)
+{
+    unsigned int next = (pusagpio_ring_in + 1) % PUSAGPIO_RING_SIZE;
+    if (next == pusagpio_ring_out)
+    {
+	pusagpio_stats.overflows++;
+	return;
+    }
+
+    struct pusagpio_event_s *ev = pusagpio_ring + pusagpio_ring_in;
+    ev->gpio = in->gpio;
+    ev->pressed = in->state;
+    ev->sample_index = in->first_sample;
+    ev->systime = in->first_systime;
+    __sync_synchronize();
+    pusagpio_ring_in = next;
+}
+
+static void pusagpio_poll(void)
+{
+    unsigned long lev[2] = { 0, 0 };
+    unsigned long eds[2] = { 0, 0 };
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* One register read per bank covers every input. */
+    lev[0] = bcmhw_gpio_read_mask(0);
+    if (pusagpio_latch_mask[0])
+	eds[0] = bcmhw_gpio_read_events(0) & pusagpio_latch_mask[0];
+    if (pusagpio_latch_mask[1])
+	eds[1] = bcmhw_gpio_read_events(1) & pusagpio_latch_mask[1];
+
+    unsigned long long sample = pusa_get_sample_index();
+    unsigned long systime = bcmhw_get_system_timer();
+
+    for (int i = 0; i < pusagpio_ninputs; i++)
+    {
+	struct pusagpio_input_s *in = pusagpio_inputs + i;
+	int bank = GPIO_BANK(in->gpio);
+
+	if (bank == 1 && lev[1] == 0)
+	    lev[1] = bcmhw_gpio_read_mask(1);
+
+	int raw = ((lev[bank] & GPIO_BIT(in->gpio)) != 0) ^ in->active_low;
+
+	if (raw != in->candidate)
+	{
+	    /* Changing back before the debounce time is up is a bounce. */
+	    if (in->candidate != in->state)
+		pusagpio_stats.bounces++;
+
+	    in->candidate = raw;
+	    in->count = 0;
+	    in->first_sample = sample;
+	    in->first_systime = systime;
+	    in->first_time = start;
+	}
+	else if (eds[bank] & GPIO_BIT(in->gpio))
+	{
+	    /*
+	     * The level looks steady but an edge was latched since the last
+	     * poll, so the contact bounced between samples.  Start over.
+	     */
+	    in->count = 0;
+	    pusagpio_stats.bounces++;
+	}
+
+	if (in->candidate != in->state && ++in->count >= in->debounce_polls)
+	{
+	    in->state = in->candidate;
+	    pusagpio_push(in);
+
+	    double latency = pusagpio_elapsed_ns(&in->first_time, &start) / 1000.0;
+	    pusagpio_stats.events++;
+	    pusagpio_latency_total_us += latency;
+	    pusagpio_stats.latency_mean_us = pusagpio_latency_total_us / pusagpio_stats.events;
+	    if (latency > pusagpio_stats.latency_max_us)
+		pusagpio_stats.latency_max_us = latency;
+	}
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = pusagpio_elapsed_ns(&start, &end);
+    pusagpio_stats.polls++;
+    pusagpio_poll_total_ns += ns;
+    pusagpio_stats.poll_mean_ns = pusagpio_poll_total_ns / pusagpio_stats.polls;
+    if (ns > pusagpio_stats.poll_max_ns)
+	pusagpio_stats.poll_max_ns = ns;
+}
+
+static void *pusagpio_thread(void *arg)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (pusagpio_running)
+    {
+	pusagpio_poll();
+
+	next.tv_nsec += pusagpio_period_ns;
+	while (next.tv_nsec >= 1000000000)
+	{
+	    next.tv_nsec -= 1000000000;
+	    next.tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    return NULL;
+}
+
+static void pusagpio_input_setup(int poll_hz)
+{
+    pusagpio_period_ns = 1000000000L / poll_hz;
+
+    for (int i = 0; i < pusagpio_ninputs; i++)
+    {
+	struct pusagpio_input_s *in = pusagpio_inputs + i;
+	in->debounce_polls = (in->debounce_ms * poll_hz + 999) / 1000;
+	if (in->debounce_polls < 1)
+	    in->debounce_polls = 1;
+
+	if (pusagpio_latch_mask[GPIO_BANK(in->gpio)] & GPIO_BIT(in->gpio))
+	    bcmhw_gpio_edge_detect(in->gpio, 1, 1);
+    }
+}
+
+/*
+ * Turn edge detection back off and clear anything latched, so nothing is
+ * left holding the bank interrupt up once no one is polling.
+ */
+static void pusagpio_input_disarm(void)
+{
+    for (int i = 0; i < pusagpio_ninputs; i++)
+    {
+	struct pusagpio_input_s *in = pusagpio_inputs + i;
+
+	if (pusagpio_latch_mask[GPIO_BANK(in->gpio)] & GPIO_BIT(in->gpio))
+	    bcmhw_gpio_edge_detect(in->gpio, 0, 0);
+    }
+}
+
+/*
+ * Start polling the inputs poll_hz times per second.  The thread runs at
+ * normal priority on the housekeeping cores; a footswitch doesn't need
+ * to preempt anything.
+ */
+int pusagpio_input_start(int poll_hz)
+{
+    if (poll_hz <= 0 || pusagpio_running)
+	return -1;
+
+    pusagpio_input_setup(poll_hz);
+
+    pusagpio_running = 1;
+    if (pthread_create(&pusagpio_tid, NULL, pusagpio_thread, NULL) != 0)
+    {
+	pusagpio_running = 0;
+	pusagpio_input_disarm();
+	return -1;
+    }
+
+    if (!pusagpio_exit_registered)
+    {
+	atexit(pusagpio_input_stop);
+	pusagpio_exit_registered = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop polling.  Also called at exit.
+ */
+void pusagpio_input_stop(void)
+{
+    if (!pusagpio_running)
+	return;
+
+    pusagpio_running = 0;
+    pthread_join(pusagpio_tid, NULL);
+    pusagpio_input_disarm();
+}
+
+/*
+ * Get the next press or release.  Returns 1 if an event was returned.
+ * Wait-free, so it may be called from the audio handler.  Only one thread
+ * may consume events.
+ */
+int pusagpio_get_event(struct pusagpio_event_s *ev)
+{
+    if (pusagpio_ring_out == pusagpio_ring_in)
+	return 0;
+
+    __sync_synchronize();
+    *ev = pusagpio_ring[pusagpio_ring_out];
+    __sync_synchronize();
+    pusagpio_ring_out = (pusagpio_ring_out + 1) % PUSAGPIO_RING_SIZE;
+
+    return 1;
+}
+
+void pusagpio_get_stats(struct pusagpio_stats_s *stats)
+{
+    *stats = pusagpio_stats;
+}
+
+void pusagpio_print_stats(void)
+{
+    struct pusagpio_stats_s stats;
+    pusagpio_get_stats(&stats);
+
+    printf("gpio: polls %lu, poll %.0f ns (max %.0f), events %lu, "
+	   "detect to event %.0f us (max %.0f), bounces %lu, overflows %lu\n",
+	   stats.polls, stats.poll_mean_ns, stats.poll_max_ns, stats.events,
+	   stats.latency_mean_us, stats.latency_max_us, stats.bounces, stats.overflows);
+}
+
+/*
+ * Sample-accurate GPIO outputs.  Control threads queue set/clear
+ * operations for a sample index.  The audio thread applies everything that
+ * is due with at most one GPSET and one GPCLR write per bank, so pulses
+ * are locked to the I2S clock.
+ */
+struct pusagpio_op_s
+{
+    unsigned long long sample_index;
+    int gpio;
+    int on;
+};
+
+#define PUSAGPIO_OPS_SIZE	256
+#define PUSAGPIO_PENDING_MAX	64
+
+static pthread_mutex_t pusagpio_ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pusagpio_op_s pusagpio_ops[PUSAGPIO_OPS_SIZE];
+static volatile unsigned int pusagpio_ops_in = 0;
+static volatile unsigned int pusagpio_ops_out = 0;
+
+/* Owned by the audio thread. */
+static struct pusagpio_op_s pusagpio_pending[PUSAGPIO_PENDING_MAX];
+static int pusagpio_npending = 0;
+static unsigned long long pusagpio_next_due = ~0ULL;
+
+static struct pusagpio_out_stats_s pusagpio_out_stats;
+
+int pusagpio_output_add(int gpio)
+{
+    if (gpio < 0 || gpio > 53)
+	return -1;
+
+    bcmhw_gpio_select(gpio, GPIO_FUNC_OUTPUT);
+    return 0;
+}
+
+/*
+ * Set or clear a GPIO at the given sample index.  Operations that are
+ * already due are applied on the next frame.
+ */
+int pusagpio_schedule(int gpio, int on, unsigned long long sample_index)
+{
+    if (gpio < 0 || gpio > 53)
+	return -1;
+
+    pthread_mutex_lock(&pusagpio_ops_lock);
+    unsigned int next = (pusagpio_ops_in + 1) % PUSAGPIO_OPS_SIZE;
+    if (next == pusagpio_ops_out)
+    {
+	pthread_mutex_unlock(&pusagpio_ops_lock);
+	return -1;
+    }
+
+    struct pusagpio_op_s *op = pusagpio_ops + pusagpio_ops_in;
+    op->sample_index = sample_index;
+    op->gpio = gpio;
+    op->on = on;
+    __sync_synchronize();
+    pusagpio_ops_in = next;
+    pthread_mutex_unlock(&pusagpio_ops_lock);
+
+    return 0;
+}
+
+int pusagpio_schedule_pulse(int gpio, unsigned long long sample_index, int length)
+{
+    if (length < 1)
+	return -1;
+
+    if (pusagpio_schedule(gpio, 1, sample_index) < 0)
+	return -1;
+
+    return pusagpio_schedule(gpio, 0, sample_index + length);
+}
+
+/*
+ * Called by the audio thread once per frame.
+ */
+void pusagpio_rt_frame(unsigned long long sample_index)
+{
+    while (pusagpio_ops_out != pusagpio_ops_in)
+    {
+	__sync_synchronize();
+	struct pusagpio_op_s *op = pusagpio_ops + pusagpio_ops_out;
+
+	if (pusagpio_npending < PUSAGPIO_PENDING_MAX)
+	{
+	    pusagpio_pending[pusagpio_npending++] = *op;
+	    if (op->sample_index < pusagpio_next_due)
+		pusagpio_next_due = op->sample_index;
+	}
+	else
+	    pusagpio_out_stats.dropped++;
+
+	__sync_synchronize();
+	pusagpio_ops_out = (pusagpio_ops_out + 1) % PUSAGPIO_OPS_SIZE;
+    }
+
+    if (sample_index < pusagpio_next_due)
+	return;
+
+    unsigned long set[2] = { 0, 0 };
+    unsigned long clr[2] = { 0, 0 };
+    unsigned long long next_due = ~0ULL;
+    int n = 0;
+
+    /* Keep queue order so the later of two operations on a pin wins. */
+    for (int i = 0; i < pusagpio_npending; i++)
+    {
+	struct pusagpio_op_s *op = pusagpio_pending + i;
+
+	if (op->sample_index <= sample_index)
+	{
+	    int bank = GPIO_BANK(op->gpio);
+	    unsigned long bit = GPIO_BIT(op->gpio);
+
+	    if (op->on)
+	    {
+		set[bank] |= bit;
+		clr[bank] &= ~bit;
+	    }
+	    else
+	    {
+		clr[bank] |= bit;
+		set[bank] &= ~bit;
+	    }
+
+	    unsigned long late = sample_index - op->sample_index;
+	    if (late > 0)
+		pusagpio_out_stats.late++;
+	    if (late > pusagpio_out_stats.max_late_samples)
+		pusagpio_out_stats.max_late_samples = late;
+	    pusagpio_out_stats.applied++;
+	}
+	else
+	{
+	    if (op->sample_index < next_due)
+		next_due = op->sample_index;
+	    pusagpio_pending[n++] = *op;
+	}
+    }
+
+    pusagpio_npending = n;
+    pusagpio_next_due = next_due;
+
+    for (int bank = 0; bank < 2; bank++)
+    {
+	if (set[bank])
+	    bcmhw_gpio_set_mask(bank, set[bank]);
+	if (clr[bank])
+	    bcmhw_gpio_clear_mask(bank, clr[bank]);
+    }
+}
+
+void pusagpio_get_out_stats(struct pusagpio_out_stats_s *stats)
+{
+    *stats = pusagpio_out_stats;
+}
+
+#ifdef PUSAGPIO_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Runs against the emulated GPIO block (build with -DBCMHW_EMULATE).
+ */
+static unsigned long long test_sample = 0;
+
+unsigned long long pusa_get_sample_index(void)
+{
+    return test_sample;
+}
+
+static unsigned long test_systime = 0;
+
+/* Poll n times, 1 ms and 48 samples apart. */
+static void test_polls(int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+	test_sample += 48;
+	test_systime += 1000;
+	bcmhw_emu_set_system_timer(test_systime);
+	pusagpio_poll();
+    }
+}
+
+/*
+ * A footswitch on GPIO 17, pulled up and closing to ground, and one on
+ * GPIO 40 with edges latched, both debounced over 5 polls at 1 kHz.
+ */
+static void test_inputs(void)
+{
+    struct pusagpio_event_s ev;
+    struct pusagpio_stats_s st;
+
+    bcmhw_emu_gpio_input(17, 1);
+    check(pusagpio_input_add(17, GPIO_PU_ENABLEUP, 1, 5, 0) == 0, "add gpio 17");
+    check(pusagpio_input_add(40, GPIO_PU_ENABLEDOWN, 0, 5, PUSAGPIO_EDGE_LATCH) == 0, "add gpio 40");
+    check((readl(GPREN1) & GPIO_BIT(40)) == 0, "edge detect not armed before start");
+    pusagpio_input_setup(1000);
+    check((readl(GPREN1) & GPIO_BIT(40)) && (readl(GPFEN1) & GPIO_BIT(40)), "edge detect armed");
+
+    test_polls(3);
+    check(pusagpio_get_event(&ev) == 0, "no events while idle");
+
+    /* A clean press is reported after 5 polls, stamped with the first. */
+    bcmhw_emu_gpio_input(17, 0);
+    test_polls(1);
+    unsigned long long pressed_sample = test_sample;
+    unsigned long pressed_time = test_systime;
+    test_polls(3);
+    check(pusagpio_get_event(&ev) == 0, "nothing before the debounce time");
+    test_polls(1);
+    check(pusagpio_get_event(&ev) == 1 && ev.gpio == 17 && ev.pressed == 1, "press");
+    check(ev.sample_index == pressed_sample && ev.systime == pressed_time, "press stamps");
+    check(pusagpio_get_event(&ev) == 0, "one event per press");
+
+    /* Letting go for less than the debounce time is a bounce. */
+    bcmhw_emu_gpio_input(17, 1);
+    test_polls(2);
+    bcmhw_emu_gpio_input(17, 0);
+    test_polls(10);
+    pusagpio_get_stats(&st);
+    check(pusagpio_get_event(&ev) == 0 && st.bounces == 1, "short release ignored");
+
+    /*
+     * GPIO 40 bounces open and closed again between two polls while it
+     * settles.  Only the latched edges show it, and debouncing starts
+     * over, so the press comes 5 polls after that.
+     */
+    bcmhw_emu_gpio_input(40, 1);
+    test_polls(1);
+    pressed_sample = test_sample;
+    pressed_time = test_systime;
+    test_polls(2);
+    bcmhw_emu_gpio_input(40, 0);
+    bcmhw_emu_gpio_input(40, 1);
+    test_polls(4);
+    check(pusagpio_get_event(&ev) == 0, "latched bounce restarts the debounce");
+    test_polls(1);
+    pusagpio_get_stats(&st);
+    check(pusagpio_get_event(&ev) == 1 && ev.gpio == 40 && ev.pressed == 1 &&
+	  ev.sample_index == pressed_sample && ev.systime == pressed_time, "latched press");
+    check(st.bounces == 2, "latched bounce counted");
+
+    /* Both released in the same poll. */
+    bcmhw_emu_gpio_input(17, 1);
+    bcmhw_emu_gpio_input(40, 0);
+    test_polls(5);
+    int released = 0;
+    while (pusagpio_get_event(&ev))
+	if (ev.pressed == 0 && ev.sample_index == test_sample - 4 * 48)
+	    released++;
+    check(released == 2, "releases");
+
+    pusagpio_get_stats(&st);
+    check(st.events == 4 && st.overflows == 0 && st.polls == 3 + 5 + 12 + 8 + 5, "input stats");
+
+    /* Stopping disarms and clears the edge detectors. */
+    check(pusagpio_input_start(1000) == 0, "start");
+    bcmhw_emu_gpio_input(40, 1);
+    pusagpio_input_stop();
+    check((readl(GPREN1) & GPIO_BIT(40)) == 0 && (readl(GPFEN1) & GPIO_BIT(40)) == 0 &&
+	  readl(GPEDS1) == 0, "edge detect disarmed on stop");
+
+    pusagpio_print_stats();
+}
+
+int main(int argc, char **argv)
+{
+    bcmhw_init_emulated();
+
+    pusagpio_output_add(5);
+    pusagpio_output_add(6);
+    pusagpio_output_add(40);
+
+    /* Pulses on three pins, two in the same frame and one in bank 1. */
+    pusagpio_schedule_pulse(5, 100, 10);
+    pusagpio_schedule_pulse(6, 100, 3);
+    pusagpio_schedule_pulse(40, 250, 1);
+
+    int rise5 = -1, fall5 = -1, rise6 = -1, fall6 = -1, rise40 = -1, fall40 = -1;
+    unsigned long max_set_writes = 0;
+
+    for (test_sample = 0; test_sample < 400; test_sample++)
+    {
+	unsigned long before = bcmhw_emu_write_count(GPSET0);
+
+	pusagpio_rt_frame(test_sample);
+
+	unsigned long writes = bcmhw_emu_write_count(GPSET0) - before;
+	if (writes > max_set_writes)
+	    max_set_writes = writes;
+
+	int l5 = bcmhw_gpio_get(5), l6 = bcmhw_gpio_get(6), l40 = bcmhw_gpio_get(40);
+	if (l5 && rise5 < 0) rise5 = test_sample;
+	if (!l5 && rise5 >= 0 && fall5 < 0) fall5 = test_sample;
+	if (l6 && rise6 < 0) rise6 = test_sample;
+	if (!l6 && rise6 >= 0 && fall6 < 0) fall6 = test_sample;
+	if (l40 && rise40 < 0) rise40 = test_sample;
+	if (!l40 && rise40 >= 0 && fall40 < 0) fall40 = test_sample;
+    }
+
+    check(rise5 == 100 && fall5 == 110, "gpio 5 pulse");
+    check(rise6 == 100 && fall6 == 103, "gpio 6 pulse");
+    check(rise40 == 250 && fall40 == 251, "gpio 40 pulse");
+    check(max_set_writes == 1, "one GPSET0 write per frame");
+
+    /* Set and clear queued for the same sample: the later one wins. */
+    pusagpio_schedule(5, 1, 500);
+    pusagpio_schedule(5, 0, 500);
+    for (test_sample = 400; test_sample < 600; test_sample++)
+    {
+	pusagpio_rt_frame(test_sample);
+	check(bcmhw_gpio_get(5) == 0, "gpio 5 stays low");
+    }
+
+    /* Operations scheduled in the past are applied on the next frame. */
+    pusagpio_schedule(6, 1, 10);
+    pusagpio_rt_frame(test_sample);
+    check(bcmhw_gpio_get(6) == 1, "late set applied");
+
+    struct pusagpio_out_stats_s stats;
+    pusagpio_get_out_stats(&stats);
+    check(stats.applied == 9, "applied count");
+    check(stats.late == 1 && stats.max_late_samples == 590, "late accounting");
+
+    printf("applied %lu, late %lu, max late %lu samples, dropped %lu\n",
+	   stats.applied, stats.late, stats.max_late_samples, stats.dropped);
+
+    test_inputs();
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
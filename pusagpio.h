@@ -0,0 +1,71 @@
+/*
+ * Header file for GPIO inputs such as footswitches.
+ */
+
+#ifndef __pusagpio_h__
+#define __pusagpio_h__
+
+#define PUSAGPIO_INPUT_MAX	16
+
+/*
+ * Flags for pusagpio_input_add()
+ *
+ * PUSAGPIO_EDGE_LATCH also uses the pin's edge detector to catch bounces
+ * too short for the polls to see.  Without it inputs are debounced from
+ * the polled levels alone, which is enough for a footswitch.  Only use it
+ * on pins no kernel driver has claimed as interrupts, and expect the
+ * kernel to complain: latched edges hold the GPIO bank interrupt up until
+ * the next poll clears them, and the kernel's handler never clears events
+ * it doesn't own.  If that goes on long enough the kernel disables the
+ * bank interrupt, taking every other GPIO interrupt on the bank with it.
+ * The edge detectors are only armed between pusagpio_input_start() and
+ * pusagpio_input_stop(), or exit.
+ */
+#define PUSAGPIO_EDGE_LATCH	(1 << 0)
+
+struct pusagpio_event_s
+{
+    int gpio;
+    int pressed;
+    unsigned long long sample_index;
+    unsigned long systime;
+};
+
+struct pusagpio_out_stats_s
+{
+    unsigned long applied;
+    unsigned long late;
+    unsigned long max_late_samples;
+    unsigned long dropped;
+};
+
+/*
+ * bounces counts changes abandoned before the debounce time was up, and
+ * edges latched between polls that didn't show in the levels.
+ */
+struct pusagpio_stats_s
+{
+    unsigned long polls;
+    double poll_mean_ns;
+    double poll_max_ns;
+    unsigned long events;
+    double latency_mean_us;
+    double latency_max_us;
+    unsigned long overflows;
+    unsigned long bounces;
+};
+
+int pusagpio_input_add(int gpio, int pull, int active_low, int debounce_ms, int flags);
+int pusagpio_input_start(int poll_hz);
+void pusagpio_input_stop(void);
+int pusagpio_get_event(struct pusagpio_event_s *ev);
+void pusagpio_get_stats(struct pusagpio_stats_s *stats);
+void pusagpio_print_stats(void);
+
+int pusagpio_output_add(int gpio);
+int pusagpio_schedule(int gpio, int on, unsigned long long sample_index);
+int pusagpio_schedule_pulse(int gpio, unsigned long long sample_index, int length);
+void pusagpio_rt_frame(unsigned long long sample_index);
+void pusagpio_get_out_stats(struct pusagpio_out_stats_s *stats);
+
+#endif /* __pusagpio_h__ */
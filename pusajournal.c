@@ -0,0 +1,842 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Session journal.  While recording, the audio thread logs everything
+ * that reaches the handler: each input frame, each pusa_execute_in_rt()
+ * function, and each MIDI message it takes from pusamidi, all tagged with
+ * the sample index.  Entries go into a ring and a worker thread writes
+ * them to a file.  pusajournal_replay() then feeds the same inputs to the
+ * handler through pusa_render() in the same order, so a glitch heard live
+ * can be reproduced offline, under a debugger or profiler, at any speed.
+ *
+ * Replay is exact when the handler starts in the same state it was in
+ * when recording started, so start the journal with the session or have
+ * the first pusa_execute_in_rt() call set the handler up.  A checksum of
+ * the handler's output is kept for every run of frames so replay can tell
+ * where it stopped matching.
+ *
+ * Functions and parameters of pusa_execute_in_rt() calls are stored as
+ * offsets into the executable or library that holds them, so they can be
+ * found again in another process running the same binaries.  Calls with
+ * a parameter on the heap or stack can't be replayed and are skipped.
+ *
+ * File layout: PUSAJOURNAL_MAGIC, the sample rate as 4 bytes, then
+ * records, each a type byte followed by fields.  Numbers are unsigned
+ * LEB128 unless noted.
+ *
+ *   FRAMES  count, 4 byte output checksum, count input frames as 32 bit
+ *           left and right
+ *   SEEK    sample index of the next frame
+ *   OBJECT  object number byte, name length, name
+ *   CALL    object byte and offset of the function, then of the parameter
+ *   MIDI    port byte, length, message
+ *   LOST    number of ring entries dropped
+ *
+ * Everything but FRAMES applies before the next frame.  Fixed size fields
+ * are in host byte order.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <link.h>
+
+#include "bcmhw.h"
+#include "pusa.h"
+#include "pusamidi.h"
+#include "pusajournal.h"
+#include "pusatrace.h"
+
+#define PUSAJOURNAL_MAGIC	"PUSAJRN1"
+
+#define PUSAJOURNAL_FRAMES	1
+#define PUSAJOURNAL_SEEK	2
+#define PUSAJOURNAL_OBJECT	3
+#define PUSAJOURNAL_CALL	4
+#define PUSAJOURNAL_MIDI	5
+#define PUSAJOURNAL_LOST	6
+
+/* Ring entry types beyond the record types. */
+#define PUSAJOURNAL_PARM	7
+#define PUSAJOURNAL_MORE	8
+
+/* Object numbers for pointers outside any loaded object. */
+#define PUSAJOURNAL_NULL	0
+#define PUSAJOURNAL_UNKNOWN	255
+
+#define PUSAJOURNAL_INDEX_MASK	((1ULL << 56) - 1)
+
+#define PUSAJOURNAL_FNV_BASIS	2166136261u
+#define PUSAJOURNAL_FNV_PRIME	16777619u
+
+/*
+ * tag has the type in the top byte and the sample index below it.  A
+ * frame has the input in value and a mix of the output in check.  A MIDI
+ * message has up to 8 bytes in value and the port and length in check,
+ * with MORE entries for longer ones.  A call is a CALL entry with the
+ * function and a PARM entry with the parameter.
+ */
+struct pusajournal_entry_s
+{
+    unsigned long long tag;
+    unsigned long long value;
+    unsigned int check;
+};
+
+/*
+ * Audio thread to worker.  Single producer, single consumer.  While the
+ * audio thread is stopped, pusa_execute_in_rt() calls are added from the
+ * calling thread instead.
+ */
+static struct pusajournal_entry_s pusajournal_rt_ring[PUSAJOURNAL_RT_RING];
+static volatile unsigned int pusajournal_rt_in = 0;
+static volatile unsigned int pusajournal_rt_out = 0;
+static volatile int pusajournal_recording = 0;
+static unsigned long pusajournal_lost = 0;
+static int pusajournal_input[2];
+static unsigned int pusajournal_sample_count = 0;
+static unsigned long long pusajournal_rt_cycles = 0;
+static unsigned long long pusajournal_rt_max = 0;
+static unsigned long pusajournal_rt_samples = 0;
+
+static FILE *volatile pusajournal_fp = NULL;
+static volatile int pusajournal_stopping = 0;
+static int pusajournal_worker_started = 0;
+
+/* Worker state for the file being written. */
+static int pusajournal_run[PUSAJOURNAL_RUN * 2];
+static int pusajournal_run_len = 0;
+static unsigned int pusajournal_run_hash = 0;
+static unsigned long long pusajournal_next_index = 0;
+static char *pusajournal_objects[PUSAJOURNAL_MAX_OBJECTS];
+static int pusajournal_nobjects = 0;
+
+static pthread_mutex_t pusajournal_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pusajournal_stats_s pusajournal_stats;
+
+static inline unsigned int pusajournal_mix(const int *data)
+{
+    return ((unsigned int) data[0] * 0x9e3779b1u) ^ ((unsigned int) data[1] * 0x85ebca6bu);
+}
+
+static void pusajournal_put_number(FILE *fp, unsigned long long v)
+{
+    do
+    {
+	int byte = v & 0x7f;
+	v >>= 7;
+	fputc(v ? byte | 0x80 : byte, fp);
+    } while (v);
+}
+
+static int pusajournal_get_number(FILE *fp, unsigned long long *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+	int byte = fgetc(fp);
+	if (byte == EOF)
+	    return -1;
+	*v |= (unsigned long long) (byte & 0x7f) << shift;
+	if (!(byte & 0x80))
+	    return 0;
+    }
+
+    return -1;
+}
+
+static const char *pusajournal_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+/*
+ * Object number and offset for addr, writing an OBJECT record the first
+ * time an object is seen.
+ */
+static int pusajournal_ref(FILE *fp, const void *addr, unsigned long long *offset)
+{
+    Dl_info info;
+
+    *offset = 0;
+    if (addr == NULL)
+	return PUSAJOURNAL_NULL;
+    if (!dladdr(addr, &info) || info.dli_fname == NULL)
+	return PUSAJOURNAL_UNKNOWN;
+
+    *offset = (const char *) addr - (const char *) info.dli_fbase;
+
+    const char *name = pusajournal_basename(info.dli_fname);
+    for (int i = 0; i < pusajournal_nobjects; i++)
+	if (strcmp(pusajournal_objects[i], name) == 0)
+	    return i + 1;
+
+    if (pusajournal_nobjects == PUSAJOURNAL_MAX_OBJECTS)
+	return PUSAJOURNAL_UNKNOWN;
+
+    pusajournal_objects[pusajournal_nobjects++] = strdup(name);
+    fputc(PUSAJOURNAL_OBJECT, fp);
+    fputc(pusajournal_nobjects, fp);
+    pusajournal_put_number(fp, strlen(name));
+    fwrite(name, strlen(name), 1, fp);
+
+    return pusajournal_nobjects;
+}
+
+static void pusajournal_flush_run(FILE *fp)
+{
+    if (pusajournal_run_len == 0)
+	return;
+
+    fputc(PUSAJOURNAL_FRAMES, fp);
+    pusajournal_put_number(fp, pusajournal_run_len);
+    fwrite(&pusajournal_run_hash, 4, 1, fp);
+    fwrite(pusajournal_run, 8, pusajournal_run_len, fp);
+    pusajournal_run_len = 0;
+}
+
+/*
+ * Make the next frame in the file the one at index.
+ */
+static void pusajournal_seek(FILE *fp, unsigned long long index)
+{
+    if (index == pusajournal_next_index)
+	return;
+
+    pusajournal_flush_run(fp);
+    fputc(PUSAJOURNAL_SEEK, fp);
+    pusajournal_put_number(fp, index);
+    pusajournal_next_index = index;
+}
+
+/*
+ * Write out one entry, and any that belong with it.  Returns the number
+ * of entries used.
+ */
+static int pusajournal_write_entry(FILE *fp, unsigned int pos)
+{
+    struct pusajournal_entry_s *e = pusajournal_rt_ring + pos;
+    unsigned long long index = e->tag & PUSAJOURNAL_INDEX_MASK;
+    int type = e->tag >> 56;
+
+    if (type == PUSAJOURNAL_LOST)
+    {
+	pusajournal_flush_run(fp);
+	fputc(PUSAJOURNAL_LOST, fp);
+	pusajournal_put_number(fp, e->value);
+	return 1;
+    }
+
+    pusajournal_seek(fp, index);
+
+    if (type == PUSAJOURNAL_FRAMES)
+    {
+	if (pusajournal_run_len == 0)
+	    pusajournal_run_hash = PUSAJOURNAL_FNV_BASIS;
+	memcpy(pusajournal_run + 2 * pusajournal_run_len, &e->value, 8);
+	pusajournal_run_hash = (pusajournal_run_hash ^ e->check) * PUSAJOURNAL_FNV_PRIME;
+	pusajournal_next_index++;
+	if (++pusajournal_run_len == PUSAJOURNAL_RUN)
+	    pusajournal_flush_run(fp);
+	pusajournal_stats.frames++;
+	return 1;
+    }
+
+    pusajournal_flush_run(fp);
+
+    if (type == PUSAJOURNAL_CALL)
+    {
+	struct pusajournal_entry_s *parm = pusajournal_rt_ring + (pos + 1) % PUSAJOURNAL_RT_RING;
+	unsigned long long func_offset, parm_offset;
+	int func_object = pusajournal_ref(fp, (void *) (unsigned long) e->value, &func_offset);
+	int parm_object = pusajournal_ref(fp, (void *) (unsigned long) parm->value, &parm_offset);
+
+	fputc(PUSAJOURNAL_CALL, fp);
+	fputc(func_object, fp);
+	pusajournal_put_number(fp, func_offset);
+	fputc(parm_object, fp);
+	pusajournal_put_number(fp, parm_offset);
+	pusajournal_stats.calls++;
+	return 2;
+    }
+
+    /* MIDI, with 8 bytes in each entry. */
+    int port = e->check & 0xff;
+    int len = e->check >> 8;
+    int n = (len + 7) / 8;
+
+    fputc(PUSAJOURNAL_MIDI, fp);
+    fputc(port, fp);
+    pusajournal_put_number(fp, len);
+    for (int i = 0; i < n; i++)
+    {
+	struct pusajournal_entry_s *more = pusajournal_rt_ring + (pos + i) % PUSAJOURNAL_RT_RING;
+	fwrite(&more->value, len - 8 * i < 8 ? len - 8 * i : 8, 1, fp);
+    }
+    pusajournal_stats.midi++;
+
+    return n;
+}
+
+static void *pusajournal_worker(void *arg)
+{
+    struct timespec start, end;
+
+    PUSATRACE_THREAD("journal");
+
+    while (1)
+    {
+	FILE *fp = pusajournal_fp;
+
+	if (fp == NULL || pusajournal_rt_out == pusajournal_rt_in)
+	{
+	    if (fp != NULL && pusajournal_stopping)
+	    {
+		pusajournal_flush_run(fp);
+		fflush(fp);
+		__sync_synchronize();
+		pusajournal_stopping = 0;
+	    }
+
+	    usleep(1000);
+	    continue;
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	PUSATRACE_BEGIN(PUSATRACE_JOURNAL);
+	pthread_mutex_lock(&pusajournal_lock);
+	while (pusajournal_rt_out != pusajournal_rt_in)
+	{
+	    __sync_synchronize();
+	    int used = pusajournal_write_entry(fp, pusajournal_rt_out);
+
+	    __sync_synchronize();
+	    pusajournal_rt_out = (pusajournal_rt_out + used) % PUSAJOURNAL_RT_RING;
+	}
+	pusajournal_stats.bytes = ftell(fp);
+	pthread_mutex_unlock(&pusajournal_lock);
+	PUSATRACE_END(PUSATRACE_JOURNAL);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+	pusajournal_stats.worker_cpu += (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    return NULL;
+}
+
+/*
+ * Room for n entries, with a LOST entry ahead of them if anything was
+ * dropped since the last one.  Returns the slot to fill or -1.
+ */
+static inline int pusajournal_reserve(int n)
+{
+    unsigned int in = pusajournal_rt_in;
+    unsigned int used = (in - pusajournal_rt_out + PUSAJOURNAL_RT_RING) % PUSAJOURNAL_RT_RING;
+
+    if (used + n + (pusajournal_lost != 0) >= PUSAJOURNAL_RT_RING)
+    {
+	pusajournal_lost += n;
+	pusajournal_stats.rt_overflows++;
+	return -1;
+    }
+
+    if (pusajournal_lost)
+    {
+	pusajournal_rt_ring[in].tag = (unsigned long long) PUSAJOURNAL_LOST << 56;
+	pusajournal_rt_ring[in].value = pusajournal_lost;
+	pusajournal_lost = 0;
+	in = (in + 1) % PUSAJOURNAL_RT_RING;
+    }
+
+    return in;
+}
+
+static inline void pusajournal_publish(unsigned int in)
+{
+    __sync_synchronize();
+    pusajournal_rt_in = in % PUSAJOURNAL_RT_RING;
+}
+
+/*
+ * Remember the frame going into the handler.  Audio thread only.
+ */
+void pusajournal_rt_input(const int *data)
+{
+    pusajournal_input[0] = data[0];
+    pusajournal_input[1] = data[1];
+}
+
+/*
+ * Log the frame given to pusajournal_rt_input() with what the handler
+ * made of it.  Audio thread only.
+ */
+void pusajournal_rt_output(unsigned long long sample_index, const int *data)
+{
+    if (!pusajournal_recording)
+	return;
+
+    unsigned long long start = 0;
+    int timed = ++pusajournal_sample_count == PUSAJOURNAL_SAMPLE;
+    if (timed)
+    {
+	pusajournal_sample_count = 0;
+	start = bcmhw_cycles();
+    }
+
+    int in = pusajournal_reserve(1);
+    if (in >= 0)
+    {
+	struct pusajournal_entry_s *e = pusajournal_rt_ring + in;
+	e->tag = (unsigned long long) PUSAJOURNAL_FRAMES << 56 | sample_index;
+	memcpy(&e->value, pusajournal_input, 8);
+	e->check = pusajournal_mix(data);
+	pusajournal_publish(in + 1);
+    }
+
+    if (timed)
+    {
+	unsigned long long cycles = bcmhw_cycles() - start;
+	pusajournal_rt_cycles += cycles;
+	pusajournal_rt_samples++;
+	if (cycles > pusajournal_rt_max)
+	    pusajournal_rt_max = cycles;
+    }
+}
+
+/*
+ * Log a pusa_execute_in_rt() function about to run before the frame at
+ * sample_index.
+ */
+void pusajournal_rt_call(unsigned long long sample_index, pusa_rt_func func, void *parm)
+{
+    if (!pusajournal_recording)
+	return;
+
+    int in = pusajournal_reserve(2);
+    if (in < 0)
+	return;
+
+    struct pusajournal_entry_s *e = pusajournal_rt_ring + in;
+    e->tag = (unsigned long long) PUSAJOURNAL_CALL << 56 | sample_index;
+    e->value = (unsigned long) func;
+    e = pusajournal_rt_ring + (in + 1) % PUSAJOURNAL_RT_RING;
+    e->tag = (unsigned long long) PUSAJOURNAL_PARM << 56 | sample_index;
+    e->value = (unsigned long) parm;
+    pusajournal_publish(in + 2);
+}
+
+/*
+ * Called by pusamidi for every message taken from its queues.  Only the
+ * ones the audio thread takes reach the handler.
+ */
+static void pusajournal_rt_midi(int port, const unsigned char *msg, int len)
+{
+    if (!pusajournal_recording || !pusa_in_rt_thread())
+	return;
+
+    int n = (len + 7) / 8;
+    int in = pusajournal_reserve(n);
+    if (in < 0)
+	return;
+
+    unsigned long long index = pusa_get_sample_index();
+    for (int i = 0; i < n; i++)
+    {
+	struct pusajournal_entry_s *e = pusajournal_rt_ring + (in + i) % PUSAJOURNAL_RT_RING;
+	int type = i == 0 ? PUSAJOURNAL_MIDI : PUSAJOURNAL_MORE;
+
+	e->tag = (unsigned long long) type << 56 | index;
+	e->value = 0;
+	memcpy(&e->value, msg + 8 * i, len - 8 * i < 8 ? len - 8 * i : 8);
+	e->check = port | len << 8;
+    }
+    pusajournal_publish(in + n);
+}
+
+/*
+ * Start journalling to path.
+ */
+int pusajournal_start(const char *path)
+{
+    if (pusajournal_fp != NULL)
+    {
+	printf("pusajournal: already recording\n");
+	return -1;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, PUSAJOURNAL_IO_BUFFER);
+
+    unsigned int rate = pusa_get_sample_rate();
+    fwrite(PUSAJOURNAL_MAGIC, 8, 1, fp);
+    fwrite(&rate, 4, 1, fp);
+
+    if (!pusajournal_worker_started)
+    {
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, pusajournal_worker, NULL) != 0)
+	{
+	    pthread_attr_destroy(&attr);
+	    fclose(fp);
+	    return -1;
+	}
+	pthread_attr_destroy(&attr);
+	pusajournal_worker_started = 1;
+    }
+
+    /* The worker is idle until pusajournal_fp is set. */
+    for (int i = 0; i < pusajournal_nobjects; i++)
+	free(pusajournal_objects[i]);
+    pusajournal_nobjects = 0;
+    pusajournal_run_len = 0;
+    pusajournal_next_index = ~0ULL;
+    pusajournal_lost = 0;
+    pusajournal_rt_out = pusajournal_rt_in;
+    memset(&pusajournal_stats, 0, sizeof(pusajournal_stats));
+    pusajournal_rt_cycles = pusajournal_rt_max = pusajournal_rt_samples = 0;
+
+    pusamidi_set_read_callback(pusajournal_rt_midi);
+    pusajournal_fp = fp;
+    __sync_synchronize();
+    pusajournal_recording = 1;
+
+    return 0;
+}
+
+/*
+ * Stop journalling and close the file once everything logged is written.
+ */
+int pusajournal_stop(void)
+{
+    FILE *fp = pusajournal_fp;
+
+    if (fp == NULL)
+	return -1;
+
+    pusajournal_recording = 0;
+    pusamidi_set_read_callback(NULL);
+    __sync_synchronize();
+
+    pusajournal_stopping = 1;
+    while (pusajournal_stopping)
+	usleep(1000);
+
+    pthread_mutex_lock(&pusajournal_lock);
+    int status = ferror(fp) ? -1 : 0;
+    pusajournal_stats.bytes = ftell(fp);
+    if (fclose(fp) != 0)
+	status = -1;
+    pusajournal_fp = NULL;
+    pthread_mutex_unlock(&pusajournal_lock);
+
+    return status;
+}
+
+struct pusajournal_find_s
+{
+    const char *name;
+    void *base;
+};
+
+static int pusajournal_find_object(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    struct pusajournal_find_s *find = arg;
+    Dl_info dl;
+
+    /* Name objects the way dladdr() did when recording. */
+    for (int i = 0; i < info->dlpi_phnum; i++)
+    {
+	if (info->dlpi_phdr[i].p_type != PT_LOAD)
+	    continue;
+
+	void *addr = (void *) (info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+	if (dladdr(addr, &dl) && dl.dli_fname != NULL &&
+	    strcmp(pusajournal_basename(dl.dli_fname), find->name) == 0)
+	{
+	    find->base = dl.dli_fbase;
+	    return 1;
+	}
+	break;
+    }
+
+    return 0;
+}
+
+static double pusajournal_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Play a journal back through handler.  The audio thread must be stopped.
+ * Returns 0 if the journal was read to the end, whether or not the output
+ * matched.
+ */
+int pusajournal_replay(const char *path, pusa_audio_handler_t handler,
+		       struct pusajournal_replay_s *replay)
+{
+    static int frames[PUSAJOURNAL_RUN * 2];
+    void *bases[PUSAJOURNAL_MAX_OBJECTS + 1] = { NULL };
+    unsigned char msg[256];
+    char magic[8], name[256];
+    unsigned int rate;
+    unsigned long long index = 0, v;
+
+    double speed = replay->speed;
+    memset(replay, 0, sizeof(*replay));
+    replay->speed = speed;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, PUSAJOURNAL_IO_BUFFER);
+
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, PUSAJOURNAL_MAGIC, 8) != 0 ||
+	fread(&rate, 4, 1, fp) != 1 || pusa_render_init(rate, handler) < 0)
+    {
+	printf("%s: not a journal, or audio running\n", path);
+	fclose(fp);
+	return -1;
+    }
+
+    double start = pusajournal_now();
+    int status = 0, type;
+
+    while (status == 0 && (type = fgetc(fp)) != EOF)
+    {
+	if (type == PUSAJOURNAL_FRAMES)
+	{
+	    unsigned int hash, check = PUSAJOURNAL_FNV_BASIS;
+
+	    if (pusajournal_get_number(fp, &v) < 0 || v == 0 || v > PUSAJOURNAL_RUN ||
+		fread(&hash, 4, 1, fp) != 1 || fread(frames, 8, v, fp) != v)
+	    {
+		status = -1;
+		break;
+	    }
+
+	    for (int i = 0; i < (int) v; i++)
+	    {
+		pusa_render(frames + 2 * i, 1);
+		check = (check ^ pusajournal_mix(frames + 2 * i)) * PUSAJOURNAL_FNV_PRIME;
+	    }
+
+	    if (check != hash && replay->mismatched_runs++ == 0)
+		replay->first_mismatch = index;
+	    replay->runs++;
+	    replay->frames += v;
+	    index += v;
+
+	    /* Hold back to the requested speed. */
+	    if (speed > 0)
+	    {
+		double due = start + replay->frames / (rate * speed);
+		double now = pusajournal_now();
+		if (due > now)
+		    usleep((due - now) * 1e6);
+	    }
+	}
+	else if (type == PUSAJOURNAL_SEEK)
+	{
+	    if (pusajournal_get_number(fp, &index) < 0)
+		status = -1;
+	    else
+		pusa_render_seek(index);
+	}
+	else if (type == PUSAJOURNAL_OBJECT)
+	{
+	    int id = fgetc(fp);
+	    if (id < 1 || id > PUSAJOURNAL_MAX_OBJECTS || pusajournal_get_number(fp, &v) < 0 ||
+		v >= sizeof(name) || fread(name, 1, v, fp) != v)
+	    {
+		status = -1;
+		break;
+	    }
+	    name[v] = '\0';
+
+	    struct pusajournal_find_s find = { name, NULL };
+	    dl_iterate_phdr(pusajournal_find_object, &find);
+	    bases[id] = find.base;
+	    if (find.base == NULL)
+		printf("pusajournal: %s is not loaded, its calls are skipped\n", name);
+	}
+	else if (type == PUSAJOURNAL_CALL)
+	{
+	    void *ptr[2];
+	    int ok = 1;
+
+	    for (int i = 0; i < 2; i++)
+	    {
+		int id = fgetc(fp);
+		if (id == EOF || pusajournal_get_number(fp, &v) < 0)
+		{
+		    status = -1;
+		    break;
+		}
+
+		ptr[i] = NULL;
+		if (id == PUSAJOURNAL_UNKNOWN || id > PUSAJOURNAL_MAX_OBJECTS ||
+		    (id != PUSAJOURNAL_NULL && bases[id] == NULL))
+		    ok = 0;
+		else if (id != PUSAJOURNAL_NULL)
+		    ptr[i] = (char *) bases[id] + v;
+	    }
+
+	    if (status < 0)
+		break;
+	    if (ok && ptr[0] != NULL)
+	    {
+		((pusa_rt_func) ptr[0])(ptr[1]);
+		replay->calls++;
+	    }
+	    else
+		replay->skipped_calls++;
+	}
+	else if (type == PUSAJOURNAL_MIDI)
+	{
+	    int port = fgetc(fp);
+	    if (port == EOF || pusajournal_get_number(fp, &v) < 0 || v > sizeof(msg) ||
+		fread(msg, 1, v, fp) != v)
+	    {
+		status = -1;
+		break;
+	    }
+	    pusamidi_inject(port, msg, v);
+	    replay->midi++;
+	}
+	else if (type == PUSAJOURNAL_LOST)
+	{
+	    if (pusajournal_get_number(fp, &v) < 0)
+		status = -1;
+	    replay->gaps++;
+	}
+	else
+	    status = -1;
+    }
+
+    if (status < 0)
+	printf("%s: journal damaged after %llu frames\n", path, replay->frames);
+
+    replay->seconds = pusajournal_now() - start;
+    fclose(fp);
+
+    return status;
+}
+
+void pusajournal_get_stats(struct pusajournal_stats_s *stats)
+{
+    pthread_mutex_lock(&pusajournal_lock);
+    *stats = pusajournal_stats;
+    pthread_mutex_unlock(&pusajournal_lock);
+
+    double ns_per_cycle = 1e9 / bcmhw_cycles_per_sec();
+    if (pusajournal_rt_samples)
+	stats->rt_ns_mean = pusajournal_rt_cycles * ns_per_cycle / pusajournal_rt_samples;
+    stats->rt_ns_max = pusajournal_rt_max * ns_per_cycle;
+}
+
+void pusajournal_print_stats(void)
+{
+    struct pusajournal_stats_s st;
+
+    pusajournal_get_stats(&st);
+    printf("journal: %llu frames, %lu calls, %lu MIDI messages, %.1f bytes/frame, "
+	   "rt %.0f ns/frame (max %.0f), worker %.3f s cpu\n",
+	   st.frames, st.calls, st.midi, st.frames ? (double) st.bytes / st.frames : 0.0,
+	   st.rt_ns_mean, st.rt_ns_max, st.worker_cpu);
+    if (st.rt_overflows)
+	printf("  %lu entries dropped, replay will not be exact\n", st.rt_overflows);
+}
+
+#ifdef PUSAJOURNAL_BENCH
+/*
+ * Audio thread cost of journalling, frame by frame at roughly the audio
+ * rate so the worker keeps up, against the same loop not recording.
+ */
+static double bench_frames(int seconds)
+{
+    int data[2] = { 0, 0 };
+    unsigned long long cycles = 0;
+    int nframes = seconds * pusa_get_sample_rate();
+
+    for (int i = 0; i < nframes; i++)
+    {
+	data[0] = i << 8;
+	data[1] = -data[0];
+
+	unsigned long long start = bcmhw_cycles();
+	pusajournal_rt_input(data);
+	pusajournal_rt_output(i, data);
+	cycles += bcmhw_cycles() - start;
+
+	if (i % 48 == 47)
+	    usleep(1000);
+    }
+
+    return cycles * 1e9 / bcmhw_cycles_per_sec() / nframes;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/tmp/pusajournal.bench";
+
+    double off = bench_frames(2);
+    if (pusajournal_start(path) < 0)
+	return 1;
+    double on = bench_frames(5);
+    pusajournal_stop();
+
+    printf("not recording: %.1f ns/frame\n", off);
+    printf("recording:     %.1f ns/frame\n", on);
+    pusajournal_print_stats();
+
+    struct pusajournal_stats_s st;
+    pusajournal_get_stats(&st);
+    printf("%.1f kB per second of audio, worker %.2f%% of a core\n",
+	   st.bytes / 5.0 / 1000, st.worker_cpu / 5.0 * 100);
+    unlink(path);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Header file for the session journal.
+ */
+
+#ifndef __pusajournal_h__
+#define __pusajournal_h__
+
+#include "pusa.h"
+
+#define PUSAJOURNAL_RT_RING	16384
+#define PUSAJOURNAL_RUN		4096
+#define PUSAJOURNAL_MAX_OBJECTS	64
+#define PUSAJOURNAL_IO_BUFFER	(1024 * 1024)
+
+/* One in this many frames has its journal cost timed. */
+#define PUSAJOURNAL_SAMPLE	64
+
+/*
+ * rt_ns is the time the audio thread spends adding a frame to the
+ * journal, from sampled frames.
+ */
+struct pusajournal_stats_s
+{
+    unsigned long long frames;
+    unsigned long calls;
+    unsigned long midi;
+    unsigned long rt_overflows;
+    unsigned long long bytes;
+    double rt_ns_mean;
+    double rt_ns_max;
+    double worker_cpu;
+};
+
+/*
+ * speed is set by the caller: 0 replays as fast as possible, 1 in real
+ * time.  A run is a stretch of up to PUSAJOURNAL_RUN frames with a
+ * checksum of the handler's output; mismatched runs differ from what was
+ * heard when recording and first_mismatch is the first frame of the first
+ * of them.  gaps counts places where the journal lost data, after which
+ * replay can't be exact.  Calls whose function or parameter isn't in a
+ * loaded object of the same name are skipped.
+ */
+struct pusajournal_replay_s
+{
+    double speed;
+    unsigned long long frames;
+    unsigned long calls;
+    unsigned long skipped_calls;
+    unsigned long midi;
+    unsigned long gaps;
+    unsigned long runs;
+    unsigned long mismatched_runs;
+    unsigned long long first_mismatch;
+    double seconds;
+};
+
+int pusajournal_start(const char *path);
+int pusajournal_stop(void);
+void pusajournal_rt_input(const int *data);
+void pusajournal_rt_output(unsigned long long sample_index, const int *data);
+void pusajournal_rt_call(unsigned long long sample_index, pusa_rt_func func, void *parm);
+int pusajournal_replay(const char *path, pusa_audio_handler_t handler,
+		       struct pusajournal_replay_s *replay);
+void pusajournal_get_stats(struct pusajournal_stats_s *stats);
+void pusajournal_print_stats(void);
+
+#endif /* __pusajournal_h__ */
@@ -0,0 +1,289 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Round trip latency with the output connected to the input.  A maximum
+ * length sequence is played for two of its periods and the second period
+ * recorded; the circular cross correlation of the two peaks at the delay.
+ * An MLS correlates with itself at every lag but one to -1/N, so the peak
+ * stands out even at low levels and through noise.
+ *
+ * Two measurements are made, one after the other:
+ *
+ *   loop      the sequence replaces the handler's output just before the
+ *             transmit FIFO and is recorded as it comes back in from the
+ *             receive FIFO
+ *   pipeline  the sequence replaces the handler's input and is recorded
+ *             at the transmit FIFO
+ *
+ * The round trip is the sum.  The audio thread only plays and records;
+ * correlating is done by whoever polls for the result.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "pusa.h"
+#include "pusalatency.h"
+
+/* Galois feedback taps giving the full 4095 frame period. */
+#define PUSALATENCY_MLS_TAPS	0xe08
+
+#define PUSALATENCY_PERIODS	2
+#define PUSALATENCY_TIMEOUT_MS	5000
+
+#define PUSALATENCY_IDLE	0
+#define PUSALATENCY_LOOP	1
+#define PUSALATENCY_PIPELINE	2
+#define PUSALATENCY_DONE	3
+
+static signed char pusalatency_mls[PUSALATENCY_MLS_LENGTH];
+static int pusalatency_loop_rec[PUSALATENCY_MLS_LENGTH][2];
+static int pusalatency_pipeline_rec[PUSALATENCY_MLS_LENGTH][2];
+static volatile int pusalatency_state = PUSALATENCY_IDLE;
+static int pusalatency_pos = 0;
+
+static void pusalatency_make_mls(void)
+{
+    unsigned int lfsr = 1;
+
+    for (int i = 0; i < PUSALATENCY_MLS_LENGTH; i++)
+    {
+	pusalatency_mls[i] = (lfsr & 1) ? 1 : -1;
+	lfsr = (lfsr >> 1) ^ ((lfsr & 1) ? PUSALATENCY_MLS_TAPS : 0);
+    }
+}
+
+/*
+ * Recording starts one period in, so anything the signal has to settle
+ * is already past and the recording is one whole period of the loop.
+ */
+static void pusalatency_rt_record(int (*rec)[2], const int *data)
+{
+    int i = pusalatency_pos - PUSALATENCY_MLS_LENGTH;
+
+    if (i >= 0 && i < PUSALATENCY_MLS_LENGTH)
+    {
+	rec[i][0] = data[0];
+	rec[i][1] = data[1];
+    }
+}
+
+static void pusalatency_rt_play(int *data)
+{
+    int value = pusalatency_mls[pusalatency_pos % PUSALATENCY_MLS_LENGTH] * PUSALATENCY_LEVEL;
+
+    data[0] = value;
+    data[1] = value;
+}
+
+/*
+ * Called by the audio thread with each frame as received, before the
+ * handler.
+ */
+void pusalatency_rt_input(int *data)
+{
+    int state = pusalatency_state;
+
+    if (state == PUSALATENCY_LOOP)
+	pusalatency_rt_record(pusalatency_loop_rec, data);
+    else if (state == PUSALATENCY_PIPELINE)
+	pusalatency_rt_play(data);
+}
+
+/*
+ * Called by the audio thread with each frame just before it goes to the
+ * transmit FIFO.  The frame count advances here, so a frame played here
+ * and heard back n frames later is recorded n positions on.
+ */
+void pusalatency_rt_output(int *data)
+{
+    int state = pusalatency_state;
+
+    if (state == PUSALATENCY_LOOP)
+	pusalatency_rt_play(data);
+    else if (state == PUSALATENCY_PIPELINE)
+	pusalatency_rt_record(pusalatency_pipeline_rec, data);
+    else
+	return;
+
+    if (++pusalatency_pos < PUSALATENCY_PERIODS * PUSALATENCY_MLS_LENGTH)
+	return;
+
+    /* Whoever gave up on the measurement may have reset the state. */
+    pusalatency_pos = 0;
+    __sync_synchronize();
+    __sync_bool_compare_and_swap(&pusalatency_state, state, state + 1);
+}
+
+/*
+ * Correlate a recording against the sequence.  Both channels are summed
+ * so it doesn't matter which is connected, and an inverted signal counts
+ * too.  The peak is interpolated between lags with a parabola.
+ */
+static double pusalatency_correlate(int (*rec)[2], double *confidence, double *psr_db)
+{
+    static double x[PUSALATENCY_MLS_LENGTH];
+    static double r[PUSALATENCY_MLS_LENGTH];
+    int n = PUSALATENCY_MLS_LENGTH;
+    double energy = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+	x[i] = ((double) rec[i][0] + rec[i][1]) / 2;
+	energy += x[i] * x[i];
+    }
+
+    /* Recording position i is sequence position i - k, mod n. */
+    int peak = 0;
+    for (int k = 0; k < n; k++)
+    {
+	double sum = 0;
+	for (int i = 0, j = n - k; i < n; i++, j++)
+	{
+	    if (j == n)
+		j = 0;
+	    sum += x[i] * pusalatency_mls[j];
+	}
+	r[k] = sum;
+	if (fabs(r[k]) > fabs(r[peak]))
+	    peak = k;
+    }
+
+    double sidelobe = 0;
+    for (int k = 0; k < n; k++)
+	if (k != peak && fabs(r[k]) > sidelobe)
+	    sidelobe = fabs(r[k]);
+
+    /* The lags wrap around. */
+    double best = fabs(r[peak]);
+    double prev = fabs(r[(peak + n - 1) % n]);
+    double next = fabs(r[(peak + 1) % n]);
+    double lag = peak;
+    if (prev - 2 * best + next < 0)
+	lag += 0.5 * (prev - next) / (prev - 2 * best + next);
+
+    *confidence = energy > 0 ? best / sqrt(energy * n) : 0;
+    *psr_db = 20 * log10((best + 1e-9) / (sidelobe + 1e-9));
+
+    return lag;
+}
+
+/*
+ * Start a measurement.  The output is replaced by the test signal for
+ * the whole of it, about half a second at 48 kHz.
+ */
+int pusalatency_start(void)
+{
+    if (pusalatency_state != PUSALATENCY_IDLE)
+    {
+	printf("pusalatency: measurement already running\n");
+	return -1;
+    }
+
+    pusalatency_make_mls();
+    pusalatency_pos = 0;
+    __sync_synchronize();
+    pusalatency_state = PUSALATENCY_LOOP;
+
+    return 0;
+}
+
+/*
+ * Returns 1 and fills in result once the measurement started by
+ * pusalatency_start() is complete, 0 while it is running and -1 if none
+ * was started.
+ */
+int pusalatency_poll(struct pusalatency_result_s *result)
+{
+    double loop_confidence, pipeline_confidence;
+    double loop_psr, pipeline_psr;
+
+    int state = pusalatency_state;
+    if (state == PUSALATENCY_IDLE)
+	return -1;
+    if (state != PUSALATENCY_DONE)
+	return 0;
+    __sync_synchronize();
+
+    memset(result, 0, sizeof(*result));
+    result->sample_rate = pusa_get_sample_rate();
+    result->loop_frames = pusalatency_correlate(pusalatency_loop_rec, &loop_confidence, &loop_psr);
+    result->pipeline_frames = pusalatency_correlate(pusalatency_pipeline_rec,
+						    &pipeline_confidence, &pipeline_psr);
+    result->round_trip_frames = result->loop_frames + result->pipeline_frames;
+    if (result->sample_rate > 0)
+	result->round_trip_us = result->round_trip_frames * 1e6 / result->sample_rate;
+    result->fifo_frames = pusa_get_prefill_frames();
+    result->converter_frames = result->loop_frames - result->fifo_frames;
+    result->confidence = fmin(loop_confidence, pipeline_confidence);
+    result->psr_db = fmin(loop_psr, pipeline_psr);
+
+    pusalatency_state = PUSALATENCY_IDLE;
+
+    return 1;
+}
+
+/*
+ * Measure and wait for the result.  Fails if the audio thread isn't
+ * running or the test signal can't be found in what came back.
+ */
+int pusalatency_measure(struct pusalatency_result_s *result)
+{
+    if (pusalatency_start() < 0)
+	return -1;
+
+    int rc = 0;
+    for (int ms = 0; ms < PUSALATENCY_TIMEOUT_MS && rc == 0; ms++)
+    {
+	usleep(1000);
+	rc = pusalatency_poll(result);
+    }
+
+    if (rc <= 0)
+    {
+	printf("pusalatency: timed out, is audio running?\n");
+	pusalatency_state = PUSALATENCY_IDLE;
+	return -1;
+    }
+
+    if (result->confidence < PUSALATENCY_MIN_CONFIDENCE)
+    {
+	printf("pusalatency: no clear peak, confidence %.2f, is the output connected to the input?\n",
+	       result->confidence);
+	return -1;
+    }
+
+    return 0;
+}
+
+void pusalatency_print(const struct pusalatency_result_s *result)
+{
+    double ms = result->sample_rate > 0 ? 1000.0 / result->sample_rate : 0;
+
+    printf("Round trip latency: %.2f frames, %.0f us (confidence %.2f, peak to sidelobe %.1f dB)\n",
+	   result->round_trip_frames, result->round_trip_us, result->confidence, result->psr_db);
+    printf("  pipeline     %8.2f frames %8.3f ms\n", result->pipeline_frames, result->pipeline_frames * ms);
+    printf("  FIFO prefill %8d frames %8.3f ms\n", result->fifo_frames, result->fifo_frames * ms);
+    printf("  converters   %8.2f frames %8.3f ms\n", result->converter_frames, result->converter_frames * ms);
+}
@@ -0,0 +1,49 @@
+/*
+ * Header file for round trip latency measurement.
+ */
+
+#ifndef __pusalatency_h__
+#define __pusalatency_h__
+
+#define PUSALATENCY_MLS_ORDER	12
+#define PUSALATENCY_MLS_LENGTH	((1 << PUSALATENCY_MLS_ORDER) - 1)
+
+/* Test signal level, about -20 dBFS for 24 bit samples. */
+#define PUSALATENCY_LEVEL	((1 << 23) / 10)
+
+/* Below this the peak is more likely noise than the test signal. */
+#define PUSALATENCY_MIN_CONFIDENCE	0.5
+
+/*
+ * All delays are in frames, fractional where the peak falls between two
+ * frames.  The loop is from a frame being written to the transmit FIFO
+ * to it being read back from the receive FIFO, and is made up of the
+ * transmit FIFO prefill and everything outside the FIFOs: converters,
+ * their filters and whatever is connected between output and input.  The
+ * pipeline is from the handler's input to the transmit FIFO.
+ *
+ * confidence is the height of the smaller of the two correlation peaks
+ * relative to a perfect match, from 0 to 1, and psr_db the smaller ratio
+ * of a peak to the largest other lag.
+ */
+struct pusalatency_result_s
+{
+    int sample_rate;
+    double round_trip_frames;
+    double round_trip_us;
+    double loop_frames;
+    double pipeline_frames;
+    int fifo_frames;
+    double converter_frames;
+    double confidence;
+    double psr_db;
+};
+
+int pusalatency_start(void);
+int pusalatency_poll(struct pusalatency_result_s *result);
+int pusalatency_measure(struct pusalatency_result_s *result);
+void pusalatency_rt_input(int *data);
+void pusalatency_rt_output(int *data);
+void pusalatency_print(const struct pusalatency_result_s *result);
+
+#endif /* __pusalatency_h__ */
@@ -0,0 +1,694 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory for audio handlers.  malloc() can take locks and fault in pages,
+ * so the audio thread gets its memory from here instead.  One region is
+ * mapped, locked and touched up front.  It is split into power of two size
+ * classes, each a lock-free free list, plus a scratch arena that the audio
+ * thread can carve up during a callback and that is emptied before the
+ * next one.
+ *
+ * Other threads that unpublish something the audio thread may still be
+ * looking at hand it to pusamem_retire().  A reclaim thread frees it once
+ * the audio thread has started another callback.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bcmhw.h"
+#include "pusamem.h"
+
+struct pusamem_class_s
+{
+    char *base;
+    unsigned long size;
+    unsigned long blocks;
+
+    /* Block number + 1 of the first free block, ABA tag in the top half. */
+    unsigned long long head;
+
+    unsigned long in_use;
+    unsigned long max_in_use;
+};
+
+struct pusamem_retired_s
+{
+    void *ptr;
+    pusamem_free_t func;
+    unsigned long long epoch;
+};
+
+static char *pusamem_region = NULL;
+static size_t pusamem_region_size = 0;
+static char *pusamem_pool_end = NULL;
+static struct pusamem_class_s pusamem_classes[PUSAMEM_NCLASSES];
+
+static char *pusamem_scratch_base = NULL;
+static unsigned long pusamem_scratch_used = 0;
+
+static unsigned long long pusamem_ns_scale = 0;
+static struct pusamem_stats_s pusamem_stats;
+
+/*
+ * Callbacks started by the audio thread.  While it isn't running, nothing
+ * it could be holding needs to wait.
+ */
+static volatile unsigned long long pusamem_epoch = 0;
+static volatile int pusamem_rt_running = 0;
+
+static pthread_mutex_t pusamem_retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pusamem_retire_space = PTHREAD_COND_INITIALIZER;
+static struct pusamem_retired_s pusamem_retired[PUSAMEM_RETIRE_MAX];
+static int pusamem_nretired = 0;
+
+static void pusamem_push(struct pusamem_class_s *c, unsigned long n)
+{
+    unsigned int *link = (unsigned int *) (c->base + n * c->size);
+    unsigned long long old = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    unsigned long long new;
+
+    do
+    {
+	*link = (unsigned int) old;
+	new = ((old >> 32) + 1) << 32 | (n + 1);
+    } while (!__atomic_compare_exchange_n(&c->head, &old, new, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *pusamem_pop(struct pusamem_class_s *c)
+{
+    unsigned long long old = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    unsigned long long new;
+    unsigned int n;
+
+    do
+    {
+	n = (unsigned int) old;
+	if (n == 0)
+	    return NULL;
+
+	/*
+	 * The block may be handed out and overwritten by another thread
+	 * before the exchange, but then the tag has moved on and this
+	 * value is thrown away.
+	 */
+	unsigned int next = *(volatile unsigned int *) (c->base + (n - 1) * c->size);
+	new = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&c->head, &old, new, 1,
+					  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return c->base + (n - 1) * c->size;
+}
+
+static void pusamem_record(unsigned long long start)
+{
+    unsigned long long ns = ((bcmhw_cycles() - start) * pusamem_ns_scale) >> 32;
+    int bucket = 0;
+
+    while (bucket < PUSAMEM_HIST_BUCKETS - 1 && ns >= (1ULL << bucket))
+	bucket++;
+
+    __atomic_add_fetch(&pusamem_stats.hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Allocate from the pool.  Falls back to larger classes when a class is
+ * used up.  Returns NULL if size is over PUSAMEM_MAX_SIZE or nothing is
+ * left.  Safe to call from any thread, including the audio thread.
+ */
+void *pusamem_alloc(size_t size)
+{
+    unsigned long long start = bcmhw_cycles();
+    void *ptr = NULL;
+    int c = 0;
+
+    while (c < PUSAMEM_NCLASSES && pusamem_classes[c].size < size)
+	c++;
+
+    for (int first = c; c < PUSAMEM_NCLASSES; c++)
+    {
+	struct pusamem_class_s *cl = pusamem_classes + c;
+
+	ptr = pusamem_pop(cl);
+	if (ptr != NULL)
+	{
+	    unsigned long n = __atomic_add_fetch(&cl->in_use, 1, __ATOMIC_RELAXED);
+	    if (n > cl->max_in_use)
+		cl->max_in_use = n;
+	    if (c != first)
+		__atomic_add_fetch(&pusamem_stats.fallbacks, 1, __ATOMIC_RELAXED);
+	    break;
+	}
+    }
+
+    if (ptr == NULL)
+	__atomic_add_fetch(&pusamem_stats.failures, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pusamem_stats.allocs, 1, __ATOMIC_RELAXED);
+    pusamem_record(start);
+
+    return ptr;
+}
+
+/*
+ * Return a block to the pool.  Safe to call from any thread, but only once
+ * nobody else can still be using it; see pusamem_retire().
+ */
+void pusamem_free(void *ptr)
+{
+    char *p = ptr;
+
+    if (p == NULL)
+	return;
+
+    if (p < pusamem_region || p >= pusamem_pool_end)
+    {
+	__atomic_add_fetch(&pusamem_stats.bad_frees, 1, __ATOMIC_RELAXED);
+	return;
+    }
+
+    for (int c = PUSAMEM_NCLASSES - 1; c >= 0; c--)
+    {
+	struct pusamem_class_s *cl = pusamem_classes + c;
+
+	if (p >= cl->base)
+	{
+	    unsigned long offset = p - cl->base;
+	    if (offset % cl->size != 0)
+		break;
+
+	    __atomic_sub_fetch(&cl->in_use, 1, __ATOMIC_RELAXED);
+	    pusamem_push(cl, offset / cl->size);
+	    return;
+	}
+    }
+
+    __atomic_add_fetch(&pusamem_stats.bad_frees, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Memory that lasts until the end of the current callback.  Audio thread
+ * only.  Returns NULL when the arena is used up.
+ */
+void *pusamem_scratch(size_t size)
+{
+    size = (size + 15) & ~15UL;
+    if (pusamem_scratch_used + size > pusamem_stats.scratch_size)
+    {
+	pusamem_stats.scratch_failures++;
+	return NULL;
+    }
+
+    void *ptr = pusamem_scratch_base + pusamem_scratch_used;
+    pusamem_scratch_used += size;
+    if (pusamem_scratch_used > pusamem_stats.scratch_max)
+	pusamem_stats.scratch_max = pusamem_scratch_used;
+
+    return ptr;
+}
+
+/*
+ * Called by the audio thread before each callback.  Empties the scratch
+ * arena and lets the reclaim thread know that the previous callback is
+ * finished.
+ */
+void pusamem_rt_period(void)
+{
+    pusamem_scratch_used = 0;
+    __atomic_store_n(&pusamem_epoch, pusamem_epoch + 1, __ATOMIC_RELEASE);
+}
+
+void pusamem_rt_active(int active)
+{
+    __sync_synchronize();
+    pusamem_rt_running = active;
+}
+
+/*
+ * Touch the stack the audio thread will use so the first deep call
+ * doesn't take page faults.
+ */
+void pusamem_prefault_stack(void)
+{
+    char stack[PUSAMEM_STACK_PREFAULT];
+
+    memset(stack, 0, sizeof(stack));
+    asm volatile("" : : "r" (stack) : "memory");
+}
+
+/*
+ * Free ptr with func, or pusamem_free() if func is NULL, once the audio
+ * thread can no longer be using it.  The caller must already have removed
+ * every reference the audio thread could find.  Not for the audio thread;
+ * blocks if too much is waiting.
+ */
+void pusamem_retire(void *ptr, pusamem_free_t func)
+{
+    pthread_mutex_lock(&pusamem_retire_lock);
+    while (pusamem_nretired >= PUSAMEM_RETIRE_MAX)
+	pthread_cond_wait(&pusamem_retire_space, &pusamem_retire_lock);
+
+    struct pusamem_retired_s *r = pusamem_retired + pusamem_nretired++;
+    r->ptr = ptr;
+    r->func = func;
+    r->epoch = __atomic_load_n(&pusamem_epoch, __ATOMIC_ACQUIRE);
+    pusamem_stats.retired++;
+    pthread_mutex_unlock(&pusamem_retire_lock);
+}
+
+static void pusamem_reclaim(void)
+{
+    struct pusamem_retired_s ready[PUSAMEM_RETIRE_MAX];
+    int nready = 0;
+
+    pthread_mutex_lock(&pusamem_retire_lock);
+
+    unsigned long long epoch = __atomic_load_n(&pusamem_epoch, __ATOMIC_ACQUIRE);
+    int running = pusamem_rt_running;
+
+    for (int i = 0; i < pusamem_nretired; )
+    {
+	if (!running || pusamem_retired[i].epoch < epoch)
+	{
+	    ready[nready++] = pusamem_retired[i];
+	    pusamem_retired[i] = pusamem_retired[--pusamem_nretired];
+	}
+	else
+	    i++;
+    }
+
+    if (nready > 0)
+	pthread_cond_broadcast(&pusamem_retire_space);
+    pthread_mutex_unlock(&pusamem_retire_lock);
+
+    for (int i = 0; i < nready; i++)
+    {
+	if (ready[i].func != NULL)
+	    ready[i].func(ready[i].ptr);
+	else
+	    pusamem_free(ready[i].ptr);
+    }
+
+    __atomic_add_fetch(&pusamem_stats.reclaimed, nready, __ATOMIC_RELAXED);
+}
+
+static void *pusamem_reclaim_thread(void *arg)
+{
+    while (1)
+    {
+	usleep(1000);
+	pusamem_reclaim();
+    }
+
+    return NULL;
+}
+
+/*
+ * Reserve and fault in the pool and scratch arena.  Zero sizes pick the
+ * defaults.  Huge pages are tried first if asked for.  Does nothing if
+ * already done, so an application can size things before pusa_init().
+ */
+int pusamem_init(size_t pool_size, size_t scratch_size, int hugepages)
+{
+    if (pusamem_region != NULL)
+	return 0;
+
+    if (pool_size == 0)
+	pool_size = PUSAMEM_DEFAULT_POOL;
+    if (scratch_size == 0)
+	scratch_size = PUSAMEM_DEFAULT_SCRATCH;
+
+    /* Each class gets an equal share of the pool, rounded to whole blocks. */
+    unsigned long share = pool_size / PUSAMEM_NCLASSES / PUSAMEM_MAX_SIZE * PUSAMEM_MAX_SIZE;
+    if (share == 0)
+    {
+	printf("pusamem: pool of %lu bytes is too small\n", (unsigned long) pool_size);
+	return -1;
+    }
+    scratch_size = (scratch_size + 15) & ~15UL;
+
+    size_t size = share * PUSAMEM_NCLASSES + scratch_size;
+    void *region = MAP_FAILED;
+
+    if (hugepages)
+    {
+	size_t huge = 2 * 1024 * 1024;
+	size_t rounded = (size + huge - 1) / huge * huge;
+
+	region = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (region != MAP_FAILED)
+	    size = rounded;
+	else
+	    printf("pusamem: no huge pages, using normal pages\n");
+    }
+
+    if (region == MAP_FAILED)
+    {
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	hugepages = 0;
+    }
+
+    if (region == MAP_FAILED)
+    {
+	perror("pusamem: mmap");
+	return -1;
+    }
+
+    /* Locking can fail without privileges; the pages are still touched. */
+    if (mlock(region, size) < 0)
+	printf("pusamem: could not lock %lu bytes\n", (unsigned long) size);
+    memset(region, 0, size);
+
+    pusamem_region = region;
+    pusamem_region_size = size;
+    pusamem_stats.hugepages = hugepages;
+
+    char *p = pusamem_region;
+    for (int c = 0; c < PUSAMEM_NCLASSES; c++)
+    {
+	struct pusamem_class_s *cl = pusamem_classes + c;
+
+	cl->base = p;
+	cl->size = PUSAMEM_MIN_SIZE << c;
+	cl->blocks = share / cl->size;
+	cl->head = 0;
+	for (unsigned long n = cl->blocks; n > 0; n--)
+	    pusamem_push(cl, n - 1);
+	p += share;
+    }
+    pusamem_pool_end = p;
+
+    pusamem_scratch_base = p;
+    pusamem_stats.scratch_size = scratch_size;
+
+    pusamem_ns_scale = (1000000000ULL << 32) / bcmhw_cycles_per_sec();
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusamem_reclaim_thread, NULL) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	printf("pusamem: failed to start reclaim thread\n");
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+void pusamem_get_stats(struct pusamem_stats_s *stats)
+{
+    *stats = pusamem_stats;
+
+    for (int c = 0; c < PUSAMEM_NCLASSES; c++)
+    {
+	struct pusamem_class_s *cl = pusamem_classes + c;
+
+	stats->classes[c].size = cl->size;
+	stats->classes[c].blocks = cl->blocks;
+	stats->classes[c].in_use = __atomic_load_n(&cl->in_use, __ATOMIC_RELAXED);
+	stats->classes[c].max_in_use = cl->max_in_use;
+    }
+}
+
+static void pusamem_print_hist(const unsigned long *hist)
+{
+    for (int i = 0; i < PUSAMEM_HIST_BUCKETS; i++)
+    {
+	if (hist[i] == 0)
+	    continue;
+
+	if (i == PUSAMEM_HIST_BUCKETS - 1)
+	    printf("    >= %7llu ns: %lu\n", 1ULL << (i - 1), hist[i]);
+	else
+	    printf("    <  %7llu ns: %lu\n", 1ULL << i, hist[i]);
+    }
+}
+
+void pusamem_print_stats(void)
+{
+    struct pusamem_stats_s stats;
+
+    pusamem_get_stats(&stats);
+
+    printf("pusamem: %lu allocs, %lu failed, %lu fell back, %lu bad frees, %s pages\n",
+	   stats.allocs, stats.failures, stats.fallbacks, stats.bad_frees,
+	   stats.hugepages ? "huge" : "normal");
+    for (int c = 0; c < PUSAMEM_NCLASSES; c++)
+	printf("  %4lu bytes: %lu/%lu in use, max %lu\n", stats.classes[c].size,
+	       stats.classes[c].in_use, stats.classes[c].blocks, stats.classes[c].max_in_use);
+    printf("  scratch: max %lu of %lu bytes, %lu failed\n",
+	   stats.scratch_max, stats.scratch_size, stats.scratch_failures);
+    printf("  retired %lu, reclaimed %lu\n", stats.retired, stats.reclaimed);
+    printf("  allocation time:\n");
+    pusamem_print_hist(stats.hist);
+}
+
+#ifdef PUSAMEM_UNIT_TEST
+#include "pusatest.h"
+
+static volatile int test_released = 0;
+
+static void test_release(void *ptr)
+{
+    test_released++;
+    pusamem_free(ptr);
+}
+
+/*
+ * Two threads allocate, fill, check and free blocks as fast as they can.
+ * A block handed to both at once shows up as a wrong fill value.
+ */
+#define TEST_SLOTS	64
+#define TEST_ROUNDS	200000
+
+static volatile int test_corrupt = 0;
+
+static void *test_stress(void *arg)
+{
+    unsigned char tag = (unsigned char) (unsigned long) arg;
+    unsigned char *slots[TEST_SLOTS] = { NULL };
+    unsigned int seed = tag;
+
+    for (int i = 0; i < TEST_ROUNDS; i++)
+    {
+	int s = rand_r(&seed) % TEST_SLOTS;
+
+	if (slots[s] != NULL)
+	{
+	    for (int j = 0; j < 16; j++)
+		if (slots[s][j] != tag)
+		    test_corrupt = 1;
+	    pusamem_free(slots[s]);
+	    slots[s] = NULL;
+	}
+	else
+	{
+	    slots[s] = pusamem_alloc(16 + rand_r(&seed) % 200);
+	    if (slots[s] != NULL)
+		memset(slots[s], tag, 16);
+	}
+    }
+
+    for (int s = 0; s < TEST_SLOTS; s++)
+	pusamem_free(slots[s]);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusamem_stats_s stats;
+
+    check(pusamem_init(PUSAMEM_NCLASSES * 16384, 1024, 0) == 0, "init");
+    pusamem_get_stats(&stats);
+    check(stats.classes[0].size == 16 && stats.classes[0].blocks == 1024, "16 byte class");
+    check(stats.classes[8].size == 4096 && stats.classes[8].blocks == 4, "4096 byte class");
+
+    void *p = pusamem_alloc(1);
+    check(p != NULL && pusamem_alloc(PUSAMEM_MAX_SIZE + 1) == NULL, "size limits");
+    pusamem_free(p);
+
+    /* Use up the largest two classes; the 2048 class overflows into 4096. */
+    void *big[16];
+    int nbig = 0;
+    while (nbig < 16 && (big[nbig] = pusamem_alloc(2000)) != NULL)
+	nbig++;
+    pusamem_get_stats(&stats);
+    check(nbig == 12 && stats.fallbacks == 4, "fall back to larger class");
+    check(stats.failures == 2, "failure when pool used up");
+    for (int i = 0; i < nbig; i++)
+	pusamem_free(big[i]);
+
+    int x;
+    pusamem_free(&x);
+    pusamem_free((char *) pusamem_alloc(64) + 1);
+    pusamem_get_stats(&stats);
+    check(stats.bad_frees == 2, "foreign pointers rejected");
+
+    pthread_t t1, t2;
+    pthread_create(&t1, NULL, test_stress, (void *) 1);
+    pthread_create(&t2, NULL, test_stress, (void *) 2);
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+    check(!test_corrupt, "no block handed out twice");
+
+    pusamem_get_stats(&stats);
+    int leaked = 0;
+    for (int c = 0; c < PUSAMEM_NCLASSES; c++)
+	leaked += stats.classes[c].in_use;
+    check(leaked == 1, "everything returned");
+
+    check(pusamem_scratch(1000) != NULL && pusamem_scratch(100) == NULL, "scratch limit");
+    pusamem_rt_period();
+    check(pusamem_scratch(1000) != NULL, "scratch emptied each period");
+
+    /* With the audio thread running, retired memory waits for a period. */
+    pusamem_rt_active(1);
+    pusamem_retire(pusamem_alloc(32), test_release);
+    usleep(20000);
+    check(test_released == 0, "retired memory held during callback");
+    pusamem_rt_period();
+    usleep(20000);
+    check(test_released == 1, "retired memory freed after callback");
+
+    pusamem_rt_active(0);
+    pusamem_retire(pusamem_alloc(32), test_release);
+    usleep(20000);
+    check(test_released == 2, "retired memory freed while stopped");
+
+    pusamem_prefault_stack();
+    pusamem_print_stats();
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSAMEM_BENCH
+/*
+ * Random allocation sizes and lifetimes, with another thread churning
+ * the same allocator in the background.  Reports the latency histogram
+ * of the measured thread for pusamem and for glibc malloc.
+ */
+#define BENCH_SLOTS	1024
+#define BENCH_OPS	2000000
+
+static volatile int bench_done = 0;
+static int bench_use_malloc = 0;
+
+static void *bench_alloc(size_t size)
+{
+    return bench_use_malloc ? malloc(size) : pusamem_alloc(size);
+}
+
+static void bench_free(void *ptr)
+{
+    if (bench_use_malloc)
+	free(ptr);
+    else
+	pusamem_free(ptr);
+}
+
+static void *bench_churn(void *arg)
+{
+    void *slots[BENCH_SLOTS] = { NULL };
+    unsigned int seed = 99;
+
+    while (!bench_done)
+    {
+	int s = rand_r(&seed) % BENCH_SLOTS;
+	bench_free(slots[s]);
+	slots[s] = bench_alloc(1 + rand_r(&seed) % PUSAMEM_MAX_SIZE);
+    }
+
+    for (int s = 0; s < BENCH_SLOTS; s++)
+	bench_free(slots[s]);
+
+    return NULL;
+}
+
+static void bench_run(const char *name)
+{
+    static void *slots[BENCH_SLOTS];
+    unsigned long hist[PUSAMEM_HIST_BUCKETS] = { 0 };
+    unsigned long long total = 0, worst = 0;
+    unsigned int seed = 1;
+    pthread_t tid;
+
+    bench_done = 0;
+    pthread_create(&tid, NULL, bench_churn, NULL);
+
+    for (int i = 0; i < BENCH_OPS; i++)
+    {
+	int s = rand_r(&seed) % BENCH_SLOTS;
+	size_t size = 1 + rand_r(&seed) % PUSAMEM_MAX_SIZE;
+
+	bench_free(slots[s]);
+
+	unsigned long long start = bcmhw_cycles();
+	slots[s] = bench_alloc(size);
+	unsigned long long ns = ((bcmhw_cycles() - start) * pusamem_ns_scale) >> 32;
+
+	total += ns;
+	if (ns > worst)
+	    worst = ns;
+
+	int bucket = 0;
+	while (bucket < PUSAMEM_HIST_BUCKETS - 1 && ns >= (1ULL << bucket))
+	    bucket++;
+	hist[bucket]++;
+    }
+
+    bench_done = 1;
+    pthread_join(tid, NULL);
+    for (int s = 0; s < BENCH_SLOTS; s++)
+    {
+	bench_free(slots[s]);
+	slots[s] = NULL;
+    }
+
+    printf("%s: mean %.1f ns, max %llu ns\n", name, (double) total / BENCH_OPS, worst);
+    pusamem_print_hist(hist);
+}
+
+int main(int argc, char **argv)
+{
+    if (pusamem_init(0, 0, argc > 1) < 0)
+	return 1;
+
+    bench_use_malloc = 0;
+    bench_run("pusamem");
+    bench_use_malloc = 1;
+    bench_run("malloc");
+
+    return 0;
+}
+#endif
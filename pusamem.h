@@ -0,0 +1,62 @@
+/*
+ * Header file for the real-time safe memory allocator.
+ */
+
+#ifndef __pusamem_h__
+#define __pusamem_h__
+
+#include <stddef.h>
+
+/* Size classes are powers of two from PUSAMEM_MIN_SIZE to PUSAMEM_MAX_SIZE. */
+#define PUSAMEM_MIN_SIZE	16
+#define PUSAMEM_MAX_SIZE	4096
+#define PUSAMEM_NCLASSES	9
+
+#define PUSAMEM_DEFAULT_POOL	(4 * 1024 * 1024)
+#define PUSAMEM_DEFAULT_SCRATCH	(64 * 1024)
+#define PUSAMEM_STACK_PREFAULT	(64 * 1024)
+
+/* Objects waiting for the audio thread to move on before being freed. */
+#define PUSAMEM_RETIRE_MAX	256
+
+/* Allocation latency histogram, bucket n counts times below 2^n ns. */
+#define PUSAMEM_HIST_BUCKETS	20
+
+typedef void (*pusamem_free_t)(void *ptr);
+
+struct pusamem_class_stats_s
+{
+    unsigned long size;
+    unsigned long blocks;
+    unsigned long in_use;
+    unsigned long max_in_use;
+};
+
+struct pusamem_stats_s
+{
+    struct pusamem_class_stats_s classes[PUSAMEM_NCLASSES];
+    unsigned long allocs;
+    unsigned long failures;
+    unsigned long fallbacks;
+    unsigned long bad_frees;
+    unsigned long scratch_size;
+    unsigned long scratch_max;
+    unsigned long scratch_failures;
+    unsigned long retired;
+    unsigned long reclaimed;
+    int hugepages;
+    unsigned long hist[PUSAMEM_HIST_BUCKETS];
+};
+
+int pusamem_init(size_t pool_size, size_t scratch_size, int hugepages);
+void *pusamem_alloc(size_t size);
+void pusamem_free(void *ptr);
+void *pusamem_scratch(size_t size);
+void pusamem_retire(void *ptr, pusamem_free_t func);
+void pusamem_rt_period(void);
+void pusamem_rt_active(int active);
+void pusamem_prefault_stack(void);
+void pusamem_get_stats(struct pusamem_stats_s *stats);
+void pusamem_print_stats(void);
+
+#endif /* __pusamem_h__ */
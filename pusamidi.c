@@ -26,14 +26,32 @@
 #include <alsa/asoundlib.h>
 #include <alsa/asoundef.h>
 
+#include "pusamidi.h"
+#include "pusatrace.h"
+
 pid_t gettid(void);
 
-static pthread_mutex_t pusamidi_fifo_lock = PTHREAD_MUTEX_INITIALIZER;
-static unsigned char pusamidi_in_fifo[0x10000];
-static int pusamidi_in_fifo_in = 0;
-static int pusamidi_in_fifo_out = 0;
+/*
+ * Each input port has its own message ring.  The port's input thread is
+ * the only producer, so no lock is needed on that side.  Messages are
+ * stored as a two byte length followed by the message bytes.  The lock
+ * only serializes consumers.
+ */
+#define PUSAMIDI_RING_SIZE	0x1000
 
-#define PUSAMIDI_PORT_MAX	32
+struct pusamidi_ring_s
+{
+    unsigned char data[PUSAMIDI_RING_SIZE];
+    volatile unsigned int in;
+    volatile unsigned int out;
+};
+
+static pthread_mutex_t pusamidi_fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pusamidi_ring_s pusamidi_in_rings[PUSAMIDI_PORT_MAX];
+static int pusamidi_next_ring = 0;
+static unsigned char pusamidi_pending[2048];
+static int pusamidi_pending_len = 0;
+static int pusamidi_pending_pos = 0;
 
 struct pusamidi_port_s
 {
@@ -41,12 +59,53 @@ struct pusamidi_port_s
     char *name;
     pid_t tid;
     snd_rawmidi_t *midiport;
+    volatile unsigned int route_seq;
+
+    /* Ports not driven by ALSA supply their own output function. */
+    void (*write)(const void *buffer, size_t len);
+
+    /* Input parser state */
+    unsigned char buffer[2048];
+    int len;
+    unsigned char last_cmd;
+};
+
+/*
+ * Compiled routing table.  For every input port and status byte there is
+ * a run of actions in actions[].  Built by pusamidi_set_routes() and only
+ * read by the input threads.
+ */
+struct pusamidi_action_s
+{
+    unsigned int outs;
+    unsigned char app;
+    signed char channel;
+};
+
+struct pusamidi_routing_s
+{
+    unsigned short first[PUSAMIDI_PORT_MAX][128];
+    unsigned char count[PUSAMIDI_PORT_MAX][128];
+    int nactions;
+    struct pusamidi_action_s actions[];
 };
 
+static pthread_mutex_t pusamidi_routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pusamidi_routing_s *volatile pusamidi_routing = NULL;
+
 static pthread_mutex_t pusamidi_db_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct pusamidi_port_s pusamidi_ins[PUSAMIDI_PORT_MAX];
 static struct pusamidi_port_s pusamidi_outs[PUSAMIDI_PORT_MAX];
 
+/*
+ * Optional hook for system real time bytes (clock, start, stop, ...).
+ * Called from the input thread as soon as the byte arrives so the receiver
+ * can timestamp it.
+ */
+static void (*volatile pusamidi_realtime_callback)(int c) = NULL;
+static void (*volatile pusamidi_read_callback)(int port, const unsigned char *msg, int len) = NULL;
+static int (*volatile pusamidi_cc_callback)(int port, int channel, int cc, int value) = NULL;
+
 static struct pusamidi_port_s *pusamidi_find_port(char *hwname, snd_rawmidi_stream_t type)
 {
     struct pusamidi_port_s *ports = NULL;
@@ -96,6 +155,9 @@ static void pusamidi_close_port(char *hwname, snd_rawmidi_stream_t type)
 	port->tid = 0;
 	port->name = NULL;
 	port->hwname = NULL;
+	port->write = NULL;
+	port->len = 0;
+	port->last_cmd = 0;
 	pthread_mutex_unlock(&pusamidi_db_lock);
     }
 }
@@ -127,13 +189,15 @@ static int pusamidi_process_midi_in(unsigned char *buffer, int *len, unsigned ch
 	*len = 2;
     }
 
-    if ((buffer[0] == 0x80 || buffer[0] == 0x90 || buffer[0] == 0xa0 ||
-	 buffer[0] == 0xb0 || buffer[0] == 0xe0) && *len == 3)
+    int type = buffer[0] & 0xf0;
+
+    if ((type == 0x80 || type == 0x90 || type == 0xa0 ||
+	 type == 0xb0 || type == 0xe0) && *len == 3)
     {
 	*last_cmd = buffer[0];
 	return *len;
     }
-    else if ((buffer[0] == 0xc0 || buffer[0] == 0xd0) && *len == 2)
+    else if ((type == 0xc0 || type == 0xd0) && *len == 2)
     {
 	*last_cmd = buffer[0];
 	return *len;
@@ -142,18 +206,282 @@ static int pusamidi_process_midi_in(unsigned char *buffer, int *len, unsigned ch
     return 0;
 }
 
-static void *pusamidi_in_thread(void *arg)
+static void pusamidi_ring_put(struct pusamidi_ring_s *ring, const unsigned char *msg, int len)
 {
-    unsigned char buffer[2048];
-    unsigned char last_cmd = 0;
-    int len = 0;
+    unsigned int in = ring->in;
+    unsigned int room = (ring->out - in - 1) % PUSAMIDI_RING_SIZE;
+
+    if (room < len + 2)
+	return;
+
+    ring->data[in] = len & 0xff;
+    ring->data[(in + 1) % PUSAMIDI_RING_SIZE] = len >> 8;
+    for (int i = 0; i < len; i++)
+	ring->data[(in + 2 + i) % PUSAMIDI_RING_SIZE] = msg[i];
+
+    __sync_synchronize();
+    ring->in = (in + len + 2) % PUSAMIDI_RING_SIZE;
+}
+
+static int pusamidi_ring_get(struct pusamidi_ring_s *ring, unsigned char *buffer, int size)
+{
+    unsigned int out = ring->out;
+    if (out == ring->in)
+	return 0;
+
+    __sync_synchronize();
+    int len = ring->data[out] | (ring->data[(out + 1) % PUSAMIDI_RING_SIZE] << 8);
+    for (int i = 0; i < len && i < size; i++)
+	buffer[i] = ring->data[(out + 2 + i) % PUSAMIDI_RING_SIZE];
+
+    __sync_synchronize();
+    ring->out = (out + len + 2) % PUSAMIDI_RING_SIZE;
+
+    return len < size ? len : size;
+}
+
+static void pusamidi_port_write(struct pusamidi_port_s *port, const void *buffer, size_t len)
+{
+    void (*write)(const void *buffer, size_t len) = port->write;
+    snd_rawmidi_t *handle = port->midiport;
+
+    if (write)
+	write(buffer, len);
+    else if (handle)
+	snd_rawmidi_write(handle, buffer, len);
+}
+
+static void pusamidi_write_outs(unsigned int outs, const unsigned char *msg, int len)
+{
+    for (int i = 0; outs != 0; i++, outs >>= 1)
+    {
+	if (outs & 1)
+	    pusamidi_port_write(pusamidi_outs + i, msg, len);
+    }
+}
+
+/*
+ * Apply the routing table to one complete message from an input port.
+ * Runs in the port's input thread.  Thru and merge go straight to the
+ * output ports from here.
+ */
+static void pusamidi_route(int portnum, const unsigned char *msg, int len)
+{
+    struct pusamidi_port_s *port = pusamidi_ins + portnum;
+
+    /* Odd sequence means this thread is using the table. */
+    port->route_seq++;
+    __sync_synchronize();
+
+    struct pusamidi_routing_s *routing = pusamidi_routing;
+    if (routing == NULL)
+    {
+	pusamidi_ring_put(pusamidi_in_rings + portnum, msg, len);
+    }
+    else
+    {
+	int status = msg[0] & 0x7f;
+	int first = routing->first[portnum][status];
+	int count = routing->count[portnum][status];
+
+	for (int i = first; i < first + count; i++)
+	{
+	    struct pusamidi_action_s *action = routing->actions + i;
+	    const unsigned char *out = msg;
+	    unsigned char remapped[3];
+
+	    if (action->channel >= 0 && len <= 3)
+	    {
+		memcpy(remapped, msg, len);
+		remapped[0] = (msg[0] & 0xf0) | action->channel;
+		out = remapped;
+	    }
+
+	    if (action->outs)
+		pusamidi_write_outs(action->outs, out, len);
+	    if (action->app)
+		pusamidi_ring_put(pusamidi_in_rings + portnum, out, len);
+	}
+    }
+
+    __sync_synchronize();
+    port->route_seq++;
+}
+
+static unsigned int pusamidi_status_type(int status)
+{
+    if (status >= 0xf8)
+	return PUSAMIDI_TYPE_REALTIME;
+    else if (status >= 0xf0)
+	return PUSAMIDI_TYPE_SYSTEM;
+    else
+	return 1 << ((status >> 4) - 8);
+}
+
+static int pusamidi_route_matches(const struct pusamidi_route_s *route, int port, int status)
+{
+    if (route->in_port != PUSAMIDI_ROUTE_ANY && route->in_port != port)
+	return 0;
+    if (route->types != 0 && (route->types & pusamidi_status_type(status)) == 0)
+	return 0;
+    if (status < 0xf0 && route->channels != 0 && (route->channels & (1 << (status & 0xf))) == 0)
+	return 0;
+
+    return 1;
+}
+
+/*
+ * Compile a routing matrix and swap it in.  Called from a control thread.
+ * The old table is freed once no input thread can still be using it.
+ * Passing no routes restores the default of delivering everything to the
+ * application.
+ */
+int pusamidi_set_routes(const struct pusamidi_route_s *routes, int nroutes)
+{
+    struct pusamidi_routing_s *routing = NULL;
+
+    if (nroutes > 0)
+    {
+	size_t max_actions = (size_t) PUSAMIDI_PORT_MAX * 128 * nroutes;
+	if (max_actions > 0xffff)
+	    max_actions = 0xffff;
+
+	routing = calloc(1, sizeof(*routing) + max_actions * sizeof(struct pusamidi_action_s));
+	if (routing == NULL)
+	    return -1;
+
+	for (int port = 0; port < PUSAMIDI_PORT_MAX; port++)
+	{
+	    for (int status = 0x80; status <= 0xff; status++)
+	    {
+		int first = routing->nactions;
+
+		for (int r = 0; r < nroutes; r++)
+		{
+		    const struct pusamidi_route_s *route = routes + r;
+		    if (!pusamidi_route_matches(route, port, status))
+			continue;
+
+		    int channel = status < 0xf0 ? route->channel : -1;
+		    if (channel > 15)
+			channel = -1;
+
+		    /* Merge with an earlier action that has the same remap. */
+		    struct pusamidi_action_s *action = NULL;
+		    for (int i = first; i < routing->nactions; i++)
+			if (routing->actions[i].channel == channel)
+			    action = routing->actions + i;
+
+		    if (action == NULL)
+		    {
+			if (routing->nactions >= max_actions)
+			{
+			    free(routing);
+			    return -1;
+			}
+
+			action = routing->actions + routing->nactions++;
+			action->channel = channel;
+		    }
+
+		    if (route->out_port == PUSAMIDI_ROUTE_APP)
+			action->app = 1;
+		    else if (route->out_port == PUSAMIDI_ROUTE_ALL_OUTS)
+			action->outs = ~0U;
+		    else if (route->out_port >= 0 && route->out_port < PUSAMIDI_PORT_MAX)
+			action->outs |= 1U << route->out_port;
+		}
+
+		routing->first[port][status - 0x80] = first;
+		routing->count[port][status - 0x80] = routing->nactions - first;
+	    }
+	}
+    }
+
+    pthread_mutex_lock(&pusamidi_routes_lock);
+    struct pusamidi_routing_s *old = pusamidi_routing;
+    pusamidi_routing = routing;
+    __sync_synchronize();
+
+    /*
+     * Wait for every input thread that was inside pusamidi_route() to
+     * leave it.  Threads entering later see the new table.
+     */
+    for (int i = 0; i < PUSAMIDI_PORT_MAX; i++)
+    {
+	unsigned int seq = pusamidi_ins[i].route_seq;
+	if (seq & 1)
+	{
+	    while (pusamidi_ins[i].route_seq == seq)
+		sched_yield();
+	}
+    }
+
+    free(old);
+    pthread_mutex_unlock(&pusamidi_routes_lock);
+
+    return 0;
+}
+
+/*
+ * Feed raw bytes received on an input port through the parser and the
+ * routing table.  Only one thread may feed a given port.
+ */
+void pusamidi_port_input(int portnum, const unsigned char *data, int n)
+{
+    if (portnum < 0 || portnum >= PUSAMIDI_PORT_MAX)
+	return;
+
+    struct pusamidi_port_s *port = pusamidi_ins + portnum;
+
+    for (int i = 0; i < n; i++)
+    {
+	unsigned char c = data[i];
+
+	/*
+	 * Real time bytes may arrive in the middle of another message.
+	 * Deliver them on their own without disturbing the message.
+	 */
+	if (c >= 0xf8)
+	{
+	    if (pusamidi_realtime_callback != NULL)
+		pusamidi_realtime_callback(c);
+
+	    pusamidi_route(portnum, &c, 1);
+	    continue;
+	}
+
+	if (port->len < sizeof(port->buffer))
+	    port->buffer[port->len++] = c;
+	else
+	{
+	    port->len = 1;
+	    port->buffer[0] = c;
+	    port->last_cmd = 0;
+	}
+
+	int len = pusamidi_process_midi_in(port->buffer, &port->len, &port->last_cmd);
+	if (len > 0)
+	{
+	    int (*cc_callback)(int, int, int, int) = pusamidi_cc_callback;
+	    if (cc_callback == NULL || len != 3 || (port->buffer[0] & 0xf0) != 0xb0 ||
+		!cc_callback(portnum, port->buffer[0] & 0x0f, port->buffer[1], port->buffer[2]))
+		pusamidi_route(portnum, port->buffer, len);
+	    port->len = 0;
+	}
+    }
+}
 
+static void *pusamidi_in_thread(void *arg)
+{
     struct pusamidi_port_s *port = arg;
+    int portnum = port - pusamidi_ins;
 
     if (snd_rawmidi_open(&port->midiport, NULL, port->hwname, 0) < 0)
 	goto done;
 
     printf(" In: tid: %d, name %s (%s)\n", gettid(), port->hwname, port->name);
+    PUSATRACE_THREAD(port->hwname);
 
     unsigned char c;
     while (1)
@@ -166,37 +494,8 @@ static void *pusamidi_in_thread(void *arg)
 	}
 	else if (status > 0)
 	{
-	    if (len < sizeof(buffer))
-		buffer[len++] = c;
-	    else
-	    {
-		len = 1;
-		buffer[0] = c;
-		last_cmd = 0;
-	    }
-
-	    int n = pusamidi_process_midi_in(buffer, &len, &last_cmd);
-	    if (n > 0)
-	    {
-		pthread_mutex_lock(&pusamidi_fifo_lock);
-		int room = pusamidi_in_fifo_out - pusamidi_in_fifo_in;
-		if (room <= 0)
-		    room += sizeof(pusamidi_in_fifo);
-		room -= 1;
-
-		if (room > n)
-		{
-		    for (int i = 0; i < n; i++)
-		    {
-			pusamidi_in_fifo[pusamidi_in_fifo_in++] = buffer[i];
-			if (pusamidi_in_fifo_in >= sizeof(pusamidi_in_fifo))
-			    pusamidi_in_fifo_in = 0;
-		    }
-		}
-
-		pthread_mutex_unlock(&pusamidi_fifo_lock);
-		len = 0;
-	    }
+	    PUSATRACE_INSTANT(PUSATRACE_MIDI_IN, c);
+	    pusamidi_port_input(portnum, &c, 1);
 	}
     }
 
@@ -332,31 +631,147 @@ void pusamidi_init(void)
     pthread_attr_destroy(&attr);
 }
 
+static int pusamidi_get_message_locked(int *port, unsigned char *buffer, int size)
+{
+    for (int i = 0; i < PUSAMIDI_PORT_MAX; i++)
+    {
+	int portnum = (pusamidi_next_ring + i) % PUSAMIDI_PORT_MAX;
+	int len = pusamidi_ring_get(pusamidi_in_rings + portnum, buffer, size);
+	if (len > 0)
+	{
+	    pusamidi_next_ring = (portnum + 1) % PUSAMIDI_PORT_MAX;
+	    if (port)
+		*port = portnum;
+	    if (pusamidi_read_callback != NULL)
+		pusamidi_read_callback(portnum, buffer, len);
+	    return len;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Get the next complete message along with the input port it came from.
+ * Returns the message length or 0 if nothing is waiting.  Ports are
+ * serviced round robin.
+ */
+int pusamidi_get_midi_message(int *port, unsigned char *buffer, int size)
+{
+    pthread_mutex_lock(&pusamidi_fifo_lock);
+    int len = pusamidi_get_message_locked(port, buffer, size);
+    pthread_mutex_unlock(&pusamidi_fifo_lock);
+
+    return len;
+}
+
 int pusamidi_get_midi_in(void)
 {
     int c = -1;
 
     pthread_mutex_lock(&pusamidi_fifo_lock);
-    if (pusamidi_in_fifo_out != pusamidi_in_fifo_in)
+    if (pusamidi_pending_pos >= pusamidi_pending_len)
     {
-	c = pusamidi_in_fifo[pusamidi_in_fifo_out++];
-	if (pusamidi_in_fifo_out >= sizeof(pusamidi_in_fifo))
-	    pusamidi_in_fifo_out = 0;
+	pusamidi_pending_len = pusamidi_get_message_locked(NULL, pusamidi_pending,
+							    sizeof(pusamidi_pending));
+	pusamidi_pending_pos = 0;
     }
 
+    if (pusamidi_pending_pos < pusamidi_pending_len)
+	c = pusamidi_pending[pusamidi_pending_pos++];
+
     pthread_mutex_unlock(&pusamidi_fifo_lock);
 
     return c;
 }
 
+const char *pusamidi_port_name(int port, int output)
+{
+    if (port < 0 || port >= PUSAMIDI_PORT_MAX)
+	return NULL;
+
+    return output ? pusamidi_outs[port].name : pusamidi_ins[port].name;
+}
+
+void pusamidi_set_realtime_callback(void (*func)(int c))
+{
+    pusamidi_realtime_callback = func;
+}
+
+/*
+ * Have func see every message as it is taken from the input queues, by
+ * whichever thread takes it.
+ */
+void pusamidi_set_read_callback(void (*func)(int port, const unsigned char *msg, int len))
+{
+    pusamidi_read_callback = func;
+}
+
+/*
+ * Have func see control changes in the input thread before they are
+ * routed.  Returning nonzero drops the message.
+ */
+void pusamidi_set_cc_callback(int (*func)(int port, int channel, int cc, int value))
+{
+    pusamidi_cc_callback = func;
+}
+
+/*
+ * Queue a message for the application as if it had arrived on port and
+ * passed the routing table.  For replaying recorded input; nothing else
+ * may be feeding the port.
+ */
+void pusamidi_inject(int port, const unsigned char *msg, int len)
+{
+    if (port < 0 || port >= PUSAMIDI_PORT_MAX)
+	return;
+
+    pusamidi_ring_put(pusamidi_in_rings + port, msg, len);
+}
+
 void pusamidi_send_midi_out(const void *buffer, size_t len)
 {
     for (int i = 0; i < PUSAMIDI_PORT_MAX; i++)
-    {
-	snd_rawmidi_t *handle = pusamidi_outs[i].midiport;
-	if (handle)
-	    snd_rawmidi_write(handle, buffer, len);
-    }
+	pusamidi_port_write(pusamidi_outs + i, buffer, len);
+}
+
+/*
+ * Register a MIDI port that isn't driven by ALSA.  The caller feeds input
+ * with pusamidi_port_input() using the returned input port number.  Output
+ * routed to the port is passed to write().
+ */
+int pusamidi_add_port(const char *hwname, const char *name,
+		      void (*write)(const void *buffer, size_t len))
+{
+    struct pusamidi_port_s *in = pusamidi_find_port(NULL, SND_RAWMIDI_STREAM_INPUT);
+    struct pusamidi_port_s *out = pusamidi_find_port(NULL, SND_RAWMIDI_STREAM_OUTPUT);
+    if (in == NULL || out == NULL)
+	return -1;
+
+    pthread_mutex_lock(&pusamidi_db_lock);
+    in->name = strdup(name);
+    in->len = 0;
+    in->last_cmd = 0;
+    in->hwname = strdup(hwname);
+
+    out->name = strdup(name);
+    out->write = write;
+    out->hwname = strdup(hwname);
+    pthread_mutex_unlock(&pusamidi_db_lock);
+
+    printf("Port: %s (%s)\n", hwname, name);
+
+    return in - pusamidi_ins;
+}
+
+int pusamidi_find_port_index(const char *hwname, int output)
+{
+    struct pusamidi_port_s *port =
+	pusamidi_find_port((char *) hwname, output ? SND_RAWMIDI_STREAM_OUTPUT : SND_RAWMIDI_STREAM_INPUT);
+    if (port == NULL)
+	return -1;
+
+    return output ? port - pusamidi_outs : port - pusamidi_ins;
 }
 
 #ifdef PUSAMIDI_UNIT_TEST
@@ -385,3 +800,262 @@ int main(int argc, char **argv)
     return 0;
 }
 #endif
+
+#ifdef PUSAMIDI_ROUTE_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Routing through ports added with pusamidi_add_port(), so no ALSA
+ * devices are needed.  Every output port records what it was sent.
+ */
+#define TEST_PORTS	4
+#define TEST_OUT_MAX	4096
+
+static unsigned char test_out[TEST_PORTS][TEST_OUT_MAX];
+static volatile int test_out_len[TEST_PORTS];
+
+static void test_record(int port, const void *buffer, size_t len)
+{
+    for (size_t i = 0; i < len && test_out_len[port] < TEST_OUT_MAX; i++)
+	test_out[port][test_out_len[port]++] = ((const unsigned char *) buffer)[i];
+}
+
+static void test_write0(const void *buffer, size_t len) { test_record(0, buffer, len); }
+static void test_write2(const void *buffer, size_t len) { test_record(2, buffer, len); }
+static void test_write3(const void *buffer, size_t len) { test_record(3, buffer, len); }
+
+static void test_input(int port, const unsigned char *bytes, int n)
+{
+    pusamidi_port_input(port, bytes, n);
+}
+
+/* Check and clear what an output port was sent. */
+static int test_sent(int port, const unsigned char *expect, int n)
+{
+    int ok = test_out_len[port] == n && memcmp(test_out[port], expect, n) == 0;
+
+    if (!ok)
+    {
+	printf("port %d got", port);
+	for (int i = 0; i < test_out_len[port]; i++)
+	    printf(" %02x", test_out[port][i]);
+	printf("\n");
+    }
+    test_out_len[port] = 0;
+
+    return ok;
+}
+
+/* Check and take the messages waiting for the application. */
+static int test_app(int port, const unsigned char *expect, int n)
+{
+    unsigned char all[256], msg[256];
+    int len, from, total = 0, ok = 1;
+
+    while ((len = pusamidi_get_midi_message(&from, msg, sizeof(msg))) > 0)
+    {
+	if (from != port)
+	    ok = 0;
+	for (int i = 0; i < len && total < sizeof(all); i++)
+	    all[total++] = msg[i];
+    }
+
+    return ok && total == n && memcmp(all, expect, n) == 0;
+}
+
+#define TEST_SWAP_MESSAGES	100000
+
+static volatile int test_feeding = 0;
+static int test_thru = 0;
+static int test_thru_bad = 0;
+
+/* Port 1 only counts during the table swap test. */
+static void test_write1(const void *buffer, size_t len)
+{
+    if (!test_feeding)
+    {
+	test_record(1, buffer, len);
+	return;
+    }
+
+    if (len != 3 || memcmp(buffer, (unsigned char []) { 0x90, 60, 100 }, 3) != 0)
+	test_thru_bad++;
+    test_thru++;
+}
+
+/*
+ * Note ons into port 0 in bursts, never more than the application ring
+ * holds, with a pause so the tables change between bursts too.
+ */
+static void *test_feeder(void *arg)
+{
+    unsigned char msg[3] = { 0x90, 60, 100 };
+
+    for (int n = 0; n < TEST_SWAP_MESSAGES; n += 50)
+    {
+	while (pusamidi_in_rings[0].in != pusamidi_in_rings[0].out)
+	    sched_yield();
+	for (int i = 0; i < 50; i++)
+	    pusamidi_port_input(0, msg, sizeof(msg));
+	usleep(50);
+    }
+    test_feeding = 0;
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static void (*writes[TEST_PORTS])(const void *, size_t) =
+	{ test_write0, test_write1, test_write2, test_write3 };
+
+    for (int i = 0; i < TEST_PORTS; i++)
+    {
+	char hwname[16];
+	sprintf(hwname, "test:%d", i);
+	check(pusamidi_add_port(hwname, hwname, writes[i]) == i, "add port");
+    }
+
+    /* Without routes everything goes to the application. */
+    test_input(2, (unsigned char []) { 0xb4, 7, 1 }, 3);
+    check(test_app(2, (unsigned char []) { 0xb4, 7, 1 }, 3), "default delivers to the application");
+
+    struct pusamidi_route_s routes[] =
+    {
+	/* Notes on channel 1 of port 0 to the application. */
+	{ 0, 0x0001, PUSAMIDI_TYPE_NOTE_ON | PUSAMIDI_TYPE_NOTE_OFF, PUSAMIDI_ROUTE_APP, -1 },
+	/* Thru from port 1 to port 2, moved to channel 6, and its CCs to the application. */
+	{ 1, 0, 0, 2, 5 },
+	{ 1, 0, PUSAMIDI_TYPE_CC, PUSAMIDI_ROUTE_APP, -1 },
+	/* Channel 1 of port 3 merged into port 2. */
+	{ 3, 0x0001, 0, 2, -1 },
+	/* Clocks from anywhere to port 3. */
+	{ PUSAMIDI_ROUTE_ANY, 0, PUSAMIDI_TYPE_REALTIME, 3, -1 },
+    };
+    check(pusamidi_set_routes(routes, sizeof(routes) / sizeof(routes[0])) == 0, "set routes");
+
+    /* Channel and type filters, and running status. */
+    test_input(0, (unsigned char []) { 0x90, 60, 100, 62, 100, 0x80, 60, 0 }, 8);
+    test_input(0, (unsigned char []) { 0x91, 60, 100, 0xb0, 7, 1 }, 6);
+    check(test_app(0, (unsigned char []) { 0x90, 60, 100, 0x90, 62, 100, 0x80, 60, 0 }, 9),
+	  "channel and type filters, running status");
+    for (int i = 0; i < TEST_PORTS; i++)
+	check(test_sent(i, NULL, 0), "filtered messages go nowhere");
+
+    /* Thru with a channel remap, and the same CC merged to the application. */
+    test_input(1, (unsigned char []) { 0x93, 60, 100, 0xb3, 7, 1, 8, 2 }, 8);
+    check(test_sent(2, (unsigned char []) { 0x95, 60, 100, 0xb5, 7, 1, 0xb5, 8, 2 }, 9),
+	  "thru remaps the channel");
+    check(test_app(1, (unsigned char []) { 0xb3, 7, 1, 0xb3, 8, 2 }, 6), "cc to the application unchanged");
+
+    /* Port 3 merges into port 2; SysEx isn't a channel message so passes. */
+    unsigned char sysex[] = { 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 };
+    test_input(3, (unsigned char []) { 0x90, 1, 2, 0x91, 1, 2 }, 6);
+    test_input(3, sysex, sizeof(sysex));
+    check(test_sent(2, (unsigned char []) { 0x90, 1, 2, 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 }, 9),
+	  "merge, channel filter, sysex unfiltered");
+    check(test_app(0, NULL, 0), "nothing from port 3 for the application");
+
+    /* A clock inside a message goes out on its own, ahead of it. */
+    test_input(1, (unsigned char []) { 0x93, 60, 0xf8, 100 }, 4);
+    check(test_sent(3, (unsigned char []) { 0xf8 }, 1), "clock routed from any port");
+    check(test_sent(2, (unsigned char []) { 0xf8, 0x95, 60, 100 }, 4), "clock doesn't split the message");
+    test_input(2, (unsigned char []) { 0xf8 }, 1);
+    check(test_sent(3, (unsigned char []) { 0xf8 }, 1), "clock from an unrouted port");
+
+    /*
+     * Swap between two tables while another thread feeds port 0.  Every
+     * message goes to exactly one of the application or port 1.
+     */
+    struct pusamidi_route_s to_app[] = { { 0, 0, 0, PUSAMIDI_ROUTE_APP, -1 } };
+    struct pusamidi_route_s to_port[] = { { 0, 0, 0, 1, -1 } };
+    unsigned char msg[16];
+    int received = 0, swaps = 0, bad = 0;
+
+    test_feeding = 1;
+    pthread_t tid;
+    pthread_create(&tid, NULL, test_feeder, NULL);
+    for (swaps = 0; test_feeding; swaps++)
+    {
+	if (pusamidi_set_routes(swaps & 1 ? to_port : to_app, 1) < 0)
+	    bad++;
+	while (pusamidi_get_midi_message(NULL, msg, sizeof(msg)) > 0)
+	{
+	    if (memcmp(msg, (unsigned char []) { 0x90, 60, 100 }, 3) != 0)
+		bad++;
+	    received++;
+	}
+	sched_yield();
+    }
+    pthread_join(tid, NULL);
+    while (pusamidi_get_midi_message(NULL, msg, sizeof(msg)) > 0)
+	received++;
+
+    printf("%d messages during %d swaps: %d to the application, %d thru\n",
+	   TEST_SWAP_MESSAGES, swaps, received, test_thru);
+    check(swaps > 100 && received > 0 && test_thru > 0, "both tables used");
+    check(bad == 0 && test_thru_bad == 0 && received + test_thru == TEST_SWAP_MESSAGES,
+	  "route swap while input is flowing");
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSAMIDI_ROUTE_BENCH
+#include <time.h>
+
+/*
+ * Time pusamidi_route() for note messages on a single port.  No output
+ * ports are opened, so this measures table lookup and application delivery
+ * only, not the cost of the ALSA writes.
+ */
+static double pusamidi_bench_routes(int nmessages)
+{
+    unsigned char msg[3] = { 0x90, 60, 100 };
+    unsigned char buffer[16];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nmessages; i++)
+    {
+	msg[0] = 0x90 | (i & 0xf);
+	pusamidi_route(i % 4, msg, sizeof(msg));
+	while (pusamidi_get_midi_message(NULL, buffer, sizeof(buffer)) > 0)
+	    ;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    return ns / nmessages;
+}
+
+int main(int argc, char **argv)
+{
+    const int nmessages = 1000000;
+
+    printf("default:   %.1f ns/message\n", pusamidi_bench_routes(nmessages));
+
+    struct pusamidi_route_s routes[] =
+    {
+	{ 0, 0x0001, PUSAMIDI_TYPE_NOTE_ON | PUSAMIDI_TYPE_NOTE_OFF, PUSAMIDI_ROUTE_APP, -1 },
+	{ 1, 0, 0, PUSAMIDI_ROUTE_APP, 3 },
+	{ 2, 0x00ff, PUSAMIDI_TYPE_CC, 1, -1 },
+	{ 3, 0, 0, 2, 9 },
+	{ PUSAMIDI_ROUTE_ANY, 0, PUSAMIDI_TYPE_REALTIME, PUSAMIDI_ROUTE_ALL_OUTS, -1 },
+	{ PUSAMIDI_ROUTE_ANY, 0xff00, 0, PUSAMIDI_ROUTE_APP, -1 },
+    };
+
+    if (pusamidi_set_routes(routes, sizeof(routes) / sizeof(routes[0])) < 0)
+    {
+	printf("Failed to compile routes\n");
+	exit(1);
+    }
+
+    printf("%d routes: %.1f ns/message\n", (int) (sizeof(routes) / sizeof(routes[0])),
+	   pusamidi_bench_routes(nmessages));
+
+    return 0;
+}
+#endif
@@ -1,8 +1,55 @@
 #ifndef __pusamidi_h__
 #define __pusamidi_h__
 
+#define PUSAMIDI_PORT_MAX	32
+
+/*
+ * Routing destinations and port wildcards.
+ */
+#define PUSAMIDI_ROUTE_ANY	-1
+#define PUSAMIDI_ROUTE_ALL_OUTS	-1
+#define PUSAMIDI_ROUTE_APP	-2
+
+/*
+ * Message type bits for struct pusamidi_route_s types.
+ */
+#define PUSAMIDI_TYPE_NOTE_OFF	(1 << 0)
+#define PUSAMIDI_TYPE_NOTE_ON	(1 << 1)
+#define PUSAMIDI_TYPE_POLY_AT	(1 << 2)
+#define PUSAMIDI_TYPE_CC	(1 << 3)
+#define PUSAMIDI_TYPE_PROGRAM	(1 << 4)
+#define PUSAMIDI_TYPE_CHAN_AT	(1 << 5)
+#define PUSAMIDI_TYPE_PITCH	(1 << 6)
+#define PUSAMIDI_TYPE_SYSTEM	(1 << 7)
+#define PUSAMIDI_TYPE_REALTIME	(1 << 8)
+
+/*
+ * A route matches messages from an input port on a set of channels and
+ * message types.  A zero channels or types mask matches everything.
+ * Channel messages are moved to channel (0-15) unless it is -1.
+ */
+struct pusamidi_route_s
+{
+    int in_port;
+    unsigned int channels;
+    unsigned int types;
+    int out_port;
+    int channel;
+};
+
 void pusamidi_init(void);
 int pusamidi_get_midi_in(void);
+int pusamidi_get_midi_message(int *port, unsigned char *buffer, int size);
+const char *pusamidi_port_name(int port, int output);
+int pusamidi_set_routes(const struct pusamidi_route_s *routes, int nroutes);
 void pusamidi_send_midi_out(const void *buffer, size_t len);
+void pusamidi_set_realtime_callback(void (*func)(int c));
+void pusamidi_set_read_callback(void (*func)(int port, const unsigned char *msg, int len));
+void pusamidi_set_cc_callback(int (*func)(int port, int channel, int cc, int value));
+void pusamidi_inject(int port, const unsigned char *msg, int len);
+int pusamidi_add_port(const char *hwname, const char *name,
+		      void (*write)(const void *buffer, size_t len));
+int pusamidi_find_port_index(const char *hwname, int output);
+void pusamidi_port_input(int portnum, const unsigned char *data, int n);
 
 #endif /* __pusamidi_h__ */
@@ -0,0 +1,942 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Network audio streams.  Each stream has a network thread, which runs
+ * on the housekeeping cores like any thread started after pusa_init().
+ * The audio thread only touches two rings per stream: output frames to
+ * send, and received frames to play.
+ *
+ * Packets are RTP with a payload of 24 bit big endian stereo frames and a
+ * header extension holding the sender's CLOCK_REALTIME when sent, for
+ * measuring latency.  The network thread sends and receives packets in
+ * batches with sendmmsg() and recvmmsg().
+ *
+ * Received frames go into a jitter buffer indexed by RTP timestamp.  The
+ * network thread reads them out at a fractional position, interpolating
+ * between frames, and keeps the ring to the audio thread topped up, so
+ * frames leave at the rate of the local sample clock.  How far the
+ * position runs behind the newest frame received is held at a target
+ * set from the measured interarrival jitter by adjusting the read rate:
+ * proportional to the error, plus an integral term that settles at the
+ * drift between the two clocks.  Missing frames are replaced by the last
+ * good frame fading out.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "pusanet.h"
+#include "pusarate.h"
+
+#define PUSANET_HEADER		12
+#define PUSANET_EXTENSION	12
+#define PUSANET_PROFILE		0x5055
+#define PUSANET_MAX_PACKET	(PUSANET_HEADER + PUSANET_EXTENSION + PUSANET_MAX_FRAMES * 6)
+
+#define PUSANET_LATE_DECAY	30.0
+
+/* Fade per frame while concealing. */
+#define PUSANET_CONCEAL_FADE	0.995
+
+#define PUSANET_POLL_NS		250000
+
+struct pusanet_stream_s
+{
+    int in_use;
+    volatile int active;
+    volatile int running;
+    volatile int exited;
+    int fd;
+    int sending;
+    int receiving;
+    int cpu;
+    struct sockaddr_in remote;
+    int rate;
+    int fpp;
+    int min_delay;
+    struct timespec start;
+
+    /* Audio thread to network thread. */
+    int send_ring[PUSANET_RT_RING * 2];
+    volatile unsigned int send_in;
+    volatile unsigned int send_out;
+
+    /* Network thread to audio thread. */
+    int play_ring[PUSANET_RT_RING * 2];
+    volatile unsigned int play_in;
+    volatile unsigned int play_out;
+    volatile int playing;
+
+    /* Sending, network thread only. */
+    unsigned short seq;
+    unsigned int ssrc;
+    unsigned int timestamp;
+
+    /* Receiving, network thread only.  Positions are unwrapped timestamps. */
+    int jb[PUSANET_JB_FRAMES * 2];
+    unsigned char jb_valid[PUSANET_JB_FRAMES];
+    long long last_ext;
+    long long newest;
+    long long cleared;
+    double play_pos;
+    double ratio;
+    struct pusarate_s rate_control;
+    double level;
+    double target;
+    double late_margin;
+    double jitter;
+    double last_transit;
+    int have_transit;
+    int last_out[2];
+    double conceal_gain;
+    unsigned int rt_fill;
+    unsigned long underruns_seen;
+    int have_seq;
+    unsigned int seq_base;
+    unsigned int seq_max;
+    double latency_sum;
+    unsigned long latency_count;
+
+    struct pusanet_stats_s stats;
+};
+
+static struct pusanet_stream_s *pusanet_streams[PUSANET_MAX_STREAMS];
+
+#ifdef PUSANET_UNIT_TEST
+static int pusanet_test_drop = 0;
+static unsigned long pusanet_test_dropped = 0;
+static double pusanet_test_now = 0;
+#endif
+
+static inline int pusanet_clamp(long long v)
+{
+    return v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : v;
+}
+
+static unsigned long long pusanet_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+#ifdef PUSANET_UNIT_TEST
+    /* The test runs the streams on a virtual clock, pusanet_test_now. */
+    if (clock != CLOCK_THREAD_CPUTIME_ID)
+	return pusanet_test_now * 1e9;
+#endif
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pusanet_put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void pusanet_put32(unsigned char *p, unsigned int v)
+{
+    pusanet_put16(p, v >> 16);
+    pusanet_put16(p + 2, v);
+}
+
+static unsigned int pusanet_get16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static unsigned int pusanet_get32(const unsigned char *p)
+{
+    return pusanet_get16(p) << 16 | pusanet_get16(p + 2);
+}
+
+static void pusanet_send_batch(struct pusanet_stream_s *s, struct mmsghdr *msgs, int n)
+{
+    for (int sent = 0; sent < n; )
+    {
+	int r = sendmmsg(s->fd, msgs + sent, n - sent, 0);
+	s->stats.send_calls++;
+	if (r <= 0)
+	    break;
+	sent += r;
+	s->stats.packets_sent += r;
+    }
+}
+
+/*
+ * Turn frames in the send ring into packets and send them in batches.
+ */
+static void pusanet_send(struct pusanet_stream_s *s)
+{
+    static __thread unsigned char packets[PUSANET_BATCH][PUSANET_MAX_PACKET];
+    struct mmsghdr msgs[PUSANET_BATCH];
+    struct iovec iovs[PUSANET_BATCH];
+    int n = 0;
+
+    while ((s->send_in - s->send_out + PUSANET_RT_RING) % PUSANET_RT_RING >= (unsigned int) s->fpp)
+    {
+	unsigned char *p = packets[n];
+	unsigned long long now = pusanet_clock_ns(CLOCK_REALTIME);
+
+	p[0] = 0x90;
+	p[1] = PUSANET_PAYLOAD_TYPE;
+	pusanet_put16(p + 2, s->seq++);
+	pusanet_put32(p + 4, s->timestamp);
+	pusanet_put32(p + 8, s->ssrc);
+	pusanet_put16(p + 12, PUSANET_PROFILE);
+	pusanet_put16(p + 14, 2);
+	pusanet_put32(p + 16, now >> 32);
+	pusanet_put32(p + 20, now);
+	s->timestamp += s->fpp;
+
+	__sync_synchronize();
+	unsigned char *q = p + PUSANET_HEADER + PUSANET_EXTENSION;
+	for (int i = 0; i < s->fpp; i++)
+	{
+	    const int *frame = s->send_ring + 2 * s->send_out;
+	    for (int c = 0; c < 2; c++, q += 3)
+	    {
+		q[0] = frame[c] >> 24;
+		q[1] = frame[c] >> 16;
+		q[2] = frame[c] >> 8;
+	    }
+	    s->send_out = (s->send_out + 1) % PUSANET_RT_RING;
+	}
+
+#ifdef PUSANET_UNIT_TEST
+	if (pusanet_test_drop && s->seq % pusanet_test_drop == 0)
+	{
+	    pusanet_test_dropped++;
+	    continue;
+	}
+#endif
+
+	iovs[n].iov_base = p;
+	iovs[n].iov_len = q - p;
+	memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+	msgs[n].msg_hdr.msg_name = &s->remote;
+	msgs[n].msg_hdr.msg_namelen = sizeof(s->remote);
+	msgs[n].msg_hdr.msg_iov = iovs + n;
+	msgs[n].msg_hdr.msg_iovlen = 1;
+
+	if (++n == PUSANET_BATCH)
+	{
+	    pusanet_send_batch(s, msgs, n);
+	    n = 0;
+	}
+    }
+
+    pusanet_send_batch(s, msgs, n);
+}
+
+static unsigned int pusanet_ring_level(struct pusanet_stream_s *s)
+{
+    return (s->play_in - s->play_out + PUSANET_RT_RING) % PUSANET_RT_RING;
+}
+
+/*
+ * Start playing so that target frames are buffered behind the end of what
+ * has arrived, counting those already in the ring.
+ */
+static void pusanet_resync(struct pusanet_stream_s *s, long long end)
+{
+    memset(s->jb_valid, 0, sizeof(s->jb_valid));
+    s->newest = end;
+    s->play_pos = end - s->target + pusanet_ring_level(s);
+    s->cleared = floor(s->play_pos);
+    s->level = s->target;
+    s->stats.resyncs++;
+}
+
+/*
+ * Step the delay up at once, where the output has just glitched anyway,
+ * rather than leave the rate control to absorb it.
+ */
+static void pusanet_delay(struct pusanet_stream_s *s, double frames)
+{
+    s->play_pos -= frames;
+    s->level += frames;
+    s->target += frames;
+}
+
+static void pusanet_packet(struct pusanet_stream_s *s, const unsigned char *p, int len)
+{
+    if (len < PUSANET_HEADER || (p[0] >> 6) != 2 || (p[1] & 0x7f) != PUSANET_PAYLOAD_TYPE)
+	return;
+
+    int off = PUSANET_HEADER + 4 * (p[0] & 0xf);
+    unsigned long long sent_ns = 0;
+    if (p[0] & 0x10)
+    {
+	if (len < off + 4)
+	    return;
+	int words = pusanet_get16(p + off + 2);
+	if (pusanet_get16(p + off) == PUSANET_PROFILE && words >= 2 && len >= off + 12)
+	    sent_ns = (unsigned long long) pusanet_get32(p + off + 4) << 32 | pusanet_get32(p + off + 8);
+	off += 4 + 4 * words;
+    }
+
+    int nframes = (len - off) / 6;
+    if (nframes <= 0 || nframes > PUSANET_MAX_FRAMES)
+	return;
+
+    /* Loss from sequence numbers, as in RTCP receiver reports. */
+    unsigned int seq = pusanet_get16(p + 2);
+    if (!s->have_seq)
+    {
+	s->have_seq = 1;
+	s->seq_base = s->seq_max = seq;
+    }
+    else
+    {
+	short d = seq - (s->seq_max & 0xffff);
+	if (d > 0)
+	    s->seq_max += d;
+    }
+    s->stats.packets_received++;
+    long long expected = (long long) s->seq_max - s->seq_base + 1;
+    s->stats.packets_lost = expected > (long long) s->stats.packets_received ?
+	expected - s->stats.packets_received : 0;
+
+    if (sent_ns)
+    {
+	double ms = ((long long) (pusanet_clock_ns(CLOCK_REALTIME) - sent_ns)) / 1e6;
+	s->latency_sum += ms;
+	s->latency_count++;
+	if (ms > s->stats.net_latency_max_ms)
+	    s->stats.net_latency_max_ms = ms;
+    }
+
+    unsigned int ts = pusanet_get32(p + 4);
+    long long ext = s->playing ? s->last_ext + (int) (ts - (unsigned int) s->last_ext) : ts;
+    if (!s->playing || ext > s->last_ext)
+	s->last_ext = ext;
+
+    /* Interarrival jitter, RFC 3550, in frames. */
+    double arrival = pusanet_clock_ns(CLOCK_MONOTONIC) * (s->rate / 1e9);
+    double transit = arrival - ext;
+    if (s->have_transit)
+	s->jitter += (fabs(transit - s->last_transit) - s->jitter) / 16;
+    s->last_transit = transit;
+    s->have_transit = 1;
+
+    if (!s->playing)
+    {
+	pusanet_resync(s, ext + nframes);
+	s->stats.resyncs = 0;
+	s->playing = 1;
+    }
+    else if (ext + nframes <= s->play_pos)
+    {
+	/* Far behind means the sender started over. */
+	if (s->play_pos - (ext + nframes) < PUSANET_JB_FRAMES / 4)
+	{
+	    double late = s->play_pos - ext;
+	    s->stats.packets_late++;
+	    if (late > s->late_margin)
+	    {
+		pusanet_delay(s, late - s->late_margin);
+		s->late_margin = late;
+	    }
+	    return;
+	}
+	pusanet_resync(s, ext + nframes);
+    }
+    else if (ext + nframes - s->play_pos > PUSANET_JB_FRAMES - 2 * PUSANET_MAX_FRAMES)
+	pusanet_resync(s, ext + nframes);
+
+    const unsigned char *q = p + off;
+    for (int i = 0; i < nframes; i++, q += 6)
+    {
+	long long pos = ext + i;
+	if (pos < s->cleared)
+	    continue;
+
+	int slot = pos % PUSANET_JB_FRAMES;
+	s->jb[2 * slot] = q[0] << 24 | q[1] << 16 | q[2] << 8;
+	s->jb[2 * slot + 1] = q[3] << 24 | q[4] << 16 | q[5] << 8;
+	s->jb_valid[slot] = 1;
+    }
+
+    if (ext + nframes > s->newest)
+	s->newest = ext + nframes;
+}
+
+static void pusanet_receive(struct pusanet_stream_s *s)
+{
+    static __thread unsigned char packets[PUSANET_BATCH][PUSANET_MAX_PACKET];
+    struct mmsghdr msgs[PUSANET_BATCH];
+    struct iovec iovs[PUSANET_BATCH];
+
+    while (1)
+    {
+	for (int i = 0; i < PUSANET_BATCH; i++)
+	{
+	    iovs[i].iov_base = packets[i];
+	    iovs[i].iov_len = PUSANET_MAX_PACKET;
+	    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+	    msgs[i].msg_hdr.msg_iov = iovs + i;
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = recvmmsg(s->fd, msgs, PUSANET_BATCH, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+	    return;
+	s->stats.recv_calls++;
+
+	for (int i = 0; i < n; i++)
+	    pusanet_packet(s, packets[i], msgs[i].msg_len);
+	if (n < PUSANET_BATCH)
+	    return;
+    }
+}
+
+/*
+ * Read one frame at the play position, or make one up.
+ */
+static void pusanet_read_frame(struct pusanet_stream_s *s, int *frame)
+{
+    long long i = floor(s->play_pos);
+    double frac = s->play_pos - i;
+    int a = i % PUSANET_JB_FRAMES, b = (i + 1) % PUSANET_JB_FRAMES;
+
+    if (!s->jb_valid[a])
+    {
+	s->conceal_gain *= PUSANET_CONCEAL_FADE;
+	frame[0] = s->last_out[0] * s->conceal_gain;
+	frame[1] = s->last_out[1] * s->conceal_gain;
+	s->stats.frames_concealed++;
+	return;
+    }
+
+    for (int c = 0; c < 2; c++)
+    {
+	double v = s->jb[2 * a + c];
+	if (s->jb_valid[b])
+	    v += (s->jb[2 * b + c] - v) * frac;
+	frame[c] = v;
+	s->last_out[c] = frame[c];
+    }
+    s->conceal_gain = 1.0;
+}
+
+/*
+ * Keep the ring to the audio thread topped up and steer the read rate.
+ */
+static void pusanet_playout(struct pusanet_stream_s *s)
+{
+    if (!s->playing)
+	return;
+
+    /* Keep more ready if the audio thread ever found the ring empty. */
+    if (s->stats.rt_underruns != s->underruns_seen)
+    {
+	s->underruns_seen = s->stats.rt_underruns;
+	if (s->rt_fill < PUSANET_RT_RING / 2)
+	{
+	    s->rt_fill += 16;
+	    pusanet_delay(s, 16);
+	}
+    }
+
+    int produced = 0;
+    while (pusanet_ring_level(s) < s->rt_fill)
+    {
+	pusanet_read_frame(s, s->play_ring + 2 * s->play_in);
+	__sync_synchronize();
+	s->play_in = (s->play_in + 1) % PUSANET_RT_RING;
+	produced++;
+
+	s->play_pos += s->ratio;
+	long long end = floor(s->play_pos);
+	if (end - s->cleared >= PUSANET_JB_FRAMES)
+	    memset(s->jb_valid, 0, sizeof(s->jb_valid));
+	else
+	    for (long long c = s->cleared; c < end; c++)
+		s->jb_valid[c % PUSANET_JB_FRAMES] = 0;
+	if (end > s->cleared)
+	    s->cleared = end;
+    }
+
+    if (produced == 0)
+	return;
+
+    /*
+     * Jitter covers the usual spread of arrivals.  Packets arriving too
+     * late set a margin for the rarer long delays, as much as would have
+     * caught the latest of them, which wears off over PUSANET_LATE_DECAY
+     * seconds.  The level and target count the ring
+     * too, so topping it up further moves frames rather than upsetting
+     * the control.
+     */
+    double dt = (double) produced / s->rate;
+    s->late_margin -= s->late_margin * dt / PUSANET_LATE_DECAY;
+    double target = s->fpp + 4 * s->jitter + s->late_margin;
+    s->target = (target > s->min_delay ? target : s->min_delay) + s->rt_fill;
+
+    /* Arrivals make the level a sawtooth, so look at it over 100 ms. */
+    double alpha = dt / 0.1;
+    double level = s->newest - s->play_pos + pusanet_ring_level(s);
+    s->level += (level - s->level) * (alpha < 1 ? alpha : 1);
+
+    /* Read a little faster as the margin wears off, so the drift stays clean. */
+    double err = (s->level - s->target) / s->rate;
+    s->ratio = 1 + pusarate_update(&s->rate_control, err, dt,
+				   s->late_margin / (PUSANET_LATE_DECAY * s->rate));
+
+    /* Gone so far out that steering would take too long. */
+    if (s->newest - s->play_pos > PUSANET_JB_FRAMES / 2)
+	pusanet_resync(s, s->newest);
+}
+
+/*
+ * Move packets and frames after the thread wakes.
+ */
+static void pusanet_poll(struct pusanet_stream_s *s)
+{
+    if (s->receiving)
+	pusanet_receive(s);
+    if (s->sending)
+	pusanet_send(s);
+    if (s->receiving)
+	pusanet_playout(s);
+}
+
+#ifndef PUSANET_UNIT_TEST
+static void *pusanet_thread(void *arg)
+{
+    struct pusanet_stream_s *s = arg;
+    struct timespec timeout = { 0, PUSANET_POLL_NS };
+    unsigned long loops = 0;
+
+    if (s->cpu >= 0)
+    {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(s->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    while (s->running)
+    {
+	struct pollfd pfd = { s->fd, POLLIN, 0 };
+	ppoll(&pfd, s->receiving ? 1 : 0, &timeout, NULL);
+	pusanet_poll(s);
+
+	if (++loops % 256 == 0)
+	    s->stats.cpu = pusanet_clock_ns(CLOCK_THREAD_CPUTIME_ID) / 1e9;
+    }
+
+    s->stats.cpu = pusanet_clock_ns(CLOCK_THREAD_CPUTIME_ID) / 1e9;
+    __sync_synchronize();
+    s->exited = 1;
+
+    return NULL;
+}
+#endif
+
+/*
+ * Open a stream and start its network thread.  Returns the stream number
+ * for the other calls.
+ */
+int pusanet_open(const struct pusanet_config_s *config)
+{
+    int n;
+
+    for (n = 0; n < PUSANET_MAX_STREAMS; n++)
+	if (pusanet_streams[n] == NULL || !pusanet_streams[n]->in_use)
+	    break;
+    if (n == PUSANET_MAX_STREAMS)
+    {
+	printf("pusanet: no free streams\n");
+	return -1;
+    }
+
+    int fpp = config->frames_per_packet ? config->frames_per_packet : PUSANET_DEFAULT_FRAMES;
+    if (fpp <= 0 || fpp > PUSANET_MAX_FRAMES || config->sample_rate <= 0 ||
+	(config->remote_host == NULL && config->local_port == 0))
+    {
+	printf("pusanet: bad stream configuration\n");
+	return -1;
+    }
+
+    /* Slots are kept for reuse, as the audio thread may still look at a closed one. */
+    struct pusanet_stream_s *s = pusanet_streams[n];
+    if (s == NULL)
+    {
+	s = malloc(sizeof(*s));
+	if (s == NULL)
+	{
+	    printf("pusanet: out of memory\n");
+	    return -1;
+	}
+    }
+    memset(s, 0, sizeof(*s));
+    s->rate = config->sample_rate;
+    s->fpp = fpp;
+    s->min_delay = config->min_delay ? config->min_delay : 2 * fpp;
+    s->target = s->min_delay;
+    s->rt_fill = fpp / 2 + 16;
+    s->cpu = config->cpu;
+    s->ratio = 1.0;
+    pusarate_init(&s->rate_control);
+    s->conceal_gain = 1.0;
+    s->ssrc = (unsigned int) pusanet_clock_ns(CLOCK_REALTIME) ^ (n << 24);
+    s->seq = s->ssrc >> 16;
+    s->timestamp = s->ssrc * 2654435761u;
+
+    s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s->fd < 0)
+    {
+	perror("pusanet: socket");
+	return -1;
+    }
+
+    int tos = IPTOS_DSCP_EF;
+    setsockopt(s->fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    int size = 1024 * 1024;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    if (config->local_port)
+    {
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(config->local_port);
+	if (bind(s->fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+	{
+	    perror("pusanet: bind");
+	    close(s->fd);
+	    return -1;
+	}
+	s->receiving = 1;
+    }
+
+    if (config->remote_host != NULL)
+    {
+	struct addrinfo hints, *res;
+	char port[16];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(port, sizeof(port), "%d", config->remote_port);
+	if (getaddrinfo(config->remote_host, port, &hints, &res) != 0)
+	{
+	    printf("pusanet: can't find %s\n", config->remote_host);
+	    close(s->fd);
+	    return -1;
+	}
+	memcpy(&s->remote, res->ai_addr, sizeof(s->remote));
+	freeaddrinfo(res);
+	s->sending = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    s->in_use = 1;
+    s->running = 1;
+
+#ifdef PUSANET_UNIT_TEST
+    /* The test polls the stream itself. */
+    s->exited = 1;
+#else
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusanet_thread, s) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	close(s->fd);
+	s->in_use = 0;
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+#endif
+
+    pusanet_streams[n] = s;
+    __sync_synchronize();
+    s->active = 1;
+
+    return n;
+}
+
+void pusanet_close(int stream)
+{
+    if (stream < 0 || stream >= PUSANET_MAX_STREAMS || pusanet_streams[stream] == NULL)
+	return;
+
+    struct pusanet_stream_s *s = pusanet_streams[stream];
+    if (!s->in_use)
+	return;
+
+    s->active = 0;
+    s->running = 0;
+    while (!s->exited)
+	usleep(1000);
+
+    close(s->fd);
+    s->in_use = 0;
+}
+
+/*
+ * Audio thread only: queue a frame to send.
+ */
+void pusanet_rt_send(int stream, const int *data)
+{
+    struct pusanet_stream_s *s = pusanet_streams[stream];
+
+    if (s == NULL || !s->active || !s->sending)
+	return;
+
+    unsigned int next = (s->send_in + 1) % PUSANET_RT_RING;
+    if (next == s->send_out)
+    {
+	s->stats.send_overflows++;
+	return;
+    }
+
+    s->send_ring[2 * s->send_in] = data[0];
+    s->send_ring[2 * s->send_in + 1] = data[1];
+    __sync_synchronize();
+    s->send_in = next;
+}
+
+/*
+ * Audio thread only: add the next received frame to data.  Returns 0 if
+ * there was none.
+ */
+int pusanet_rt_receive(int stream, int *data)
+{
+    struct pusanet_stream_s *s = pusanet_streams[stream];
+
+    if (s == NULL || !s->active || !s->receiving)
+	return 0;
+
+    unsigned int out = s->play_out;
+    if (out == s->play_in)
+    {
+	if (s->playing)
+	    s->stats.rt_underruns++;
+	return 0;
+    }
+
+    __sync_synchronize();
+    data[0] = pusanet_clamp((long long) data[0] + s->play_ring[2 * out]);
+    data[1] = pusanet_clamp((long long) data[1] + s->play_ring[2 * out + 1]);
+    __sync_synchronize();
+    s->play_out = (out + 1) % PUSANET_RT_RING;
+
+    return 1;
+}
+
+/*
+ * Audio thread only: send the frame on every stream, then mix in what
+ * every stream received.
+ */
+void pusanet_rt_frame(int *data)
+{
+    for (int i = 0; i < PUSANET_MAX_STREAMS; i++)
+	pusanet_rt_send(i, data);
+    for (int i = 0; i < PUSANET_MAX_STREAMS; i++)
+	pusanet_rt_receive(i, data);
+}
+
+void pusanet_get_stats(int stream, struct pusanet_stats_s *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (stream < 0 || stream >= PUSANET_MAX_STREAMS || pusanet_streams[stream] == NULL)
+	return;
+
+    struct pusanet_stream_s *s = pusanet_streams[stream];
+    *stats = s->stats;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - s->start.tv_sec) + (now.tv_nsec - s->start.tv_nsec) / 1e9;
+    if (elapsed > 0)
+	stats->cpu /= elapsed;
+
+    if (!s->receiving)
+	return;
+
+    double ms_per_frame = 1000.0 / s->rate;
+    if (s->latency_count)
+	stats->net_latency_ms = s->latency_sum / s->latency_count;
+    stats->jitter_ms = s->jitter * ms_per_frame;
+    stats->target_ms = s->target * ms_per_frame;
+    stats->buffer_ms = s->level * ms_per_frame;
+    stats->latency_ms = stats->net_latency_ms + (s->level + s->fpp) * ms_per_frame;
+    stats->drift_ppm = s->rate_control.integral * 1e6;
+}
+
+void pusanet_print_stats(void)
+{
+    for (int i = 0; i < PUSANET_MAX_STREAMS; i++)
+    {
+	struct pusanet_stats_s st;
+
+	if (pusanet_streams[i] == NULL || !pusanet_streams[i]->in_use)
+	    continue;
+
+	pusanet_get_stats(i, &st);
+	printf("net %d: %.2f%% cpu\n", i, st.cpu * 100);
+	if (pusanet_streams[i]->sending)
+	    printf("  sent %lu packets in %lu calls, %lu frames dropped\n",
+		   st.packets_sent, st.send_calls, st.send_overflows);
+	if (pusanet_streams[i]->receiving)
+	    printf("  received %lu packets in %lu calls, lost %lu, late %lu, concealed %llu frames, "
+		   "underruns %lu, resyncs %lu\n"
+		   "  network %.2f ms (max %.2f), jitter %.3f ms, buffer %.2f ms (target %.2f), "
+		   "latency %.2f ms, drift %.1f ppm\n",
+		   st.packets_received, st.recv_calls, st.packets_lost, st.packets_late,
+		   st.frames_concealed, st.rt_underruns, st.resyncs, st.net_latency_ms,
+		   st.net_latency_max_ms, st.jitter_ms, st.buffer_ms, st.target_ms,
+		   st.latency_ms, st.drift_ppm);
+    }
+}
+
+#ifdef PUSANET_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Stream over localhost, sending at 48 kHz and playing out 200 ppm
+ * faster, with every 50th packet lost.  The frames carry their own index
+ * so the far end can tell how late and how continuous they are.  This
+ * plays both audio threads, frame by frame on the virtual clock, and
+ * polls each stream as its network thread would, every PUSANET_POLL_NS
+ * plus a random wake up latency of up to TEST_WAKE_MS.  A 10 ms minimum
+ * delay keeps the target still while the drift is measured.
+ */
+#define TEST_RATE	48000
+#define TEST_SECONDS	10
+#define TEST_SKEW	200e-6
+#define TEST_WAKE_MS	0.5
+
+int main(int argc, char **argv)
+{
+    struct pusanet_config_s tx = { "127.0.0.1", 47011, 0, TEST_RATE, 0, 0, -1 };
+    struct pusanet_config_s rx = { NULL, 0, 47011, TEST_RATE, 0, 480, -1 };
+    struct pusanet_stats_s st;
+
+    srand(1);
+    int rxs = pusanet_open(&rx);
+    int txs = pusanet_open(&tx);
+    check(rxs >= 0 && txs >= 0, "open streams");
+    pusanet_test_drop = 50;
+
+    struct pusanet_stream_s *streams[2] = { pusanet_streams[txs], pusanet_streams[rxs] };
+    double wake[2] = { 0, 0 };
+    unsigned long long produced, consumed = 0;
+    double last = -1, latency_sum = 0, t0 = -1;
+    double reported_sum = 0, drift_sum = 0;
+    unsigned long steady = 0, pairs = 0, latency_n = 0, reported_n = 0;
+
+    for (produced = 0; produced < TEST_SECONDS * TEST_RATE; produced++)
+    {
+	double t = (double) produced / TEST_RATE;
+	pusanet_test_now = t;
+
+	for (int i = 0; i < 2; i++)
+	    while (wake[i] <= t)
+	    {
+		pusanet_poll(streams[i]);
+		wake[i] += PUSANET_POLL_NS / 1e9 + TEST_WAKE_MS / 1000.0 * rand() / RAND_MAX;
+	    }
+
+	int frame[2] = { (int) (produced << 8), -(int) (produced << 8) };
+	pusanet_rt_send(txs, frame);
+
+	/* The playing clock starts with the first frame received. */
+	while (t0 < 0 || consumed < (t - t0) * TEST_RATE * (1 + TEST_SKEW))
+	{
+	    frame[0] = frame[1] = 0;
+	    int got = pusanet_rt_receive(rxs, frame);
+	    if (t0 < 0)
+	    {
+		if (!got)
+		    break;
+		t0 = t;
+	    }
+	    consumed++;
+
+	    /* Look at the last two seconds, once things have settled. */
+	    double index = frame[0] / 256.0;
+	    if (t > TEST_SECONDS - 2 && last > 0)
+	    {
+		pairs++;
+		if (got && fabs(index - last - 1) < 0.01)
+		{
+		    steady++;
+		    latency_sum += (produced - index) / (TEST_RATE / 1000.0);
+		    latency_n++;
+		}
+	    }
+	    last = index;
+	}
+
+	/* What the stream says over the same time. */
+	if (t > TEST_SECONDS - 2 && produced % 48 == 0)
+	{
+	    pusanet_get_stats(rxs, &st);
+	    reported_sum += st.latency_ms;
+	    drift_sum += st.drift_ppm;
+	    reported_n++;
+	}
+    }
+
+    pusanet_print_stats();
+    pusanet_get_stats(rxs, &st);
+
+    double measured = latency_sum / latency_n;
+    double reported = reported_sum / reported_n, drift = drift_sum / reported_n;
+    printf("measured latency %.2f ms, reported %.2f ms, drift %.1f ppm, %lu of %lu frames steady, "
+	   "%lu packets dropped\n", measured, reported, drift, steady, pairs, pusanet_test_dropped);
+    check(st.packets_lost + 1 >= pusanet_test_dropped && st.packets_lost <= pusanet_test_dropped,
+	  "losses counted");
+    check(st.frames_concealed >= pusanet_test_dropped * PUSANET_DEFAULT_FRAMES / 2,
+	  "losses concealed");
+    check(steady > pairs * 9 / 10, "output continuous");
+    check(fabs(drift + TEST_SKEW * 1e6) < 50, "drift tracked");
+    check(fabs(measured - reported) < 2, "reported latency matches measured");
+    check(st.net_latency_ms < 5, "localhost network latency");
+
+    pusanet_close(txs);
+    pusanet_close(rxs);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Header file for network audio streams.
+ */
+
+#ifndef __pusanet_h__
+#define __pusanet_h__
+
+#define PUSANET_MAX_STREAMS	4
+#define PUSANET_DEFAULT_FRAMES	48
+#define PUSANET_MAX_FRAMES	256
+#define PUSANET_RT_RING		8192
+#define PUSANET_JB_FRAMES	16384
+#define PUSANET_BATCH		16
+#define PUSANET_PAYLOAD_TYPE	96
+
+/*
+ * A stream sends to remote_host if it is set and receives on local_port
+ * if that is set; either or both.  min_delay is the least the jitter
+ * buffer holds, in frames, 0 for two packets.  cpu pins the network
+ * thread, or -1 to leave it on the housekeeping cores.
+ */
+struct pusanet_config_s
+{
+    const char *remote_host;
+    int remote_port;
+    int local_port;
+    int sample_rate;
+    int frames_per_packet;
+    int min_delay;
+    int cpu;
+};
+
+/*
+ * net_latency is from the sender's clock at sending to arrival, so only
+ * means something when the clocks are synchronized, as on one machine.
+ * latency adds the jitter buffer, the ring to the audio thread and
+ * packetization to that.  drift_ppm is how much faster the remote clock
+ * runs than the local one.  cpu is the network thread's share of a core.
+ */
+struct pusanet_stats_s
+{
+    unsigned long packets_sent;
+    unsigned long send_calls;
+    unsigned long send_overflows;
+    unsigned long packets_received;
+    unsigned long recv_calls;
+    unsigned long packets_lost;
+    unsigned long packets_late;
+    unsigned long rt_underruns;
+    unsigned long resyncs;
+    unsigned long long frames_concealed;
+    double net_latency_ms;
+    double net_latency_max_ms;
+    double jitter_ms;
+    double target_ms;
+    double buffer_ms;
+    double latency_ms;
+    double drift_ppm;
+    double cpu;
+};
+
+int pusanet_open(const struct pusanet_config_s *config);
+void pusanet_close(int stream);
+void pusanet_rt_send(int stream, const int *data);
+int pusanet_rt_receive(int stream, int *data);
+void pusanet_rt_frame(int *data);
+void pusanet_get_stats(int stream, struct pusanet_stats_s *stats);
+void pusanet_print_stats(void);
+
+#endif /* __pusanet_h__ */
@@ -0,0 +1,701 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Named parameters that control threads change without waiting for the
+ * audio thread, and that the audio thread reads without locking.
+ *
+ * There are two copies of every value.  Writers update the shared copy
+ * under a sequence count, odd while a change is being written, and queue
+ * the ids changed.  Every PUSAPARAM_BLOCK frames the audio thread copies
+ * the queued changes to its own copy, unless the count was odd or moved
+ * while it read, in which case it tries again at the next block rather
+ * than wait.  Changes made between pusaparam_begin() and pusaparam_end()
+ * are therefore always seen together.
+ *
+ * A parameter with a ramp moves to a new value in a straight line over
+ * that many frames, stepped every frame, so changes don't click.  Only
+ * parameters still ramping cost anything per frame.  Without a ramp the
+ * value changes at the block.
+ *
+ * MIDI control changes can be bound to parameters and are applied in the
+ * MIDI input thread, without going through the application.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pusamidi.h"
+#include "pusaparam.h"
+
+struct pusaparam_info_s
+{
+    char name[PUSAPARAM_NAME_LEN];
+    float min;
+    float max;
+    int ramp;
+};
+
+/* Audio thread's side of a parameter. */
+struct pusaparam_rt_s
+{
+    float target;
+    float step;
+    int remaining;
+    int active;
+};
+
+struct pusaparam_binding_s
+{
+    short id;
+    signed char port;
+};
+
+float pusaparam_values[PUSAPARAM_MAX];
+
+static struct pusaparam_info_s pusaparam_info[PUSAPARAM_MAX];
+static volatile int pusaparam_count = 0;
+static pthread_mutex_t pusaparam_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int pusaparam_depth = 0;
+
+/* Written under the sequence count, read by the audio thread. */
+static float pusaparam_targets[PUSAPARAM_MAX];
+static volatile unsigned int pusaparam_seq = 0;
+static int pusaparam_ring[PUSAPARAM_RING];
+static volatile unsigned int pusaparam_ring_in = 0;
+static volatile unsigned int pusaparam_ring_out = 0;
+static volatile unsigned int pusaparam_rescan_req = 0;
+static unsigned int pusaparam_rescan_done = 0;
+
+/* Audio thread only. */
+static struct pusaparam_rt_s pusaparam_rt[PUSAPARAM_MAX];
+static int pusaparam_ramping[PUSAPARAM_MAX];
+static int pusaparam_nramping = 0;
+static int pusaparam_rt_frames = 0;
+static int pusaparam_pending_ids[PUSAPARAM_MAX > PUSAPARAM_RING ? PUSAPARAM_MAX : PUSAPARAM_RING];
+static float pusaparam_pending_values[PUSAPARAM_MAX > PUSAPARAM_RING ? PUSAPARAM_MAX : PUSAPARAM_RING];
+
+static struct pusaparam_binding_s pusaparam_cc[16][128];
+static int pusaparam_cc_hooked = 0;
+
+static struct pusaparam_stats_s pusaparam_stats;
+
+/*
+ * Register a parameter.  ramp_frames is how long a change takes to reach
+ * the new value, 0 for at the next block.  Returns its id or -1.
+ */
+int pusaparam_register(const char *name, float min, float max, float initial, int ramp_frames)
+{
+    pthread_mutex_lock(&pusaparam_lock);
+
+    int id = pusaparam_count;
+    if (id >= PUSAPARAM_MAX)
+    {
+	pthread_mutex_unlock(&pusaparam_lock);
+	printf("pusaparam: too many parameters\n");
+	return -1;
+    }
+
+    struct pusaparam_info_s *info = pusaparam_info + id;
+    snprintf(info->name, sizeof(info->name), "%s", name);
+    info->min = min;
+    info->max = max;
+    info->ramp = ramp_frames > 0 ? ramp_frames : 0;
+
+    if (initial < min)
+	initial = min;
+    if (initial > max)
+	initial = max;
+    pusaparam_targets[id] = initial;
+    pusaparam_values[id] = initial;
+    pusaparam_rt[id].target = initial;
+    pusaparam_rt[id].remaining = 0;
+    pusaparam_rt[id].active = -1;
+
+    /* Everything above must be visible before the audio thread sees id. */
+    __sync_synchronize();
+    pusaparam_count = id + 1;
+    pusaparam_stats.params = id + 1;
+
+    pthread_mutex_unlock(&pusaparam_lock);
+
+    return id;
+}
+
+int pusaparam_find(const char *name)
+{
+    int n = pusaparam_count;
+
+    for (int i = 0; i < n; i++)
+	if (strcmp(pusaparam_info[i].name, name) == 0)
+	    return i;
+
+    return -1;
+}
+
+/*
+ * Start a group of changes that the audio thread will see all at once.
+ * Groups nest.  Keep them short: the audio thread can't pick up any
+ * changes while one is open.
+ */
+void pusaparam_begin(void)
+{
+    if (pusaparam_depth++ > 0)
+	return;
+
+    pthread_mutex_lock(&pusaparam_lock);
+    pusaparam_seq++;
+    __sync_synchronize();
+}
+
+void pusaparam_end(void)
+{
+    if (--pusaparam_depth > 0)
+	return;
+
+    __sync_synchronize();
+    pusaparam_seq++;
+    pthread_mutex_unlock(&pusaparam_lock);
+}
+
+/*
+ * Change a parameter, clamped to its range.  Safe from any thread but the
+ * audio thread.
+ */
+int pusaparam_set(int id, float value)
+{
+    if (id < 0 || id >= pusaparam_count)
+	return -1;
+
+    struct pusaparam_info_s *info = pusaparam_info + id;
+    if (value < info->min)
+	value = info->min;
+    if (value > info->max)
+	value = info->max;
+
+    pusaparam_begin();
+
+    pusaparam_targets[id] = value;
+
+    unsigned int in = pusaparam_ring_in;
+    if (in - pusaparam_ring_out < PUSAPARAM_RING)
+    {
+	pusaparam_ring[in % PUSAPARAM_RING] = id;
+	pusaparam_ring_in = in + 1;
+    }
+    else
+    {
+	pusaparam_rescan_req++;
+    }
+    pusaparam_stats.changes++;
+
+    pusaparam_end();
+
+    return 0;
+}
+
+/*
+ * The value last set, which the audio thread may not have reached yet.
+ */
+float pusaparam_get(int id)
+{
+    if (id < 0 || id >= pusaparam_count)
+	return 0;
+
+    return pusaparam_targets[id];
+}
+
+static int pusaparam_cc_input(int port, int channel, int cc, int value)
+{
+    struct pusaparam_binding_s *b = &pusaparam_cc[channel][cc];
+    int id = b->id - 1;
+
+    if (id < 0 || (b->port >= 0 && b->port != port))
+	return 0;
+
+    struct pusaparam_info_s *info = pusaparam_info + id;
+    pusaparam_set(id, info->min + (info->max - info->min) * value / 127.0f);
+    pusaparam_stats.cc_changes++;
+
+    return 1;
+}
+
+/*
+ * Have control change cc on channel (0-15) from MIDI input port, or any
+ * port if -1, set parameter id across its range.  Bound messages don't
+ * reach the application.
+ */
+int pusaparam_bind_cc(int id, int port, int channel, int cc)
+{
+    if (id < 0 || id >= pusaparam_count || channel < 0 || channel > 15 || cc < 0 || cc > 127 ||
+	port >= PUSAMIDI_PORT_MAX)
+	return -1;
+
+    pthread_mutex_lock(&pusaparam_lock);
+    pusaparam_cc[channel][cc].port = port < 0 ? -1 : port;
+    __sync_synchronize();
+    pusaparam_cc[channel][cc].id = id + 1;
+    if (!pusaparam_cc_hooked)
+    {
+	pusamidi_set_cc_callback(pusaparam_cc_input);
+	pusaparam_cc_hooked = 1;
+    }
+    pthread_mutex_unlock(&pusaparam_lock);
+
+    return 0;
+}
+
+void pusaparam_unbind_cc(int id)
+{
+    pthread_mutex_lock(&pusaparam_lock);
+    for (int c = 0; c < 16; c++)
+	for (int n = 0; n < 128; n++)
+	    if (pusaparam_cc[c][n].id == id + 1)
+		pusaparam_cc[c][n].id = 0;
+    pthread_mutex_unlock(&pusaparam_lock);
+}
+
+static void pusaparam_rt_apply(int id, float target)
+{
+    struct pusaparam_rt_s *r = pusaparam_rt + id;
+    int ramp = pusaparam_info[id].ramp;
+
+    r->target = target;
+    if (ramp == 0 || pusaparam_values[id] == target)
+    {
+	pusaparam_values[id] = target;
+	r->remaining = 0;
+	return;
+    }
+
+    r->step = (target - pusaparam_values[id]) / ramp;
+    r->remaining = ramp;
+    if (r->active < 0)
+    {
+	r->active = pusaparam_nramping;
+	pusaparam_ramping[pusaparam_nramping++] = id;
+    }
+}
+
+/*
+ * Copy changes to the audio thread's side, unless a writer got in the
+ * way.
+ */
+static void pusaparam_rt_update(void)
+{
+    unsigned int seq = pusaparam_seq;
+    int n = 0;
+
+    if (seq & 1)
+    {
+	pusaparam_stats.rt_retries++;
+	return;
+    }
+    __sync_synchronize();
+
+    unsigned int in = pusaparam_ring_in;
+    unsigned int out = pusaparam_ring_out;
+    unsigned int req = pusaparam_rescan_req;
+    int rescan = req != pusaparam_rescan_done;
+
+    if (in == out && !rescan)
+	return;
+
+    if (rescan)
+    {
+	int count = pusaparam_count;
+	for (int id = 0; id < count; id++)
+	{
+	    pusaparam_pending_ids[n] = id;
+	    pusaparam_pending_values[n++] = pusaparam_targets[id];
+	}
+    }
+    else
+    {
+	for (unsigned int i = out; i != in; i++)
+	{
+	    int id = pusaparam_ring[i % PUSAPARAM_RING];
+	    pusaparam_pending_ids[n] = id;
+	    pusaparam_pending_values[n++] = pusaparam_targets[id];
+	}
+    }
+
+    __sync_synchronize();
+    if (pusaparam_seq != seq)
+    {
+	pusaparam_stats.rt_retries++;
+	return;
+    }
+
+    for (int i = 0; i < n; i++)
+	pusaparam_rt_apply(pusaparam_pending_ids[i], pusaparam_pending_values[i]);
+
+    __sync_synchronize();
+    pusaparam_ring_out = in;
+    pusaparam_rescan_done = req;
+    pusaparam_stats.rt_updates++;
+    if (rescan)
+	pusaparam_stats.rescans++;
+}
+
+/*
+ * Called by the audio thread before the handler on every frame.
+ */
+void pusaparam_rt_frame(void)
+{
+    if (++pusaparam_rt_frames >= PUSAPARAM_BLOCK)
+    {
+	pusaparam_rt_frames = 0;
+	pusaparam_rt_update();
+    }
+
+    for (int i = 0; i < pusaparam_nramping;)
+    {
+	int id = pusaparam_ramping[i];
+	struct pusaparam_rt_s *r = pusaparam_rt + id;
+
+	if (--r->remaining > 0)
+	{
+	    pusaparam_values[id] += r->step;
+	    i++;
+	    continue;
+	}
+
+	/* Land exactly on the target and stop stepping this one. */
+	pusaparam_values[id] = r->target;
+	r->active = -1;
+	if (i < --pusaparam_nramping)
+	{
+	    pusaparam_ramping[i] = pusaparam_ramping[pusaparam_nramping];
+	    pusaparam_rt[pusaparam_ramping[i]].active = i;
+	}
+    }
+
+    pusaparam_stats.ramping = pusaparam_nramping;
+    if (pusaparam_nramping > pusaparam_stats.max_ramping)
+	pusaparam_stats.max_ramping = pusaparam_nramping;
+}
+
+void pusaparam_get_stats(struct pusaparam_stats_s *stats)
+{
+    *stats = pusaparam_stats;
+
+    stats->bindings = 0;
+    for (int c = 0; c < 16; c++)
+	for (int n = 0; n < 128; n++)
+	    if (pusaparam_cc[c][n].id != 0)
+		stats->bindings++;
+}
+
+void pusaparam_print_stats(void)
+{
+    struct pusaparam_stats_s st;
+
+    pusaparam_get_stats(&st);
+    printf("params: %d, %d CC bindings, %lu changes (%lu from CC), %lu updates, %lu retries, "
+	   "%lu rescans, ramping %d (max %d)\n",
+	   st.params, st.bindings, st.changes, st.cc_changes, st.rt_updates, st.rt_retries,
+	   st.rescans, st.ramping, st.max_ramping);
+}
+
+#ifdef PUSAPARAM_UNIT_TEST
+#include <unistd.h>
+#include <math.h>
+#include "pusatest.h"
+
+static volatile int test_writing = 0;
+static int test_x, test_y;
+
+static void test_frames(int n)
+{
+    for (int i = 0; i < n; i++)
+	pusaparam_rt_frame();
+}
+
+/* Changes x and y together, so that x == -y whenever they are read. */
+static void *test_writer(void *arg)
+{
+    for (int k = 1; test_writing; k++)
+    {
+	pusaparam_begin();
+	pusaparam_set(test_x, k);
+	pusaparam_set(test_y, -k);
+	pusaparam_end();
+	if (k % 1000 == 0)
+	    usleep(100);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusaparam_stats_s st;
+    unsigned char msg[3];
+    int port;
+
+    int a = pusaparam_register("a", 0, 10, 1, 0);
+    int r = pusaparam_register("ramp", 0, 1, 0, 480);
+    check(a == 0 && r == 1 && pusaparam_find("ramp") == r && pusaparam_find("none") < 0,
+	  "register and find");
+    check(pusaparam_value(a) == 1 && pusaparam_value(r) == 0, "initial values");
+
+    /* Without a ramp the new value arrives at the next block. */
+    pusaparam_set(a, 5);
+    check(pusaparam_get(a) == 5, "get returns the value set");
+    test_frames(PUSAPARAM_BLOCK - 1);
+    check(pusaparam_value(a) == 1, "unchanged within the block");
+    test_frames(1);
+    check(pusaparam_value(a) == 5, "changed at the block");
+    pusaparam_set(a, 100);
+    test_frames(PUSAPARAM_BLOCK);
+    check(pusaparam_value(a) == 10, "clamped to the range");
+
+    /* A ramp moves a little every frame and lands exactly on the target. */
+    pusaparam_set(r, 1);
+    int frames = 0, started = 0, monotonic = 1;
+    float last = 0, middle = 0;
+    while (pusaparam_value(r) != 1 && frames < 10000)
+    {
+	pusaparam_rt_frame();
+	if (pusaparam_value(r) != 0)
+	    started = 1;
+	if (started)
+	    frames++;
+	if (pusaparam_value(r) < last)
+	    monotonic = 0;
+	if (frames == 240)
+	    middle = pusaparam_value(r);
+	last = pusaparam_value(r);
+    }
+    printf("ramp took %d frames, %.4f halfway\n", frames, middle);
+    check(frames == 480, "ramp length");
+    check(monotonic && fabsf(middle - 0.5f) < 0.01f, "ramp is a straight line");
+    test_frames(PUSAPARAM_BLOCK);
+    pusaparam_get_stats(&st);
+    check(pusaparam_value(r) == 1 && st.ramping == 0 && st.max_ramping == 1, "ramp done");
+
+    /* Changes in a group are never seen apart. */
+    test_x = pusaparam_register("x", -1e9, 1e9, 0, 0);
+    test_y = pusaparam_register("y", -1e9, 1e9, 0, 0);
+    test_writing = 1;
+    pthread_t tid;
+    pthread_create(&tid, NULL, test_writer, NULL);
+    int torn = 0;
+    for (int i = 0; i < 2000000; i++)
+    {
+	pusaparam_rt_frame();
+	if (pusaparam_value(test_x) != -pusaparam_value(test_y))
+	    torn++;
+    }
+    test_writing = 0;
+    pthread_join(tid, NULL);
+    test_frames(PUSAPARAM_BLOCK);
+    pusaparam_print_stats();
+    pusaparam_get_stats(&st);
+    check(torn == 0, "groups applied together");
+    check(pusaparam_value(test_x) == pusaparam_get(test_x) && pusaparam_value(test_x) > 0,
+	  "last group applied");
+
+    /* More changes than the ring holds makes the next update read them all. */
+    unsigned long rescans = st.rescans;
+    for (int i = 0; i <= PUSAPARAM_RING; i++)
+	pusaparam_set(a, i % 7);
+    pusaparam_set(test_x, 42);
+    test_frames(PUSAPARAM_BLOCK);
+    pusaparam_get_stats(&st);
+    check(st.rescans == rescans + 1, "overflow rescans");
+    check(pusaparam_value(a) == PUSAPARAM_RING % 7 && pusaparam_value(test_x) == 42,
+	  "overflowed changes applied");
+
+    /* A bound control change sets the parameter and goes no further. */
+    check(pusaparam_bind_cc(a, -1, 0, 7) == 0, "bind");
+    check(pusaparam_bind_cc(r, 1, 2, 10) == 0, "bind to a port");
+    check(pusaparam_bind_cc(a, 0, 16, 7) < 0, "bad channel");
+    msg[0] = 0xb0;
+    msg[1] = 7;
+    msg[2] = 127;
+    pusamidi_port_input(3, msg, 3);
+    test_frames(PUSAPARAM_BLOCK);
+    check(pusaparam_value(a) == 10, "control change sets the parameter");
+    check(pusamidi_get_midi_message(&port, msg, sizeof(msg)) == 0, "bound message dropped");
+
+    msg[0] = 0xb2;
+    msg[1] = 10;
+    msg[2] = 0;
+    pusamidi_port_input(0, msg, 3);
+    check(pusamidi_get_midi_message(&port, msg, sizeof(msg)) == 3 && port == 0,
+	  "other ports pass");
+    msg[0] = 0xb2;
+    pusamidi_port_input(1, msg, 3);
+    test_frames(1000);
+    check(pusaparam_value(r) == 0, "bound port sets the parameter");
+
+    pusaparam_unbind_cc(a);
+    msg[0] = 0xb0;
+    msg[1] = 7;
+    msg[2] = 0;
+    pusamidi_port_input(0, msg, 3);
+    test_frames(PUSAPARAM_BLOCK);
+    check(pusaparam_value(a) == 10, "unbound");
+    check(pusamidi_get_midi_message(&port, msg, sizeof(msg)) == 3, "unbound message passes");
+
+    pusaparam_get_stats(&st);
+    check(st.bindings == 1 && st.cc_changes == 2, "binding stats");
+    pusaparam_print_stats();
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSAPARAM_BENCH
+#include <unistd.h>
+#include <time.h>
+#include "bcmhw.h"
+
+#define BENCH_RATE	48000
+#define BENCH_CHANGES	200
+
+static int bench_id;
+static volatile unsigned long long bench_set_at;
+static volatile int bench_running = 1;
+
+static double bench_ns(unsigned long long cycles, unsigned long n)
+{
+    return cycles * 1e9 / bcmhw_cycles_per_sec() / n;
+}
+
+/* Changes at random times, a few ms apart. */
+static void *bench_control(void *arg)
+{
+    for (int i = 1; i <= BENCH_CHANGES; i++)
+    {
+	usleep(1000 + rand() % 4000);
+	bench_set_at = bcmhw_cycles();
+	pusaparam_set(bench_id, i);
+    }
+    bench_running = 0;
+
+    return NULL;
+}
+
+/*
+ * Cost to the audio thread of reading parameters, of picking up changes
+ * and of ramps, and how long a change takes to be heard with the audio
+ * thread run a block at a time at 48 kHz.
+ */
+int main(int argc, char **argv)
+{
+    static int ids[PUSAPARAM_MAX];
+    char name[PUSAPARAM_NAME_LEN];
+    const int blocks = 10000;
+    volatile float sum = 0;
+
+    for (int i = 0; i < PUSAPARAM_MAX - 1; i++)
+    {
+	snprintf(name, sizeof(name), "p%d", i);
+	ids[i] = pusaparam_register(name, 0, 1, 0, i < 64 ? 480 : 0);
+    }
+    bench_id = pusaparam_register("latency", 0, 1e9, 0, 0);
+
+    unsigned long long start = bcmhw_cycles();
+    for (int b = 0; b < blocks; b++)
+	for (int f = 0; f < PUSAPARAM_BLOCK; f++)
+	    pusaparam_rt_frame();
+    printf("idle: %.1f ns/frame\n", bench_ns(bcmhw_cycles() - start, blocks * PUSAPARAM_BLOCK));
+
+    start = bcmhw_cycles();
+    for (int b = 0; b < blocks; b++)
+	for (int i = 0; i < 64; i++)
+	    sum += pusaparam_value(ids[i]);
+    printf("read: %.2f ns/parameter\n", bench_ns(bcmhw_cycles() - start, blocks * 64UL));
+
+    static const int counts[] = { 1, 16, 256, PUSAPARAM_RING, PUSAPARAM_RING + 1 };
+    for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+	unsigned long long cycles = 0;
+
+	for (int b = 0; b < 100; b++)
+	{
+	    for (int i = 0; i < counts[c]; i++)
+		pusaparam_set(ids[64 + i % (PUSAPARAM_MAX - 65)], b & 1);
+	    start = bcmhw_cycles();
+	    for (int f = 0; f < PUSAPARAM_BLOCK; f++)
+		pusaparam_rt_frame();
+	    cycles += bcmhw_cycles() - start;
+	}
+	printf("update with %d changes: %.1f ns/block\n", counts[c], bench_ns(cycles, 100));
+    }
+
+    unsigned long long cycles = 0;
+    for (int b = 0; b < 100; b++)
+    {
+	for (int i = 0; i < 64; i++)
+	    pusaparam_set(ids[i], b & 1);
+	start = bcmhw_cycles();
+	for (int f = 0; f < PUSAPARAM_BLOCK; f++)
+	    pusaparam_rt_frame();
+	cycles += bcmhw_cycles() - start;
+    }
+    printf("64 ramping: %.1f ns/frame\n", bench_ns(cycles, 100 * PUSAPARAM_BLOCK));
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, bench_control, NULL);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    float last = pusaparam_value(bench_id);
+    double total = 0, worst = 0;
+    int seen = 0;
+    while (bench_running || last != pusaparam_get(bench_id))
+    {
+	for (int f = 0; f < PUSAPARAM_BLOCK; f++)
+	    pusaparam_rt_frame();
+	if (pusaparam_value(bench_id) != last)
+	{
+	    double us = bench_ns(bcmhw_cycles() - bench_set_at, 1) / 1000;
+	    last = pusaparam_value(bench_id);
+	    total += us;
+	    if (us > worst)
+		worst = us;
+	    seen++;
+	}
+
+	next.tv_nsec += PUSAPARAM_BLOCK * 1000000000LL / BENCH_RATE;
+	if (next.tv_nsec >= 1000000000)
+	{
+	    next.tv_sec++;
+	    next.tv_nsec -= 1000000000;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    pthread_join(tid, NULL);
+
+    printf("change to audio thread: %.0f us mean, %.0f us max over %d changes (block is %.0f us)\n",
+	   total / seen, worst, seen, PUSAPARAM_BLOCK * 1e6 / BENCH_RATE);
+    pusaparam_print_stats();
+
+    return 0;
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Header file for the parameter store.
+ */
+
+#ifndef __pusaparam_h__
+#define __pusaparam_h__
+
+#define PUSAPARAM_MAX		4096
+#define PUSAPARAM_NAME_LEN	32
+
+/* Changes queued between two updates before the audio thread rescans. */
+#define PUSAPARAM_RING		4096
+
+/* Frames between the audio thread picking up changes. */
+#define PUSAPARAM_BLOCK		32
+
+/*
+ * rt_retries counts updates put off because a change was being written
+ * at the time, and rescans updates that read every parameter because
+ * more changes were queued than the ring holds.
+ */
+struct pusaparam_stats_s
+{
+    int params;
+    int bindings;
+    unsigned long changes;
+    unsigned long cc_changes;
+    unsigned long rt_updates;
+    unsigned long rt_retries;
+    unsigned long rescans;
+    int ramping;
+    int max_ramping;
+};
+
+int pusaparam_register(const char *name, float min, float max, float initial, int ramp_frames);
+int pusaparam_find(const char *name);
+int pusaparam_set(int id, float value);
+float pusaparam_get(int id);
+void pusaparam_begin(void);
+void pusaparam_end(void);
+int pusaparam_bind_cc(int id, int port, int channel, int cc);
+void pusaparam_unbind_cc(int id);
+void pusaparam_rt_frame(void);
+void pusaparam_get_stats(struct pusaparam_stats_s *stats);
+void pusaparam_print_stats(void);
+
+/*
+ * The value the audio thread should use for this frame.  Audio thread
+ * only.
+ */
+extern float pusaparam_values[PUSAPARAM_MAX];
+
+static inline float pusaparam_value(int id)
+{
+    return pusaparam_values[id];
+}
+
+#endif /* __pusaparam_h__ */
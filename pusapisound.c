@@ -0,0 +1,448 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * User space driver for the Pisound MIDI interface.  The MIDI UART sits
+ * behind a microcontroller on SPI.  Every 16-bit SPI word is full duplex:
+ * the high byte of a word we send is non-zero when the low byte is a MIDI
+ * byte to transmit, and likewise the high byte of the received word is
+ * non-zero when its low byte is a received MIDI byte.  GPIO 25 goes high
+ * while the microcontroller has received bytes waiting.  GPIO 24 is its
+ * reset line.
+ *
+ * With this driver the snd_soc_pisound module can stay blacklisted.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "bcmhw.h"
+#include "pusamidi.h"
+#include "pusapisound.h"
+
+#define PUSAPISOUND_OUT_SIZE	1024
+
+static struct pusapisound_io_s pusapisound_io;
+static int pusapisound_portnum = -1;
+static int pusapisound_spi_fd = -1;
+
+static pthread_mutex_t pusapisound_out_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char pusapisound_out[PUSAPISOUND_OUT_SIZE];
+static volatile unsigned int pusapisound_out_in = 0;
+static volatile unsigned int pusapisound_out_out = 0;
+
+static struct pusapisound_stats_s pusapisound_stats;
+
+static int pusapisound_spi_transfer(void *ctx, const unsigned short *tx, unsigned short *rx, int nwords)
+{
+    struct spi_ioc_transfer xfer[PUSAPISOUND_BATCH];
+    unsigned char txbuf[PUSAPISOUND_BATCH][2];
+    unsigned char rxbuf[PUSAPISOUND_BATCH][2];
+
+    if (nwords > PUSAPISOUND_BATCH)
+	nwords = PUSAPISOUND_BATCH;
+
+    /*
+     * One transfer per word so chip select is released between words and
+     * the microcontroller gets its delay, but all of them in one ioctl.
+     * cs_change on the last transfer would instead leave chip select
+     * asserted after the ioctl, so the last word wouldn't end until the
+     * next message.
+     */
+    memset(xfer, 0, sizeof(xfer));
+    for (int i = 0; i < nwords; i++)
+    {
+	txbuf[i][0] = tx[i] >> 8;
+	txbuf[i][1] = tx[i] & 0xff;
+
+	xfer[i].tx_buf = (unsigned long) txbuf[i];
+	xfer[i].rx_buf = (unsigned long) rxbuf[i];
+	xfer[i].len = 2;
+	xfer[i].speed_hz = PUSAPISOUND_SPI_SPEED;
+	xfer[i].delay_usecs = PUSAPISOUND_SPI_DELAY_US;
+	xfer[i].bits_per_word = 8;
+	xfer[i].cs_change = i < nwords - 1;
+    }
+
+    if (ioctl(pusapisound_spi_fd, SPI_IOC_MESSAGE(nwords), xfer) < 0)
+	return -1;
+
+    for (int i = 0; i < nwords; i++)
+	rx[i] = (rxbuf[i][0] << 8) | rxbuf[i][1];
+
+    return nwords;
+}
+
+static int pusapisound_gpio_data_available(void *ctx)
+{
+    return bcmhw_gpio_get(PUSAPISOUND_GPIO_DATA_AVAIL) == 1;
+}
+
+static void pusapisound_gpio_reset(void *ctx, int level)
+{
+    bcmhw_gpio_set(PUSAPISOUND_GPIO_RESET, level);
+}
+
+/*
+ * Output function for the pusamidi port.  May be called from any thread.
+ */
+static void pusapisound_write(const void *buffer, size_t len)
+{
+    const unsigned char *bytes = buffer;
+
+    pthread_mutex_lock(&pusapisound_out_lock);
+    for (size_t i = 0; i < len; i++)
+    {
+	unsigned int next = (pusapisound_out_in + 1) % PUSAPISOUND_OUT_SIZE;
+	if (next == pusapisound_out_out)
+	{
+	    pusapisound_stats.out_overflows++;
+	    break;
+	}
+
+	pusapisound_out[pusapisound_out_in] = bytes[i];
+	__sync_synchronize();
+	pusapisound_out_in = next;
+    }
+    pthread_mutex_unlock(&pusapisound_out_lock);
+}
+
+static void *pusapisound_thread(void *arg)
+{
+    unsigned short tx[PUSAPISOUND_BATCH];
+    unsigned short rx[PUSAPISOUND_BATCH];
+    unsigned char in[PUSAPISOUND_BATCH];
+
+    while (1)
+    {
+	int avail = pusapisound_io.data_available(pusapisound_io.ctx);
+	int nout = (pusapisound_out_in - pusapisound_out_out) % PUSAPISOUND_OUT_SIZE;
+
+	if (!avail && nout == 0)
+	{
+	    usleep(PUSAPISOUND_POLL_US);
+	    continue;
+	}
+
+	/*
+	 * Read a full batch while input is pending, otherwise just enough
+	 * words to drain the output.  Either way output rides along.
+	 */
+	int nwords = avail ? PUSAPISOUND_BATCH : nout;
+	if (nwords > PUSAPISOUND_BATCH)
+	    nwords = PUSAPISOUND_BATCH;
+
+	for (int i = 0; i < nwords; i++)
+	{
+	    if (pusapisound_out_out != pusapisound_out_in)
+	    {
+		__sync_synchronize();
+		tx[i] = 0x0f00 | pusapisound_out[pusapisound_out_out];
+		pusapisound_out_out = (pusapisound_out_out + 1) % PUSAPISOUND_OUT_SIZE;
+		pusapisound_stats.bytes_out++;
+	    }
+	    else
+		tx[i] = 0;
+	}
+
+	int n = pusapisound_io.transfer(pusapisound_io.ctx, tx, rx, nwords);
+	if (n < 0)
+	{
+	    perror("pisound spi transfer");
+	    usleep(10000);
+	    continue;
+	}
+
+	pusapisound_stats.transfers++;
+	pusapisound_stats.words += n;
+
+	int nin = 0;
+	for (int i = 0; i < n; i++)
+	{
+	    if (rx[i] >> 8)
+		in[nin++] = rx[i] & 0xff;
+	}
+
+	if (nin > 0)
+	{
+	    pusapisound_stats.bytes_in += nin;
+	    pusamidi_port_input(pusapisound_portnum, in, nin);
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the driver with the given hardware access functions.
+ */
+int pusapisound_init_io(const struct pusapisound_io_s *io)
+{
+    pusapisound_io = *io;
+
+    /* Hold the microcontroller in reset briefly, then give it time to boot. */
+    pusapisound_io.reset(pusapisound_io.ctx, 0);
+    usleep(1000);
+    pusapisound_io.reset(pusapisound_io.ctx, 1);
+    usleep(64000);
+
+    pusapisound_portnum = pusamidi_add_port("pisound-spi", "Pisound MIDI", pusapisound_write);
+    if (pusapisound_portnum < 0)
+	return -1;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rv = pthread_create(&tid, &attr, pusapisound_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    return rv == 0 ? 0 : -1;
+}
+
+/*
+ * Start the driver on the real hardware.  bcmhw_init() must have been
+ * called first.
+ */
+int pusapisound_init(void)
+{
+    pusapisound_spi_fd = open(PUSAPISOUND_SPI_DEV, O_RDWR);
+    if (pusapisound_spi_fd < 0)
+    {
+	perror("open " PUSAPISOUND_SPI_DEV);
+	return -1;
+    }
+
+    unsigned char mode = SPI_MODE_0;
+    unsigned char bits = 8;
+    unsigned int speed = PUSAPISOUND_SPI_SPEED;
+
+    if (ioctl(pusapisound_spi_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+	ioctl(pusapisound_spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+	ioctl(pusapisound_spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    {
+	perror("spi setup");
+	close(pusapisound_spi_fd);
+	pusapisound_spi_fd = -1;
+	return -1;
+    }
+
+    bcmhw_gpio_select(PUSAPISOUND_GPIO_RESET, GPIO_FUNC_OUTPUT);
+    bcmhw_gpio_select(PUSAPISOUND_GPIO_DATA_AVAIL, GPIO_FUNC_INPUT);
+
+    struct pusapisound_io_s io =
+    {
+	pusapisound_spi_transfer,
+	pusapisound_gpio_data_available,
+	pusapisound_gpio_reset,
+	NULL
+    };
+
+    return pusapisound_init_io(&io);
+}
+
+int pusapisound_port(void)
+{
+    return pusapisound_portnum;
+}
+
+void pusapisound_get_stats(struct pusapisound_stats_s *stats)
+{
+    *stats = pusapisound_stats;
+}
+
+#ifdef PUSAPISOUND_UNIT_TEST
+#include <time.h>
+
+/*
+ * Stand-in for the Pisound microcontroller.  Bytes queued in fake_in are
+ * returned one per SPI word and data available stays high until they are
+ * gone.  Transmitted bytes are collected in fake_out.
+ */
+static unsigned char fake_in[4096];
+static volatile unsigned int fake_in_in = 0;
+static volatile unsigned int fake_in_out = 0;
+static unsigned char fake_out[4096];
+static volatile unsigned int fake_out_count = 0;
+static int fake_resets = 0;
+
+static int fake_transfer(void *ctx, const unsigned short *tx, unsigned short *rx, int nwords)
+{
+    for (int i = 0; i < nwords; i++)
+    {
+	if ((tx[i] >> 8) && fake_out_count < sizeof(fake_out))
+	    fake_out[fake_out_count++] = tx[i] & 0xff;
+
+	if (fake_in_out != fake_in_in)
+	{
+	    rx[i] = 0x0100 | fake_in[fake_in_out % sizeof(fake_in)];
+	    __sync_synchronize();
+	    fake_in_out++;
+	}
+	else
+	    rx[i] = 0;
+    }
+
+    return nwords;
+}
+
+static int fake_data_available(void *ctx)
+{
+    return fake_in_out != fake_in_in;
+}
+
+static void fake_reset(void *ctx, int level)
+{
+    if (level == 0)
+	fake_resets++;
+}
+
+static void fake_inject(const unsigned char *bytes, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+	fake_in[fake_in_in % sizeof(fake_in)] = bytes[i];
+	__sync_synchronize();
+	fake_in_in++;
+    }
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int wait_message(int *port, unsigned char *buffer, int size)
+{
+    double start = now_us();
+    while (now_us() - start < 1000000.0)
+    {
+	int len = pusamidi_get_midi_message(port, buffer, size);
+	if (len > 0)
+	    return len;
+    }
+
+    return 0;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    struct pusapisound_io_s io = { fake_transfer, fake_data_available, fake_reset, NULL };
+    unsigned char buffer[64];
+    int port, len, failures = 0;
+
+    if (pusapisound_init_io(&io) < 0)
+    {
+	printf("Failed to init\n");
+	exit(1);
+    }
+
+    if (fake_resets != 1)
+    {
+	printf("FAIL: reset not pulsed\n");
+	failures++;
+    }
+
+    /* Clock in the middle of a note on must not break the note. */
+    unsigned char note[] = { 0x92, 0x3c, 0xf8, 0x64 };
+    fake_inject(note, sizeof(note));
+
+    len = wait_message(&port, buffer, sizeof(buffer));
+    if (len != 1 || buffer[0] != 0xf8 || port != pusapisound_port())
+    {
+	printf("FAIL: clock, len %d port %d\n", len, port);
+	failures++;
+    }
+
+    len = wait_message(&port, buffer, sizeof(buffer));
+    if (len != 3 || buffer[0] != 0x92 || buffer[1] != 0x3c || buffer[2] != 0x64 ||
+	port != pusapisound_port())
+    {
+	printf("FAIL: note, len %d port %d\n", len, port);
+	failures++;
+    }
+
+    unsigned char sysex[] = { 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 };
+    fake_inject(sysex, sizeof(sysex));
+    len = wait_message(&port, buffer, sizeof(buffer));
+    if (len != sizeof(sysex) || memcmp(buffer, sysex, len) != 0)
+    {
+	printf("FAIL: sysex, len %d\n", len);
+	failures++;
+    }
+
+    pusamidi_send_midi_out(sysex, sizeof(sysex));
+    double start = now_us();
+    while (fake_out_count < sizeof(sysex) && now_us() - start < 1000000.0)
+	;
+    if (fake_out_count != sizeof(sysex) || memcmp(fake_out, sysex, sizeof(sysex)) != 0)
+    {
+	printf("FAIL: output, %u bytes\n", fake_out_count);
+	failures++;
+    }
+
+    /*
+     * Byte to event latency through the SPI path with the stand-in.  This
+     * is the driver's polling and parsing cost, not the SPI bus time.
+     */
+    const int niter = 2000;
+    double *lat = malloc(niter * sizeof(double));
+    for (int i = 0; i < niter; i++)
+    {
+	unsigned char msg[3] = { 0x90, i & 0x7f, 0x40 };
+	double t0 = now_us();
+	fake_inject(msg, sizeof(msg));
+	if (wait_message(&port, buffer, sizeof(buffer)) != 3)
+	{
+	    printf("FAIL: latency message %d lost\n", i);
+	    failures++;
+	    break;
+	}
+	lat[i] = now_us() - t0;
+    }
+
+    qsort(lat, niter, sizeof(double), cmpdouble);
+    double sum = 0;
+    for (int i = 0; i < niter; i++)
+	sum += lat[i];
+    printf("byte to event: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us (poll %d us)\n",
+	   sum / niter, lat[niter / 2], lat[niter * 99 / 100], lat[niter - 1],
+	   PUSAPISOUND_POLL_US);
+    free(lat);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Header file for the user space Pisound MIDI driver.
+ */
+
+#ifndef __pusapisound_h__
+#define __pusapisound_h__
+
+#define PUSAPISOUND_SPI_DEV		"/dev/spidev0.0"
+#define PUSAPISOUND_SPI_SPEED		150000
+#define PUSAPISOUND_SPI_DELAY_US	10
+#define PUSAPISOUND_GPIO_RESET		24
+#define PUSAPISOUND_GPIO_DATA_AVAIL	25
+#define PUSAPISOUND_BATCH		16
+#define PUSAPISOUND_POLL_US		250
+
+/*
+ * Hardware access used by the driver.  pusapisound_init() uses spidev and
+ * the mmapped GPIO block.  Tests may supply their own.
+ */
+struct pusapisound_io_s
+{
+    int (*transfer)(void *ctx, const unsigned short *tx, unsigned short *rx, int nwords);
+    int (*data_available)(void *ctx);
+    void (*reset)(void *ctx, int level);
+    void *ctx;
+};
+
+struct pusapisound_stats_s
+{
+    unsigned long transfers;
+    unsigned long words;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long out_overflows;
+};
+
+int pusapisound_init(void);
+int pusapisound_init_io(const struct pusapisound_io_s *io);
+int pusapisound_port(void);
+void pusapisound_get_stats(struct pusapisound_stats_s *stats);
+
+#endif /* __pusapisound_h__ */
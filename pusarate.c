@@ -0,0 +1,55 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Proportional and integral rate control, shared by the network streams
+ * and the ALSA bridge.
+ */
+
+#include <string.h>
+
+#include "pusarate.h"
+
+void pusarate_init(struct pusarate_s *pi)
+{
+    memset(pi, 0, sizeof(*pi));
+}
+
+/*
+ * err is how far the buffer is above its target, in seconds, after dt
+ * seconds more.  bias is added to the integral, for a drift the caller
+ * knows about.  Returns the fraction to read faster or write slower by.
+ */
+double pusarate_update(struct pusarate_s *pi, double err, double dt, double bias)
+{
+    pi->integral += err / (PUSARATE_TP * PUSARATE_TI) * dt;
+    if (pi->integral > PUSARATE_MAX_DRIFT)
+	pi->integral = PUSARATE_MAX_DRIFT;
+    else if (pi->integral < -PUSARATE_MAX_DRIFT)
+	pi->integral = -PUSARATE_MAX_DRIFT;
+
+    double corr = err / PUSARATE_TP + pi->integral + bias;
+    if (corr > PUSARATE_MAX_CORR)
+	corr = PUSARATE_MAX_CORR;
+    else if (corr < -PUSARATE_MAX_CORR)
+	corr = -PUSARATE_MAX_CORR;
+
+    return corr;
+}
@@ -0,0 +1,36 @@
+/*
+ * Header file for rate control between clock domains.
+ */
+
+#ifndef __pusarate_h__
+#define __pusarate_h__
+
+/*
+ * A buffer filled on one clock and emptied on another is held at a
+ * target by nudging the rate it is read or written at: proportional to
+ * how far off it is, plus an integral term that settles at the drift
+ * between the clocks.
+ *
+ * PUSARATE_TP is the time constant, in seconds, for correcting an error,
+ * long enough that jitter in the level doesn't reach the rate.  The
+ * integral follows the drift over PUSARATE_TI; at twice PUSARATE_TP the
+ * loop is damped at 0.7, settling without ringing.  PUSARATE_MAX_DRIFT
+ * is well past what crystals are off by, and PUSARATE_MAX_CORR leaves
+ * the proportional term room beyond it while keeping the pitch within
+ * 3.5 cents.
+ */
+#define PUSARATE_TP		1.0
+#define PUSARATE_TI		2.0
+#define PUSARATE_MAX_DRIFT	0.001
+#define PUSARATE_MAX_CORR	0.002
+
+/* integral is the drift measured so far, as a fraction. */
+struct pusarate_s
+{
+    double integral;
+};
+
+void pusarate_init(struct pusarate_s *pi);
+double pusarate_update(struct pusarate_s *pi, double err, double dt, double bias);
+
+#endif /* __pusarate_h__ */
@@ -0,0 +1,865 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline rendering.  WAV files go through an audio handler with
+ * pusa_render(), the same per-frame path the audio thread uses, as fast
+ * as the processor allows.  MIDI events from a text file are fed in at
+ * their frame numbers through pusamidi_port_input(), so handlers read
+ * them with pusamidi_get_midi_message() as they would live.
+ *
+ * Handlers always see stereo frames.  Files with more channels are split
+ * into pairs; a lone last channel is sent on both sides and only the left
+ * is kept.  With more than one process, each pair of each file renders in
+ * its own forked process, so handlers with global state don't interfere
+ * and every render starts from the same state.  Pairs are joined back
+ * into one file at the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "pusa.h"
+#include "pusamidi.h"
+#include "pusarender.h"
+
+#define PUSARENDER_PCM		1
+#define PUSARENDER_FLOAT	3
+#define PUSARENDER_EXTENSIBLE	0xfffe
+
+#define PUSARENDER_MAX_EVENT	8
+
+struct pusarender_wav_s
+{
+    FILE *fp;
+    int format;
+    int channels;
+    int rate;
+    int bits;
+    unsigned long long frames;
+    unsigned long long written;
+};
+
+struct pusarender_event_s
+{
+    unsigned long long frame;
+    int len;
+    unsigned char msg[PUSARENDER_MAX_EVENT];
+};
+
+struct pusarender_task_s
+{
+    int job;
+    int pair;
+    int npairs;
+};
+
+static unsigned int pusarender_get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static int pusarender_wav_open(const char *path, struct pusarender_wav_s *wav)
+{
+    unsigned char hdr[40];
+
+    memset(wav, 0, sizeof(*wav));
+    wav->fp = fopen(path, "rb");
+    if (wav->fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+    setvbuf(wav->fp, NULL, _IOFBF, PUSARENDER_IO_BUFFER);
+
+    if (fread(hdr, 12, 1, wav->fp) != 1 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+    {
+	printf("%s: not a WAV file\n", path);
+	fclose(wav->fp);
+	return -1;
+    }
+
+    while (fread(hdr, 8, 1, wav->fp) == 1)
+    {
+	unsigned int size = pusarender_get32(hdr + 4);
+
+	if (memcmp(hdr, "fmt ", 4) == 0 && size >= 16)
+	{
+	    unsigned char fmt[40] = { 0 };
+	    if (fread(fmt, size < sizeof(fmt) ? size : sizeof(fmt), 1, wav->fp) != 1)
+		break;
+	    if (size > sizeof(fmt))
+		fseek(wav->fp, size - sizeof(fmt), SEEK_CUR);
+	    if (size & 1)
+		fseek(wav->fp, 1, SEEK_CUR);
+
+	    wav->format = fmt[0] | fmt[1] << 8;
+	    wav->channels = fmt[2] | fmt[3] << 8;
+	    wav->rate = pusarender_get32(fmt + 4);
+	    wav->bits = fmt[14] | fmt[15] << 8;
+	    if (wav->format == PUSARENDER_EXTENSIBLE && size >= 26)
+		wav->format = fmt[24] | fmt[25] << 8;
+	}
+	else if (memcmp(hdr, "data", 4) == 0)
+	{
+	    if (wav->channels <= 0 || wav->channels > PUSARENDER_MAX_CHANNELS ||
+		!((wav->format == PUSARENDER_PCM &&
+		   (wav->bits == 16 || wav->bits == 24 || wav->bits == 32)) ||
+		  (wav->format == PUSARENDER_FLOAT && wav->bits == 32)))
+	    {
+		printf("%s: unsupported format %d, %d channels, %d bits\n",
+		       path, wav->format, wav->channels, wav->bits);
+		break;
+	    }
+
+	    /* Streams written without knowing their length say 0 or ~0. */
+	    if (size == 0 || size == 0xffffffff)
+		wav->frames = ~0ULL;
+	    else
+		wav->frames = size / (wav->channels * wav->bits / 8);
+	    return 0;
+	}
+	else
+	    fseek(wav->fp, size + (size & 1), SEEK_CUR);
+    }
+
+    printf("%s: no usable audio\n", path);
+    fclose(wav->fp);
+    return -1;
+}
+
+static void pusarender_put(FILE *fp, unsigned int v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+	fputc((v >> (8 * i)) & 0xff, fp);
+}
+
+static void pusarender_wav_header(const struct pusarender_wav_s *wav)
+{
+    unsigned int bytes = wav->bits / 8;
+    unsigned int data = wav->written * wav->channels * bytes;
+
+    fwrite("RIFF", 4, 1, wav->fp);
+    pusarender_put(wav->fp, 36 + data, 4);
+    fwrite("WAVEfmt ", 8, 1, wav->fp);
+    pusarender_put(wav->fp, 16, 4);
+    pusarender_put(wav->fp, wav->format, 2);
+    pusarender_put(wav->fp, wav->channels, 2);
+    pusarender_put(wav->fp, wav->rate, 4);
+    pusarender_put(wav->fp, wav->rate * wav->channels * bytes, 4);
+    pusarender_put(wav->fp, wav->channels * bytes, 2);
+    pusarender_put(wav->fp, wav->bits, 2);
+    fwrite("data", 4, 1, wav->fp);
+    pusarender_put(wav->fp, data, 4);
+}
+
+/* Same sample format as like, with channels channels. */
+static int pusarender_wav_create(const char *path, const struct pusarender_wav_s *like,
+				 int channels, struct pusarender_wav_s *wav)
+{
+    *wav = *like;
+    wav->channels = channels;
+    wav->written = 0;
+    wav->fp = fopen(path, "wb");
+    if (wav->fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+    setvbuf(wav->fp, NULL, _IOFBF, PUSARENDER_IO_BUFFER);
+
+    pusarender_wav_header(wav);
+    return 0;
+}
+
+static int pusarender_wav_close(struct pusarender_wav_s *wav, int writing)
+{
+    int result = 0;
+
+    if (writing)
+    {
+	rewind(wav->fp);
+	pusarender_wav_header(wav);
+	result = ferror(wav->fp) ? -1 : 0;
+    }
+
+    if (fclose(wav->fp) != 0)
+	result = -1;
+
+    return result;
+}
+
+/*
+ * Read up to nframes frames as 32 bit samples with the audio in the top
+ * bits, as the PCM block delivers them.  Returns the frames read.
+ */
+static int pusarender_wav_read(struct pusarender_wav_s *wav, int *out, int nframes)
+{
+    static unsigned char raw[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS * 4];
+    int bytes = wav->bits / 8;
+
+    if (wav->frames != ~0ULL && (unsigned long long) nframes > wav->frames - wav->written)
+	nframes = wav->frames - wav->written;
+
+    int n = fread(raw, wav->channels * bytes, nframes, wav->fp);
+    wav->written += n;
+
+    for (int i = 0; i < n * wav->channels; i++)
+    {
+	const unsigned char *p = raw + i * bytes;
+
+	if (wav->format == PUSARENDER_FLOAT)
+	{
+	    float f;
+	    memcpy(&f, p, 4);
+	    double v = f * 2147483648.0;
+	    out[i] = v >= 2147483647.0 ? 2147483647 : v <= -2147483648.0 ? -2147483647 - 1 : (int) v;
+	}
+	else if (bytes == 2)
+	    out[i] = (p[0] | p[1] << 8) << 16;
+	else if (bytes == 3)
+	    out[i] = p[0] << 8 | p[1] << 16 | (unsigned int) p[2] << 24;
+	else
+	    out[i] = pusarender_get32(p);
+    }
+
+    return n;
+}
+
+static void pusarender_wav_write(struct pusarender_wav_s *wav, const int *in, int nframes)
+{
+    static unsigned char raw[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS * 4];
+    int bytes = wav->bits / 8;
+
+    for (int i = 0; i < nframes * wav->channels; i++)
+    {
+	unsigned char *p = raw + i * bytes;
+	unsigned int v = in[i];
+
+	if (wav->format == PUSARENDER_FLOAT)
+	{
+	    float f = in[i] / 2147483648.0;
+	    memcpy(p, &f, 4);
+	    continue;
+	}
+
+	if (bytes == 2)
+	    v >>= 16;
+	else if (bytes == 3)
+	    v >>= 8;
+	for (int b = 0; b < bytes; b++)
+	    p[b] = v >> (8 * b);
+    }
+
+    fwrite(raw, wav->channels * bytes, nframes, wav->fp);
+    wav->written += nframes;
+}
+
+static int pusarender_event_compare(const void *a, const void *b)
+{
+    const struct pusarender_event_s *ea = a, *eb = b;
+
+    return ea->frame < eb->frame ? -1 : ea->frame > eb->frame;
+}
+
+/*
+ * Load MIDI events sorted by frame.  Returns the number of events.
+ */
+static int pusarender_load_events(const char *path, struct pusarender_event_s **events)
+{
+    char line[256];
+    int n = 0, size = 0;
+
+    *events = NULL;
+    if (path == NULL)
+	return 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+	char *p = line, *end;
+	unsigned long long frame = strtoull(p, &end, 10);
+
+	if (line[0] == '#' || end == p)
+	    continue;
+
+	if (n == size)
+	{
+	    size = size ? size * 2 : 256;
+	    struct pusarender_event_s *grown = realloc(*events, size * sizeof(**events));
+	    if (grown == NULL)
+	    {
+		fclose(fp);
+		free(*events);
+		return -1;
+	    }
+	    *events = grown;
+	}
+
+	struct pusarender_event_s *ev = *events + n;
+	ev->frame = frame;
+	ev->len = 0;
+	for (p = end; ev->len < PUSARENDER_MAX_EVENT; p = end)
+	{
+	    unsigned long byte = strtoul(p, &end, 16);
+	    if (end == p)
+		break;
+	    ev->msg[ev->len++] = byte;
+	}
+
+	if (ev->len > 0)
+	    n++;
+    }
+
+    fclose(fp);
+    qsort(*events, n, sizeof(**events), pusarender_event_compare);
+
+    return n;
+}
+
+static void pusarender_pair_path(char *buf, size_t size, const char *output, int pair)
+{
+    snprintf(buf, size, "%s.pair%d", output, pair);
+}
+
+/*
+ * Render one pair of channels of a file.  With one pair the output is the
+ * finished WAV file; otherwise raw stereo frames for pusarender_join().
+ */
+static int pusarender_pair(const struct pusarender_job_s *job, int pair, int npairs,
+			   pusa_audio_handler_t handler, struct pusarender_result_s *result)
+{
+    static int in[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS];
+    static int frames[PUSARENDER_BLOCK * 2];
+    struct pusarender_wav_s wav, out;
+    struct pusarender_event_s *events;
+    struct timespec start, end;
+    char path[1024];
+    FILE *raw = NULL;
+
+    memset(result, 0, sizeof(*result));
+    result->status = -1;
+
+    int nevents = pusarender_load_events(job->midi, &events);
+    if (nevents < 0)
+	return -1;
+
+    if (pusarender_wav_open(job->input, &wav) < 0)
+    {
+	free(events);
+	return -1;
+    }
+
+    int status = 0;
+    if (npairs == 1)
+	status = pusarender_wav_create(job->output, &wav, wav.channels, &out);
+    else
+    {
+	pusarender_pair_path(path, sizeof(path), job->output, pair);
+	raw = fopen(path, "wb");
+	if (raw == NULL)
+	{
+	    perror(path);
+	    status = -1;
+	}
+	else
+	    setvbuf(raw, NULL, _IOFBF, PUSARENDER_IO_BUFFER);
+    }
+
+    if (status < 0 || pusa_render_init(wav.rate, handler) < 0)
+    {
+	pusarender_wav_close(&wav, 0);
+	free(events);
+	return -1;
+    }
+
+    int left = 2 * pair;
+    int right = left + 1 < wav.channels ? left + 1 : left;
+    unsigned long long frame = 0;
+    int e = 0, n;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    while ((n = pusarender_wav_read(&wav, in, PUSARENDER_BLOCK)) > 0)
+    {
+	for (int i = 0; i < n; i++)
+	{
+	    frames[2 * i] = in[i * wav.channels + left];
+	    frames[2 * i + 1] = in[i * wav.channels + right];
+	}
+
+	/* Split the block at each event so it arrives on its frame. */
+	for (int pos = 0; pos < n; )
+	{
+	    while (e < nevents && events[e].frame <= frame + pos)
+	    {
+		pusamidi_port_input(0, events[e].msg, events[e].len);
+		e++;
+	    }
+
+	    int next = n;
+	    if (e < nevents && events[e].frame < frame + n)
+		next = events[e].frame - frame;
+
+	    pusa_render(frames + 2 * pos, next - pos);
+	    pos = next;
+	}
+
+	if (raw != NULL)
+	    fwrite(frames, 8, n, raw);
+	else if (wav.channels == 1)
+	{
+	    for (int i = 0; i < n; i++)
+		frames[i] = frames[2 * i];
+	    pusarender_wav_write(&out, frames, n);
+	}
+	else
+	    pusarender_wav_write(&out, frames, n);
+
+	frame += n;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+    if (raw != NULL)
+	status = fclose(raw) == 0 ? 0 : -1;
+    else
+	status = pusarender_wav_close(&out, 1);
+    pusarender_wav_close(&wav, 0);
+    free(events);
+
+    result->status = status;
+    result->channels = wav.channels;
+    result->rate = wav.rate;
+    result->frames = frame;
+    result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    return status;
+}
+
+/*
+ * Interleave the rendered pairs of a file into its output.
+ */
+static int pusarender_join(const struct pusarender_job_s *job, int npairs)
+{
+    static int frames[PUSARENDER_BLOCK * 2];
+    static int out[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS];
+    FILE *pairs[PUSARENDER_MAX_CHANNELS / 2];
+    struct pusarender_wav_s wav, result;
+    char path[1024];
+    int status = 0;
+
+    if (pusarender_wav_open(job->input, &wav) < 0)
+	return -1;
+    pusarender_wav_close(&wav, 0);
+
+    if (pusarender_wav_create(job->output, &wav, wav.channels, &result) < 0)
+	return -1;
+
+    for (int p = 0; p < npairs; p++)
+    {
+	pusarender_pair_path(path, sizeof(path), job->output, p);
+	pairs[p] = fopen(path, "rb");
+	if (pairs[p] == NULL)
+	    status = -1;
+	else
+	    setvbuf(pairs[p], NULL, _IOFBF, PUSARENDER_IO_BUFFER);
+    }
+
+    while (status == 0)
+    {
+	int n = PUSARENDER_BLOCK;
+
+	for (int p = 0; p < npairs; p++)
+	{
+	    int got = fread(frames, 8, n, pairs[p]);
+	    n = got < n ? got : n;
+	    for (int i = 0; i < n; i++)
+	    {
+		out[i * wav.channels + 2 * p] = frames[2 * i];
+		if (2 * p + 1 < wav.channels)
+		    out[i * wav.channels + 2 * p + 1] = frames[2 * i + 1];
+	    }
+	}
+
+	if (n == 0)
+	    break;
+	pusarender_wav_write(&result, out, n);
+    }
+
+    for (int p = 0; p < npairs; p++)
+    {
+	if (pairs[p] != NULL)
+	    fclose(pairs[p]);
+	pusarender_pair_path(path, sizeof(path), job->output, p);
+	unlink(path);
+    }
+
+    if (pusarender_wav_close(&result, 1) < 0)
+	status = -1;
+
+    return status;
+}
+
+/*
+ * Render several files, using up to nprocs processes.  With nprocs of 1
+ * everything runs in this process, one after another, and the handler
+ * keeps its state from one file to the next.  results has one entry per
+ * job.  Returns 0 if every file rendered.
+ */
+int pusarender_files(const struct pusarender_job_s *jobs, int njobs,
+		     pusa_audio_handler_t handler, int nprocs,
+		     struct pusarender_result_s *results)
+{
+    struct pusarender_task_s tasks[PUSARENDER_MAX_TASKS];
+    int ntasks = 0;
+
+    for (int j = 0; j < njobs; j++)
+    {
+	struct pusarender_wav_s wav;
+
+	memset(results + j, 0, sizeof(results[j]));
+	results[j].status = -1;
+	if (pusarender_wav_open(jobs[j].input, &wav) < 0)
+	    continue;
+	pusarender_wav_close(&wav, 0);
+
+	int npairs = (wav.channels + 1) / 2;
+	for (int p = 0; p < npairs && ntasks < PUSARENDER_MAX_TASKS; p++)
+	{
+	    tasks[ntasks].job = j;
+	    tasks[ntasks].pair = p;
+	    tasks[ntasks].npairs = npairs;
+	    ntasks++;
+	}
+    }
+
+    struct pusarender_result_s *done = mmap(NULL, ntasks * sizeof(*done) + 1,
+					    PROT_READ | PROT_WRITE,
+					    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (done == MAP_FAILED)
+    {
+	perror("mmap");
+	return -1;
+    }
+
+    int running = 0;
+    for (int t = 0; t < ntasks; t++)
+    {
+	struct pusarender_task_s *task = tasks + t;
+
+	if (nprocs <= 1)
+	{
+	    pusarender_pair(jobs + task->job, task->pair, task->npairs, handler, done + t);
+	    continue;
+	}
+
+	if (running == nprocs)
+	{
+	    wait(NULL);
+	    running--;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+	    int status = pusarender_pair(jobs + task->job, task->pair, task->npairs,
+					 handler, done + t);
+	    fflush(stdout);
+	    _exit(status == 0 ? 0 : 1);
+	}
+	else if (pid < 0)
+	{
+	    perror("fork");
+	    done[t].status = -1;
+	}
+	else
+	    running++;
+    }
+
+    while (running > 0 && wait(NULL) > 0)
+	running--;
+
+    for (int t = 0; t < ntasks; t++)
+    {
+	struct pusarender_result_s *r = results + tasks[t].job;
+
+	if (tasks[t].pair == 0)
+	    *r = done[t];
+	else
+	{
+	    r->seconds += done[t].seconds;
+	    if (done[t].status < 0 || done[t].frames != r->frames)
+		r->status = -1;
+	}
+    }
+    munmap(done, ntasks * sizeof(*done) + 1);
+
+    int status = 0;
+    for (int j = 0; j < njobs; j++)
+    {
+	struct pusarender_result_s *r = results + j;
+
+	if (r->status == 0 && r->channels > 2 && pusarender_join(jobs + j, (r->channels + 1) / 2) < 0)
+	    r->status = -1;
+	if (r->seconds > 0)
+	    r->realtime = (double) r->frames / r->rate / r->seconds;
+	if (r->status < 0)
+	    status = -1;
+    }
+
+    return status;
+}
+
+int pusarender_file(const struct pusarender_job_s *job, pusa_audio_handler_t handler,
+		    struct pusarender_result_s *result)
+{
+    return pusarender_files(job, 1, handler, 1, result);
+}
+
+#ifdef PUSARENDER_MAIN
+#include "pusachain.h"
+
+static double pusarender_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pusarender_usage(const char *name)
+{
+    printf("Usage: %s [-j processes] [-p plugin.so[:args]]... [-m events] "
+	   "input.wav output.wav...\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct pusarender_job_s jobs[PUSARENDER_MAX_TASKS];
+    struct pusarender_result_s results[PUSARENDER_MAX_TASKS];
+    int nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *midi = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:p:m:")) != -1)
+    {
+	if (opt == 'j')
+	    nprocs = atoi(optarg);
+	else if (opt == 'm')
+	    midi = optarg;
+	else if (opt == 'p')
+	{
+	    char *args = strchr(optarg, ':');
+	    if (args != NULL)
+		*args++ = '\0';
+	    if (pusachain_insert(-1, optarg, args) < 0)
+		return 1;
+	}
+	else
+	    pusarender_usage(argv[0]);
+    }
+
+    int njobs = (argc - optind) / 2;
+    if (njobs == 0 || (argc - optind) % 2 != 0 || njobs > PUSARENDER_MAX_TASKS)
+	pusarender_usage(argv[0]);
+
+    for (int j = 0; j < njobs; j++)
+    {
+	jobs[j].input = argv[optind + 2 * j];
+	jobs[j].output = argv[optind + 2 * j + 1];
+	jobs[j].midi = midi;
+    }
+
+    double start = pusarender_now();
+    int status = pusarender_files(jobs, njobs, pusachain_process, nprocs, results);
+    double wall = pusarender_now() - start;
+
+    double audio = 0;
+    for (int j = 0; j < njobs; j++)
+    {
+	struct pusarender_result_s *r = results + j;
+
+	if (r->status < 0)
+	{
+	    printf("%s: failed\n", jobs[j].input);
+	    continue;
+	}
+
+	audio += (double) r->frames / r->rate;
+	printf("%s: %llu frames, %d channels, %.1fx real time\n",
+	       jobs[j].output, r->frames, r->channels, r->realtime);
+    }
+    printf("%.1f s of audio in %.2f s with %d processes, %.1fx real time\n",
+	   audio, wall, nprocs, audio / wall);
+
+    return status < 0 ? 1 : 0;
+}
+#endif
+
+#ifdef PUSARENDER_UNIT_TEST
+#include "pusatest.h"
+
+/* Halves the level and marks note ons with the note number on the left. */
+static void test_handler(int *data, int nchannels)
+{
+    unsigned char msg[8];
+
+    data[0] >>= 1;
+    data[1] >>= 1;
+    while (pusamidi_get_midi_message(NULL, msg, sizeof(msg)) > 0)
+	if ((msg[0] & 0xf0) == 0x90)
+	    data[0] = msg[1] << 20;
+}
+
+static void test_write(const char *path, int format, int channels, int bits, int nframes,
+		       int (*sample)(int frame, int channel))
+{
+    static int frames[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS];
+    struct pusarender_wav_s like = { NULL, format, channels, 48000, bits, 0, 0 };
+    struct pusarender_wav_s wav;
+
+    pusarender_wav_create(path, &like, channels, &wav);
+    for (int i = 0; i < nframes; i++)
+	for (int c = 0; c < channels; c++)
+	    frames[(i % PUSARENDER_BLOCK) * channels + c] = sample(i, c);
+
+    /* Every block is the same, which is all the tests need. */
+    for (int i = 0; i < nframes; i += PUSARENDER_BLOCK)
+	pusarender_wav_write(&wav, frames, nframes - i < PUSARENDER_BLOCK ? nframes - i : PUSARENDER_BLOCK);
+    pusarender_wav_close(&wav, 1);
+}
+
+static int test_stereo(int frame, int channel)
+{
+    int v = (frame % PUSARENDER_BLOCK) * 7 - 14000;
+    return (channel ? -v : v) << 16;
+}
+
+static int test_multi(int frame, int channel)
+{
+    return ((channel + 1) * 100000 + frame % PUSARENDER_BLOCK) << 8;
+}
+
+static int test_mono(int frame, int channel)
+{
+    return (frame % PUSARENDER_BLOCK) << 18;
+}
+
+static int test_compare(const char *path, int nframes, int (*expect)(int frame, int channel),
+			int marker_frame, int marker)
+{
+    static int frames[PUSARENDER_BLOCK * PUSARENDER_MAX_CHANNELS];
+    struct pusarender_wav_s wav;
+    int ok = 1, frame = 0, n;
+
+    if (pusarender_wav_open(path, &wav) < 0)
+	return 0;
+
+    while ((n = pusarender_wav_read(&wav, frames, PUSARENDER_BLOCK)) > 0)
+    {
+	for (int i = 0; i < n; i++, frame++)
+	    for (int c = 0; c < wav.channels; c++)
+	    {
+		int want = frame == marker_frame && c == 0 ? marker : expect(frame, c);
+		if (frames[i * wav.channels + c] != want)
+		    ok = 0;
+	    }
+    }
+    pusarender_wav_close(&wav, 0);
+
+    return ok && frame == nframes;
+}
+
+/* Output of test_handler, truncated back to the file's bit depth. */
+static int test_half16(int frame, int channel)
+{
+    return ((test_stereo(frame, channel) >> 1) >> 16) << 16;
+}
+
+static int test_half24(int frame, int channel)
+{
+    return ((test_multi(frame, channel) >> 1) >> 8) << 8;
+}
+
+static int test_half_float(int frame, int channel)
+{
+    return test_mono(frame, channel) >> 1;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/pusarenderXXXXXX";
+    char path[8][300];
+    struct pusarender_result_s results[3];
+    const int nframes = 3 * 48000 + 123;
+
+    if (mkdtemp(dir) == NULL)
+	return 1;
+    for (int i = 0; i < 8; i++)
+	sprintf(path[i], "%s/%d", dir, i);
+
+    test_write(path[0], PUSARENDER_PCM, 2, 16, nframes, test_stereo);
+    test_write(path[1], PUSARENDER_PCM, 5, 24, nframes, test_multi);
+    test_write(path[2], PUSARENDER_FLOAT, 1, 32, nframes, test_mono);
+
+    FILE *fp = fopen(path[3], "w");
+    fprintf(fp, "# note on, on frame 100\n100 90 3c 64\n50000 80 3c 00\n");
+    fclose(fp);
+
+    struct pusarender_job_s jobs[3] =
+    {
+	{ path[0], path[4], path[3] },
+	{ path[1], path[5], NULL },
+	{ path[2], path[6], NULL },
+    };
+
+    check(pusarender_files(jobs, 3, test_handler, 4, results) == 0, "render in parallel");
+    for (int j = 0; j < 3; j++)
+	printf("%s: %llu frames, %d channels, %.0fx real time\n", jobs[j].input,
+	       results[j].frames, results[j].channels, results[j].realtime);
+
+    check(test_compare(path[4], nframes, test_half16, 100, 0x3c << 20), "16 bit stereo with MIDI");
+    check(test_compare(path[5], nframes, test_half24, -1, 0), "24 bit, 5 channels");
+    check(test_compare(path[6], nframes, test_half_float, -1, 0), "float mono");
+    check(results[1].channels == 5 && results[1].frames == nframes, "multichannel result");
+
+    struct pusarender_job_s single = { path[0], path[7], path[3] };
+    check(pusarender_file(&single, test_handler, results) == 0, "render in process");
+    check(test_compare(path[7], nframes, test_half16, 100, 0x3c << 20), "same result in process");
+
+    for (int i = 0; i < 8; i++)
+	unlink(path[i]);
+    rmdir(dir);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Header file for offline rendering.
+ */
+
+#ifndef __pusarender_h__
+#define __pusarender_h__
+
+#include "pusa.h"
+
+#define PUSARENDER_BLOCK	4096
+#define PUSARENDER_MAX_CHANNELS	32
+#define PUSARENDER_MAX_TASKS	256
+#define PUSARENDER_IO_BUFFER	(1024 * 1024)
+
+/*
+ * One file to render.  midi may be NULL, or a text file of events, one
+ * per line: the frame number then the message bytes in hex, for example
+ * "48000 90 3c 64".  Lines starting with # are ignored.
+ */
+struct pusarender_job_s
+{
+    const char *input;
+    const char *output;
+    const char *midi;
+};
+
+/*
+ * seconds is processor time spent rendering; realtime is audio length
+ * divided by that.
+ */
+struct pusarender_result_s
+{
+    int status;
+    int channels;
+    int rate;
+    unsigned long long frames;
+    double seconds;
+    double realtime;
+};
+
+int pusarender_file(const struct pusarender_job_s *job, pusa_audio_handler_t handler,
+		    struct pusarender_result_s *result);
+int pusarender_files(const struct pusarender_job_s *jobs, int njobs,
+		     pusa_audio_handler_t handler, int nprocs,
+		     struct pusarender_result_s *results);
+
+#endif /* __pusarender_h__ */
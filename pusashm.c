@@ -0,0 +1,737 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Audio processing in other processes.  The audio thread collects input
+ * frames into periods in a shared memory segment and wakes the clients
+ * with a futex on the period sequence number.  Each client writes its
+ * output for the period into its own slot and marks it done.  At the end
+ * of the next period the audio thread mixes in the output of every client
+ * that finished and plays the mix over the period after that, so clients
+ * get one period to run and output comes two periods after its input.  A
+ * client that hasn't finished is left out of that period's mix and
+ * counted as missed; the audio thread never waits.
+ *
+ * Input and output buffers are double buffered by the parity of the
+ * sequence number.  A client's slot is claimed with a compare and swap,
+ * and a thread in the server frees the slots of clients that exit without
+ * closing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pusashm.h"
+
+#define PUSASHM_MAGIC		0x41535550
+#define PUSASHM_VERSION		1
+
+#define PUSASHM_FREE		0
+#define PUSASHM_CLAIMING	1
+#define PUSASHM_ACTIVE		2
+
+/* How often the server looks for clients that died. */
+#define PUSASHM_REAP_US		100000
+
+/*
+ * periods and missed are written by the server, the rest by the client.
+ */
+struct pusashm_slot_s
+{
+    volatile int state;
+    int pid;
+    char name[PUSASHM_NAME_LEN];
+    unsigned int first;
+    volatile unsigned int done;
+    unsigned long periods;
+    unsigned long missed;
+    unsigned long wakes;
+    double wake_ns_sum;
+    double wake_ns_sumsq;
+    double wake_ns_max;
+    int output[2][PUSASHM_MAX_PERIOD * 2];
+};
+
+struct pusashm_header_s
+{
+    unsigned int magic;
+    unsigned int version;
+    int rate;
+    int period;
+    volatile int running;
+    volatile unsigned int seq;
+    volatile unsigned long long publish_ns;
+    int input[2][PUSASHM_MAX_PERIOD * 2];
+    struct pusashm_slot_s slots[PUSASHM_MAX_CLIENTS];
+};
+
+struct pusashm_client_s
+{
+    struct pusashm_header_s *shm;
+    struct pusashm_slot_s *slot;
+    unsigned int seq;
+};
+
+/*
+ * Server state.  Everything but the segment itself is private to the
+ * audio thread.
+ */
+static struct pusashm_header_s *pusashm_shm = NULL;
+static char pusashm_name[NAME_MAX];
+static volatile int pusashm_active = 0;
+static int pusashm_period = 0;
+static int pusashm_pos = 0;
+static int pusashm_in[PUSASHM_MAX_PERIOD * 2];
+static long long pusashm_mix[PUSASHM_MAX_PERIOD * 2];
+static unsigned long pusashm_periods = 0;
+static unsigned long pusashm_reaped = 0;
+
+static unsigned long long pusashm_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long pusashm_futex(volatile unsigned int *addr, int op, unsigned int val,
+			  const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static inline int pusashm_clamp(long long v)
+{
+    return v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : v;
+}
+
+/*
+ * Free the slots of clients that have gone away.
+ */
+static void *pusashm_reaper(void *arg)
+{
+    struct pusashm_header_s *shm = arg;
+
+    while (shm->running)
+    {
+	for (int i = 0; i < PUSASHM_MAX_CLIENTS; i++)
+	{
+	    struct pusashm_slot_s *slot = shm->slots + i;
+
+	    if (slot->state == PUSASHM_ACTIVE && kill(slot->pid, 0) < 0 && errno == ESRCH &&
+		__sync_bool_compare_and_swap(&slot->state, PUSASHM_ACTIVE, PUSASHM_FREE))
+		pusashm_reaped++;
+	}
+
+	usleep(PUSASHM_REAP_US);
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the segment and start handing periods of period frames to
+ * clients.
+ */
+int pusashm_server_start(const char *name, int sample_rate, int period)
+{
+    if (pusashm_shm != NULL)
+    {
+	printf("pusashm: server already running\n");
+	return -1;
+    }
+    if (period <= 0 || period > PUSASHM_MAX_PERIOD)
+    {
+	printf("pusashm: bad period %d\n", period);
+	return -1;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+	perror(name);
+	return -1;
+    }
+
+    struct pusashm_header_s *shm = MAP_FAILED;
+    if (ftruncate(fd, sizeof(*shm)) == 0)
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+	perror(name);
+	shm_unlink(name);
+	return -1;
+    }
+
+    /* Page it all in now rather than from the audio thread. */
+    memset(shm, 0, sizeof(*shm));
+    if (mlock(shm, sizeof(*shm)) < 0)
+	perror("pusashm: mlock");
+
+    shm->magic = PUSASHM_MAGIC;
+    shm->version = PUSASHM_VERSION;
+    shm->rate = sample_rate;
+    shm->period = period;
+    shm->running = 1;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusashm_reaper, shm) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	munmap(shm, sizeof(*shm));
+	shm_unlink(name);
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    snprintf(pusashm_name, sizeof(pusashm_name), "%s", name);
+    pusashm_period = period;
+    pusashm_pos = 0;
+    pusashm_periods = 0;
+    pusashm_reaped = 0;
+    memset(pusashm_mix, 0, sizeof(pusashm_mix));
+    pusashm_shm = shm;
+    __sync_synchronize();
+    pusashm_active = 1;
+
+    return 0;
+}
+
+/*
+ * Tell clients the server is gone and remove the segment.  The audio
+ * thread must not be running.  The reaper keeps its mapping.
+ */
+void pusashm_server_stop(void)
+{
+    struct pusashm_header_s *shm = pusashm_shm;
+
+    if (shm == NULL)
+	return;
+
+    pusashm_active = 0;
+    shm->running = 0;
+    __sync_synchronize();
+    shm->seq++;
+    pusashm_futex(&shm->seq, FUTEX_WAKE, INT_MAX, NULL);
+
+    shm_unlink(pusashm_name);
+    pusashm_shm = NULL;
+}
+
+/*
+ * Mix in what clients made of the last period and hand them this one.
+ */
+static void pusashm_rt_period(void)
+{
+    struct pusashm_header_s *shm = pusashm_shm;
+    unsigned int last = shm->seq;
+    int nclients = 0;
+
+    memset(pusashm_mix, 0, pusashm_period * 2 * sizeof(pusashm_mix[0]));
+    for (int i = 0; i < PUSASHM_MAX_CLIENTS; i++)
+    {
+	struct pusashm_slot_s *slot = shm->slots + i;
+
+	if (slot->state != PUSASHM_ACTIVE)
+	    continue;
+	nclients++;
+	if ((int) (last - slot->first) < 0)
+	    continue;
+
+	if (slot->done != last)
+	{
+	    slot->missed++;
+	    continue;
+	}
+
+	__sync_synchronize();
+	const int *out = slot->output[last & 1];
+	for (int j = 0; j < pusashm_period * 2; j++)
+	    pusashm_mix[j] += out[j];
+	slot->periods++;
+    }
+
+    memcpy(shm->input[(last + 1) & 1], pusashm_in, pusashm_period * 2 * sizeof(int));
+    shm->publish_ns = pusashm_now_ns();
+    __sync_synchronize();
+    shm->seq = last + 1;
+
+    if (nclients)
+	pusashm_futex(&shm->seq, FUTEX_WAKE, INT_MAX, NULL);
+    pusashm_periods++;
+}
+
+/*
+ * Audio thread only: the frame going into the handler.
+ */
+void pusashm_rt_input(const int *data)
+{
+    if (!pusashm_active)
+	return;
+
+    pusashm_in[2 * pusashm_pos] = data[0];
+    pusashm_in[2 * pusashm_pos + 1] = data[1];
+}
+
+/*
+ * Audio thread only: add the clients' output to the handler's.
+ */
+void pusashm_rt_output(int *data)
+{
+    if (!pusashm_active)
+	return;
+
+    data[0] = pusashm_clamp(data[0] + pusashm_mix[2 * pusashm_pos]);
+    data[1] = pusashm_clamp(data[1] + pusashm_mix[2 * pusashm_pos + 1]);
+
+    if (++pusashm_pos == pusashm_period)
+    {
+	pusashm_pos = 0;
+	pusashm_rt_period();
+    }
+}
+
+void pusashm_get_stats(struct pusashm_stats_s *stats)
+{
+    struct pusashm_header_s *shm = pusashm_shm;
+
+    memset(stats, 0, sizeof(*stats));
+    if (shm == NULL)
+	return;
+
+    stats->period = pusashm_period;
+    stats->periods = pusashm_periods;
+    stats->reaped = pusashm_reaped;
+
+    for (int i = 0; i < PUSASHM_MAX_CLIENTS; i++)
+    {
+	struct pusashm_slot_s *slot = shm->slots + i;
+	struct pusashm_client_stats_s *cs = stats->clients + stats->nclients;
+
+	if (slot->state != PUSASHM_ACTIVE)
+	    continue;
+
+	cs->pid = slot->pid;
+	memcpy(cs->name, slot->name, sizeof(cs->name));
+	cs->periods = slot->periods;
+	cs->missed = slot->missed;
+	if (slot->wakes)
+	{
+	    double mean = slot->wake_ns_sum / slot->wakes;
+	    double var = slot->wake_ns_sumsq / slot->wakes - mean * mean;
+	    cs->wake_us_mean = mean / 1000;
+	    cs->wake_us_jitter = var > 0 ? sqrt(var) / 1000 : 0;
+	    cs->wake_us_max = slot->wake_ns_max / 1000;
+	}
+	stats->nclients++;
+    }
+}
+
+void pusashm_print_stats(void)
+{
+    struct pusashm_stats_s st;
+
+    pusashm_get_stats(&st);
+    printf("shm: %d clients, %lu periods of %d frames, %lu reaped\n",
+	   st.nclients, st.periods, st.period, st.reaped);
+    for (int i = 0; i < st.nclients; i++)
+    {
+	struct pusashm_client_stats_s *cs = st.clients + i;
+	printf("  %-16s pid %-6d %8lu periods, %6lu missed, wake %.1f us (jitter %.1f, max %.1f)\n",
+	       cs->name, cs->pid, cs->periods, cs->missed,
+	       cs->wake_us_mean, cs->wake_us_jitter, cs->wake_us_max);
+    }
+}
+
+/*
+ * Attach to the server's segment as client_name.  Returns NULL if there
+ * is no server or no free slot.
+ */
+struct pusashm_client_s *pusashm_client_open(const char *name, const char *client_name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+	perror(name);
+	return NULL;
+    }
+
+    struct pusashm_header_s *shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+	perror(name);
+	return NULL;
+    }
+
+    if (shm->magic != PUSASHM_MAGIC || shm->version != PUSASHM_VERSION || !shm->running)
+    {
+	printf("pusashm: %s is not a running server\n", name);
+	munmap(shm, sizeof(*shm));
+	return NULL;
+    }
+    mlock(shm, sizeof(*shm));
+
+    struct pusashm_client_s *client = malloc(sizeof(*client));
+    if (client == NULL)
+    {
+	munmap(shm, sizeof(*shm));
+	return NULL;
+    }
+
+    for (int i = 0; i < PUSASHM_MAX_CLIENTS; i++)
+    {
+	struct pusashm_slot_s *slot = shm->slots + i;
+
+	if (!__sync_bool_compare_and_swap(&slot->state, PUSASHM_FREE, PUSASHM_CLAIMING))
+	    continue;
+
+	slot->pid = getpid();
+	snprintf(slot->name, sizeof(slot->name), "%s", client_name);
+	slot->periods = slot->missed = slot->wakes = 0;
+	slot->wake_ns_sum = slot->wake_ns_sumsq = slot->wake_ns_max = 0;
+
+	/* Start far enough ahead that the first period isn't already due. */
+	slot->first = shm->seq + 2;
+	slot->done = slot->first - 1;
+	__sync_synchronize();
+	slot->state = PUSASHM_ACTIVE;
+
+	client->shm = shm;
+	client->slot = slot;
+	client->seq = slot->first - 1;
+	return client;
+    }
+
+    printf("pusashm: no free client slots\n");
+    free(client);
+    munmap(shm, sizeof(*shm));
+    return NULL;
+}
+
+/*
+ * Wait for the next period.  Sets in to its input frames and out to where
+ * the output goes, and returns the number of frames, or -1 once the
+ * server has stopped.  If this client fell behind, periods it missed are
+ * skipped.
+ */
+int pusashm_client_wait(struct pusashm_client_s *client, const int **in, int **out)
+{
+    struct pusashm_header_s *shm = client->shm;
+    struct pusashm_slot_s *slot = client->slot;
+    struct timespec timeout = { 0, 100000000 };
+    unsigned int seq;
+
+    while (1)
+    {
+	if (!shm->running)
+	    return -1;
+
+	seq = shm->seq;
+	if (seq != client->seq && (int) (seq - slot->first) >= 0)
+	    break;
+
+	pusashm_futex(&shm->seq, FUTEX_WAIT, seq, &timeout);
+    }
+
+    __sync_synchronize();
+    double ns = pusashm_now_ns() - shm->publish_ns;
+    slot->wakes++;
+    slot->wake_ns_sum += ns;
+    slot->wake_ns_sumsq += ns * ns;
+    if (ns > slot->wake_ns_max)
+	slot->wake_ns_max = ns;
+
+    client->seq = seq;
+    *in = shm->input[seq & 1];
+    *out = slot->output[seq & 1];
+
+    return shm->period;
+}
+
+/*
+ * Hand the output of the period from pusashm_client_wait() to the server.
+ */
+void pusashm_client_done(struct pusashm_client_s *client)
+{
+    __sync_synchronize();
+    client->slot->done = client->seq;
+}
+
+int pusashm_client_rate(struct pusashm_client_s *client)
+{
+    return client->shm->rate;
+}
+
+void pusashm_client_close(struct pusashm_client_s *client)
+{
+    __sync_bool_compare_and_swap(&client->slot->state, PUSASHM_ACTIVE, PUSASHM_FREE);
+    munmap(client->shm, sizeof(*client->shm));
+    free(client);
+}
+
+#ifdef PUSASHM_UNIT_TEST
+#include <sys/wait.h>
+#include "pusatest.h"
+
+#define TEST_PERIOD	32
+#define TEST_PERIODS	40
+
+/* Halves its input, or adds a constant and runs late now and then. */
+static void test_client(const char *name, int slow)
+{
+    struct pusashm_client_s *client = pusashm_client_open("/pusashmtest", name);
+    const int *in;
+    int *out, n, count = 0;
+
+    if (client == NULL)
+	_exit(1);
+
+    while ((n = pusashm_client_wait(client, &in, &out)) > 0)
+    {
+	for (int i = 0; i < 2 * n; i++)
+	    out[i] = slow ? 1000 : in[i] / 2;
+	if (slow && ++count % 8 == 5)
+	    usleep(30000);
+	pusashm_client_done(client);
+    }
+
+    pusashm_client_close(client);
+    _exit(0);
+}
+
+/*
+ * Wait for clients to finish the period just published, giving the slow
+ * one less time than it sometimes takes.
+ */
+static void test_wait_clients(void)
+{
+    struct pusashm_header_s *shm = pusashm_shm;
+
+    for (int i = 0; i < PUSASHM_MAX_CLIENTS; i++)
+    {
+	struct pusashm_slot_s *slot = shm->slots + i;
+
+	if (slot->state != PUSASHM_ACTIVE || (int) (shm->seq - slot->first) < 0)
+	    continue;
+	for (int t = 0; t < 100 && slot->done != shm->seq; t++)
+	    usleep(100);
+    }
+}
+
+static int test_find(struct pusashm_stats_s *st, const char *name)
+{
+    for (int i = 0; i < st->nclients; i++)
+	if (strcmp(st->clients[i].name, name) == 0)
+	    return i;
+
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    static int input[TEST_PERIODS * TEST_PERIOD * 2], output[TEST_PERIODS * TEST_PERIOD * 2];
+    struct pusashm_stats_s st;
+    pid_t pids[2];
+
+    check(pusashm_server_start("/pusashmtest", 48000, TEST_PERIOD) == 0, "start server");
+    for (int c = 0; c < 2; c++)
+	if ((pids[c] = fork()) == 0)
+	    test_client(c ? "slow" : "halve", c);
+
+    for (int t = 0; t < 1000; t++)
+    {
+	pusashm_get_stats(&st);
+	if (st.nclients == 2)
+	    break;
+	usleep(1000);
+    }
+    check(st.nclients == 2, "clients attached");
+
+    /* Play the part of the audio thread. */
+    for (int f = 0; f < TEST_PERIODS * TEST_PERIOD; f++)
+    {
+	int *frame = output + 2 * f;
+
+	input[2 * f] = (f + 1) << 8;
+	input[2 * f + 1] = -input[2 * f];
+	frame[0] = input[2 * f];
+	frame[1] = input[2 * f + 1];
+	pusashm_rt_input(frame);
+
+	/* The mix made at the end of the last period is never heard. */
+	if (f == TEST_PERIODS * TEST_PERIOD - 1)
+	    pusashm_get_stats(&st);
+	pusashm_rt_output(frame);
+	if (f % TEST_PERIOD == TEST_PERIOD - 1)
+	    test_wait_clients();
+    }
+
+    /* Each period of output has each client's share of two periods back, or nothing. */
+    unsigned long halve = 0, slow = 0, bad = 0;
+    for (int p = 0; p < TEST_PERIODS; p++)
+    {
+	int has_halve = 1, has_slow = 1, no_halve = 1, no_slow = 1;
+
+	for (int i = p * TEST_PERIOD * 2; i < (p + 1) * TEST_PERIOD * 2; i++)
+	{
+	    int extra = output[i] - input[i];
+	    int half = p >= 2 ? input[i - 2 * TEST_PERIOD * 2] / 2 : 0;
+
+	    has_halve &= extra == half || extra == half + 1000;
+	    has_slow &= extra == 1000 || extra == half + 1000;
+	    no_halve &= extra == 0 || extra == 1000;
+	    no_slow &= extra == 0 || extra == half;
+	}
+
+	halve += has_halve && !no_halve;
+	slow += has_slow && !no_slow;
+	bad += !(has_halve || no_halve) || !(has_slow || no_slow);
+    }
+
+    pusashm_print_stats();
+    int h = test_find(&st, "halve"), s = test_find(&st, "slow");
+    check(bad == 0, "output is input plus whole periods from clients");
+    check(h >= 0 && st.clients[h].missed == 0 && st.clients[h].periods == halve,
+	  "prompt client mixed every period");
+    check(s >= 0 && st.clients[s].missed > 0 && st.clients[s].periods == slow,
+	  "late client dropped for missed periods");
+    check(h >= 0 && st.clients[h].periods + 4 >= TEST_PERIODS, "prompt client heard throughout");
+
+    /* A client that dies without closing gives up its slot. */
+    kill(pids[1], SIGKILL);
+    waitpid(pids[1], NULL, 0);
+    for (int t = 0; t < 100; t++)
+    {
+	pusashm_get_stats(&st);
+	if (st.nclients == 1)
+	    break;
+	usleep(10000);
+    }
+    check(st.nclients == 1 && st.reaped == 1, "dead client reaped");
+
+    int status = -1;
+    pusashm_server_stop();
+    waitpid(pids[0], &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client sees server stop");
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+    return test_failures ? 1 : 0;
+}
+#endif
+
+#ifdef PUSASHM_BENCH
+#include <sched.h>
+#include <sys/wait.h>
+
+/*
+ * Clients each do a little work on every period while this process plays
+ * the audio thread on a timer, as fast as the device would.
+ */
+static void bench_client(int n)
+{
+    char name[PUSASHM_NAME_LEN];
+    const int *in;
+    int *out, nframes;
+
+    snprintf(name, sizeof(name), "client%d", n);
+    struct pusashm_client_s *client = pusashm_client_open("/pusashmbench", name);
+    if (client == NULL)
+	_exit(1);
+
+    while ((nframes = pusashm_client_wait(client, &in, &out)) > 0)
+    {
+	for (int i = 0; i < 2 * nframes; i++)
+	    out[i] = in[i] / 8;
+	pusashm_client_done(client);
+    }
+
+    pusashm_client_close(client);
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    int nclients = argc > 1 ? atoi(argv[1]) : 4;
+    int period = argc > 2 ? atoi(argv[2]) : 64;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    struct sched_param sparam = { .sched_priority = 50 };
+    struct timespec next;
+    int frame[2];
+
+    if (pusashm_server_start("/pusashmbench", 48000, period) < 0)
+	return 1;
+    for (int i = 0; i < nclients; i++)
+	if (fork() == 0)
+	    bench_client(i);
+
+    if (sched_setscheduler(0, SCHED_FIFO, &sparam) < 0)
+	printf("not real time, expect more jitter\n");
+
+    long period_ns = 1000000000L / 48000 * period;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (long p = 0; p < (long) seconds * 48000 / period; p++)
+    {
+	next.tv_nsec += period_ns;
+	if (next.tv_nsec >= 1000000000L)
+	{
+	    next.tv_nsec -= 1000000000L;
+	    next.tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+	for (int f = 0; f < period; f++)
+	{
+	    frame[0] = f << 16;
+	    frame[1] = -frame[0];
+	    pusashm_rt_input(frame);
+	    pusashm_rt_output(frame);
+	}
+    }
+
+    printf("%d clients, %d frame periods (%.2f ms), %d s\n", nclients, period,
+	   period * 1000.0 / 48000, seconds);
+    pusashm_print_stats();
+    pusashm_server_stop();
+    while (wait(NULL) > 0)
+	;
+
+    return 0;
+}
+#endif
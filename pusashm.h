@@ -0,0 +1,56 @@
+/*
+ * Header file for shared memory clients.
+ */
+
+#ifndef __pusashm_h__
+#define __pusashm_h__
+
+#define PUSASHM_DEFAULT_NAME	"/pusa"
+#define PUSASHM_MAX_CLIENTS	8
+#define PUSASHM_MAX_PERIOD	1024
+#define PUSASHM_NAME_LEN	32
+
+/*
+ * periods and missed are counted by the server: periods whose output made
+ * the deadline and periods dropped because it didn't.  Wake latency is
+ * from the server publishing a period to the client seeing it; jitter is
+ * its standard deviation.
+ */
+struct pusashm_client_stats_s
+{
+    int pid;
+    char name[PUSASHM_NAME_LEN];
+    unsigned long periods;
+    unsigned long missed;
+    double wake_us_mean;
+    double wake_us_jitter;
+    double wake_us_max;
+};
+
+struct pusashm_stats_s
+{
+    int nclients;
+    int period;
+    unsigned long periods;
+    unsigned long reaped;
+    struct pusashm_client_stats_s clients[PUSASHM_MAX_CLIENTS];
+};
+
+struct pusashm_client_s;
+
+/* Server, in the process running the audio thread. */
+int pusashm_server_start(const char *name, int sample_rate, int period);
+void pusashm_server_stop(void);
+void pusashm_rt_input(const int *data);
+void pusashm_rt_output(int *data);
+void pusashm_get_stats(struct pusashm_stats_s *stats);
+void pusashm_print_stats(void);
+
+/* Client library. */
+struct pusashm_client_s *pusashm_client_open(const char *name, const char *client_name);
+int pusashm_client_wait(struct pusashm_client_s *client, const int **in, int **out);
+void pusashm_client_done(struct pusashm_client_s *client);
+int pusashm_client_rate(struct pusashm_client_s *client);
+void pusashm_client_close(struct pusashm_client_s *client);
+
+#endif /* __pusashm_h__ */
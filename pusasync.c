@@ -0,0 +1,591 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "bcmhw.h"
+#include "pusa.h"
+#include "pusamidi.h"
+#include "pusasync.h"
+
+struct pusasync_acc_s
+{
+    unsigned long count;
+    double mean;
+    double m2;
+    double min;
+    double max;
+};
+
+struct pusasync_event_s
+{
+    unsigned char byte;
+    unsigned long systime;
+};
+
+static volatile int pusasync_mode = PUSASYNC_MODE_OFF;
+
+/*
+ * Master state.  The phase accumulator is a 32-bit fraction of a clock
+ * tick.  It is only touched by the audio thread, so a clock is always
+ * emitted on the exact sample where the accumulator wraps.
+ */
+static volatile unsigned int pusasync_master_inc = 0;
+static volatile int pusasync_master_cmd = 0;
+static unsigned int pusasync_master_phase = 0;
+static unsigned long pusasync_master_ticks = 0;
+static double pusasync_master_bpm = 120.0;
+
+/*
+ * Audio thread to sender thread.  Single producer, single consumer.  The
+ * sender polls rather than being woken, so the audio thread never makes a
+ * system call for a clock.  The poll period adds up to that much jitter
+ * on top of the 320 us a byte takes on the wire.
+ */
+#define PUSASYNC_RING_SIZE	256
+#define PUSASYNC_POLL_US	250
+
+static struct pusasync_event_s pusasync_ring[PUSASYNC_RING_SIZE];
+static volatile unsigned int pusasync_ring_in = 0;
+static volatile unsigned int pusasync_ring_out = 0;
+
+/*
+ * Slave state.  The DLL runs in the MIDI input thread.  The published
+ * clock is protected by a sequence count so the audio thread can read it
+ * without locking.
+ */
+static pthread_mutex_t pusasync_slave_lock = PTHREAD_MUTEX_INITIALIZER;
+static double pusasync_bandwidth = 1.0;
+static int pusasync_dll_locked = 0;
+static double pusasync_dll_last = -1.0;
+static double pusasync_dll_t0;
+static double pusasync_dll_t1;
+static double pusasync_dll_e2;
+static unsigned long pusasync_slave_ticks = 0;
+
+static volatile unsigned int pusasync_pub_seq = 0;
+static double pusasync_pub_t0 = 0.0;
+static double pusasync_pub_t1 = 0.0;
+static unsigned long pusasync_pub_ticks = 0;
+
+static struct pusasync_acc_s pusasync_master_acc;
+static struct pusasync_acc_s pusasync_slave_acc;
+static unsigned long pusasync_master_overflows = 0;
+static unsigned long pusasync_slave_relocks = 0;
+
+static void pusasync_acc_add(struct pusasync_acc_s *acc, double x)
+{
+    acc->count++;
+    if (acc->count == 1)
+    {
+	acc->min = x;
+	acc->max = x;
+    }
+    if (x < acc->min)
+	acc->min = x;
+    if (x > acc->max)
+	acc->max = x;
+
+    double delta = x - acc->mean;
+    acc->mean += delta / acc->count;
+    acc->m2 += delta * (x - acc->mean);
+}
+
+static void pusasync_acc_get(struct pusasync_acc_s *acc, struct pusasync_jitter_s *j)
+{
+    j->count = acc->count;
+    j->mean_us = acc->mean;
+    j->stddev_us = acc->count > 1 ? sqrt(acc->m2 / (acc->count - 1)) : 0.0;
+    j->min_us = acc->min;
+    j->max_us = acc->max;
+}
+
+static void pusasync_push(unsigned char byte)
+{
+    unsigned int next = (pusasync_ring_in + 1) % PUSASYNC_RING_SIZE;
+    if (next == pusasync_ring_out)
+    {
+	pusasync_master_overflows++;
+	return;
+    }
+
+    pusasync_ring[pusasync_ring_in].byte = byte;
+    pusasync_ring[pusasync_ring_in].systime = bcmhw_get_system_timer();
+    __sync_synchronize();
+    pusasync_ring_in = next;
+}
+
+/*
+ * Called by the audio thread once per frame, before the audio handler.
+ */
+void pusasync_rt_frame(unsigned long long sample_index)
+{
+    if (pusasync_mode != PUSASYNC_MODE_MASTER)
+	return;
+
+    /* Take the command in one step so a start or stop can't be lost. */
+    int cmd = __atomic_exchange_n(&pusasync_master_cmd, 0, __ATOMIC_ACQ_REL);
+    if (cmd)
+    {
+	pusasync_push(cmd);
+
+	/* First clock after a start is the downbeat. */
+	if (cmd == 0xfa)
+	{
+	    pusasync_master_ticks = 0;
+	    pusasync_master_phase = 0;
+	    pusasync_push(0xf8);
+	    return;
+	}
+    }
+
+    unsigned int inc = pusasync_master_inc;
+    pusasync_master_phase += inc;
+    if (pusasync_master_phase < inc)
+    {
+	pusasync_master_ticks++;
+	pusasync_push(0xf8);
+    }
+}
+
+static void *pusasync_sender_thread(void *arg)
+{
+    while (1)
+    {
+	if (pusasync_ring_out == pusasync_ring_in)
+	{
+	    usleep(PUSASYNC_POLL_US);
+	    continue;
+	}
+
+	while (pusasync_ring_out != pusasync_ring_in)
+	{
+	    __sync_synchronize();
+	    struct pusasync_event_s ev = pusasync_ring[pusasync_ring_out];
+	    pusasync_ring_out = (pusasync_ring_out + 1) % PUSASYNC_RING_SIZE;
+
+	    pusamidi_send_midi_out(&ev.byte, 1);
+
+	    if (ev.byte == 0xf8)
+		pusasync_acc_add(&pusasync_master_acc,
+				 (double) (bcmhw_get_system_timer() - ev.systime));
+	}
+    }
+
+    return NULL;
+}
+
+static void pusasync_publish(double t0, double t1, unsigned long ticks)
+{
+    pusasync_pub_seq++;
+    __sync_synchronize();
+    pusasync_pub_t0 = t0;
+    pusasync_pub_t1 = t1;
+    pusasync_pub_ticks = ticks;
+    __sync_synchronize();
+    pusasync_pub_seq++;
+}
+
+/*
+ * Second order delay-locked loop as described by Fons Adriaensen in
+ * "Using a DLL to filter time".  Times are in samples.
+ */
+static void pusasync_dll_update(double t)
+{
+    if (!pusasync_dll_locked)
+    {
+	if (pusasync_dll_last >= 0.0 && t > pusasync_dll_last)
+	{
+	    pusasync_dll_e2 = t - pusasync_dll_last;
+	    pusasync_dll_t0 = t;
+	    pusasync_dll_t1 = t + pusasync_dll_e2;
+	    pusasync_dll_locked = 1;
+	}
+	pusasync_dll_last = t;
+	return;
+    }
+
+    double e = t - pusasync_dll_t1;
+
+    /* A lost or wildly early clock means the tempo jumped.  Start over. */
+    if (fabs(e) > pusasync_dll_e2 / 2)
+    {
+	pusasync_dll_locked = 0;
+	pusasync_dll_last = t;
+	pusasync_slave_relocks++;
+	return;
+    }
+
+    pusasync_acc_add(&pusasync_slave_acc, e * 1000000.0 / pusa_get_sample_rate());
+
+    double omega = 2.0 * M_PI * pusasync_bandwidth * pusasync_dll_e2 / pusa_get_sample_rate();
+    pusasync_dll_t0 = pusasync_dll_t1;
+    pusasync_dll_t1 += M_SQRT2 * omega * e + pusasync_dll_e2;
+    pusasync_dll_e2 += omega * omega * e;
+}
+
+/*
+ * Called from the MIDI input threads for every system real time byte.
+ */
+static void pusasync_midi_realtime(int c)
+{
+    double now = (double) pusa_get_sample_index();
+
+    if (pusasync_mode != PUSASYNC_MODE_SLAVE)
+	return;
+
+    pthread_mutex_lock(&pusasync_slave_lock);
+    switch (c)
+    {
+      case 0xf8:
+	pusasync_dll_update(now);
+	if (pusasync_dll_locked)
+	{
+	    pusasync_slave_ticks++;
+	    pusasync_publish(pusasync_dll_t0, pusasync_dll_t1, pusasync_slave_ticks);
+	}
+	break;
+
+      case 0xfa:
+	pusasync_slave_ticks = 0;
+	if (pusasync_dll_locked)
+	    pusasync_publish(now, pusasync_dll_t1 - pusasync_dll_t0 + now, 0);
+	break;
+    }
+    pthread_mutex_unlock(&pusasync_slave_lock);
+}
+
+double pusasync_beat_position(void)
+{
+    if (pusasync_mode == PUSASYNC_MODE_MASTER)
+    {
+	return (pusasync_master_ticks + pusasync_master_phase / 4294967296.0) / PUSASYNC_PPQN;
+    }
+    else if (pusasync_mode == PUSASYNC_MODE_SLAVE)
+    {
+	unsigned int seq;
+	double t0, t1;
+	unsigned long ticks;
+
+	do
+	{
+	    seq = pusasync_pub_seq;
+	    __sync_synchronize();
+	    t0 = pusasync_pub_t0;
+	    t1 = pusasync_pub_t1;
+	    ticks = pusasync_pub_ticks;
+	    __sync_synchronize();
+	}
+	while ((seq & 1) || seq != pusasync_pub_seq);
+
+	if (t1 <= t0)
+	    return 0.0;
+
+	/* Hold at the next tick if it is late rather than running ahead. */
+	double frac = ((double) pusa_get_sample_index() - t0) / (t1 - t0);
+	if (frac < 0.0)
+	    frac = 0.0;
+	if (frac > 1.0)
+	    frac = 1.0;
+
+	return (ticks + frac) / PUSASYNC_PPQN;
+    }
+
+    return 0.0;
+}
+
+double pusasync_beat_phase(void)
+{
+    double pos = pusasync_beat_position();
+    return pos - floor(pos);
+}
+
+void pusasync_set_mode(int mode)
+{
+    pthread_mutex_lock(&pusasync_slave_lock);
+    pusasync_dll_locked = 0;
+    pusasync_dll_last = -1.0;
+    pusasync_slave_ticks = 0;
+    pusasync_publish(0.0, 0.0, 0);
+    pthread_mutex_unlock(&pusasync_slave_lock);
+
+    pusasync_mode = mode;
+}
+
+void pusasync_set_tempo(double bpm)
+{
+    if (bpm < 1.0 || bpm > 999.0)
+	return;
+
+    /*
+     * Round up, so that when the clock period is a whole number of
+     * samples the accumulator wraps after exactly that many from 0, as it
+     * is after a start.
+     */
+    pusasync_master_bpm = bpm;
+    pusasync_master_inc = (unsigned int)
+	ceil(bpm * PUSASYNC_PPQN / 60.0 / pusa_get_sample_rate() * 4294967296.0);
+}
+
+double pusasync_get_tempo(void)
+{
+    if (pusasync_mode == PUSASYNC_MODE_SLAVE)
+    {
+	double period;
+
+	pthread_mutex_lock(&pusasync_slave_lock);
+	period = pusasync_dll_locked ? pusasync_dll_e2 : 0.0;
+	pthread_mutex_unlock(&pusasync_slave_lock);
+
+	if (period <= 0.0)
+	    return 0.0;
+
+	return 60.0 * pusa_get_sample_rate() / (PUSASYNC_PPQN * period);
+    }
+
+    return pusasync_master_bpm;
+}
+
+void pusasync_set_bandwidth(double hz)
+{
+    if (hz > 0.0)
+	pusasync_bandwidth = hz;
+}
+
+void pusasync_start(void)
+{
+    pusasync_master_cmd = 0xfa;
+}
+
+void pusasync_stop(void)
+{
+    pusasync_master_cmd = 0xfc;
+}
+
+void pusasync_get_stats(struct pusasync_stats_s *stats)
+{
+    pusasync_acc_get(&pusasync_master_acc, &stats->master);
+    pusasync_acc_get(&pusasync_slave_acc, &stats->slave);
+    stats->master_overflows = pusasync_master_overflows;
+    stats->slave_relocks = pusasync_slave_relocks;
+}
+
+void pusasync_print_stats(void)
+{
+    struct pusasync_stats_s stats;
+    pusasync_get_stats(&stats);
+
+    printf("sync: tempo %.2f, beat %.3f, overflows %lu, relocks %lu\n",
+	   pusasync_get_tempo(), pusasync_beat_position(),
+	   stats.master_overflows, stats.slave_relocks);
+    printf("  master: n %lu, mean %.1f us, stddev %.1f us, min %.1f us, max %.1f us\n",
+	   stats.master.count, stats.master.mean_us, stats.master.stddev_us,
+	   stats.master.min_us, stats.master.max_us);
+    printf("  slave:  n %lu, mean %.1f us, stddev %.1f us, min %.1f us, max %.1f us\n",
+	   stats.slave.count, stats.slave.mean_us, stats.slave.stddev_us,
+	   stats.slave.min_us, stats.slave.max_us);
+}
+
+int pusasync_init(void)
+{
+    pusasync_set_tempo(pusasync_master_bpm);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusasync_sender_thread, NULL) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    /*
+     * The sender shares the housekeeping cores with everything else, so
+     * give it priority over normal threads to keep clock latency low.
+     */
+    struct sched_param sparam;
+    sparam.sched_priority = 80;
+    pthread_setschedparam(tid, SCHED_FIFO, &sparam);
+
+    pusamidi_set_realtime_callback(pusasync_midi_realtime);
+
+    return 0;
+}
+
+#ifdef PUSASYNC_UNIT_TEST
+#include "pusatest.h"
+
+/*
+ * Runs against the emulated system timer (build with -DBCMHW_EMULATE).
+ * The library functions pusasync uses are replaced so the test decides
+ * the sample index and sees every byte sent.
+ */
+#define TEST_RATE	48000
+#define TEST_SENT_MAX	1024
+
+static unsigned long long test_sample = 0;
+static void (*test_realtime)(int c) = NULL;
+static unsigned char test_sent[TEST_SENT_MAX];
+static unsigned long long test_sent_at[TEST_SENT_MAX];
+static volatile int test_nsent = 0;
+
+unsigned long long pusa_get_sample_index(void)
+{
+    return test_sample;
+}
+
+int pusa_get_sample_rate(void)
+{
+    return TEST_RATE;
+}
+
+void pusamidi_send_midi_out(const void *buffer, size_t len)
+{
+    if (test_nsent < TEST_SENT_MAX)
+    {
+	test_sent[test_nsent] = *(const unsigned char *) buffer;
+	test_sent_at[test_nsent] = test_sample;
+	test_nsent++;
+    }
+}
+
+void pusamidi_set_realtime_callback(void (*func)(int c))
+{
+    test_realtime = func;
+}
+
+/*
+ * Run the audio thread side for n frames.  Whenever it queues anything,
+ * wait for the sender so bytes are stamped with the frame that sent them.
+ */
+static void test_master_frames(int n)
+{
+    for (int i = 0; i < n; i++, test_sample++)
+    {
+	unsigned int in = pusasync_ring_in;
+
+	pusasync_rt_frame(test_sample);
+	if (pusasync_ring_in == in)
+	    continue;
+	while (pusasync_ring_out != pusasync_ring_in)
+	    usleep(100);
+    }
+}
+
+/* Clocks every period samples, each up to jitter samples early or late. */
+static void test_slave_clocks(int n, double period, int jitter, double *t)
+{
+    for (int i = 0; i < n; i++)
+    {
+	*t += period;
+	test_sample = *t + (jitter ? rand() % (2 * jitter + 1) - jitter : 0);
+	test_realtime(0xf8);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct pusasync_stats_s st;
+    char msg[100];
+
+    bcmhw_init_emulated();
+    check(pusasync_init() == 0 && test_realtime != NULL, "init");
+
+    /* 120 BPM at 48 kHz is a clock every 1000 samples. */
+    pusasync_set_mode(PUSASYNC_MODE_MASTER);
+    pusasync_set_tempo(120);
+    test_master_frames(10 * 1000 + 500);
+    int n = test_nsent, spacing = 1;
+    for (int i = 1; i < n; i++)
+	if (test_sent[i] != 0xf8 || test_sent_at[i] - test_sent_at[i - 1] != 1000)
+	    spacing = 0;
+    sprintf(msg, "%d clocks, 1000 samples apart", n);
+    check(n == 10 && test_sent[0] == 0xf8 && spacing, msg);
+
+    /* A start goes out with a clock on the next frame, the downbeat. */
+    pusasync_start();
+    unsigned long long started = test_sample;
+    test_master_frames(1);
+    check(test_nsent == n + 2 && test_sent[n] == 0xfa && test_sent[n + 1] == 0xf8 &&
+	  test_sent_at[n + 1] == started, "start and downbeat together");
+    check(pusasync_beat_position() == 0, "beat position 0 at the downbeat");
+    test_master_frames(PUSASYNC_PPQN * 1000 - 1);
+    check(test_nsent == n + 2 + PUSASYNC_PPQN - 1 &&
+	  test_sent_at[test_nsent - 1] == started + (PUSASYNC_PPQN - 1) * 1000,
+	  "clocks follow the downbeat");
+    sprintf(msg, "a beat after the start, position %.4f", pusasync_beat_position());
+    check(fabs(pusasync_beat_position() - 1.0) < 0.001, msg);
+
+    /* The stop lands on the next beat, so goes out just before its clock. */
+    pusasync_stop();
+    test_master_frames(1);
+    check(test_sent[test_nsent - 2] == 0xfc && test_sent[test_nsent - 1] == 0xf8 &&
+	  test_sent_at[test_nsent - 1] == started + PUSASYNC_PPQN * 1000, "stop");
+
+    pusasync_get_stats(&st);
+    check(st.master.count == test_nsent - 2 && st.master_overflows == 0, "master stats");
+
+    /*
+     * The slave locks to 100 BPM, a clock every 1200 samples, with up to
+     * 500 us of jitter on each one.
+     */
+    srand(1);
+    pusasync_set_mode(PUSASYNC_MODE_SLAVE);
+    check(pusasync_get_tempo() == 0, "no tempo before lock");
+    double t = 100000;
+    test_slave_clocks(400, 1200, 24, &t);
+    sprintf(msg, "slave tempo %.3f BPM", pusasync_get_tempo());
+    check(fabs(pusasync_get_tempo() - 100) < 0.2, msg);
+
+    pusasync_get_stats(&st);
+    printf("slave jitter: n %lu, mean %.1f us, stddev %.1f us, min %.1f us, max %.1f us\n",
+	   st.slave.count, st.slave.mean_us, st.slave.stddev_us, st.slave.min_us, st.slave.max_us);
+    check(st.slave.count == 398 && st.slave_relocks == 0, "every clock after lock measured");
+    check(fabs(st.slave.mean_us) < 100 && st.slave.stddev_us > 150 && st.slave.stddev_us < 500,
+	  "slave jitter");
+    check(st.slave.min_us > -3000 && st.slave.max_us < 3000, "slave jitter while locking");
+
+    /* After a start the beat counts from the start. */
+    test_sample = t;
+    test_realtime(0xfa);
+    check(fabs(pusasync_beat_position()) < 0.01, "slave beat position 0 at start");
+    test_slave_clocks(PUSASYNC_PPQN, 1200, 0, &t);
+    sprintf(msg, "slave a beat after the start, position %.4f", pusasync_beat_position());
+    check(fabs(pusasync_beat_position() - 1.0) < 0.01, msg);
+
+    /* A lost clock starts the lock over. */
+    t += 1200;
+    test_slave_clocks(10, 1200, 0, &t);
+    pusasync_get_stats(&st);
+    check(st.slave_relocks == 1 && fabs(pusasync_get_tempo() - 100) < 0.2, "relock after lost clock");
+
+    pusasync_print_stats();
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
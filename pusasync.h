@@ -0,0 +1,50 @@
+/*
+ * Header file for MIDI clock sync.
+ */
+
+#ifndef __pusasync_h__
+#define __pusasync_h__
+
+#define PUSASYNC_PPQN		24
+
+#define PUSASYNC_MODE_OFF	0
+#define PUSASYNC_MODE_MASTER	1
+#define PUSASYNC_MODE_SLAVE	2
+
+/*
+ * Timing error statistics in microseconds.  For the master this is the
+ * delay from the sample a clock was due to the time it was written to the
+ * MIDI ports.  For the slave it is the error of each incoming clock
+ * relative to the DLL prediction.
+ */
+struct pusasync_jitter_s
+{
+    unsigned long count;
+    double mean_us;
+    double stddev_us;
+    double min_us;
+    double max_us;
+};
+
+struct pusasync_stats_s
+{
+    struct pusasync_jitter_s master;
+    struct pusasync_jitter_s slave;
+    unsigned long master_overflows;
+    unsigned long slave_relocks;
+};
+
+int pusasync_init(void);
+void pusasync_set_mode(int mode);
+void pusasync_set_tempo(double bpm);
+double pusasync_get_tempo(void);
+void pusasync_set_bandwidth(double hz);
+void pusasync_start(void);
+void pusasync_stop(void);
+double pusasync_beat_position(void);
+double pusasync_beat_phase(void);
+void pusasync_rt_frame(unsigned long long sample_index);
+void pusasync_get_stats(struct pusasync_stats_s *stats);
+void pusasync_print_stats(void);
+
+#endif /* __pusasync_h__ */
@@ -0,0 +1,22 @@
+/*
+ * Header file for the unit tests built into the modules.  Each test main
+ * reports with check() and exits with test_failures as its status.
+ */
+
+#ifndef __pusatest_h__
+#define __pusatest_h__
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+	printf("FAIL: %s\n", what);
+	test_failures++;
+    }
+}
+
+#endif /* __pusatest_h__ */
@@ -0,0 +1,578 @@
+/*
+ * Copyright 2025 - Robert Amstadt
+ *
+ * This file is part of PiUserSpaceAudio.
+ *
+ * PiUserSpaceAudio is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * PiUserSpaceAudio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with PiUserSpaceAudio. If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Timeline of what the audio, MIDI and worker threads are doing, for
+ * chrome://tracing or ui.perfetto.dev.  Each thread writes fixed size
+ * events, stamped with bcmhw_cycles(), into its own ring; recording one
+ * is a few stores and never waits.  A collector thread drains the rings
+ * every PUSATRACE_COLLECT_MS and writes Chrome trace JSON.
+ *
+ * Timestamps are converted to CLOCK_MONOTONIC microseconds, the clock
+ * "perf record -k CLOCK_MONOTONIC -e sched:sched_switch" uses, so the
+ * two can be lined up.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pusatrace.h"
+
+pid_t gettid(void);
+
+#define PUSATRACE_COLLECT_MS	10
+
+volatile int pusatrace_enabled = 0;
+__thread struct pusatrace_buffer_s *pusatrace_buffer = NULL;
+static __thread int pusatrace_refused = 0;
+
+static struct pusatrace_buffer_s *pusatrace_buffers[PUSATRACE_MAX_THREADS];
+static volatile int pusatrace_nbuffers = 0;
+static unsigned long pusatrace_recycled_dropped = 0;
+static pthread_mutex_t pusatrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pusatrace_key;
+static pthread_once_t pusatrace_key_once = PTHREAD_ONCE_INIT;
+
+static char pusatrace_names[PUSATRACE_MAX_IDS][PUSATRACE_NAME_LEN] =
+{
+    "fifo wake", "handler", "modifier", "resync", "rx error", "tx error",
+    "midi in", "analysis", "capture", "journal"
+};
+
+static FILE *pusatrace_fp = NULL;
+static volatile int pusatrace_collecting = 0;
+static volatile int pusatrace_collector_done = 1;
+static int pusatrace_first_event;
+static unsigned long long pusatrace_events = 0;
+static int pusatrace_pid;
+
+/* bcmhw_cycles() at pusatrace_start() and CLOCK_MONOTONIC then, in ns. */
+static unsigned long long pusatrace_cycles0;
+static double pusatrace_ns0;
+static double pusatrace_ns_per_cycle;
+
+/*
+ * Runs as a thread that has a buffer exits.  The collector releases the
+ * buffer once it has written out the last of its events.
+ */
+static void pusatrace_thread_exit(void *arg)
+{
+    struct pusatrace_buffer_s *b = arg;
+
+    /* Nothing recorded by later destructors can land in a reused buffer. */
+    pusatrace_buffer = NULL;
+    pusatrace_refused = 1;
+
+    __sync_synchronize();
+    b->exited = 1;
+}
+
+static void pusatrace_key_create(void)
+{
+    pthread_key_create(&pusatrace_key, pusatrace_thread_exit);
+}
+
+/*
+ * A buffer whose thread has exited, to hand to a new one.  While not
+ * tracing nothing reads the buffers, so one needn't wait for the
+ * collector to release it.  Called with pusatrace_lock held.
+ */
+static struct pusatrace_buffer_s *pusatrace_recycle(void)
+{
+    for (int i = 0; i < pusatrace_nbuffers; i++)
+    {
+	struct pusatrace_buffer_s *b = pusatrace_buffers[i];
+
+	if (b->released || (b->exited && pusatrace_fp == NULL))
+	{
+	    pusatrace_recycled_dropped += b->dropped;
+	    b->dropped = 0;
+	    b->out = b->in;
+	    b->exited = 0;
+	    __sync_synchronize();
+	    b->released = 0;
+	    return b;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Set up the calling thread's buffer, naming it if name isn't NULL.
+ * Buffers of threads that have exited are reused.  Returns NULL while
+ * PUSATRACE_MAX_THREADS live threads have one.
+ */
+struct pusatrace_buffer_s *pusatrace_thread(const char *name)
+{
+    struct pusatrace_buffer_s *b = pusatrace_buffer;
+
+    if (b == NULL && !pusatrace_refused)
+    {
+	pthread_once(&pusatrace_key_once, pusatrace_key_create);
+
+	pthread_mutex_lock(&pusatrace_lock);
+	b = pusatrace_recycle();
+	if (b == NULL && pusatrace_nbuffers < PUSATRACE_MAX_THREADS)
+	{
+	    b = calloc(1, sizeof(*b));
+	    if (b != NULL)
+	    {
+		/* Touch it now rather than on the first events. */
+		memset(b, 0, sizeof(*b));
+		pusatrace_buffers[pusatrace_nbuffers] = b;
+		__sync_synchronize();
+		pusatrace_nbuffers++;
+	    }
+	}
+	if (b != NULL)
+	{
+	    b->tid = gettid();
+	    snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+	    pthread_setspecific(pusatrace_key, b);
+	}
+	else
+	{
+	    printf("pusatrace: no buffer for thread %d\n", gettid());
+	    pusatrace_refused = 1;
+	}
+	pthread_mutex_unlock(&pusatrace_lock);
+	pusatrace_buffer = b;
+    }
+
+    if (b != NULL && name != NULL)
+	snprintf(b->name, sizeof(b->name), "%s", name);
+
+    return b;
+}
+
+void pusatrace_set_name(int id, const char *name)
+{
+    if (id >= 0 && id < PUSATRACE_MAX_IDS)
+	snprintf(pusatrace_names[id], PUSATRACE_NAME_LEN, "%s", name);
+}
+
+static double pusatrace_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void pusatrace_write_event(struct pusatrace_buffer_s *b, const struct pusatrace_event_s *e)
+{
+    static const char phases[] = { 'B', 'E', 'i' };
+    unsigned long long ns = pusatrace_ns0 + (long long) (e->time - pusatrace_cycles0) * pusatrace_ns_per_cycle;
+    const char *name = e->id < PUSATRACE_MAX_IDS ? pusatrace_names[e->id] : "";
+
+    /* Microseconds, with integer formatting to keep up with the audio thread. */
+    fprintf(pusatrace_fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+	    pusatrace_first_event ? "" : ",", name[0] ? name : "event", phases[e->type % 3],
+	    ns / 1000, (unsigned int) (ns % 1000), pusatrace_pid, b->tid);
+    if (e->type == PUSATRACE_TYPE_INSTANT)
+	fprintf(pusatrace_fp, ",\"s\":\"t\",\"args\":{\"arg\":%u}", e->arg);
+    fputc('}', pusatrace_fp);
+
+    pusatrace_first_event = 0;
+    pusatrace_events++;
+}
+
+static void pusatrace_write_name(struct pusatrace_buffer_s *b)
+{
+    fprintf(pusatrace_fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+	    "\"args\":{\"name\":\"%s\"}}",
+	    pusatrace_first_event ? "" : ",", pusatrace_pid, b->tid, b->name);
+    pusatrace_first_event = 0;
+}
+
+/*
+ * Write out the events recorded since the last drain.  A buffer whose
+ * thread has exited is released once empty, with the thread's name
+ * written now since the buffer may be renamed by the time we stop.
+ */
+static void pusatrace_drain(void)
+{
+    int n = pusatrace_nbuffers;
+
+    __sync_synchronize();
+    for (int i = 0; i < n; i++)
+    {
+	struct pusatrace_buffer_s *b = pusatrace_buffers[i];
+
+	if (b->released)
+	    continue;
+
+	/* Read before in, so no events can follow it. */
+	int exited = b->exited;
+	__sync_synchronize();
+
+	unsigned int in = __atomic_load_n(&b->in, __ATOMIC_ACQUIRE);
+	unsigned int out = b->out;
+
+	for (; out != in; out++)
+	    pusatrace_write_event(b, b->events + out % PUSATRACE_BUFFER);
+
+	__sync_synchronize();
+	b->out = out;
+
+	if (exited)
+	{
+	    pusatrace_write_name(b);
+	    __sync_synchronize();
+	    b->released = 1;
+	}
+    }
+}
+
+static void *pusatrace_collector(void *arg)
+{
+    while (pusatrace_collecting)
+    {
+	pusatrace_drain();
+	usleep(PUSATRACE_COLLECT_MS * 1000);
+    }
+
+    __sync_synchronize();
+    pusatrace_collector_done = 1;
+
+    return NULL;
+}
+
+/*
+ * Start writing a trace to path.  Events recorded before this are
+ * dropped.
+ */
+int pusatrace_start(const char *path)
+{
+    if (pusatrace_fp != NULL)
+    {
+	printf("pusatrace: already tracing\n");
+	return -1;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+	perror(path);
+	return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pusatrace_first_event = 1;
+    pusatrace_events = 0;
+    pusatrace_pid = getpid();
+
+    /* Held so a new thread can't take over a buffer as we start. */
+    pthread_mutex_lock(&pusatrace_lock);
+    pusatrace_fp = fp;
+    pusatrace_recycled_dropped = 0;
+    for (int i = 0; i < pusatrace_nbuffers; i++)
+    {
+	pusatrace_buffers[i]->out = pusatrace_buffers[i]->in;
+	pusatrace_buffers[i]->dropped = 0;
+    }
+    pthread_mutex_unlock(&pusatrace_lock);
+
+    pusatrace_ns_per_cycle = 1e9 / bcmhw_cycles_per_sec();
+    pusatrace_cycles0 = bcmhw_cycles();
+    pusatrace_ns0 = pusatrace_monotonic_ns();
+
+    pusatrace_collecting = 1;
+    pusatrace_collector_done = 0;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pusatrace_collector, NULL) != 0)
+    {
+	pthread_attr_destroy(&attr);
+	fclose(fp);
+	pusatrace_fp = NULL;
+	return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    __sync_synchronize();
+    pusatrace_enabled = 1;
+
+    return 0;
+}
+
+/*
+ * Stop recording, write out what is left with the thread names and close
+ * the trace.
+ */
+int pusatrace_stop(void)
+{
+    if (pusatrace_fp == NULL)
+	return -1;
+
+    pusatrace_enabled = 0;
+    pusatrace_collecting = 0;
+    while (!pusatrace_collector_done)
+	usleep(1000);
+    pthread_mutex_lock(&pusatrace_lock);
+    pusatrace_drain();
+
+    /* Released buffers had their names written as they were. */
+    for (int i = 0; i < pusatrace_nbuffers; i++)
+    {
+	if (!pusatrace_buffers[i]->released)
+	    pusatrace_write_name(pusatrace_buffers[i]);
+    }
+    fprintf(pusatrace_fp, "\n]}\n");
+
+    int rc = fclose(pusatrace_fp) == 0 ? 0 : -1;
+    pusatrace_fp = NULL;
+    pthread_mutex_unlock(&pusatrace_lock);
+
+    return rc;
+}
+
+void pusatrace_get_stats(struct pusatrace_stats_s *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = pusatrace_nbuffers;
+    stats->events = pusatrace_events;
+    stats->dropped = pusatrace_recycled_dropped;
+    for (int i = 0; i < stats->threads; i++)
+	stats->dropped += pusatrace_buffers[i]->dropped;
+}
+
+void pusatrace_print_stats(void)
+{
+    struct pusatrace_stats_s st;
+
+    pusatrace_get_stats(&st);
+    printf("trace: %d threads, %llu events, %lu dropped\n", st.threads, st.events, st.dropped);
+}
+
+#ifdef PUSATRACE_UNIT_TEST
+#include "pusatest.h"
+
+#define TEST_THREADS	3
+#define TEST_EVENTS	20000
+
+static void *test_thread(void *arg)
+{
+    char name[16];
+
+    sprintf(name, "test %ld", (long) arg);
+    PUSATRACE_THREAD(name);
+
+    for (int i = 0; i < TEST_EVENTS; i++)
+    {
+	PUSATRACE_BEGIN(PUSATRACE_USER);
+	PUSATRACE_INSTANT(PUSATRACE_USER + 1, i);
+	PUSATRACE_END(PUSATRACE_USER);
+
+	/* Slower than the collector drains. */
+	if (i % 500 == 499)
+	    usleep(20000);
+    }
+
+    return NULL;
+}
+
+/* Records a few events and exits, leaving its buffer to be reused. */
+static void *test_short_thread(void *arg)
+{
+    PUSATRACE_THREAD("short");
+    for (int i = 0; i < 100; i++)
+	PUSATRACE_INSTANT(PUSATRACE_USER + 1, i);
+
+    return (void *) (long) (pusatrace_buffer != NULL);
+}
+
+/*
+ * Run n short lived threads a few at a time, giving the collector time
+ * to release their buffers.  Returns how many got a buffer.
+ */
+static int test_short_threads(int n)
+{
+    int got = 0;
+
+    for (int i = 0; i < n; i += 8)
+    {
+	pthread_t tids[8];
+	void *rc;
+
+	for (int k = 0; k < 8; k++)
+	    pthread_create(&tids[k], NULL, test_short_thread, NULL);
+	for (int k = 0; k < 8; k++)
+	{
+	    pthread_join(tids[k], &rc);
+	    got += rc != NULL;
+	}
+	usleep(3 * PUSATRACE_COLLECT_MS * 1000);
+    }
+
+    return got;
+}
+
+/*
+ * Time events into an empty buffer, waiting for the collector in
+ * between, and keep the best run.
+ */
+static double test_event_ns(void)
+{
+    struct pusatrace_buffer_s *b = PUSATRACE_THREAD("bench");
+    double best = 1e9;
+
+    for (int run = 0; run < 20; run++)
+    {
+	while (b->out != b->in)
+	    usleep(1000);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < PUSATRACE_BUFFER / 2; i++)
+	    PUSATRACE_INSTANT(PUSATRACE_USER, i);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+	    (PUSATRACE_BUFFER / 2);
+	if (ns < best)
+	    best = ns;
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/tmp/pusatrace.json";
+    struct pusatrace_stats_s st;
+    pthread_t tids[TEST_THREADS];
+
+    pusatrace_set_name(PUSATRACE_USER, "work");
+    pusatrace_set_name(PUSATRACE_USER + 1, "tick");
+
+    /* Nothing is recorded while not tracing. */
+    PUSATRACE_INSTANT(PUSATRACE_USER, 0);
+    check(pusatrace_buffer == NULL, "no buffer before tracing");
+
+    check(pusatrace_start(path) == 0, "start trace");
+    check(pusatrace_start(path) < 0, "one trace at a time");
+    for (long i = 0; i < TEST_THREADS; i++)
+	pthread_create(&tids[i], NULL, test_thread, (void *) i);
+    for (int i = 0; i < TEST_THREADS; i++)
+	pthread_join(tids[i], NULL);
+
+    double ns = test_event_ns();
+    check(pusatrace_stop() == 0, "stop trace");
+    pusatrace_print_stats();
+    printf("%.1f ns/event\n", ns);
+
+    pusatrace_get_stats(&st);
+    check(st.dropped == 0, "no events dropped");
+    check(st.events == TEST_THREADS * TEST_EVENTS * 3ULL + 20 * (PUSATRACE_BUFFER / 2), "every event written");
+
+    /* Read the trace back: one event per line, in time order per thread. */
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    double last_ts[TEST_THREADS + 1];
+    int tids_seen[TEST_THREADS + 1];
+    int ntids = 0, depth = 0, names = 0, out_of_order = 0;
+    unsigned long long events = 0;
+
+    check(fp != NULL && fgets(line, sizeof(line), fp) != NULL &&
+	  strncmp(line, "{\"displayTimeUnit\"", 18) == 0, "trace header");
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+    {
+	char *ph = strstr(line, "\"ph\":\"");
+	char *ts = strstr(line, "\"ts\":");
+	char *tid = strstr(line, "\"tid\":");
+
+	if (strstr(line, "\"thread_name\"") != NULL)
+	    names++;
+	if (ph == NULL || ts == NULL || tid == NULL)
+	    continue;
+
+	int t = atoi(tid + 6), k;
+	for (k = 0; k < ntids && tids_seen[k] != t; k++)
+	    ;
+	if (k == ntids && ntids <= TEST_THREADS)
+	{
+	    tids_seen[ntids] = t;
+	    last_ts[ntids++] = 0;
+	}
+
+	double us = atof(ts + 5);
+	if (k < ntids)
+	{
+	    if (us < last_ts[k])
+		out_of_order++;
+	    last_ts[k] = us;
+	}
+
+	if (ph[6] == 'B')
+	    depth++;
+	else if (ph[6] == 'E')
+	    depth--;
+	events++;
+    }
+    if (fp != NULL)
+	fclose(fp);
+
+    check(events == st.events, "every event read back");
+    check(ntids == TEST_THREADS + 1 && names == TEST_THREADS + 1, "thread names");
+    check(out_of_order == 0, "events in time order");
+    check(depth == 0, "begins and ends match");
+
+    /* Threads that come and go don't use up the buffers. */
+    check(test_short_threads(4 * PUSATRACE_MAX_THREADS) == 4 * PUSATRACE_MAX_THREADS,
+	  "buffers reused while not tracing");
+    check(pusatrace_start(path) == 0, "restart trace");
+    check(test_short_threads(4 * PUSATRACE_MAX_THREADS) == 4 * PUSATRACE_MAX_THREADS,
+	  "buffers reused while tracing");
+    pthread_create(&tids[0], NULL, test_thread, (void *) 0L);
+    pthread_join(tids[0], NULL);
+    check(pusatrace_stop() == 0, "stop second trace");
+    pusatrace_print_stats();
+
+    pusatrace_get_stats(&st);
+    check(st.threads <= 16, "buffers recycled");
+    check(st.dropped == 0, "no events dropped by short threads");
+    check(st.events == 4 * PUSATRACE_MAX_THREADS * 100ULL + TEST_EVENTS * 3ULL, "short thread events written");
+
+    fp = fopen(path, "r");
+    names = 0;
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+	if (strstr(line, "\"thread_name\"") != NULL)
+	    names++;
+    if (fp != NULL)
+	fclose(fp);
+    check(names >= 4 * PUSATRACE_MAX_THREADS + 1, "short thread names");
+    unlink(path);
+
+    printf("%s\n", test_failures ? "FAILED" : "PASSED");
+
+    return test_failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Header file for timeline tracing.
+ */
+
+#ifndef __pusatrace_h__
+#define __pusatrace_h__
+
+#include "bcmhw.h"
+
+#define PUSATRACE_BUFFER	16384
+#define PUSATRACE_MAX_THREADS	32
+#define PUSATRACE_MAX_IDS	64
+#define PUSATRACE_NAME_LEN	16
+
+/* Events the library records.  Ids from PUSATRACE_USER on are free. */
+#define PUSATRACE_FIFO_WAKE	0
+#define PUSATRACE_HANDLER	1
+#define PUSATRACE_MODIFIER	2
+#define PUSATRACE_RESYNC	3
+#define PUSATRACE_RX_ERROR	4
+#define PUSATRACE_TX_ERROR	5
+#define PUSATRACE_MIDI_IN	6
+#define PUSATRACE_ANALYSIS	7
+#define PUSATRACE_CAPTURE	8
+#define PUSATRACE_JOURNAL	9
+#define PUSATRACE_USER		16
+
+#define PUSATRACE_TYPE_BEGIN	0
+#define PUSATRACE_TYPE_END	1
+#define PUSATRACE_TYPE_INSTANT	2
+
+struct pusatrace_event_s
+{
+    unsigned long long time;
+    unsigned short id;
+    unsigned short type;
+    unsigned int arg;
+};
+
+/*
+ * One per thread.  The thread is the only writer of in and the collector
+ * the only writer of out.  exited is set when the thread exits and
+ * released once its events and name are in the trace, after which
+ * pusatrace_thread() can hand the buffer to another thread.
+ */
+struct pusatrace_buffer_s
+{
+    struct pusatrace_event_s events[PUSATRACE_BUFFER];
+    volatile unsigned int in;
+    volatile unsigned int out;
+    unsigned long dropped;
+    volatile int exited;
+    volatile int released;
+    int tid;
+    char name[PUSATRACE_NAME_LEN];
+};
+
+struct pusatrace_stats_s
+{
+    int threads;
+    unsigned long long events;
+    unsigned long dropped;
+};
+
+int pusatrace_start(const char *path);
+int pusatrace_stop(void);
+void pusatrace_set_name(int id, const char *name);
+struct pusatrace_buffer_s *pusatrace_thread(const char *name);
+void pusatrace_get_stats(struct pusatrace_stats_s *stats);
+void pusatrace_print_stats(void);
+
+/*
+ * Build with -DPUSA_TRACE to record events.  Without it the macros are
+ * empty and tracing costs nothing.  A thread records into its own buffer,
+ * set up by PUSATRACE_THREAD() or on its first event; real time threads
+ * should call PUSATRACE_THREAD() before they start, since it allocates.
+ */
+#ifdef PUSA_TRACE
+extern volatile int pusatrace_enabled;
+extern __thread struct pusatrace_buffer_s *pusatrace_buffer;
+
+static inline void pusatrace_event(int type, int id, unsigned int arg)
+{
+    struct pusatrace_buffer_s *b = pusatrace_buffer;
+
+    if (!pusatrace_enabled)
+	return;
+    if (b == NULL && (b = pusatrace_thread(NULL)) == NULL)
+	return;
+
+    unsigned int in = b->in;
+    if (in - b->out >= PUSATRACE_BUFFER)
+    {
+	b->dropped++;
+	return;
+    }
+
+    struct pusatrace_event_s *e = b->events + in % PUSATRACE_BUFFER;
+    e->time = bcmhw_cycles();
+    e->id = id;
+    e->type = type;
+    e->arg = arg;
+    __atomic_store_n(&b->in, in + 1, __ATOMIC_RELEASE);
+}
+
+#define PUSATRACE_THREAD(name)		pusatrace_thread(name)
+#define PUSATRACE_BEGIN(id)		pusatrace_event(PUSATRACE_TYPE_BEGIN, (id), 0)
+#define PUSATRACE_END(id)		pusatrace_event(PUSATRACE_TYPE_END, (id), 0)
+#define PUSATRACE_INSTANT(id, arg)	pusatrace_event(PUSATRACE_TYPE_INSTANT, (id), (arg))
+#else
+#define PUSATRACE_THREAD(name)		do { } while (0)
+#define PUSATRACE_BEGIN(id)		do { } while (0)
+#define PUSATRACE_END(id)		do { } while (0)
+#define PUSATRACE_INSTANT(id, arg)	do { } while (0)
+#endif
+
+#endif /* __pusatrace_h__ */